@@ -20,6 +20,52 @@
 #ifndef _DAHDI_ARITH_H
 #define _DAHDI_ARITH_H
 
+#ifdef DAHDI_CHUNKSIZE
+/* Add src to dst with saturation, storing in dst */
+static inline void __ACSS_C(short *dst, const short *src)
+{
+	int x;
+
+#ifdef BFIN
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		dst[x] = __builtin_bfin_add_fr1x16(dst[x], src[x]);
+#else
+	int sum;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		sum = dst[x] + src[x];
+		if (sum > 32767)
+			sum = 32767;
+		else if (sum < -32768)
+			sum = -32768;
+		dst[x] = sum;
+	}
+#endif
+}
+
+/* Subtract src from dst with saturation, storing in dst */
+static inline void __SCSS_C(short *dst, const short *src)
+{
+	int x;
+
+#ifdef BFIN
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		dst[x] = __builtin_bfin_sub_fr1x16(dst[x], src[x]);
+#else
+	int sum;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		sum = dst[x] - src[x];
+		if (sum > 32767)
+			sum = 32767;
+		else if (sum < -32768)
+			sum = -32768;
+		dst[x] = sum;
+	}
+#endif
+}
+#endif	/* DAHDI_CHUNKSIZE */
+
 #ifdef CONFIG_DAHDI_MMX
 #ifdef DAHDI_CHUNKSIZE
 static inline void __ACSS(volatile short *dst, const short *src)
@@ -273,51 +319,270 @@ static inline short MAX16(const short *y, int len, int *pos)
 #else
 
 #ifdef DAHDI_CHUNKSIZE
-static inline void ACSS(short *dst, short *src)
+
+/*
+ * With CONFIG_DAHDI_SIMD_MIX the conference arithmetic uses SSE2 (x86_64)
+ * or NEON (arm64) whenever the calling CPU is inside a mixing section that
+ * managed to claim the FPU (see dahdi_mix_begin() in dahdi-base.c), and
+ * the C version otherwise.
+ */
+#if defined(CONFIG_DAHDI_SIMD_MIX) && ((DAHDI_CHUNKSIZE % 8) == 0)
+#if defined(CONFIG_X86_64) && \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0))
+#define DAHDI_SIMD_MIX
+#define DAHDI_SIMD_MIX_NAME "sse2"
+#elif defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON) && \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0))
+#define DAHDI_SIMD_MIX
+#define DAHDI_SIMD_MIX_NAME "neon"
+#endif
+#endif
+
+#ifdef DAHDI_SIMD_MIX
+#include <linux/percpu.h>
+
+/* Non-zero while this CPU owns the FPU for conference mixing */
+DECLARE_PER_CPU(int, dahdi_mix_simd);
+
+#ifdef CONFIG_X86_64
+static inline void __ACSS_SIMD(short *dst, const short *src)
 {
 	int x;
 
-	/* Add src to dst with saturation, storing in dst */
+	for (x = 0; x < DAHDI_CHUNKSIZE; x += 8) {
+		__asm__ __volatile__ (
+			"movdqu %0, %%xmm0;\n"
+			"movdqu %1, %%xmm1;\n"
+			"paddsw %%xmm1, %%xmm0;\n"
+			"movdqu %%xmm0, %0;\n"
+		    : "+m" (*(short (*)[8])(dst + x))
+		    : "m" (*(const short (*)[8])(src + x)));
+	}
+}
+
+static inline void __SCSS_SIMD(short *dst, const short *src)
+{
+	int x;
 
-#ifdef BFIN
-	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-		dst[x] = __builtin_bfin_add_fr1x16(dst[x], src[x]);
+	for (x = 0; x < DAHDI_CHUNKSIZE; x += 8) {
+		__asm__ __volatile__ (
+			"movdqu %0, %%xmm0;\n"
+			"movdqu %1, %%xmm1;\n"
+			"psubsw %%xmm1, %%xmm0;\n"
+			"movdqu %%xmm0, %0;\n"
+		    : "+m" (*(short (*)[8])(dst + x))
+		    : "m" (*(const short (*)[8])(src + x)));
+	}
+}
 #else
-	int sum;
+static inline void __ACSS_SIMD(short *dst, const short *src)
+{
+	int x;
 
-	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-		sum = dst[x] + src[x];
-		if (sum > 32767)
-			sum = 32767;
-		else if (sum < -32768)
-			sum = -32768;
-		dst[x] = sum;
+	for (x = 0; x < DAHDI_CHUNKSIZE; x += 8) {
+		__asm__ __volatile__ (
+			"ld1 {v0.8h}, [%0];\n"
+			"ld1 {v1.8h}, [%1];\n"
+			"sqadd v0.8h, v0.8h, v1.8h;\n"
+			"st1 {v0.8h}, [%0];\n"
+		    : : "r" (dst + x), "r" (src + x)
+		    : "memory");
 	}
-#endif
 }
 
-static inline void SCSS(short *dst, short *src)
+static inline void __SCSS_SIMD(short *dst, const short *src)
 {
 	int x;
 
-	/* Subtract src from dst with saturation, storing in dst */
-#ifdef BFIN
-	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-		dst[x] = __builtin_bfin_sub_fr1x16(dst[x], src[x]);
-#else
-	int sum;
+	for (x = 0; x < DAHDI_CHUNKSIZE; x += 8) {
+		__asm__ __volatile__ (
+			"ld1 {v0.8h}, [%0];\n"
+			"ld1 {v1.8h}, [%1];\n"
+			"sqsub v0.8h, v0.8h, v1.8h;\n"
+			"st1 {v0.8h}, [%0];\n"
+		    : : "r" (dst + x), "r" (src + x)
+		    : "memory");
+	}
+}
+#endif
+#endif	/* DAHDI_SIMD_MIX */
 
-	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-		sum = dst[x] - src[x];
-		if (sum > 32767)
-			sum = 32767;
-		else if (sum < -32768)
-			sum = -32768;
-		dst[x] = sum;
+static inline void ACSS(short *dst, short *src)
+{
+#ifdef DAHDI_SIMD_MIX
+	if (this_cpu_read(dahdi_mix_simd)) {
+		__ACSS_SIMD(dst, src);
+		return;
+	}
+#endif
+	__ACSS_C(dst, src);
+}
+
+static inline void SCSS(short *dst, short *src)
+{
+#ifdef DAHDI_SIMD_MIX
+	if (this_cpu_read(dahdi_mix_simd)) {
+		__SCSS_SIMD(dst, src);
+		return;
 	}
 #endif
+	__SCSS_C(dst, src);
 }
 
+/*
+ * With CONFIG_DAHDI_SIMD_MIX on x86_64 the core also converts linear
+ * samples to mu-law / A-law eight at a time with SSE2 inside the same
+ * FPU sections, computing each code instead of looking it up in the 16 KB
+ * __dahdi_lin2mu / __dahdi_lin2a tables.  The results are exactly those
+ * of DAHDI_LIN2MU() / DAHDI_LIN2A().
+ */
+#if defined(DAHDI_SIMD_MIX) && defined(CONFIG_X86_64)
+#define DAHDI_SIMD_XLAW
+#include <linux/stringify.h>
+
+/* Offsets of the rows of __dahdi_xlaw_k[] used by the asm below */
+#define XLAW_K_LINMASK	0
+#define XLAW_K_CLIP	16
+#define XLAW_K_BIAS	32
+#define XLAW_K_SEG	48	/* 7 rows: top of segments 0 to 6 */
+#define XLAW_K_MU_MULT	160
+#define XLAW_K_A_MULT	176
+#define XLAW_K_MANT	192
+#define XLAW_K_SIGN	208
+#define XLAW_K_FF	224
+#define XLAW_K_TRAP	240
+#define XLAW_K_MIN	256
+#define XLAW_K_A_XOR	272
+
+#define __XLAW_ROW(v) { v, v, v, v, v, v, v, v }
+
+static const short __dahdi_xlaw_k[18][8] __aligned(16) = {
+#ifdef CONFIG_CALC_XLAW
+	__XLAW_ROW(-1),
+#else
+	/* The tables only look at the top 14 bits of the sample */
+	__XLAW_ROW(-4),
+#endif
+	__XLAW_ROW(32635),
+	__XLAW_ROW(0x84),
+	__XLAW_ROW(0xff), __XLAW_ROW(0x1ff), __XLAW_ROW(0x3ff),
+	__XLAW_ROW(0x7ff), __XLAW_ROW(0xfff), __XLAW_ROW(0x1fff),
+	__XLAW_ROW(0x3fff),
+	__XLAW_ROW(0x2000),
+	__XLAW_ROW(0x1000),
+	__XLAW_ROW(0x0f),
+	__XLAW_ROW(0x80),
+	__XLAW_ROW(0xff),
+	__XLAW_ROW(0x02),
+	__XLAW_ROW(-32768),
+	__XLAW_ROW(0xd5),
+};
+
+#define __XK(row) __stringify(XLAW_K_##row) "(%[k])"
+
+/*
+ * One segment step: %%xmm0 holds the magnitude, %%xmm2 counts the
+ * segments it is above and %%xmm3 halves the mantissa multiplier for
+ * each one.
+ */
+#define __XLAW_SEG(n, mult) \
+	"movdqa %%xmm0, %%xmm4;\n" \
+	"pcmpgtw " __stringify(XLAW_K_SEG + 16 * n) "(%[k]), %%xmm4;\n" \
+	"psubw %%xmm4, %%xmm2;\n" \
+	mult
+#define __XLAW_HALVE \
+	"movdqa %%xmm3, %%xmm5;\n" \
+	"psrlw $1, %%xmm5;\n" \
+	"pand %%xmm4, %%xmm5;\n" \
+	"psubw %%xmm5, %%xmm3;\n"
+
+/* Same as DAHDI_LIN2MU() on src[0..7] */
+static inline void __LIN2MU_SIMD(unsigned char *dst, const short *src)
+{
+	__asm__ __volatile__ (
+		"movdqu %[src], %%xmm0;\n"
+		"pand " __XK(LINMASK) ", %%xmm0;\n"
+		/* sign in %%xmm1, clipped magnitude + bias in %%xmm0 */
+		"movdqa %%xmm0, %%xmm1;\n"
+		"psraw $15, %%xmm1;\n"
+		"pxor %%xmm1, %%xmm0;\n"
+		"psubw %%xmm1, %%xmm0;\n"
+		"pminsw " __XK(CLIP) ", %%xmm0;\n"
+		"paddw " __XK(BIAS) ", %%xmm0;\n"
+		"pxor %%xmm2, %%xmm2;\n"
+		"movdqa " __XK(MU_MULT) ", %%xmm3;\n"
+		__XLAW_SEG(0, __XLAW_HALVE)
+		__XLAW_SEG(1, __XLAW_HALVE)
+		__XLAW_SEG(2, __XLAW_HALVE)
+		__XLAW_SEG(3, __XLAW_HALVE)
+		__XLAW_SEG(4, __XLAW_HALVE)
+		__XLAW_SEG(5, __XLAW_HALVE)
+		__XLAW_SEG(6, __XLAW_HALVE)
+		/* mantissa is the magnitude >> (segment + 3) */
+		"pmulhuw %%xmm3, %%xmm0;\n"
+		"pand " __XK(MANT) ", %%xmm0;\n"
+		"psllw $4, %%xmm2;\n"
+		"por %%xmm2, %%xmm0;\n"
+		"pand " __XK(SIGN) ", %%xmm1;\n"
+		"por %%xmm1, %%xmm0;\n"
+		"pxor " __XK(FF) ", %%xmm0;\n"
+		/* 0x00 becomes 0x02 and 0xff becomes 0x7f */
+		"pxor %%xmm4, %%xmm4;\n"
+		"pcmpeqw %%xmm0, %%xmm4;\n"
+		"pand " __XK(TRAP) ", %%xmm4;\n"
+		"por %%xmm4, %%xmm0;\n"
+		"movdqa %%xmm0, %%xmm4;\n"
+		"pcmpeqw " __XK(FF) ", %%xmm4;\n"
+		"pand " __XK(SIGN) ", %%xmm4;\n"
+		"psubw %%xmm4, %%xmm0;\n"
+		"packuswb %%xmm0, %%xmm0;\n"
+		"movq %%xmm0, %[dst];\n"
+	    : [dst] "=m" (*(unsigned char (*)[8])dst)
+	    : [src] "m" (*(const short (*)[8])src), [k] "r" (__dahdi_xlaw_k)
+	    : "memory");
+}
+
+/* Same as DAHDI_LIN2A() on src[0..7] */
+static inline void __LIN2A_SIMD(unsigned char *dst, const short *src)
+{
+	__asm__ __volatile__ (
+		"movdqu %[src], %%xmm0;\n"
+		"pand " __XK(LINMASK) ", %%xmm0;\n"
+		/* -32768 is the only input above segment 7 */
+		"movdqa %%xmm0, %%xmm6;\n"
+		"pcmpeqw " __XK(MIN) ", %%xmm6;\n"
+		"pand " __XK(SIGN) ", %%xmm6;\n"
+		/* sign in %%xmm1, magnitude in %%xmm0 */
+		"movdqa %%xmm0, %%xmm1;\n"
+		"psraw $15, %%xmm1;\n"
+		"pxor %%xmm1, %%xmm0;\n"
+		"psubw %%xmm1, %%xmm0;\n"
+		"pxor %%xmm2, %%xmm2;\n"
+		"movdqa " __XK(A_MULT) ", %%xmm3;\n"
+		__XLAW_SEG(0, "")
+		__XLAW_SEG(1, __XLAW_HALVE)
+		__XLAW_SEG(2, __XLAW_HALVE)
+		__XLAW_SEG(3, __XLAW_HALVE)
+		__XLAW_SEG(4, __XLAW_HALVE)
+		__XLAW_SEG(5, __XLAW_HALVE)
+		__XLAW_SEG(6, __XLAW_HALVE)
+		/* mantissa is the magnitude >> max(segment + 3, 4) */
+		"pmulhuw %%xmm3, %%xmm0;\n"
+		"pand " __XK(MANT) ", %%xmm0;\n"
+		"psllw $4, %%xmm2;\n"
+		"por %%xmm2, %%xmm0;\n"
+		"por %%xmm6, %%xmm0;\n"
+		"pand " __XK(SIGN) ", %%xmm1;\n"
+		"pxor " __XK(A_XOR) ", %%xmm1;\n"
+		"pxor %%xmm1, %%xmm0;\n"
+		"packuswb %%xmm0, %%xmm0;\n"
+		"movq %%xmm0, %[dst];\n"
+	    : [dst] "=m" (*(unsigned char (*)[8])dst)
+	    : [src] "m" (*(const short (*)[8])src), [k] "r" (__dahdi_xlaw_k)
+	    : "memory");
+}
+#endif	/* DAHDI_SIMD_MIX && CONFIG_X86_64 */
+
 #endif	/* DAHDI_CHUNKSIZE */
 
 static inline int CONVOLVE(const int *coeffs, const short *hist, int len)
@@ -375,4 +640,267 @@ static inline short MAX16(const short *y, int len, int *pos)
 }
 
 #endif	/* MMX */
+
+/*
+ * With CONFIG_DAHDI_SIMD_EC the software echo cancellers that use
+ * CONVOLVE2_SIMD() run their FIR convolution with SSE2 or AVX2 (x86_64)
+ * or NEON (arm64), chosen at load time. The vector versions wrap on
+ * overflow exactly like the C loop, so the output is bit for bit the
+ * same. Callers claim the FPU with dahdi_simd_ec_begin() around a block
+ * of calls and get the C version whenever that fails.
+ */
+#if defined(CONFIG_DAHDI_SIMD_EC) && !defined(CONFIG_DAHDI_MMX)
+#if defined(CONFIG_X86_64) && \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0))
+#define DAHDI_SIMD_EC
+#elif defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON) && \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0))
+#define DAHDI_SIMD_EC
+#endif
+#endif
+
+enum {
+	DAHDI_SIMD_EC_NONE = 0,
+	DAHDI_SIMD_EC_BASE,	/* SSE2 on x86_64, NEON on arm64 */
+	DAHDI_SIMD_EC_AVX2,
+};
+
+#ifdef DAHDI_SIMD_EC
+#include <linux/random.h>
+#include <asm/cpufeature.h>
+#include <asm/simd.h>
+#ifdef CONFIG_X86_64
+#include <asm/fpu/api.h>
+#else
+#include <asm/neon.h>
+#endif
+
+#ifdef CONFIG_X86_64
+static inline int __CONVOLVE2_SSE2(const short *coeffs, const short *hist,
+				   int len)
+{
+	int blocks = len >> 3;
+	int sum = 0;
+	int x;
+
+	if (blocks) {
+		__asm__ __volatile__ (
+			"pxor %%xmm0, %%xmm0;\n"
+			"1:\n"
+			"movdqu (%1), %%xmm1;\n"
+			"movdqu (%2), %%xmm2;\n"
+			"pmaddwd %%xmm2, %%xmm1;\n"
+			"paddd %%xmm1, %%xmm0;\n"
+			"add $16, %1;\n"
+			"add $16, %2;\n"
+			"dec %3;\n"
+			"jnz 1b;\n"
+			"pshufd $0x4e, %%xmm0, %%xmm1;\n"
+			"paddd %%xmm1, %%xmm0;\n"
+			"pshufd $0xb1, %%xmm0, %%xmm1;\n"
+			"paddd %%xmm1, %%xmm0;\n"
+			"movd %%xmm0, %0;\n"
+		    : "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (blocks)
+		    : : "memory", "cc");
+	}
+	for (x = 0; x < (len & 7); x++)
+		sum += coeffs[x] * hist[x];
+	return sum;
+}
+
+static inline int __CONVOLVE2_AVX2(const short *coeffs, const short *hist,
+				   int len)
+{
+	int blocks = len >> 4;
+	int sum = 0;
+	int x;
+
+	if (blocks) {
+		__asm__ __volatile__ (
+			"vpxor %%ymm0, %%ymm0, %%ymm0;\n"
+			"1:\n"
+			"vmovdqu (%1), %%ymm1;\n"
+			"vpmaddwd (%2), %%ymm1, %%ymm1;\n"
+			"vpaddd %%ymm1, %%ymm0, %%ymm0;\n"
+			"add $32, %1;\n"
+			"add $32, %2;\n"
+			"dec %3;\n"
+			"jnz 1b;\n"
+			"vextracti128 $1, %%ymm0, %%xmm1;\n"
+			"vpaddd %%xmm1, %%xmm0, %%xmm0;\n"
+			"vpshufd $0x4e, %%xmm0, %%xmm1;\n"
+			"vpaddd %%xmm1, %%xmm0, %%xmm0;\n"
+			"vpshufd $0xb1, %%xmm0, %%xmm1;\n"
+			"vpaddd %%xmm1, %%xmm0, %%xmm0;\n"
+			"vmovd %%xmm0, %0;\n"
+			"vzeroupper;\n"
+		    : "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (blocks)
+		    : : "memory", "cc");
+	}
+	for (x = 0; x < (len & 15); x++)
+		sum += coeffs[x] * hist[x];
+	return sum;
+}
+#else
+static inline int __CONVOLVE2_NEON(const short *coeffs, const short *hist,
+				   int len)
+{
+	int blocks = len >> 3;
+	int sum = 0;
+	int x;
+
+	if (blocks) {
+		__asm__ __volatile__ (
+			"movi v0.4s, #0;\n"
+			"1:\n"
+			"ld1 {v1.8h}, [%1], #16;\n"
+			"ld1 {v2.8h}, [%2], #16;\n"
+			"smlal v0.4s, v1.4h, v2.4h;\n"
+			"smlal2 v0.4s, v1.8h, v2.8h;\n"
+			"subs %w3, %w3, #1;\n"
+			"b.ne 1b;\n"
+			"addv s0, v0.4s;\n"
+			"fmov %w0, s0;\n"
+		    : "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (blocks)
+		    : : "memory", "cc");
+	}
+	for (x = 0; x < (len & 7); x++)
+		sum += coeffs[x] * hist[x];
+	return sum;
+}
+#endif
+
+static inline int CONVOLVE2_SIMD(int level, const short *coeffs,
+				 const short *hist, int len)
+{
+#ifdef CONFIG_X86_64
+	if (level == DAHDI_SIMD_EC_AVX2)
+		return __CONVOLVE2_AVX2(coeffs, hist, len);
+	if (level)
+		return __CONVOLVE2_SSE2(coeffs, hist, len);
+#else
+	if (level)
+		return __CONVOLVE2_NEON(coeffs, hist, len);
+#endif
+	return CONVOLVE2(coeffs, hist, len);
+}
+
+/* Best level this CPU supports */
+static inline int dahdi_simd_ec_level(void)
+{
+#ifdef CONFIG_X86_64
+	if (boot_cpu_has(X86_FEATURE_AVX2))
+		return DAHDI_SIMD_EC_AVX2;
+	return boot_cpu_has(X86_FEATURE_XMM2) ?
+		DAHDI_SIMD_EC_BASE : DAHDI_SIMD_EC_NONE;
+#else
+	return system_supports_fpsimd() ?
+		DAHDI_SIMD_EC_BASE : DAHDI_SIMD_EC_NONE;
+#endif
+}
+
+static inline const char *dahdi_simd_ec_name(int level)
+{
+	switch (level) {
+	case DAHDI_SIMD_EC_AVX2:
+		return "avx2";
+	case DAHDI_SIMD_EC_BASE:
+#ifdef CONFIG_X86_64
+		return "sse2";
+#else
+		return "neon";
+#endif
+	default:
+		return "c";
+	}
+}
+
+/* Claims the FPU for CONVOLVE2_SIMD(). Returns the level to pass it, which
+ * is DAHDI_SIMD_EC_NONE if the FPU cannot be used in this context. */
+static inline int dahdi_simd_ec_begin(int level)
+{
+	if (!level || !may_use_simd())
+		return DAHDI_SIMD_EC_NONE;
+#ifdef CONFIG_X86_64
+	kernel_fpu_begin();
+#else
+	kernel_neon_begin();
+#endif
+	return level;
+}
+
+static inline void dahdi_simd_ec_end(int level)
+{
+	if (!level)
+		return;
+#ifdef CONFIG_X86_64
+	kernel_fpu_end();
+#else
+	kernel_neon_end();
+#endif
+}
+
+/**
+ * dahdi_simd_ec_check() - Compare CONVOLVE2_SIMD() at level with CONVOLVE2().
+ *
+ * Runs random and worst case (all -32768) input of every length up to
+ * 1024 taps plus a tail. Meant to be called once at load time, from
+ * process context.
+ *
+ * Returns level if both agree, DAHDI_SIMD_EC_NONE otherwise.
+ */
+static inline int dahdi_simd_ec_check(int level)
+{
+	static short coeffs[1024 + 16], hist[1024 + 16];
+	int len, pass, ok = 1;
+
+	for (pass = 0; pass < 2 && ok; pass++) {
+		if (pass) {
+			for (len = 0; len < ARRAY_SIZE(coeffs); len++)
+				coeffs[len] = hist[len] = -32768;
+		} else {
+			get_random_bytes(coeffs, sizeof(coeffs));
+			get_random_bytes(hist, sizeof(hist));
+		}
+		for (len = 1; len <= ARRAY_SIZE(coeffs) && ok; len++) {
+			const int expected = CONVOLVE2(coeffs, hist, len);
+			int got;
+
+			if (dahdi_simd_ec_begin(level) != level)
+				return DAHDI_SIMD_EC_NONE;
+			got = CONVOLVE2_SIMD(level, coeffs, hist, len);
+			dahdi_simd_ec_end(level);
+			ok = (got == expected);
+		}
+	}
+	return ok ? level : DAHDI_SIMD_EC_NONE;
+}
+#else
+#define CONVOLVE2_SIMD(level, coeffs, hist, len) CONVOLVE2(coeffs, hist, len)
+
+static inline int dahdi_simd_ec_level(void)
+{
+	return DAHDI_SIMD_EC_NONE;
+}
+
+static inline const char *dahdi_simd_ec_name(int level)
+{
+	return "c";
+}
+
+static inline int dahdi_simd_ec_begin(int level)
+{
+	return DAHDI_SIMD_EC_NONE;
+}
+
+static inline void dahdi_simd_ec_end(int level)
+{
+}
+
+static inline int dahdi_simd_ec_check(int level)
+{
+	return DAHDI_SIMD_EC_NONE;
+}
+#endif	/* DAHDI_SIMD_EC */
+
 #endif	/* _DAHDI_ARITH_H */
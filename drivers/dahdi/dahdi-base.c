@@ -52,6 +52,14 @@
 #include <linux/mutex.h>
 #include <linux/ktime.h>
 #include <linux/slab.h>
+#include <linux/irq_work.h>
+#include <linux/cpumask.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/eventfd.h>
+#include <linux/file.h>
+#include <linux/hrtimer.h>
 
 #include <linux/ppp_defs.h>
 
@@ -68,6 +76,7 @@
 #endif /* 4.11.0 */
 
 #include "ecdis.h"
+#include "digitdet.h"
 #include "dahdi.h"
 
 #ifdef CONFIG_DAHDI_PPP
@@ -98,6 +107,14 @@
 #if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
 #include <asm/i387.h>
 #endif
+#ifdef DAHDI_SIMD_MIX
+#include <asm/simd.h>
+#ifdef CONFIG_X86_64
+#include <asm/fpu/api.h>
+#else
+#include <asm/neon.h>
+#endif
+#endif
 
 #define hdlc_to_chan(h) (((struct dahdi_hdlc *)(h))->chan)
 #define netdev_to_chan(h) (((struct dahdi_hdlc *)(dev_to_hdlc(h)->priv))->chan)
@@ -177,10 +194,45 @@ static sumtype sums[(DAHDI_MAX_CONF + 1) * 3];
 static short confalias[DAHDI_MAX_CONF + 1];
 static short confrev[DAHDI_MAX_CONF + 1];
 
+/* Aliases currently in use, i.e. the sums that need clearing every tick.
+ * Alias 0 is where channels without an alias end up and is always set. */
+static DECLARE_BITMAP(conf_active, DAHDI_MAX_CONF + 1) = { 1UL };
+
 static sumtype *conf_sums_next;
 static sumtype *conf_sums;
 static sumtype *conf_sums_prev;
 
+/* Loudest-N mixing state of each alias, see DAHDI_CONF_LOUDEST.  Who gets
+ * mixed is decided from the loudest talkers of the previous tick, since
+ * members are summed in whatever order their spans come around. */
+static struct conf_talkers {
+	int	max;		/* N, or 0 to mix every talker */
+	u32	floor;		/* Energy needed to be mixed this tick */
+	int	admitted;	/* Talkers mixed so far this tick */
+	int	talking;	/* Talkers heard so far this tick */
+	int	last_admitted;
+	int	last_talking;
+	u32	top[DAHDI_CONF_LOUDEST_MAX];	/* Loudest energies, descending */
+} conf_talkers[DAHDI_MAX_CONF + 1];
+
+typedef short wbsumtype[DAHDI_WB_CHUNKSIZE];
+
+/* 16 kHz sums of the aliases that have had a wideband member, indexed by
+ * conf_wb_prev / conf_wb_cur / conf_wb_next the way conf_sums_prev,
+ * conf_sums and conf_sums_next are.  They are allocated the first time an
+ * alias needs them and kept for the next conference that gets it. */
+static wbsumtype *conf_wbsums[DAHDI_MAX_CONF + 1];
+static DECLARE_BITMAP(conf_wideband, DAHDI_MAX_CONF + 1);
+static int conf_wb_prev, conf_wb_cur, conf_wb_next;
+
+/* One of the 16 kHz sums of alias a, or NULL if it is not wideband */
+static inline short *conf_wbsum(int a, int which)
+{
+	wbsumtype *const wb = READ_ONCE(conf_wbsums[a]);
+
+	return (wb && test_bit(a, conf_wideband)) ? wb[which] : NULL;
+}
+
 static struct dahdi_span *master_span;
 struct file_operations *dahdi_transcode_fops = NULL;
 
@@ -199,16 +251,133 @@ static int maxlinks;
 
 static struct core_timer {
 	struct timer_list timer;
+	struct hrtimer hrtimer;
 	ktime_t start_interval;
 	unsigned long interval;
+	int chunks;		/* chunks per tick, see DAHDI_SET_CHUNKSIZE */
 	int dahdi_receive_used;
 	atomic_t count;
 	atomic_t shutdown;
 	atomic_t last_count;
+	/* Tick lateness while the core timer is the master */
+	ktime_t expires;
+	u64 ticks;
+	u64 late_total_ns;
+	u64 late_last_ns;
+	u64 late_max_ns;
+	u64 catchup;		/* chunks processed beyond one per tick */
 } core_timer;
 
+static int hires_core_timer;
+
 #endif /* CONFIG_DAHDI_CORE_TIMER */
 
+static int coretimer_set_chunks(int chunks);
+
+#if defined(CONFIG_SMP) && LINUX_VERSION_CODE >= KERNEL_VERSION(3, 17, 0)
+#define DAHDI_SHARDED_MASTERSPAN
+#endif
+
+#ifdef DAHDI_SHARDED_MASTERSPAN
+
+#define DAHDI_MAX_SHARDS	32
+#define DAHDI_CONF_SUM_LOCKS	64
+
+/* The steps of _process_masterspan_chunks() that can be spread over shards. */
+enum masterspan_phase {
+	MASTERSPAN_SPAN_RECEIVE,
+	MASTERSPAN_PSEUDO_TRANSMIT,
+	MASTERSPAN_PSEUDO_RECEIVE,
+	MASTERSPAN_SPAN_TRANSMIT,
+};
+
+struct masterspan_shard {
+	struct irq_work work;
+	int cpu;
+	atomic_t claimed;	/* Last phase generation this shard ran in */
+	u64 tick_ns;		/* Time spent so far in the current tick */
+	u64 last_ns;		/* Time spent in the last complete tick */
+	u64 max_ns;		/* Longest tick seen */
+} ____cacheline_aligned_in_smp;
+
+/* How long the master CPU waits for a shard that another CPU has already
+ * started before it gives up on sharding. */
+#define DAHDI_SHARD_STALL_NS	(2 * NSEC_PER_MSEC)
+
+static struct masterspan_shard shards[DAHDI_MAX_SHARDS];
+static int num_shards;
+static enum masterspan_phase shard_phase;
+static atomic_t shard_gen;
+static atomic_t shards_pending;
+static bool shards_stalled;
+static unsigned int shard_stalls;
+
+/* When sharded, members of the same conference may be processed on
+ * different CPUs at once, so updates to a conference's sums are serialized
+ * on one of these (hashed by conference number). */
+static spinlock_t conf_sum_locks[DAHDI_CONF_SUM_LOCKS];
+
+static inline bool masterspan_sharded(void)
+{
+	return num_shards > 1 && !READ_ONCE(shards_stalled);
+}
+
+/* The monitor modes read the getlin / putlin of the channel in conf_chan,
+ * which may be processed on another shard in the same phase. Channels in
+ * these modes are left to the master CPU once the shards are done. */
+static inline bool masterspan_monitors(const struct dahdi_chan *chan)
+{
+	switch (chan->master->confmode & DAHDI_CONF_MODE_MASK) {
+	case DAHDI_CONF_MONITOR:
+	case DAHDI_CONF_MONITORTX:
+	case DAHDI_CONF_MONITORBOTH:
+	case DAHDI_CONF_MONITOR_RX_PREECHO:
+	case DAHDI_CONF_MONITOR_TX_PREECHO:
+	case DAHDI_CONF_MONITORBOTH_PREECHO:
+	case DAHDI_CONF_DIGITALMON:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline spinlock_t *masterspan_lock_conf(const struct dahdi_chan *chan)
+{
+	spinlock_t *lock;
+
+	/* _confn only names a conference in the conference modes; the
+	 * monitors never run while other shards do. Tested on num_shards
+	 * rather than masterspan_sharded() so that a stall noticed halfway
+	 * through a tick does not drop the lock for the rest of it. */
+	if (num_shards <= 1 || masterspan_monitors(chan) ||
+	    !(chan->master->confmode & DAHDI_CONF_MODE_MASK))
+		return NULL;
+	lock = &conf_sum_locks[chan->master->_confn &
+			       (DAHDI_CONF_SUM_LOCKS - 1)];
+	spin_lock(lock);
+	return lock;
+}
+
+static inline void masterspan_unlock_conf(spinlock_t *lock)
+{
+	if (lock)
+		spin_unlock(lock);
+}
+
+#else
+
+static inline bool masterspan_sharded(void) { return false; }
+static inline spinlock_t *masterspan_lock_conf(const struct dahdi_chan *chan)
+{
+	return NULL;
+}
+static inline void masterspan_unlock_conf(spinlock_t *lock) { }
+
+#endif /* DAHDI_SHARDED_MASTERSPAN */
+
+/* Number of shards to split master span processing into (0 to disable) */
+static int masterspan_shards;
+
 
 enum dahdi_digit_mode {
 	DIGIT_MODE_DTMF,
@@ -301,6 +470,137 @@ static inline void dahdi_kernel_fpu_end(void)
 
 #endif
 
+#ifdef DAHDI_SIMD_MIX
+DEFINE_PER_CPU(int, dahdi_mix_simd);
+static DEFINE_PER_CPU(int, dahdi_mix_depth);
+static bool simd_mix_enabled __read_mostly;
+
+/** dahdi_mix_begin() - Enter a section of conference mixing
+ *
+ * Claims the FPU for the SIMD versions of ACSS() / SCSS() once for a
+ * whole span or master span pass rather than once per channel.  Sections
+ * nest; only the outermost one saves and restores the FPU state.  When
+ * the FPU cannot be used in the current context the C versions are used
+ * instead.
+ *
+ * Disables preemption until the matching dahdi_mix_end().
+ */
+static inline void dahdi_mix_begin(void)
+{
+	if (!simd_mix_enabled)
+		return;
+	preempt_disable();
+	if (__this_cpu_inc_return(dahdi_mix_depth) != 1)
+		return;
+	if (!may_use_simd())
+		return;
+#ifdef CONFIG_X86_64
+	kernel_fpu_begin();
+#else
+	kernel_neon_begin();
+#endif
+	__this_cpu_write(dahdi_mix_simd, 1);
+}
+
+static inline void dahdi_mix_end(void)
+{
+	if (!simd_mix_enabled)
+		return;
+	if (__this_cpu_dec_return(dahdi_mix_depth) == 0 &&
+	    __this_cpu_read(dahdi_mix_simd)) {
+		__this_cpu_write(dahdi_mix_simd, 0);
+#ifdef CONFIG_X86_64
+		kernel_fpu_end();
+#else
+		kernel_neon_end();
+#endif
+	}
+	preempt_enable();
+}
+
+#ifdef ECDIS_BANK_SSE41
+static bool ced_sse41 __read_mostly;
+#endif
+#ifdef DIGITDET_BANK_SSE41
+static bool digit_sse41 __read_mostly;
+#endif
+
+static bool simd_mix_supported(void)
+{
+#ifdef CONFIG_X86_64
+	return boot_cpu_has(X86_FEATURE_XMM2);
+#else
+	return system_supports_fpsimd();
+#endif
+}
+#else
+static inline void dahdi_mix_begin(void) { }
+static inline void dahdi_mix_end(void) { }
+#endif
+
+static int simd_mix = 1;
+
+static void __init simd_mix_init(void)
+{
+#ifdef DAHDI_SIMD_MIX
+	simd_mix_enabled = simd_mix && simd_mix_supported();
+	if (simd_mix_enabled)
+		module_printk(KERN_INFO, "Using %s conference mixing\n",
+			      DAHDI_SIMD_MIX_NAME);
+#ifdef ECDIS_BANK_SSE41
+	ced_sse41 = simd_mix_enabled && boot_cpu_has(X86_FEATURE_XMM4_1);
+#endif
+#ifdef DIGITDET_BANK_SSE41
+	digit_sse41 = simd_mix_enabled && boot_cpu_has(X86_FEATURE_XMM4_1);
+#endif
+#endif
+}
+
+/**
+ * dahdi_xlaw_to_lin_block() - Convert count samples of chan to linear
+ *
+ * The decode tables are only 512 bytes each and stay in L1, so this is
+ * the DAHDI_XLAW() loop.
+ */
+static inline void dahdi_xlaw_to_lin_block(const struct dahdi_chan *chan,
+					   short *lin, const u_char *xlaw,
+					   int count)
+{
+	int x;
+
+	for (x = 0; x < count; x++)
+		lin[x] = DAHDI_XLAW(xlaw[x], chan);
+}
+
+/**
+ * dahdi_lin_to_xlaw_block() - Convert count linear samples to the law of chan
+ *
+ * Inside a mixing section that owns the FPU (see dahdi_mix_begin()) the
+ * codes are computed eight at a time rather than read from the 16 KB
+ * encode tables, which a span of many channels otherwise keeps pulling
+ * back into the cache.  Either way the result is that of DAHDI_LIN2X().
+ */
+static inline void dahdi_lin_to_xlaw_block(const struct dahdi_chan *chan,
+					   u_char *xlaw, const short *lin,
+					   int count)
+{
+	int x = 0;
+
+#ifdef DAHDI_SIMD_XLAW
+	if (this_cpu_read(dahdi_mix_simd)) {
+		if (chan->xlaw == __dahdi_alaw) {
+			for (; x + 8 <= count; x += 8)
+				__LIN2A_SIMD(xlaw + x, lin + x);
+		} else {
+			for (; x + 8 <= count; x += 8)
+				__LIN2MU_SIMD(xlaw + x, lin + x);
+		}
+	}
+#endif
+	for (; x < count; x++)
+		xlaw[x] = DAHDI_LIN2X(lin[x], chan);
+}
+
 struct dahdi_timer {
 	spinlock_t lock;
 	int ms;			/* Countdown */
@@ -401,6 +701,148 @@ static inline bool is_pseudo_chan(const struct dahdi_chan *chan)
 static DEFINE_MUTEX(registration_mutex);
 static LIST_HEAD(span_list);
 
+/*
+ * Latency histograms of the hot paths. Each CPU counts into its own copy,
+ * so recording one sample is two clock reads and a this_cpu_inc().
+ */
+enum dahdi_prof_stage {
+	DAHDI_PROF_MASTERSPAN,
+	DAHDI_PROF_RECEIVE,
+	DAHDI_PROF_TRANSMIT,
+	DAHDI_PROF_EC_CHUNK,
+	DAHDI_PROF_EC_SPAN,
+	DAHDI_PROF_STAGES,
+};
+
+static const char *const dahdi_prof_stage_names[DAHDI_PROF_STAGES] = {
+	[DAHDI_PROF_MASTERSPAN] = "process_masterspan",
+	[DAHDI_PROF_RECEIVE] = "receive",
+	[DAHDI_PROF_TRANSMIT] = "transmit",
+	[DAHDI_PROF_EC_CHUNK] = "ec_chunk",
+	[DAHDI_PROF_EC_SPAN] = "ec_span",
+};
+
+struct dahdi_prof_hist {
+	u32 count[DAHDI_PROF_STAGES][DAHDI_LATENCY_BUCKETS];
+	u64 max_ns[DAHDI_PROF_STAGES];
+};
+
+static DEFINE_PER_CPU(struct dahdi_prof_hist, dahdi_prof_hist);
+
+static int latency_profiling;
+
+static inline unsigned int dahdi_latency_bucket(u64 ns)
+{
+	return min_t(unsigned int, fls64(ns), DAHDI_LATENCY_BUCKETS - 1);
+}
+
+/* Returns 0 when profiling is off, which dahdi_prof_end() then ignores */
+static inline u64 dahdi_prof_start(void)
+{
+	return likely(latency_profiling) ? ktime_get_ns() : 0;
+}
+
+static inline void dahdi_prof_end(enum dahdi_prof_stage stage, u64 start)
+{
+	u64 ns;
+
+	if (!start)
+		return;
+	ns = ktime_get_ns() - start;
+	this_cpu_inc(dahdi_prof_hist.count[stage][dahdi_latency_bucket(ns)]);
+	if (ns > this_cpu_read(dahdi_prof_hist.max_ns[stage]))
+		this_cpu_write(dahdi_prof_hist.max_ns[stage], ns);
+}
+
+/* Records how far this service call of span was from the expected period */
+static inline void dahdi_prof_span_rx(struct dahdi_span *span, u64 now,
+				      int chunks)
+{
+	const u64 period = (u64)chunks * DAHDI_MSECS_PER_CHUNK * NSEC_PER_MSEC;
+	const u64 last = span->rx_last_ns;
+	u64 delta;
+
+	span->rx_last_ns = now;
+	if (!now || !last)
+		return;
+	delta = now - last;
+	delta = (delta > period) ? delta - period : period - delta;
+	span->rx_latency[dahdi_latency_bucket(delta)]++;
+}
+
+static int dahdi_latency_hist_print(char *buf, size_t size, const u32 *hist)
+{
+	int len = 0;
+	int b;
+
+	for (b = 0; b < DAHDI_LATENCY_BUCKETS; b++) {
+		if (!hist[b])
+			continue;
+		len += scnprintf(buf + len, size - len, " %s%llu:%u",
+				 (b == DAHDI_LATENCY_BUCKETS - 1) ? ">=" : "<",
+				 (b == DAHDI_LATENCY_BUCKETS - 1) ?
+				 1ULL << (b - 1) : 1ULL << b, hist[b]);
+	}
+	len += scnprintf(buf + len, size - len, "\n");
+	return len;
+}
+
+int dahdi_latency_stats(char *buf, size_t size)
+{
+	u32 hist[DAHDI_LATENCY_BUCKETS];
+	int len = 0;
+	int stage, cpu, b;
+
+	len += scnprintf(buf + len, size - len, "profiling: %s\n",
+			 latency_profiling ? "on" : "off");
+	for (stage = 0; stage < DAHDI_PROF_STAGES; stage++) {
+		u64 max_ns = 0;
+
+		memset(hist, 0, sizeof(hist));
+		for_each_possible_cpu(cpu) {
+			const struct dahdi_prof_hist *const h =
+				per_cpu_ptr(&dahdi_prof_hist, cpu);
+
+			for (b = 0; b < DAHDI_LATENCY_BUCKETS; b++)
+				hist[b] += READ_ONCE(h->count[stage][b]);
+			max_ns = max(max_ns, READ_ONCE(h->max_ns[stage]));
+		}
+		len += scnprintf(buf + len, size - len, "%s: max %llu ns,",
+				 dahdi_prof_stage_names[stage],
+				 (unsigned long long)max_ns);
+		len += dahdi_latency_hist_print(buf + len, size - len, hist);
+	}
+	return len;
+}
+
+int dahdi_span_latency_stats(struct dahdi_span *span, char *buf, size_t size)
+{
+	u32 hist[DAHDI_LATENCY_BUCKETS];
+	int b;
+
+	for (b = 0; b < DAHDI_LATENCY_BUCKETS; b++)
+		hist[b] = READ_ONCE(span->rx_latency[b]);
+	return dahdi_latency_hist_print(buf, size, hist);
+}
+
+/* Clears the core and per span histograms. Samples recorded while this
+ * runs may be lost. */
+void dahdi_latency_stats_reset(void)
+{
+	struct dahdi_span *s;
+	unsigned long flags;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&dahdi_prof_hist, cpu), 0,
+		       sizeof(struct dahdi_prof_hist));
+
+	spin_lock_irqsave(&chan_lock, flags);
+	list_for_each_entry(s, &span_list, spans_node)
+		memset(s->rx_latency, 0, sizeof(s->rx_latency));
+	spin_unlock_irqrestore(&chan_lock, flags);
+}
+
 static unsigned long
 __for_each_channel(unsigned long (*func)(struct dahdi_chan *chan,
 					 unsigned long data),
@@ -543,7 +985,7 @@ static inline bool can_provide_timing(const struct dahdi_span *const s)
 	return !s->cannot_provide_timing;
 }
 
-static int maxconfs;
+static int maxconfs = 1;
 
 short __dahdi_mulaw[256];
 short __dahdi_alaw[256];
@@ -616,21 +1058,303 @@ void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec)
 	spin_unlock(&ecfactory_list_lock);
 }
 
+/* Instances each echo canceler pool starts with */
+static int ec_pool = 16;
+
+/* Ahead of every pooled instance, and a whole number of cache lines so the
+ * instance itself starts on one. */
+struct dahdi_ec_pool_obj {
+	struct list_head node;
+	struct dahdi_echocan_pool_bucket *bucket;
+} ____cacheline_aligned;
+
+/* Instances are kept by size class, so that tail lengths close to each
+ * other share a bucket rather than each needing one of their own. */
+static inline size_t dahdi_ec_pool_class(size_t size)
+{
+	return roundup_pow_of_two(size);
+}
+
+static struct dahdi_echocan_pool_bucket *
+dahdi_ec_pool_find(struct dahdi_echocan_pool *pool, size_t size)
+{
+	int i;
+
+	for (i = 0; i < DAHDI_EC_POOL_SIZES; i++) {
+		if (pool->buckets[i].cache && pool->buckets[i].size == size)
+			return &pool->buckets[i];
+	}
+	return NULL;
+}
+
+/* Find or add the bucket for an instance of size bytes, or NULL if all
+ * are taken */
+static struct dahdi_echocan_pool_bucket *
+dahdi_ec_pool_bucket(struct dahdi_echocan_pool *pool, size_t size)
+{
+	struct dahdi_echocan_pool_bucket *bucket;
+	struct kmem_cache *cache;
+	int i;
+
+	size = dahdi_ec_pool_class(size);
+	/* Buckets are only ever added, so a hit needs no lock */
+	bucket = dahdi_ec_pool_find(pool, size);
+	if (bucket)
+		return bucket;
+
+	mutex_lock(&pool->create);
+	bucket = dahdi_ec_pool_find(pool, size);
+	for (i = 0; !bucket && i < DAHDI_EC_POOL_SIZES; i++) {
+		if (pool->buckets[i].cache)
+			continue;
+		bucket = &pool->buckets[i];
+		snprintf(bucket->name, sizeof(bucket->name), "dahdi_ec_%s_%zu",
+			 pool->name, size);
+		cache = kmem_cache_create(bucket->name,
+					  sizeof(struct dahdi_ec_pool_obj) + size,
+					  0, SLAB_HWCACHE_ALIGN, NULL);
+		if (!cache) {
+			bucket = NULL;
+			break;
+		}
+		bucket->size = size;
+		/* Pairs with the lockless dahdi_ec_pool_find() */
+		smp_store_release(&bucket->cache, cache);
+	}
+	mutex_unlock(&pool->create);
+	return bucket;
+}
+
+static struct dahdi_ec_pool_obj *
+dahdi_ec_pool_get(struct dahdi_echocan_pool *pool,
+		  struct dahdi_echocan_pool_bucket *bucket)
+{
+	struct dahdi_ec_pool_obj *obj = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (!list_empty(&bucket->free)) {
+		obj = list_first_entry(&bucket->free, struct dahdi_ec_pool_obj,
+				       node);
+		list_del(&obj->node);
+		bucket->nfree--;
+		bucket->nused++;
+		pool->hits++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+	return obj;
+}
+
+void *dahdi_ec_pool_alloc(struct dahdi_echocan_pool *pool, size_t size)
+{
+	struct dahdi_echocan_pool_bucket *bucket;
+	struct dahdi_ec_pool_obj *obj;
+	unsigned long flags;
+
+	bucket = dahdi_ec_pool_bucket(pool, size);
+	if (bucket) {
+		obj = dahdi_ec_pool_get(pool, bucket);
+		if (obj) {
+			/* Reset what the last call left behind */
+			memset(obj + 1, 0, size);
+			return obj + 1;
+		}
+		obj = kmem_cache_zalloc(bucket->cache, GFP_KERNEL);
+	} else {
+		/* More tail lengths than buckets; these just are not kept */
+		obj = kzalloc(sizeof(*obj) + size, GFP_KERNEL);
+	}
+	if (!obj)
+		return NULL;
+
+	obj->bucket = bucket;
+	spin_lock_irqsave(&pool->lock, flags);
+	if (bucket)
+		bucket->nused++;
+	pool->misses++;
+	spin_unlock_irqrestore(&pool->lock, flags);
+	return obj + 1;
+}
+EXPORT_SYMBOL(dahdi_ec_pool_alloc);
+
+/*
+ * Gives an instance back. A bucket keeps no more free instances than
+ * ec_pool or the number still in use, whichever is larger, so that it
+ * shrinks back once a busy period is over. The rest go back to the slab.
+ */
+void dahdi_ec_pool_free(struct dahdi_echocan_pool *pool, void *ptr)
+{
+	struct dahdi_echocan_pool_bucket *bucket;
+	struct dahdi_ec_pool_obj *obj;
+	unsigned long flags;
+	bool keep;
+
+	if (!ptr)
+		return;
+	obj = (struct dahdi_ec_pool_obj *)ptr - 1;
+	bucket = obj->bucket;
+	if (!bucket) {
+		kfree(obj);
+		return;
+	}
+
+	spin_lock_irqsave(&pool->lock, flags);
+	bucket->nused--;
+	keep = bucket->nfree < max_t(unsigned int, ec_pool, bucket->nused);
+	if (keep) {
+		list_add(&obj->node, &bucket->free);
+		bucket->nfree++;
+	} else {
+		pool->shrunk++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (!keep)
+		kmem_cache_free(bucket->cache, obj);
+}
+EXPORT_SYMBOL(dahdi_ec_pool_free);
+
+int dahdi_ec_pool_init(struct dahdi_echocan_pool *pool, const char *name,
+		       size_t size)
+{
+	struct dahdi_echocan_pool_bucket *bucket;
+	struct dahdi_ec_pool_obj *obj;
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->name = name;
+	spin_lock_init(&pool->lock);
+	mutex_init(&pool->create);
+	for (i = 0; i < DAHDI_EC_POOL_SIZES; i++)
+		INIT_LIST_HEAD(&pool->buckets[i].free);
+
+	if (ec_pool <= 0)
+		return 0;
+	bucket = dahdi_ec_pool_bucket(pool, size);
+	if (!bucket)
+		return -ENOMEM;
+	for (i = 0; i < ec_pool; i++) {
+		obj = kmem_cache_zalloc(bucket->cache, GFP_KERNEL);
+		if (!obj) {
+			dahdi_ec_pool_destroy(pool);
+			return -ENOMEM;
+		}
+		obj->bucket = bucket;
+		list_add(&obj->node, &bucket->free);
+		bucket->nfree++;
+	}
+	return 0;
+}
+EXPORT_SYMBOL(dahdi_ec_pool_init);
+
+int dahdi_ec_pool_destroy(struct dahdi_echocan_pool *pool)
+{
+	struct dahdi_echocan_pool_bucket *bucket;
+	struct dahdi_ec_pool_obj *obj, *next;
+	int i;
+
+	/* An instance still out there would be freed into a destroyed
+	 * cache later on, so rather leave everything as it is. */
+	for (i = 0; i < DAHDI_EC_POOL_SIZES; i++) {
+		bucket = &pool->buckets[i];
+		if (bucket->cache && bucket->nused) {
+			module_printk(KERN_ERR, "Echo canceler pool %s still "
+				      "has %u instances of %zu bytes in use\n",
+				      pool->name, bucket->nused, bucket->size);
+			return -EBUSY;
+		}
+	}
+
+	for (i = 0; i < DAHDI_EC_POOL_SIZES; i++) {
+		bucket = &pool->buckets[i];
+		if (!bucket->cache)
+			continue;
+		list_for_each_entry_safe(obj, next, &bucket->free, node)
+			kmem_cache_free(bucket->cache, obj);
+		INIT_LIST_HEAD(&bucket->free);
+		bucket->nfree = 0;
+		kmem_cache_destroy(bucket->cache);
+		bucket->cache = NULL;
+	}
+	return 0;
+}
+EXPORT_SYMBOL(dahdi_ec_pool_destroy);
+
+int dahdi_ec_pool_stats(char *buf, size_t size)
+{
+	const struct dahdi_echocan_pool_bucket *bucket;
+	struct dahdi_echocan_pool *pool;
+	struct ecfactory *cur;
+	unsigned long flags;
+	int len = 0;
+	int i;
+
+	spin_lock(&ecfactory_list_lock);
+	list_for_each_entry(cur, &ecfactory_list, list) {
+		pool = cur->ec->pool;
+		if (!pool)
+			continue;
+		spin_lock_irqsave(&pool->lock, flags);
+		len += scnprintf(buf + len, size - len,
+				 "%s: hits %lu misses %lu shrunk %lu\n",
+				 pool->name, pool->hits, pool->misses,
+				 pool->shrunk);
+		for (i = 0; i < DAHDI_EC_POOL_SIZES; i++) {
+			bucket = &pool->buckets[i];
+			if (!bucket->cache)
+				continue;
+			len += scnprintf(buf + len, size - len,
+					 "  up to %zu bytes: free %u used %u\n",
+					 bucket->size, bucket->nfree,
+					 bucket->nused);
+		}
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+	spin_unlock(&ecfactory_list_lock);
+	return len;
+}
+
 /* Is this span our syncronization master? */
 int dahdi_is_sync_master(const struct dahdi_span *span)
 {
 	return span == master_span;
 }
 
+static inline void conf_talkers_rotate(struct conf_talkers *t, int limit)
+{
+	t->floor = (t->talking >= limit) ? t->top[limit - 1] : 0;
+	t->last_admitted = t->admitted;
+	t->last_talking = t->talking;
+	t->admitted = 0;
+	t->talking = 0;
+}
+
 static inline void rotate_sums(void)
 {
 	/* Rotate where we sum and so forth */
 	static int pos = 0;
+	unsigned int a;
+
 	conf_sums_prev = sums + (DAHDI_MAX_CONF + 1) * pos;
 	conf_sums = sums + (DAHDI_MAX_CONF + 1) * ((pos + 1) % 3);
 	conf_sums_next = sums + (DAHDI_MAX_CONF + 1) * ((pos + 2) % 3);
+	conf_wb_prev = pos;
+	conf_wb_cur = (pos + 1) % 3;
+	conf_wb_next = (pos + 2) % 3;
 	pos = (pos + 1) % 3;
-	memset(conf_sums_next, 0, maxconfs * sizeof(sumtype));
+
+	/* Only aliases in use are ever summed into, so the cost here follows
+	 * the number of live conferences rather than the highest alias. */
+	for_each_set_bit(a, conf_active, maxconfs) {
+		const int limit = READ_ONCE(conf_talkers[a].max);
+		short *const wbsum = conf_wbsum(a, conf_wb_next);
+
+		memset(conf_sums_next[a], 0, sizeof(sumtype));
+		if (wbsum)
+			memset(wbsum, 0, sizeof(wbsumtype));
+		if (limit)
+			conf_talkers_rotate(&conf_talkers[a], limit);
+	}
 }
 
 /**
@@ -643,10 +1367,79 @@ static inline bool is_chan_dacsed(const struct dahdi_chan *const chan)
 }
 
 /**
- * can_dacs_chans() - Returns true if it may be possible to dacs two channels.
+ * dahdi_chan_set_active() - Put chan back on its span's full tx / rx path.
  *
+ * Must be called with chan->lock held, after whatever made the channel
+ * busy is visible, so that a concurrent dahdi_chan_is_idle() check in the
+ * transmit loop cannot clear the bit again.
  */
-static bool can_dacs_chans(struct dahdi_chan *dst, struct dahdi_chan *src)
+static inline void dahdi_chan_set_active(struct dahdi_chan *chan)
+{
+	if (chan->span && chan->chanpos > 0 &&
+	    chan->chanpos <= chan->span->channels)
+		set_bit(chan->chanpos - 1, chan->span->active_chans);
+}
+
+#ifdef CONFIG_DAHDI_MIRROR
+static inline bool dahdi_chan_mirrored(const struct dahdi_chan *chan)
+{
+	return chan->rxmirror || chan->txmirror || chan->srcmirror;
+}
+#else
+static inline bool dahdi_chan_mirrored(const struct dahdi_chan *chan)
+{
+	return false;
+}
+#endif
+
+/**
+ * dahdi_chan_is_idle() - True if the span loops only need to send idle code.
+ *
+ * A channel is idle when it is closed, not conferenced, cross connected,
+ * slaved, carrying HDLC / looped data and has no signalling timer running.
+ * It is not idle either while another channel monitors or mirrors it, or
+ * while it is set up for SF tones, since those need its audio every tick.
+ * Called with chan->lock held.
+ */
+static inline bool dahdi_chan_is_idle(const struct dahdi_chan *chan)
+{
+	const unsigned long busy = DAHDI_FLAG_OPEN | DAHDI_FLAG_NOSTDTXRX |
+				   DAHDI_FLAG_HDLC | DAHDI_FLAG_PPP |
+				   DAHDI_FLAG_MTP2 | DAHDI_FLAG_LOOPED;
+
+	return !(chan->flags & busy) && !chan->confmode &&
+	       !is_chan_dacsed(chan) && !chan->nextslave &&
+	       (chan->master == chan) && !dahdi_have_netdev(chan) &&
+	       !chan->curtone && !chan->itimer && !chan->otimer &&
+	       !chan->pulsetimer && !chan->ringtrailer && !chan->ringdebtimer &&
+	       !atomic_read(&chan->monitors) && !dahdi_chan_mirrored(chan) &&
+	       !chan->rxp1 && !chan->rxp2 && !chan->rxp3 && !chan->txtone;
+}
+
+/**
+ * dahdi_chan_set_conf_chan() - Change the channel chan monitors.
+ * @chan:	The monitoring channel, with chan->lock held.
+ * @conf_chan:	The channel to monitor, or NULL.
+ *
+ * Keeps the monitors count of the old and the new monitored channel up
+ * to date. The new one still has to be made active with
+ * dahdi_chan_set_active() under its own lock.
+ */
+static inline void dahdi_chan_set_conf_chan(struct dahdi_chan *chan,
+					    struct dahdi_chan *conf_chan)
+{
+	if (chan->conf_chan)
+		atomic_dec(&chan->conf_chan->monitors);
+	if (conf_chan)
+		atomic_inc(&conf_chan->monitors);
+	chan->conf_chan = conf_chan;
+}
+
+/**
+ * can_dacs_chans() - Returns true if it may be possible to dacs two channels.
+ *
+ */
+static bool can_dacs_chans(struct dahdi_chan *dst, struct dahdi_chan *src)
 {
 	if (src && dst && src->span && dst->span && src->span->ops &&
 	    dst->span->ops && src->span->ops->dacs &&
@@ -1038,26 +1831,18 @@ static const struct file_operations dahdi_proc_ops = {
 static int dahdi_first_empty_alias(void)
 {
 	/* Find the first conference which has no alias pointing to it */
-	int x;
-	for (x=1;x<DAHDI_MAX_CONF;x++) {
-		if (!confrev[x])
-			return x;
-	}
-	return -1;
+	const unsigned long x = find_next_zero_bit(conf_active,
+						   DAHDI_MAX_CONF, 1);
+
+	return (x < DAHDI_MAX_CONF) ? x : -1;
 }
 
 static void recalc_maxconfs(void)
 {
-	int x;
-
-	for (x = DAHDI_MAX_CONF - 1; x > 0; x--) {
-		if (confrev[x]) {
-			maxconfs = x + 1;
-			return;
-		}
-	}
+	/* Never fails to find alias 0 */
+	const unsigned long x = find_last_bit(conf_active, DAHDI_MAX_CONF);
 
-	maxconfs = 0;
+	maxconfs = x + 1;
 }
 
 static int dahdi_first_empty_conference(void)
@@ -1073,6 +1858,8 @@ static int dahdi_first_empty_conference(void)
 	return -1;
 }
 
+/* The alias of conference x, allocated if it has none yet. -EBUSY when
+ * every alias is in use. */
 static int dahdi_get_conf_alias(int x)
 {
 	int a;
@@ -1082,9 +1869,20 @@ static int dahdi_get_conf_alias(int x)
 
 	/* Allocate an alias */
 	a = dahdi_first_empty_alias();
+	if (a < 0)
+		return -EBUSY;
 	confalias[x] = a;
 	confrev[a] = x;
 
+	/* Sums of unused aliases are not cleared on each tick, so drop
+	 * whatever a previous conference left in them. */
+	memset(sums[a], 0, sizeof(sumtype));
+	memset(sums[(DAHDI_MAX_CONF + 1) + a], 0, sizeof(sumtype));
+	memset(sums[(DAHDI_MAX_CONF + 1) * 2 + a], 0, sizeof(sumtype));
+	memset(&conf_talkers[a], 0, sizeof(conf_talkers[a]));
+	clear_bit(a, conf_wideband);
+	set_bit(a, conf_active);
+
 	/* Highest conference may have changed */
 	recalc_maxconfs();
 
@@ -1142,6 +1940,7 @@ static void dahdi_check_conf(int x)
 
 	/* If we get here, nobody is in the conference anymore.  Clear it out
 	   both forward and reverse */
+	clear_bit(confalias[x], conf_active);
 	confrev[confalias[x]] = 0;
 	confalias[x] = 0;
 
@@ -1217,12 +2016,63 @@ static inline void calc_fcs(struct dahdi_chan *ss, int inwritebuf)
 	data[len - 1] = (fcs >> 8) & 0xff;
 }
 
+/* Called with ss->lock held after the buffers have been (re)assigned */
+static void __dahdi_init_bufs(struct dahdi_chan *ss, int numbufs)
+{
+	int x;
+
+	/* Mark all buffers as empty */
+	for (x = 0; x < numbufs; x++) {
+		ss->writen[x] =
+		ss->writeidx[x]=
+		ss->readn[x]=
+		ss->readidx[x] = 0;
+	}
+
+	/* Keep track of where our data goes (if it goes
+	   anywhere at all) */
+	if (ss->readbuf[0]) {
+		ss->inreadbuf = 0;
+		ss->inwritebuf = 0;
+	} else {
+		ss->inreadbuf = -1;
+		ss->inwritebuf = -1;
+	}
+
+	ss->outreadbuf = -1;
+	ss->outwritebuf = -1;
+	ss->numbufs = numbufs;
+	ss->rx_head = ss->rx_tail = ss->rx_done = 0;
+	ss->tx_head = ss->tx_done = ss->tx_tail = 0;
+
+	if ((ss->txbufpolicy == DAHDI_POLICY_WHEN_FULL) || (ss->txbufpolicy == DAHDI_POLICY_HALF_FULL))
+		ss->txdisable = 1;
+	else
+		ss->txdisable = 0;
+}
+
+static void dahdi_ring_put(struct dahdi_ring *ring);
+
+/* Keep the reader and the writer out while the buffers are replaced */
+static inline void dahdi_chan_io_lock(struct dahdi_chan *chan)
+{
+	mutex_lock(&chan->read_mutex);
+	mutex_lock(&chan->write_mutex);
+}
+
+static inline void dahdi_chan_io_unlock(struct dahdi_chan *chan)
+{
+	mutex_unlock(&chan->write_mutex);
+	mutex_unlock(&chan->read_mutex);
+}
+
 static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 {
 	unsigned char *newtxbuf = NULL;
 	unsigned char *newrxbuf = NULL;
 	unsigned char *oldtxbuf = NULL;
 	unsigned char *oldrxbuf = NULL;
+	struct dahdi_ring *oldring;
 	unsigned long flags;
 	int x;
 
@@ -1248,11 +2098,17 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 	/* Now that we've allocated our new buffers, we can safely
  	   move things around... */
 
+	dahdi_chan_io_lock(ss);
 	spin_lock_irqsave(&ss->lock, flags);
 
 	ss->blocksize = blocksize; /* set the blocksize */
-	oldrxbuf = ss->readbuf[0]; /* Keep track of the old buffer */
-	oldtxbuf = ss->writebuf[0];
+	/* Buffers in a shared ring are released with the ring */
+	oldring = ss->ring;
+	ss->ring = NULL;
+	if (!oldring) {
+		oldrxbuf = ss->readbuf[0]; /* Keep track of the old buffer */
+		oldtxbuf = ss->writebuf[0];
+	}
 	ss->readbuf[0] = NULL;
 
 	if (newrxbuf) {
@@ -1268,37 +2124,15 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 		}
 	}
 
-	/* Mark all buffers as empty */
-	for (x = 0; x < numbufs; x++) {
-		ss->writen[x] =
-		ss->writeidx[x]=
-		ss->readn[x]=
-		ss->readidx[x] = 0;
-	}
-
-	/* Keep track of where our data goes (if it goes
-	   anywhere at all) */
-	if (newrxbuf) {
-		ss->inreadbuf = 0;
-		ss->inwritebuf = 0;
-	} else {
-		ss->inreadbuf = -1;
-		ss->inwritebuf = -1;
-	}
-
-	ss->outreadbuf = -1;
-	ss->outwritebuf = -1;
-	ss->numbufs = numbufs;
-
-	if ((ss->txbufpolicy == DAHDI_POLICY_WHEN_FULL) || (ss->txbufpolicy == DAHDI_POLICY_HALF_FULL))
-		ss->txdisable = 1;
-	else
-		ss->txdisable = 0;
+	__dahdi_init_bufs(ss, numbufs);
 
 	spin_unlock_irqrestore(&ss->lock, flags);
+	dahdi_chan_io_unlock(ss);
 
 	kfree(oldtxbuf);
 	kfree(oldrxbuf);
+	if (oldring)
+		dahdi_ring_put(oldring);
 
 	return 0;
 }
@@ -1455,6 +2289,20 @@ retry:
 	goto retry;
 }
 
+/**
+ * dahdi_ec_batch_sync() - Wait for a batch to be done with an echo canceller.
+ * @chan:	The channel whose ec_state was just taken off it.
+ *
+ * A batch runs the canceller of a channel without holding its lock, so
+ * whoever takes ec_state off the channel must call this before freeing
+ * it. It may be called with or without chan->lock held.
+ */
+static inline void dahdi_ec_batch_sync(struct dahdi_chan *chan)
+{
+	while (smp_load_acquire(&chan->ec_batched))
+		cpu_relax();
+}
+
 static void release_echocan(const struct dahdi_echocan_factory *ec)
 {
 	if (ec)
@@ -1538,6 +2386,11 @@ static void dahdi_disable_hw_preechocan(struct dahdi_chan *chan)
 		chan->span->ops->disable_hw_preechocan(chan);
 }
 
+/* Received chunks count as voice above about -50 dBFS and 9 dB above the
+   noise floor, and keep counting for DAHDI_VAD_HANGOVER chunks after */
+#define DAHDI_VAD_MIN_ENERGY	10000
+#define DAHDI_VAD_HANGOVER	(DAHDI_MS_TO_SAMPLES(200) / DAHDI_CHUNKSIZE)
+
 /* 
  * close_channel - close the channel, resetting any channel variables
  * @chan: the dahdi_chan to close
@@ -1555,6 +2408,7 @@ static void close_channel(struct dahdi_chan *chan)
 	const struct dahdi_echocan_factory *ec_current;
 	int oldconf;
 	short *readchunkpreec;
+	struct dahdi_digit_detector *digitdet;
 #ifdef CONFIG_DAHDI_PPP
 	struct ppp_channel *ppp;
 #endif
@@ -1592,6 +2446,15 @@ static void close_channel(struct dahdi_chan *chan)
 	chan->ec_current = NULL;
 	readchunkpreec = chan->readchunkpreec;
 	chan->readchunkpreec = NULL;
+	digitdet = chan->digitdet;
+	chan->digitdet = NULL;
+	chan->digitdetect = 0;
+	chan->rxenergy = 0;
+	chan->rxnoise = DAHDI_VAD_MIN_ENERGY;
+	chan->rxhang = 0;
+	chan->rxsilent = 0;
+	chan->confenergy = 0;
+	chan->wideband = 0;
 	chan->curtone = NULL;
 	if (chan->curzone) {
 		struct dahdi_zone *zone = chan->curzone;
@@ -1645,6 +2508,7 @@ static void close_channel(struct dahdi_chan *chan)
 	spin_unlock_irqrestore(&chan->lock, flags);
 
 	if (ec_state) {
+		dahdi_ec_batch_sync(chan);
 		ec_state->ops->echocan_free(chan, ec_state);
 		release_echocan(ec_current);
 	}
@@ -1656,6 +2520,8 @@ static void close_channel(struct dahdi_chan *chan)
 	if (rxgain)
 		kfree(rxgain);
 
+	kfree(digitdet);
+
 	if (readchunkpreec) {
 		dahdi_disable_hw_preechocan(chan);
 		kfree(readchunkpreec);
@@ -1916,6 +2782,8 @@ static void __dahdi_init_chan(struct dahdi_chan *chan)
 
 	spin_lock_init(&chan->lock);
 	mutex_init(&chan->mutex);
+	mutex_init(&chan->read_mutex);
+	mutex_init(&chan->write_mutex);
 	init_waitqueue_head(&chan->waitq);
 	if (!chan->master)
 		chan->master = chan;
@@ -1925,6 +2793,9 @@ static void __dahdi_init_chan(struct dahdi_chan *chan)
 		chan->writechunk = chan->swritechunk;
 	chan->rxgain = NULL;
 	chan->txgain = NULL;
+	/* Start the noise floor at the voice threshold, see __dahdi_rx_level() */
+	chan->rxnoise = DAHDI_VAD_MIN_ENERGY;
+	chan->rxhang = 0;
 	close_channel(chan);
 }
 
@@ -2305,7 +3176,7 @@ static unsigned long _chan_cleanup(struct dahdi_chan *pos, unsigned long data)
 		pos->confna = 0;
 		pos->_confn = 0;
 		pos->confmode = 0;
-		pos->conf_chan = NULL;
+		dahdi_chan_set_conf_chan(pos, NULL);
 		pos->dacs_chan = NULL;
 		spin_unlock_irqrestore(&pos->lock, flags);
 	}
@@ -2397,91 +3268,34 @@ static void dahdi_chan_unreg(struct dahdi_chan *chan)
 	}
 }
 
-static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
-			       size_t count, loff_t *ppos)
+static int num_filled_bufs(struct dahdi_chan *chan)
 {
-	struct dahdi_chan *chan = file->private_data;
-	int amnt;
-	int res, rv;
-	int oldbuf,x;
-	unsigned long flags;
+	int range1, range2;
 
-	/* Make sure count never exceeds 65k, and make sure it's unsigned */
-	count &= 0xffff;
+	if (chan->inwritebuf < 0) {
+		return chan->numbufs;
+	}
 
-	if (unlikely(!chan)) {
-		/*
-		 * This should never happen. Surprise device removal
-		 * should lead us to the nodev_* file_operations
-		 */
-		msleep(5);
-		module_printk(KERN_ERR, "%s: NODEV\n", __func__);
-		return -ENODEV;
+	if (chan->outwritebuf < 0) {
+		return 0;
 	}
 
-	if (unlikely(count < 1))
-		return -EINVAL;
+	if (chan->outwritebuf <= chan->inwritebuf) {
+		return chan->inwritebuf - chan->outwritebuf;
+	}
 
-	if (unlikely(!test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags)))
-		return -ENODEV;
+	/* This means (in > out) and we have wrap around */
+	range1 = chan->numbufs - chan->outwritebuf;
+	range2 = chan->inwritebuf;
 
-	for (;;) {
-		spin_lock_irqsave(&chan->lock, flags);
-		if (chan->eventinidx != chan->eventoutidx) {
-			spin_unlock_irqrestore(&chan->lock, flags);
-			return -ELAST /* - chan->eventbuf[chan->eventoutidx]*/;
-		}
-		res = chan->outreadbuf;
-		spin_unlock_irqrestore(&chan->lock, flags);
-		if (res >= 0)
-			break;
-		if (file->f_flags & O_NONBLOCK)
-			return -EAGAIN;
+	return range1 + range2;
+}
 
-		/* Wake up when data is available or when the board driver
-		 * unregistered the channel. */
-		rv = wait_event_interruptible(chan->waitq,
-			(!chan->file->private_data || chan->outreadbuf > -1));
-		if (rv)
-			return rv;
-		if (unlikely(!chan->file->private_data))
-			return -ENODEV;
-	}
-	amnt = count;
-	if (chan->flags & DAHDI_FLAG_LINEAR) {
-		if (amnt > (chan->readn[res] << 1))
-			amnt = chan->readn[res] << 1;
-		if (amnt) {
-			/* There seems to be a max stack size, so we have
-			   to do this in smaller pieces */
-			short lindata[128];
-			int left = amnt >> 1; /* amnt is in bytes */
-			int pos = 0;
-			int pass;
-			while (left) {
-				pass = left;
-				if (pass > 128)
-					pass = 128;
-				for (x = 0; x < pass; x++)
-					lindata[x] = DAHDI_XLAW(chan->readbuf[res][x + pos], chan);
-				if (copy_to_user(usrbuf + (pos << 1), lindata, pass << 1))
-					return -EFAULT;
-				left -= pass;
-				pos += pass;
-			}
-		}
-	} else {
-		if (amnt > chan->readn[res])
-			amnt = chan->readn[res];
-		if (amnt) {
-			if (copy_to_user(usrbuf, chan->readbuf[res], amnt))
-				return -EFAULT;
-		}
-	}
-	spin_lock_irqsave(&chan->lock, flags);
+/* Called with chan->lock held once the reader is done with readbuf[res] */
+static void __dahdi_read_done(struct dahdi_chan *chan, int res)
+{
 	chan->readidx[res] = 0;
 	chan->readn[res] = 0;
-	oldbuf = res;
 	chan->outreadbuf = (res + 1) % chan->numbufs;
 	if (chan->outreadbuf == chan->inreadbuf) {
 		/* Out of stuff */
@@ -2489,96 +3303,601 @@ static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
 	}
 	if (chan->inreadbuf < 0) {
 		/* Notify interrupt handler that we have some space now */
-		chan->inreadbuf = oldbuf;
+		chan->inreadbuf = res;
 	}
-	spin_unlock_irqrestore(&chan->lock, flags);
-
-	return amnt;
 }
 
-static int num_filled_bufs(struct dahdi_chan *chan)
+/* Called with chan->lock held once writebuf[res] has been filled */
+static void __dahdi_write_done(struct dahdi_chan *chan, int res)
 {
-	int range1, range2;
+	chan->inwritebuf = (res + 1) % chan->numbufs;
 
-	if (chan->inwritebuf < 0) {
-		return chan->numbufs;
+	if (chan->inwritebuf == chan->outwritebuf) {
+		/* Don't stomp on the transmitter, just wait for them to
+		   wake us up */
+		chan->inwritebuf = -1;
+		/* Make sure the transmitter is transmitting in case of POLICY_WHEN_FULL */
+		chan->txdisable = 0;
 	}
 
 	if (chan->outwritebuf < 0) {
-		return 0;
+		/* Okay, the interrupt handler has been waiting for us.  Give them a buffer */
+		chan->outwritebuf = res;
 	}
 
-	if (chan->outwritebuf <= chan->inwritebuf) {
-		return chan->inwritebuf - chan->outwritebuf;
+	if ((chan->txbufpolicy == DAHDI_POLICY_HALF_FULL) && (chan->txdisable)) {
+		if (num_filled_bufs(chan) >= (chan->numbufs >> 1)) {
+#ifdef BUFFER_DEBUG
+			printk("Reached buffer fill mark of %d\n", num_filled_bufs(chan));
+#endif
+			chan->txdisable = 0;
+		}
 	}
+}
 
-	/* This means (in > out) and we have wrap around */
-	range1 = chan->numbufs - chan->outwritebuf;
-	range2 = chan->inwritebuf;
+static inline void dahdi_ec_process_tx(struct dahdi_chan *chan, int res)
+{
+#ifdef CONFIG_DAHDI_ECHOCAN_PROCESS_TX
+	int x;
 
-	return range1 + range2;
+	if ((chan->ec_state) &&
+	    (ECHO_MODE_ACTIVE == chan->ec_state->status.mode) &&
+	    (chan->ec_state->ops->echocan_process_tx)) {
+		struct dahdi_echocan_state *const ec = chan->ec_state;
+		for (x = 0; x < chan->writen[res]; ++x) {
+			short tx;
+			tx = DAHDI_XLAW(chan->writebuf[res][x], chan);
+			ec->ops->echocan_process_tx(ec, &tx, 1);
+			chan->writebuf[res][x] = DAHDI_LIN2X((int) tx,
+							     chan);
+		}
+	}
+#endif
 }
 
-static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
-				size_t count, loff_t *ppos)
+/*
+ * Block hand-over between the interrupt side and read() / write()
+ *
+ * Besides the buffer indices (inreadbuf and friends, owned by whoever holds
+ * chan->lock) each direction has block positions running from 0 to
+ * 2 * numbufs - 1, every one of them advanced by one side only: rx_head and
+ * tx_tail by the interrupt side, rx_tail by the reader and tx_head by the
+ * writer.  Block (pos % numbufs) is published with a release store of the
+ * position, so the reader and writer of plain channels never take
+ * chan->lock.  __dahdi_sync_bufs() then catches the indices up from the
+ * chunk handlers, which hold the lock anyway.
+ *
+ * That only holds with a single reader and a single writer.  read() and
+ * DAHDI_BULK_IO reads of a channel hold chan->read_mutex while they take a
+ * block, and writes chan->write_mutex, so threads sharing the file
+ * descriptor take turns.  Neither is held while waiting for a block.
+ * Whatever replaces the buffers (dahdi_reallocbufs(), DAHDI_RING_SETUP)
+ * holds both, so a block is never copied while it is being freed.
+ */
+static inline u32 dahdi_pos_next(const struct dahdi_chan *chan, u32 pos)
 {
-	unsigned long flags;
-	struct dahdi_chan *chan = file->private_data;
-	int res, amnt, oldbuf, rv, x;
+	return (++pos == 2 * chan->numbufs) ? 0 : pos;
+}
 
-	/* Make sure count never exceeds 65k, and make sure it's unsigned */
-	count &= 0xffff;
+static inline u32 dahdi_pos_count(const struct dahdi_chan *chan,
+				  u32 head, u32 tail)
+{
+	return (head >= tail) ? head - tail : head + 2 * chan->numbufs - tail;
+}
 
-	if (unlikely(!chan)) {
-		/*
-		 * This should never happen. Surprise device removal
-		 * should lead us to the nodev_* file_operations
-		 */
-		msleep(5);
-		module_printk(KERN_ERR, "%s: NODEV\n", __func__);
-		return -ENODEV;
-	}
+static inline int dahdi_pos_buf(const struct dahdi_chan *chan, u32 pos)
+{
+	return (pos >= chan->numbufs) ? pos - chan->numbufs : pos;
+}
 
-	if (unlikely(count < 1))
-		return -EINVAL;
+/* Channels whose blocks are handed over without chan->lock */
+static inline bool dahdi_chan_lockless(const struct dahdi_chan *chan)
+{
+	return !(chan->flags & (DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS |
+				DAHDI_FLAG_PPP | DAHDI_FLAG_MTP2 |
+				DAHDI_FLAG_NOSTDTXRX)) &&
+	       !dahdi_have_netdev(chan);
+}
 
-	if (unlikely(!test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags)))
-		return -ENODEV;
+static inline bool dahdi_rx_ready(const struct dahdi_chan *chan)
+{
+	return READ_ONCE(chan->rx_head) != READ_ONCE(chan->rx_tail);
+}
 
-	for (;;) {
-		spin_lock_irqsave(&chan->lock, flags);
-		if ((chan->curtone || chan->pdialcount) && !is_pseudo_chan(chan)) {
-			chan->curtone = NULL;
-			chan->tonep = 0;
-			chan->dialing = 0;
-			chan->txdialbuf[0] = '\0';
-			chan->pdialcount = 0;
+static inline bool dahdi_tx_room(const struct dahdi_chan *chan, bool lockless)
+{
+	if (!lockless)
+		return READ_ONCE(chan->inwritebuf) > -1;
+	/* Pairs with the release in __dahdi_getbuf_chunk() */
+	return dahdi_pos_count(chan, chan->tx_head,
+			       smp_load_acquire(&chan->tx_tail)) < chan->numbufs;
+}
+
+/* Called with chan->lock held */
+static void __dahdi_sync_bufs(struct dahdi_chan *chan)
+{
+	/* Pairs with the releases in read() / write() */
+	const u32 rx_tail = smp_load_acquire(&chan->rx_tail);
+	const u32 tx_head = smp_load_acquire(&chan->tx_head);
+
+	/* Read blocks the reader is done with */
+	while (chan->rx_done != rx_tail && chan->outreadbuf > -1) {
+		__dahdi_read_done(chan, chan->outreadbuf);
+		chan->rx_done = dahdi_pos_next(chan, chan->rx_done);
+	}
+
+	/* Write blocks the writer has filled */
+	while (chan->tx_done != tx_head && chan->inwritebuf > -1) {
+		const int res = chan->inwritebuf;
+
+		chan->writeidx[res] = 0;
+		dahdi_ec_process_tx(chan, res);
+		__dahdi_write_done(chan, res);
+		chan->tx_done = dahdi_pos_next(chan, chan->tx_done);
+	}
+}
+
+/*
+ * Shared memory ring (DAHDI_RING_SETUP)
+ *
+ * The ring only changes where readbuf[] / writebuf[] live and mirrors the
+ * block positions above in a header page.  Positions the application
+ * advances are picked up by __dahdi_ring_sync() from the chunk handlers and
+ * poll().
+ */
+struct dahdi_ring {
+	struct kref refcount;
+	struct dahdi_ring_hdr *hdr;	/* vmalloc_user(), mapped by the app */
+	size_t size;
+	struct eventfd_ctx *efd;
+};
+
+static void dahdi_ring_release(struct kref *kref)
+{
+	struct dahdi_ring *ring = container_of(kref, struct dahdi_ring,
+					       refcount);
+
+	if (ring->efd)
+		eventfd_ctx_put(ring->efd);
+	vfree(ring->hdr);
+	kfree(ring);
+}
+
+static void dahdi_ring_put(struct dahdi_ring *ring)
+{
+	kref_put(&ring->refcount, dahdi_ring_release);
+}
+
+/*
+ * Called with chan->lock held.  Drops the blocks of the flushed direction by
+ * moving the consumer up to the producer.  Positions never move back, so a
+ * reader racing with the flush cannot hand a dropped block back again.
+ */
+static void __dahdi_flush_bufs(struct dahdi_chan *chan, int which)
+{
+	int x;
+
+	if (which & DAHDI_FLUSH_READ) {
+		for (x = 0; x < chan->numbufs; x++) {
+			chan->readn[x] = 0;
+			chan->readidx[x] = 0;
 		}
-		if (chan->eventinidx != chan->eventoutidx) {
-			spin_unlock_irqrestore(&chan->lock, flags);
-			return -ELAST;
+		chan->inreadbuf = (chan->readbuf[0]) ?
+			dahdi_pos_buf(chan, chan->rx_head) : -1;
+		chan->outreadbuf = -1;
+		chan->rx_done = chan->rx_head;
+		WRITE_ONCE(chan->rx_tail, chan->rx_head);
+		if (chan->ring)
+			WRITE_ONCE(chan->ring->hdr->rx_tail, chan->rx_tail);
+	}
+	if (which & DAHDI_FLUSH_WRITE) {
+		for (x = 0; x < chan->numbufs; x++) {
+			chan->writen[x] = 0;
+			chan->writeidx[x] = 0;
+		}
+		chan->tx_done = READ_ONCE(chan->tx_head);
+		chan->inwritebuf = (chan->writebuf[0]) ?
+			dahdi_pos_buf(chan, chan->tx_done) : -1;
+		chan->outwritebuf = -1;
+		WRITE_ONCE(chan->tx_tail, chan->tx_done);
+		if (chan->ring)
+			WRITE_ONCE(chan->ring->hdr->tx_tail, chan->tx_tail);
+	}
+}
+
+/* Called with chan->lock held */
+static void __dahdi_ring_sync(struct dahdi_chan *chan)
+{
+	struct dahdi_ring_hdr *const hdr = chan->ring->hdr;
+	const u32 rx_tail = READ_ONCE(hdr->rx_tail);
+	const u32 tx_head = READ_ONCE(hdr->tx_head);
+
+	/* Receive blocks the application is done with */
+	if (rx_tail < 2 * chan->numbufs &&
+	    dahdi_pos_count(chan, rx_tail, chan->rx_tail) <=
+	    dahdi_pos_count(chan, chan->rx_head, chan->rx_tail))
+		chan->rx_tail = rx_tail;
+
+	/* Read the blocks only after seeing tx_head */
+	smp_rmb();
+
+	/* Transmit blocks the application has filled */
+	while (tx_head < 2 * chan->numbufs && chan->tx_head != tx_head &&
+	       dahdi_pos_count(chan, chan->tx_head, chan->tx_tail) <
+	       chan->numbufs) {
+		const int res = dahdi_pos_buf(chan, chan->tx_head);
+		u32 len = READ_ONCE(hdr->tx_len[res]);
+
+		if (!len || len > chan->blocksize)
+			len = chan->blocksize;
+		chan->writen[res] = len;
+		chan->tx_head = dahdi_pos_next(chan, chan->tx_head);
+	}
+
+	__dahdi_sync_bufs(chan);
+}
+
+/* Called with chan->lock held */
+static inline void __dahdi_sync(struct dahdi_chan *chan)
+{
+	if (unlikely(chan->ring))
+		__dahdi_ring_sync(chan);
+	else
+		__dahdi_sync_bufs(chan);
+}
+
+/* Called with chan->lock held when readbuf[res] has been filled */
+static void __dahdi_ring_rx_block(struct dahdi_chan *chan, int res)
+{
+	struct dahdi_ring *const ring = chan->ring;
+
+	WRITE_ONCE(ring->hdr->rx_len[res], chan->readn[res]);
+	WRITE_ONCE(ring->hdr->rx_flags[res], chan->rxblk_flags);
+	WRITE_ONCE(ring->hdr->rx_energy[res], chan->rxblk_energy);
+	chan->rxblk_flags = 0;
+	chan->rxblk_energy = 0;
+	/* Block and length before the position */
+	smp_wmb();
+	WRITE_ONCE(ring->hdr->rx_head, chan->rx_head);
+	if (ring->efd) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(ring->efd);
+#else
+		eventfd_signal(ring->efd, 1);
+#endif
+	}
+}
+
+/* Called with chan->lock held when a write buffer has been sent */
+static inline void __dahdi_ring_tx_block(struct dahdi_chan *chan)
+{
+	WRITE_ONCE(chan->ring->hdr->tx_tail, chan->tx_tail);
+}
+
+static int dahdi_ioctl_ring_setup(struct dahdi_chan *chan, unsigned long data)
+{
+	struct dahdi_ring_setup setup;
+	struct dahdi_ring_hdr *hdr;
+	struct dahdi_ring *ring;
+	unsigned char *oldrxbuf, *oldtxbuf;
+	unsigned char *rxbuf, *txbuf;
+	unsigned long flags;
+	int blocksize, numbufs;
+	int x, res;
+
+	if (copy_from_user(&setup, (void __user *)data, sizeof(setup)))
+		return -EFAULT;
+
+	if (!dahdi_chan_lockless(chan))
+		return -EINVAL;
+
+	blocksize = chan->blocksize;
+	numbufs = chan->numbufs;
+	if (!blocksize || chan->ring)
+		return -EBUSY;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+	kref_init(&ring->refcount);
+
+	ring->size = PAGE_ALIGN(PAGE_ALIGN(sizeof(*hdr)) +
+				2 * blocksize * numbufs);
+	hdr = ring->hdr = vmalloc_user(ring->size);
+	if (!hdr) {
+		res = -ENOMEM;
+		goto error_exit;
+	}
+
+	if (setup.eventfd >= 0) {
+		ring->efd = eventfd_ctx_fdget(setup.eventfd);
+		if (IS_ERR(ring->efd)) {
+			res = PTR_ERR(ring->efd);
+			ring->efd = NULL;
+			goto error_exit;
+		}
+	}
+
+	hdr->version = DAHDI_RING_VERSION;
+	hdr->blocksize = blocksize;
+	hdr->numbufs = numbufs;
+	hdr->rx_offset = PAGE_ALIGN(sizeof(*hdr));
+	hdr->tx_offset = hdr->rx_offset + blocksize * numbufs;
+	rxbuf = (unsigned char *)hdr + hdr->rx_offset;
+	txbuf = (unsigned char *)hdr + hdr->tx_offset;
+
+	dahdi_chan_io_lock(chan);
+	spin_lock_irqsave(&chan->lock, flags);
+	if (chan->ring || (chan->blocksize != blocksize) ||
+	    (chan->numbufs != numbufs)) {
+		/* Raced with DAHDI_SET_BUFINFO or another setup */
+		spin_unlock_irqrestore(&chan->lock, flags);
+		dahdi_chan_io_unlock(chan);
+		res = -EBUSY;
+		goto error_exit;
+	}
+	oldrxbuf = chan->readbuf[0];
+	oldtxbuf = chan->writebuf[0];
+	for (x = 0; x < numbufs; x++) {
+		chan->readbuf[x] = rxbuf + x * blocksize;
+		chan->writebuf[x] = txbuf + x * blocksize;
+	}
+	__dahdi_init_bufs(chan, numbufs);
+	chan->ring = ring;
+	spin_unlock_irqrestore(&chan->lock, flags);
+	dahdi_chan_io_unlock(chan);
+
+	kfree(oldtxbuf);
+	kfree(oldrxbuf);
+
+	setup.size = ring->size;
+	if (copy_to_user((void __user *)data, &setup, sizeof(setup)))
+		return -EFAULT;
+	return 0;
+
+error_exit:
+	dahdi_ring_put(ring);
+	return res;
+}
+
+static int dahdi_ioctl_ring_release(struct dahdi_chan *chan)
+{
+	if (!chan->ring)
+		return -EINVAL;
+	/* Back to private buffers of the same geometry */
+	return dahdi_reallocbufs(chan, chan->blocksize, chan->numbufs);
+}
+
+static void dahdi_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct dahdi_ring *const ring = vma->vm_private_data;
+
+	kref_get(&ring->refcount);
+}
+
+static void dahdi_ring_vm_close(struct vm_area_struct *vma)
+{
+	dahdi_ring_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct dahdi_ring_vm_ops = {
+	.open = dahdi_ring_vm_open,
+	.close = dahdi_ring_vm_close,
+};
+
+static int dahdi_chan_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct dahdi_chan *const chan = file->private_data;
+	struct dahdi_ring *ring;
+	unsigned long flags;
+	int res;
+
+	if (unlikely(!chan))
+		return -ENODEV;
+	if (vma->vm_pgoff)
+		return -EINVAL;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	ring = chan->ring;
+	if (ring)
+		kref_get(&ring->refcount);
+	spin_unlock_irqrestore(&chan->lock, flags);
+	if (!ring)
+		return -EINVAL;
+
+	if ((vma->vm_end - vma->vm_start) > ring->size)
+		res = -EINVAL;
+	else
+		res = remap_vmalloc_range(vma, ring->hdr, 0);
+	if (res) {
+		dahdi_ring_put(ring);
+		return res;
+	}
+
+	/* The mapping keeps the ring alive after DAHDI_RING_RELEASE */
+	vma->vm_private_data = ring;
+	vma->vm_ops = &dahdi_ring_vm_ops;
+	return 0;
+}
+
+static ssize_t __dahdi_chan_read(struct dahdi_chan *chan,
+				 char __user *usrbuf, size_t count,
+				 bool nonblock)
+{
+	int amnt;
+	int res, rv;
+	u32 pos;
+	unsigned long flags;
+
+	if (unlikely(count < 1))
+		return -EINVAL;
+
+	if (unlikely(!test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags)))
+		return -ENODEV;
+
+	if (mutex_lock_interruptible(&chan->read_mutex))
+		return -ERESTARTSYS;
+	for (;;) {
+		if (chan->ring) {
+			amnt = -EBUSY;
+			goto out;
+		}
+		if (READ_ONCE(chan->eventinidx) != READ_ONCE(chan->eventoutidx)) {
+			amnt = -ELAST /* - chan->eventbuf[chan->eventoutidx]*/;
+			goto out;
+		}
+		pos = READ_ONCE(chan->rx_tail);
+		/* Pairs with the release in __putbuf_chunk() */
+		if (smp_load_acquire(&chan->rx_head) != pos)
+			break;
+		if (nonblock) {
+			amnt = -EAGAIN;
+			goto out;
+		}
+
+		/* Wake up when data is available or when the board driver
+		 * unregistered the channel. */
+		mutex_unlock(&chan->read_mutex);
+		rv = wait_event_interruptible(chan->waitq,
+			(!chan->file->private_data || dahdi_rx_ready(chan)));
+		if (rv)
+			return rv;
+		if (unlikely(!chan->file->private_data))
+			return -ENODEV;
+		if (mutex_lock_interruptible(&chan->read_mutex))
+			return -ERESTARTSYS;
+	}
+	res = dahdi_pos_buf(chan, pos);
+	amnt = count;
+	if (chan->flags & DAHDI_FLAG_LINEAR) {
+		if (amnt > (chan->readn[res] << 1))
+			amnt = chan->readn[res] << 1;
+		if (amnt) {
+			/* There seems to be a max stack size, so we have
+			   to do this in smaller pieces */
+			short lindata[128];
+			int left = amnt >> 1; /* amnt is in bytes */
+			int pos = 0;
+			int pass;
+			while (left) {
+				pass = left;
+				if (pass > 128)
+					pass = 128;
+				dahdi_xlaw_to_lin_block(chan, lindata,
+						chan->readbuf[res] + pos, pass);
+				if (copy_to_user(usrbuf + (pos << 1), lindata, pass << 1)) {
+					amnt = -EFAULT;
+					goto out;
+				}
+				left -= pass;
+				pos += pass;
+			}
+		}
+	} else {
+		if (amnt > chan->readn[res])
+			amnt = chan->readn[res];
+		if (amnt) {
+			if (copy_to_user(usrbuf, chan->readbuf[res], amnt)) {
+				amnt = -EFAULT;
+				goto out;
+			}
 		}
-		res = chan->inwritebuf;
+	}
+	/* Hand the block back, unless DAHDI_FLUSH dropped it meanwhile */
+	cmpxchg(&chan->rx_tail, pos, dahdi_pos_next(chan, pos));
+	if (!dahdi_chan_lockless(chan)) {
+		spin_lock_irqsave(&chan->lock, flags);
+		__dahdi_sync_bufs(chan);
 		spin_unlock_irqrestore(&chan->lock, flags);
-		if (res >= 0)
+	}
+out:
+	mutex_unlock(&chan->read_mutex);
+	return amnt;
+}
+
+static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
+			       size_t count, loff_t *ppos)
+{
+	struct dahdi_chan *chan = file->private_data;
+
+	/* Make sure count never exceeds 65k, and make sure it's unsigned */
+	count &= 0xffff;
+
+	if (unlikely(!chan)) {
+		/*
+		 * This should never happen. Surprise device removal
+		 * should lead us to the nodev_* file_operations
+		 */
+		msleep(5);
+		module_printk(KERN_ERR, "%s: NODEV\n", __func__);
+		return -ENODEV;
+	}
+
+	return __dahdi_chan_read(chan, usrbuf, count,
+				 file->f_flags & O_NONBLOCK);
+}
+
+static ssize_t __dahdi_chan_write(struct dahdi_chan *chan,
+				  const char __user *usrbuf, size_t count,
+				  bool nonblock)
+{
+	unsigned long flags;
+	int res, amnt, rv;
+	const bool lockless = dahdi_chan_lockless(chan);
+
+	if (unlikely(count < 1))
+		return -EINVAL;
+
+	if (unlikely(!test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags)))
+		return -ENODEV;
+
+	if (mutex_lock_interruptible(&chan->write_mutex))
+		return -ERESTARTSYS;
+	for (;;) {
+		if (chan->ring) {
+			amnt = -EBUSY;
+			goto out;
+		}
+		if ((READ_ONCE(chan->curtone) || READ_ONCE(chan->pdialcount)) &&
+		    !is_pseudo_chan(chan)) {
+			spin_lock_irqsave(&chan->lock, flags);
+			chan->curtone = NULL;
+			chan->tonep = 0;
+			chan->dialing = 0;
+			chan->txdialbuf[0] = '\0';
+			chan->pdialcount = 0;
+			spin_unlock_irqrestore(&chan->lock, flags);
+		}
+		if (READ_ONCE(chan->eventinidx) != READ_ONCE(chan->eventoutidx)) {
+			amnt = -ELAST;
+			goto out;
+		}
+		if (dahdi_tx_room(chan, lockless))
 			break;
-		if (file->f_flags & O_NONBLOCK) {
+		if (nonblock) {
 #ifdef BUFFER_DEBUG
 			printk("Error: Nonblock\n");
 #endif
-			return -EAGAIN;
+			amnt = -EAGAIN;
+			goto out;
 		}
 
 		/* Wake up when room in the write queue is available or when
 		 * the board driver unregistered the channel. */
+		mutex_unlock(&chan->write_mutex);
 		rv = wait_event_interruptible(chan->waitq,
-			(!chan->file->private_data || chan->inwritebuf > -1));
+			(!chan->file->private_data ||
+			 dahdi_tx_room(chan, lockless)));
 		if (rv)
 			return rv;
 		if (unlikely(!chan->file->private_data))
 			return -ENODEV;
+		if (mutex_lock_interruptible(&chan->write_mutex))
+			return -ERESTARTSYS;
 	}
 
+	/* The locked path queues every block at once, so this is inwritebuf */
+	res = dahdi_pos_buf(chan, chan->tx_head);
 	amnt = count;
 	if (chan->flags & DAHDI_FLAG_LINEAR) {
 		if (amnt > (chan->blocksize << 1))
@@ -2606,62 +3925,33 @@ static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
 				if (pass > 128)
 					pass = 128;
 				if (copy_from_user(lindata, usrbuf + (pos << 1), pass << 1)) {
-					return -EFAULT;
+					amnt = -EFAULT;
+					goto out;
 				}
 				left -= pass;
-				for (x = 0; x < pass; x++)
-					chan->writebuf[res][x + pos] = DAHDI_LIN2X(lindata[x], chan);
+				dahdi_lin_to_xlaw_block(chan,
+						chan->writebuf[res] + pos,
+						lindata, pass);
 				pos += pass;
 			}
 			chan->writen[res] = amnt >> 1;
 		} else {
 			if (copy_from_user(chan->writebuf[res], usrbuf, amnt)) {
-				return -EFAULT;
+				amnt = -EFAULT;
+				goto out;
 			}
 			chan->writen[res] = amnt;
 		}
-#ifdef CONFIG_DAHDI_ECHOCAN_PROCESS_TX
-		if ((chan->ec_state) &&
-		    (ECHO_MODE_ACTIVE == chan->ec_state->status.mode) &&
-		    (chan->ec_state->ops->echocan_process_tx)) {
-			struct dahdi_echocan_state *const ec = chan->ec_state;
-			for (x = 0; x < chan->writen[res]; ++x) {
-				short tx;
-				tx = DAHDI_XLAW(chan->writebuf[res][x], chan);
-				ec->ops->echocan_process_tx(ec, &tx, 1);
-				chan->writebuf[res][x] = DAHDI_LIN2X((int) tx,
-								     chan);
-			}
-		}
-#endif
-		chan->writeidx[res] = 0;
 		if (chan->flags & DAHDI_FLAG_FCS)
 			calc_fcs(chan, res);
-		oldbuf = res;
-		spin_lock_irqsave(&chan->lock, flags);
-		chan->inwritebuf = (res + 1) % chan->numbufs;
-
-		if (chan->inwritebuf == chan->outwritebuf) {
-			/* Don't stomp on the transmitter, just wait for them to
-			   wake us up */
-			chan->inwritebuf = -1;
-			/* Make sure the transmitter is transmitting in case of POLICY_WHEN_FULL */
-			chan->txdisable = 0;
-		}
-
-		if (chan->outwritebuf < 0) {
-			/* Okay, the interrupt handler has been waiting for us.  Give them a buffer */
-			chan->outwritebuf = oldbuf;
-		}
+		/* Pairs with the acquire in __dahdi_sync_bufs() */
+		smp_store_release(&chan->tx_head,
+				  dahdi_pos_next(chan, chan->tx_head));
+		if (lockless)
+			goto out;
 
-		if ((chan->txbufpolicy == DAHDI_POLICY_HALF_FULL) && (chan->txdisable)) {
-			if (num_filled_bufs(chan) >= (chan->numbufs >> 1)) {
-#ifdef BUFFER_DEBUG
-				printk("Reached buffer fill mark of %d\n", num_filled_bufs(chan));
-#endif
-				chan->txdisable = 0;
-			}
-		}
+		spin_lock_irqsave(&chan->lock, flags);
+		__dahdi_sync_bufs(chan);
 
 #ifdef BUFFER_DEBUG
 		if ((chan->statcount <= 0) || (amnt != 128) || (num_filled_bufs(chan) != chan->lastnumbufs)) {
@@ -2676,16 +3966,40 @@ static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
 		if (chan->flags & DAHDI_FLAG_NOSTDTXRX && chan->span->ops->hdlc_hard_xmit)
 			chan->span->ops->hdlc_hard_xmit(chan);
 	}
+out:
+	mutex_unlock(&chan->write_mutex);
 	return amnt;
 }
 
-static int dahdi_ctl_open(struct file *file)
+static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
+				size_t count, loff_t *ppos)
 {
-	/* Nothing to do, really */
-	return 0;
-}
+	struct dahdi_chan *chan = file->private_data;
 
-static int dahdi_chan_open(struct file *file)
+	/* Make sure count never exceeds 65k, and make sure it's unsigned */
+	count &= 0xffff;
+
+	if (unlikely(!chan)) {
+		/*
+		 * This should never happen. Surprise device removal
+		 * should lead us to the nodev_* file_operations
+		 */
+		msleep(5);
+		module_printk(KERN_ERR, "%s: NODEV\n", __func__);
+		return -ENODEV;
+	}
+
+	return __dahdi_chan_write(chan, usrbuf, count,
+				  file->f_flags & O_NONBLOCK);
+}
+
+static int dahdi_ctl_open(struct file *file)
+{
+	/* Nothing to do, really */
+	return 0;
+}
+
+static int dahdi_chan_open(struct file *file)
 {
 	/* Nothing to do here for now either */
 	return 0;
@@ -2804,6 +4118,7 @@ static void dahdi_rbs_sethook(struct dahdi_chan *chan, int txsig, int txstate,
 	if (chan->sig == DAHDI_SIG_DACS_RBS)
 		return;
 	chan->txstate = txstate;
+	dahdi_chan_set_active(chan);
 
 	/* if tone signalling */
 	if (chan->sig == DAHDI_SIG_SF) {
@@ -2860,7 +4175,7 @@ static int dahdi_cas_setbits(struct dahdi_chan *chan, int bits)
 
 static int dahdi_hangup(struct dahdi_chan *chan)
 {
-	int x, res = 0;
+	int res = 0;
 
 	/* Can't hangup pseudo channels */
 	if (!chan->span)
@@ -2903,22 +4218,7 @@ static int dahdi_hangup(struct dahdi_chan *chan)
 		return res;
 
 	/* Mark all buffers as empty */
-	for (x = 0; x < chan->numbufs; x++) {
-		chan->writen[x] =
-		chan->writeidx[x]=
-		chan->readn[x]=
-		chan->readidx[x] = 0;
-	}
-
-	if (chan->readbuf[0]) {
-		chan->inreadbuf = 0;
-		chan->inwritebuf = 0;
-	} else {
-		chan->inreadbuf = -1;
-		chan->inwritebuf = -1;
-	}
-	chan->outreadbuf = -1;
-	chan->outwritebuf = -1;
+	__dahdi_flush_bufs(chan, DAHDI_FLUSH_BOTH);
 	chan->dialing = 0;
 	chan->afterdialingtimer = 0;
 	chan->curtone = NULL;
@@ -2997,7 +4297,7 @@ static int initialize_channel(struct dahdi_chan *chan)
 	if ((chan->sig & __DAHDI_SIG_DACS) != __DAHDI_SIG_DACS) {
 		chan->confna = 0;
 		chan->confmode = 0;
-		chan->conf_chan = NULL;
+		dahdi_chan_set_conf_chan(chan, NULL);
 		dahdi_disable_dacs(chan);
 	}
 	chan->_confn = 0;
@@ -3036,6 +4336,7 @@ static int initialize_channel(struct dahdi_chan *chan)
 	}
 
 	if (ec_state) {
+		dahdi_ec_batch_sync(chan);
 		ec_state->ops->echocan_free(chan, ec_state);
 		release_echocan(ec_current);
 	}
@@ -3134,6 +4435,7 @@ static int dahdi_specchan_open(struct file *file)
 		 * update the f_op pointer and bypass a few of
 		 * the checks on the minor number. */
 		file->f_op = &dahdi_chan_fops;
+		dahdi_chan_set_active(chan);
 		spin_unlock_irqrestore(&chan->lock, flags);
 
 		if (ops && ops->open) {
@@ -5007,6 +6309,9 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 			chan->rxsig = (unsigned char) y;
 		chan->rxhooksig = DAHDI_RXSIG_INITIAL;
 	}
+	/* The master picks up its new slave on its own next pass, since it
+	 * is open whenever the slaves carry anything. */
+	dahdi_chan_set_active(chan);
 #ifdef CONFIG_DAHDI_DEBUG
 	module_printk(KERN_NOTICE, "Configured channel %s, flags %04lx, sig %04x\n", chan->name, chan->flags, chan->sig);
 #endif
@@ -5323,6 +6628,7 @@ static int dahdi_ioctl_sfconfig(unsigned long data)
 		return -EINVAL;
 
 	spin_lock_irqsave(&chan->lock, flags);
+	dahdi_chan_set_active(chan);
 	chan->rxp1 = sf.rxp1;
 	chan->rxp2 = sf.rxp2;
 	chan->rxp3 = sf.rxp3;
@@ -5535,6 +6841,128 @@ retry_check:
 	return res;
 }
 
+static int dahdi_ioctl_set_chunksize(unsigned long data)
+{
+	struct dahdi_chunkconfig cc;
+	struct dahdi_span *s;
+	int res;
+
+	if (copy_from_user(&cc, (void __user *)data, sizeof(cc)))
+		return -EFAULT;
+	if ((cc.chunksize < DAHDI_CHUNKSIZE) ||
+	    (cc.chunksize > DAHDI_MAX_SPAN_CHUNKSIZE) ||
+	    (cc.chunksize % DAHDI_CHUNKSIZE))
+		return -EINVAL;
+
+	/* Span 0 is the core timer, i.e. the pseudo channels */
+	if (!cc.span)
+		return coretimer_set_chunks(cc.chunksize / DAHDI_CHUNKSIZE);
+
+	s = span_find_and_get(cc.span);
+	if (!s)
+		return -ENXIO;
+	if (s->ops->setchunksize)
+		res = s->ops->setchunksize(s, cc.chunksize);
+	else
+		res = (cc.chunksize == DAHDI_CHUNKSIZE) ? 0 : -EOPNOTSUPP;
+	put_span(s);
+	return res;
+}
+
+/**
+ * dahdi_ioctl_bulk_io() - Read and write many channels in one call
+ *
+ * Services each entry like a non-blocking read() and / or write() on the
+ * channel and reports its state afterwards, so an application that paces
+ * itself with a DAHDI timer does not need to poll a file descriptor per
+ * channel.  Entries name channels by a file descriptor the caller has open
+ * on them, so the call cannot reach channels the caller could not read or
+ * write itself.
+ */
+static int dahdi_ioctl_bulk_io(unsigned long data)
+{
+	struct dahdi_bulk_io bulk;
+	struct dahdi_bulk_chan entry;
+	struct dahdi_bulk_chan __user *entries;
+	struct dahdi_chan *chan;
+	struct file *file;
+	ssize_t res;
+	u32 x;
+
+	if (copy_from_user(&bulk, (void __user *)data, sizeof(bulk)))
+		return -EFAULT;
+	if (bulk.count > DAHDI_MAX_CHANNELS)
+		return -EINVAL;
+	entries = (struct dahdi_bulk_chan __user *)(unsigned long)bulk.chans;
+
+	for (x = 0; x < bulk.count; x++) {
+		if (copy_from_user(&entry, &entries[x], sizeof(entry)))
+			return -EFAULT;
+
+		entry.status = 0;
+		entry.error = 0;
+		file = fget(entry.fd);
+		if (!file) {
+			entry.readlen = entry.writelen = 0;
+			entry.error = -EBADF;
+			goto next;
+		}
+		/* Only a channel opened through this very file */
+		chan = (file->f_op == &dahdi_chan_fops) ?
+			file->private_data : NULL;
+		if (!chan || READ_ONCE(chan->file) != file ||
+		    !test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags)) {
+			entry.readlen = entry.writelen = 0;
+			entry.error = -ENODEV;
+			goto put;
+		}
+
+		if (!(entry.flags & DAHDI_BULK_WRITE) || entry.writelen <= 0) {
+			entry.writelen = 0;
+		} else if (!(file->f_mode & FMODE_WRITE)) {
+			entry.writelen = 0;
+			entry.error = -EBADF;
+		} else {
+			res = __dahdi_chan_write(chan,
+				(const char __user *)(unsigned long)entry.writebuf,
+				entry.writelen & 0xffff, true);
+			entry.writelen = (res > 0) ? res : 0;
+			if (res < 0 && res != -EAGAIN && res != -ELAST)
+				entry.error = res;
+		}
+
+		if (!(entry.flags & DAHDI_BULK_READ) || entry.readlen <= 0) {
+			entry.readlen = 0;
+		} else if (!(file->f_mode & FMODE_READ)) {
+			entry.readlen = 0;
+			if (!entry.error)
+				entry.error = -EBADF;
+		} else {
+			res = __dahdi_chan_read(chan,
+				(char __user *)(unsigned long)entry.readbuf,
+				entry.readlen & 0xffff, true);
+			entry.readlen = (res > 0) ? res : 0;
+			if (res < 0 && res != -EAGAIN && res != -ELAST &&
+			    !entry.error)
+				entry.error = res;
+		}
+
+		if (dahdi_rx_ready(chan))
+			entry.status |= DAHDI_BULK_READABLE;
+		if (dahdi_tx_room(chan, dahdi_chan_lockless(chan)))
+			entry.status |= DAHDI_BULK_WRITABLE;
+		if (READ_ONCE(chan->eventinidx) != READ_ONCE(chan->eventoutidx))
+			entry.status |= DAHDI_BULK_EVENT;
+put:
+		fput(file);
+next:
+		if (copy_to_user(&entries[x], &entry, sizeof(entry)))
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
 static int
 dahdi_ctl_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 {
@@ -5570,6 +6998,10 @@ dahdi_ctl_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 	case DAHDI_DYNAMIC_CREATE:
 	case DAHDI_DYNAMIC_DESTROY:
 		return dahdi_ioctl_dynamic(cmd, data);
+	case DAHDI_BULK_IO:
+		return dahdi_ioctl_bulk_io(data);
+	case DAHDI_SET_CHUNKSIZE:
+		return dahdi_ioctl_set_chunksize(data);
 	case DAHDI_EC_LICENSE_CHALLENGE:
 	case DAHDI_EC_LICENSE_RESPONSE:
 		if (dahdi_hpec_ioctl) {
@@ -5644,6 +7076,14 @@ static int ioctl_dahdi_dial(struct dahdi_chan *chan, unsigned long data)
 	return rv;
 }
 
+/* Conference modes a wideband pseudo channel can be in */
+static inline bool dahdi_wb_confmode(unsigned int confmode)
+{
+	return (confmode == DAHDI_CONF_CONF ||
+		confmode == DAHDI_CONF_CONFANN ||
+		confmode == DAHDI_CONF_CONFMON);
+}
+
 static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 {
 	struct dahdi_confinfo conf;
@@ -5651,13 +7091,22 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 	struct dahdi_chan *conf_chan = NULL;
 	unsigned long flags;
 	unsigned int confmode;
+	unsigned int loudest;
+	wbsumtype *wbsums = NULL;
 	int oldconf;
+	int alias = 0;
 	enum {NONE, ENABLE_HWPREEC, DISABLE_HWPREEC} preec = NONE;
 
 	if (copy_from_user(&conf, (void __user *)data, sizeof(conf)))
 		return -EFAULT;
 
 	confmode = conf.confmode & DAHDI_CONF_MODE_MASK;
+	loudest = (conf.confmode & DAHDI_CONF_LOUDEST_MASK) >>
+		  DAHDI_CONF_LOUDEST_SHIFT;
+	if ((loudest > DAHDI_CONF_LOUDEST_MAX) &&
+	    (loudest != DAHDI_CONF_LOUDEST_OFF))
+		return -EINVAL;
+	conf.confmode &= ~DAHDI_CONF_LOUDEST_MASK;
 
 	chan = (conf.chan) ? chan_from_num(conf.chan) :
 			     chan_from_file(file);
@@ -5684,29 +7133,62 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 	/* likewise if 0 mode must have no conf */
 	if ((!conf.confmode) && conf.confno)
 		return -EINVAL;
+	/* In case this is the first wideband member of its alias */
+	if (READ_ONCE(chan->wideband) && conf.confmode) {
+		wbsums = kcalloc(3, sizeof(wbsumtype), GFP_KERNEL);
+		if (!wbsums)
+			return -ENOMEM;
+	}
 	dahdi_check_conf(conf.confno);
 	conf.chan = chan->channo;  /* return with real channel # */
 	spin_lock_irqsave(&chan_lock, flags);
 	spin_lock(&chan->lock);
+	if (chan->wideband && conf.confmode &&
+	    (!wbsums || !dahdi_wb_confmode(confmode))) {
+		spin_unlock(&chan->lock);
+		spin_unlock_irqrestore(&chan_lock, flags);
+		kfree(wbsums);
+		return -EINVAL;
+	}
 	if (conf.confno == -1)
 		conf.confno = dahdi_first_empty_conference();
 	if ((conf.confno < 1) && (conf.confmode)) {
 		/* No more empty conferences */
 		spin_unlock(&chan->lock);
 		spin_unlock_irqrestore(&chan_lock, flags);
+		kfree(wbsums);
 		return -EBUSY;
+	}
+	/* if we are going onto a conf, get its alias before changing
+	 * anything, as they may have run out */
+	if (conf.confno &&
+	    (confmode == DAHDI_CONF_CONF ||
+	     confmode == DAHDI_CONF_CONFANN ||
+	     confmode == DAHDI_CONF_CONFMON ||
+	     confmode == DAHDI_CONF_CONFANNMON ||
+	     confmode == DAHDI_CONF_REALANDPSEUDO)) {
+		alias = dahdi_get_conf_alias(conf.confno);
+		if (alias < 0) {
+			spin_unlock(&chan->lock);
+			spin_unlock_irqrestore(&chan_lock, flags);
+			kfree(wbsums);
+			return alias;
+		}
 	}
 	  /* if changing confs, clear last added info */
 	if (conf.confno != chan->confna) {
+		chan->confenergy = 0;
 		memset(chan->conflast, 0, sizeof(chan->conflast));
 		memset(chan->conflast1, 0, sizeof(chan->conflast1));
 		memset(chan->conflast2, 0, sizeof(chan->conflast2));
+		memset(chan->wbconflast, 0, sizeof(chan->wbconflast));
 	}
 	oldconf = chan->confna;  /* save old conference number */
 	chan->confna = conf.confno;   /* set conference number */
-	chan->conf_chan = conf_chan;
+	dahdi_chan_set_conf_chan(chan, conf_chan);
 	chan->confmode = conf.confmode;  /* set conference mode */
-	chan->_confn = 0;		     /* Clear confn */
+	chan->_confn = alias;
+	dahdi_chan_set_active(chan);
 	if (chan->span && chan->span->ops->dacs) {
 		if ((confmode == DAHDI_CONF_DIGITALMON) &&
 		    (chan->txgain == defgain) &&
@@ -5718,20 +7200,40 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 			dahdi_disable_dacs(chan);
 		}
 	}
-	/* if we are going onto a conf */
-	if (conf.confno &&
-	    (confmode == DAHDI_CONF_CONF ||
-	     confmode == DAHDI_CONF_CONFANN ||
-	     confmode == DAHDI_CONF_CONFMON ||
-	     confmode == DAHDI_CONF_CONFANNMON ||
-	     confmode == DAHDI_CONF_REALANDPSEUDO)) {
-		/* Get alias */
-		chan->_confn = dahdi_get_conf_alias(conf.confno);
+	if (chan->_confn) {
+		struct conf_talkers *const t = &conf_talkers[chan->_confn];
+
+		if (loudest) {
+			t->floor = 0;
+			t->admitted = 0;
+			t->talking = 0;
+			WRITE_ONCE(t->max, (loudest == DAHDI_CONF_LOUDEST_OFF) ?
+					   0 : loudest);
+		}
+		conf.confmode |= DAHDI_CONF_LOUDEST(t->max);
+	}
+	if (chan->wideband && chan->_confn &&
+	    !test_bit(chan->_confn, conf_wideband)) {
+		const int a = chan->_confn;
+
+		if (!conf_wbsums[a]) {
+			/* Pairs with the READ_ONCE() in conf_wbsum() */
+			smp_store_release(&conf_wbsums[a], wbsums);
+			wbsums = NULL;
+		} else {
+			memset(conf_wbsums[a], 0, 3 * sizeof(wbsumtype));
+		}
+		set_bit(a, conf_wideband);
 	}
 
 	spin_unlock(&chan->lock);
 
 	if (conf_chan) {
+		/* The monitored channel has to keep its audio flowing */
+		spin_lock(&conf_chan->lock);
+		dahdi_chan_set_active(conf_chan);
+		spin_unlock(&conf_chan->lock);
+
 		if ((confmode == DAHDI_CONF_MONITOR_RX_PREECHO) ||
 		    (confmode == DAHDI_CONF_MONITOR_TX_PREECHO) ||
 		    (confmode == DAHDI_CONF_MONITORBOTH_PREECHO)) {
@@ -5757,6 +7259,7 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 	}
 
 	spin_unlock_irqrestore(&chan_lock, flags);
+	kfree(wbsums);
 
 	if (ENABLE_HWPREEC == preec) {
 		int res = dahdi_enable_hw_preechocan(conf_chan);
@@ -5833,6 +7336,15 @@ static int dahdi_ioctl_confdiag(struct file *file, unsigned long data)
 			module_printk(KERN_NOTICE, "chan %d, mode %x\n",
 				      pseudo->chan.channo, pseudo->chan.confmode);
 		}
+		if (c && confalias[i] && conf_talkers[confalias[i]].max) {
+			const struct conf_talkers *const t =
+				&conf_talkers[confalias[i]];
+
+			module_printk(KERN_NOTICE,
+				      "loudest %d: %d of %d talkers mixed, floor %u\n",
+				      t->max, t->last_admitted, t->last_talking,
+				      t->floor);
+		}
 
 #ifdef CONFIG_DAHDI_CONFLINK
 		{
@@ -5924,6 +7436,7 @@ static int dahdi_ioctl_iomux(struct file *file, unsigned long data)
 		}
 
 		spin_lock_irqsave(&chan->lock, flags);
+		__dahdi_sync(chan);
 		chan->iomask = iomask;
 		if (iomask & DAHDI_IOMUX_READ) {
 			if (chan->outreadbuf > -1)
@@ -5992,7 +7505,7 @@ static int dahdi_ioctl_rxmirror(struct file *file, unsigned long data)
 	spin_lock_irqsave(&srcmirror->lock, flags);
 	if (srcmirror->rxmirror == NULL)
 		srcmirror->rxmirror = chan;
-
+	dahdi_chan_set_active(srcmirror);
 	spin_unlock_irqrestore(&srcmirror->lock, flags);
 	if (srcmirror->rxmirror != chan) {
 		module_printk(KERN_INFO, "Chan %d cannot be rxmirrored, " \
@@ -6036,6 +7549,7 @@ static int dahdi_ioctl_txmirror(struct file *file, unsigned long data)
 	srcmirror->txmirror = chan;
 	if (srcmirror->txmirror == NULL)
 		srcmirror->txmirror = chan;
+	dahdi_chan_set_active(srcmirror);
 	spin_unlock_irqrestore(&srcmirror->lock, flags);
 
 	if (srcmirror->txmirror != chan) {
@@ -6055,6 +7569,33 @@ static int dahdi_ioctl_txmirror(struct file *file, unsigned long data)
 }
 #endif /* CONFIG_DAHDI_MIRROR */
 
+static int dahdi_ioctl_set_wideband(struct dahdi_chan *chan,
+				    unsigned long data)
+{
+	unsigned long flags;
+	int res = 0;
+	int j;
+
+	if (get_user(j, (int __user *)data))
+		return -EFAULT;
+	if (!is_pseudo_chan(chan))
+		return -EINVAL;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if (chan->confmode) {
+		res = -EBUSY;
+	} else {
+		chan->wideband = !!j;
+		if (chan->wideband)
+			chan->flags &= ~DAHDI_FLAG_LINEAR;
+		memset(chan->wbconflast, 0, sizeof(chan->wbconflast));
+		memset(chan->wbup, 0, sizeof(chan->wbup));
+		memset(chan->wbdown, 0, sizeof(chan->wbdown));
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+	return res;
+}
+
 static int
 dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 			  unsigned long data)
@@ -6088,6 +7629,8 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		return 0;
 	case DAHDI_DIAL:
 		return ioctl_dahdi_dial(chan, data);
+	case DAHDI_SET_WIDEBAND:
+		return dahdi_ioctl_set_wideband(chan, data);
 	case DAHDI_GET_BUFINFO:
 		memset(&stack.bi, 0, sizeof(stack.bi));
 		stack.bi.rxbufpolicy = DAHDI_POLICY_IMMEDIATE;
@@ -6101,6 +7644,8 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 			return -EFAULT;
 		break;
 	case DAHDI_SET_BUFINFO:
+		if (chan->ring)
+			return -EBUSY;
 		if (copy_from_user(&stack.bi, user_data, sizeof(stack.bi)))
 			return -EFAULT;
 		if (stack.bi.bufsize > DAHDI_MAX_BLOCKSIZE)
@@ -6119,11 +7664,17 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		if ((rv = dahdi_reallocbufs(chan,  stack.bi.bufsize, stack.bi.numbufs)))
 			return (rv);
 		break;
+	case DAHDI_RING_SETUP:
+		return dahdi_ioctl_ring_setup(chan, data);
+	case DAHDI_RING_RELEASE:
+		return dahdi_ioctl_ring_release(chan);
 	case DAHDI_GET_BLOCKSIZE:  /* get blocksize */
 		/* return block size */
 		put_user(chan->blocksize, (int __user *)data);
 		break;
 	case DAHDI_SET_BLOCKSIZE:  /* set blocksize */
+		if (chan->ring)
+			return -EBUSY;
 		get_user(j, (int __user *)data);
 		/* cannot be larger than max amount */
 		if (j > DAHDI_MAX_BLOCKSIZE) return(-EINVAL);
@@ -6137,30 +7688,10 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 	case DAHDI_FLUSH:  /* flush input buffer, output buffer, and/or event queue */
 		get_user(i, (int __user *)data);  /* get param */
 		spin_lock_irqsave(&chan->lock, flags);
-		if (i & DAHDI_FLUSH_READ)  /* if for read (input) */
-		   {
-			  /* initialize read buffers and pointers */
-			chan->inreadbuf = 0;
-			chan->outreadbuf = -1;
-			for (j=0;j<chan->numbufs;j++) {
-				/* Do we need this? */
-				chan->readn[j] = 0;
-				chan->readidx[j] = 0;
-			}
-			wake_up_interruptible(&chan->waitq);  /* wake_up_interruptible waiting on read */
-		   }
-		if (i & DAHDI_FLUSH_WRITE) /* if for write (output) */
-		   {
-			  /* initialize write buffers and pointers */
-			chan->outwritebuf = -1;
-			chan->inwritebuf = 0;
-			for (j=0;j<chan->numbufs;j++) {
-				/* Do we need this? */
-				chan->writen[j] = 0;
-				chan->writeidx[j] = 0;
-			}
-			wake_up_interruptible(&chan->waitq); /* wake_up_interruptible waiting on write */
-		   }
+		/* initialize read and / or write buffers and pointers */
+		__dahdi_flush_bufs(chan, i);
+		if (i & (DAHDI_FLUSH_READ | DAHDI_FLUSH_WRITE))
+			wake_up_interruptible(&chan->waitq);
 		if (i & DAHDI_FLUSH_EVENT) /* if for events */
 		   {
 			   /* initialize the event pointers */
@@ -6172,6 +7703,7 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		for(;;)  /* loop forever */
 		   {
 			spin_lock_irqsave(&chan->lock, flags);
+			__dahdi_sync(chan);
 			  /* Know if there is a write pending */
 			i = (chan->outwritebuf > -1);
 			spin_unlock_irqrestore(&chan->lock, flags);
@@ -6260,6 +7792,9 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		/* Makes no sense on non-audio channels */
 		if (!(chan->flags & DAHDI_FLAG_AUDIO))
 			return -EINVAL;
+		/* Wideband channels are always linear */
+		if (chan->wideband)
+			return -EINVAL;
 
 		if (j)
 			chan->flags |= DAHDI_FLAG_LINEAR;
@@ -6366,6 +7901,7 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 		chan->ec_current = NULL;
 		spin_unlock_irqrestore(&chan->lock, flags);
 		if (ec_state) {
+			dahdi_ec_batch_sync(chan);
 			ec_state->ops->echocan_free(chan, ec_state);
 			release_echocan(ec_current);
 		}
@@ -6395,6 +7931,7 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 	chan->ec_current = NULL;
 	spin_unlock_irqrestore(&chan->lock, flags);
 	if (ec_state) {
+		dahdi_ec_batch_sync(chan);
 		ec_state->ops->echocan_free(chan, ec_state);
 		release_echocan(ec_current);
 	}
@@ -6525,6 +8062,86 @@ is_txstate(struct dahdi_chan *const chan, const int txstate)
 	return ret;
 }
 
+/**
+ * dahdi_ioctl_tonedetect() - Handle DAHDI_TONEDETECT on a span channel.
+ *
+ * Plain DTMF requests go to the span driver as before.  When the driver
+ * cannot detect and DAHDI_TONEDETECT_SOFT is set, or for MF, the channel
+ * gets a software detector that runs in the receive path instead.
+ */
+static int dahdi_ioctl_tonedetect(struct dahdi_chan *chan, unsigned long data)
+{
+	const int mf = DAHDI_TONEDETECT_MFR1 | DAHDI_TONEDETECT_MFR2_FWD |
+		       DAHDI_TONEDETECT_MFR2_REV;
+	struct dahdi_digit_detector *det = NULL;
+	unsigned long flags;
+	int res = -ENOTTY;
+	int j, mode;
+
+	if (!chan->span)
+		return -ENOTTY;
+	if (get_user(j, (int __user *)data))
+		return -EFAULT;
+
+	switch (j & mf) {
+	case 0:
+		mode = DIGITDET_DTMF;
+		if (chan->span->ops->ioctl)
+			res = chan->span->ops->ioctl(chan, DAHDI_TONEDETECT, data);
+		break;
+	case DAHDI_TONEDETECT_MFR1:
+		mode = DIGITDET_MFR1;
+		break;
+	case DAHDI_TONEDETECT_MFR2_FWD:
+		mode = DIGITDET_MFR2_FWD;
+		break;
+	case DAHDI_TONEDETECT_MFR2_REV:
+		mode = DIGITDET_MFR2_REV;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (!(j & DAHDI_TONEDETECT_ON)) {
+		j = 0;
+		if (res == -ENOTTY)
+			res = 0;
+	} else if (res && (j & (DAHDI_TONEDETECT_SOFT | mf))) {
+		det = kzalloc(sizeof(*det), GFP_KERNEL);
+		if (!det)
+			return -ENOMEM;
+		digitdet_init(det, mode);
+		res = 0;
+	}
+	if (res)
+		return res;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	swap(chan->digitdet, det);
+	chan->digitdetect = j;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	kfree(det);
+	return 0;
+}
+
+static int dahdi_ioctl_get_rxlevel(struct dahdi_chan *chan, unsigned long data)
+{
+	struct dahdi_rxlevel level;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	level.energy = chan->rxenergy;
+	level.noise = chan->rxnoise;
+	level.flags = chan->rxhang ? DAHDI_RXLEVEL_VOICE : 0;
+	level.silent = chan->rxsilent;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (copy_to_user((void __user *)data, &level, sizeof(level)))
+		return -EFAULT;
+	return 0;
+}
+
 static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 {
 	struct dahdi_chan *const chan = chan_from_file(file);
@@ -6582,7 +8199,7 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 			  /* initialize conference variables */
 			chan->_confn = 0;
 			chan->confna = 0;
-			chan->conf_chan = NULL;
+			dahdi_chan_set_conf_chan(chan, NULL);
 			dahdi_disable_dacs(chan);
 			chan->confmode = 0;
 			chan->confmute = 0;
@@ -6605,6 +8222,7 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 			spin_unlock_irqrestore(&chan->lock, flags);
 
 			if (ec_state) {
+				dahdi_ec_batch_sync(chan);
 				ec_state->ops->echocan_free(chan, ec_state);
 				release_echocan(ec_current);
 			}
@@ -6618,6 +8236,10 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 			chan->span->ops->audio_notify(chan, j);
 #endif
 		break;
+	case DAHDI_TONEDETECT:
+		return dahdi_ioctl_tonedetect(chan, data);
+	case DAHDI_GET_RXLEVEL:
+		return dahdi_ioctl_get_rxlevel(chan, data);
 	case DAHDI_HDLCPPP:
 #ifdef CONFIG_DAHDI_PPP
 		if (chan->sig != DAHDI_SIG_CLEAR) return (-EINVAL);
@@ -6661,6 +8283,7 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 					chan->flags |= (DAHDI_FLAG_PPP | DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS);
 
 					if (tec) {
+						dahdi_ec_batch_sync(chan);
 						tec->ops->echocan_free(chan, tec);
 						release_echocan(ec_current);
 					}
@@ -7273,6 +8896,13 @@ static int _dahdi_assign_span(struct dahdi_span *span, unsigned int spanno,
 		return -EINVAL;
 	}
 
+	if (span->channels > DAHDI_MAX_CHANNELS) {
+		dev_notice(span_device(span),
+			 "span has %d channels, more than %d\n",
+			 span->channels, DAHDI_MAX_CHANNELS);
+		return -EINVAL;
+	}
+
 	/* DAHDI_ALARM_NOTOPEN can be set when a span is disabled, i.e. via
 	 * sysfs, so when the span is being reassigned we should make sure it's
 	 * cleared. This eliminates the need for board drivers to re-report
@@ -7313,6 +8943,10 @@ static int _dahdi_assign_span(struct dahdi_span *span, unsigned int spanno,
 
 	for (x = 0; x < span->channels; x++)
 		dahdi_chan_reg(span->chans[x]);
+	/* Every channel starts on the full path; the transmit loop drops
+	 * the ones that turn out to be idle. */
+	bitmap_fill(span->active_chans, span->channels);
+	span->skipped_channels = 0;
 
 #ifdef CONFIG_PROC_FS
 	{
@@ -7793,90 +9427,533 @@ static void  __init dahdi_conv_init(void)
 #endif
 }
 
-static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigned char *txb)
+/*
+ * CED (2100 Hz answer tone) detection for echo cancellers that do not do
+ * their own is not run sample by sample as each channel passes.  The
+ * chunk is queued here instead, and dahdi_ced_flush() filters every
+ * queued channel together at the end of the span or master span pass.
+ * Span and master span passes run with local interrupts disabled, so
+ * there is one bank per CPU.
+ */
+struct dahdi_ced_bank {
+	unsigned int count;
+	struct dahdi_chan *chans[ECDIS_BANK_SIZE];
+	struct dahdi_echocan_state *ecs[ECDIS_BANK_SIZE];
+	int channos[ECDIS_BANK_SIZE];
+	bool rx[ECDIS_BANK_SIZE];
+	/* The detectors as they were when queued */
+	echo_can_disable_detector_state_t dets[ECDIS_BANK_SIZE];
+	echo_can_disable_bank_t sig;
+};
+
+static DEFINE_PER_CPU(struct dahdi_ced_bank, dahdi_ced_bank);
+
+/* Called with ms->lock held */
+static void dahdi_ced_hit(struct dahdi_chan *ms, int channo, bool rx)
 {
-	/* We transmit data from our master channel */
-	/* Called with ss->lock held */
-	struct dahdi_chan *ms = ss->master;
-	/* Linear representation */
-	short getlin[DAHDI_CHUNKSIZE], k[DAHDI_CHUNKSIZE];
-	int x;
+	if (rx) {
+		set_echocan_fax_mode(ms, channo, "CED rx detected", 1);
+		dahdi_qevent_nolock(ms, DAHDI_EVENT_RX_CED_DETECTED);
+	} else {
+		set_echocan_fax_mode(ms, channo, "CED tx detected", 1);
+		dahdi_qevent_nolock(ms, DAHDI_EVENT_TX_CED_DETECTED);
+	}
+}
 
-	/* Okay, now we've got something to transmit */
-	for (x=0;x<DAHDI_CHUNKSIZE;x++)
-		getlin[x] = DAHDI_XLAW(txb[x], ms);
+/**
+ * dahdi_ced_detect() - Look for CED in a chunk of ms.
+ * @ms:		Master channel, with an active echo canceller.
+ * @channo:	Channel the chunk belongs to, for the log.
+ * @lin:	The chunk, DAHDI_CHUNKSIZE linear samples.
+ * @rx:		true for the receive direction, false for transmit.
+ *
+ * Queues the chunk on this CPU's bank.  A detector that already had a hit
+ * reports it again straight away, and channels with slaves (which pass
+ * more than once per pass) or chunks that do not fit in the bank are
+ * checked on the spot, as before.
+ *
+ * Called with the channel lock held, from span and master span passes
+ * only; they call dahdi_ced_flush() before they finish.
+ */
+static void dahdi_ced_detect(struct dahdi_chan *ms, int channo,
+			     const short *lin, bool rx)
+{
+	struct dahdi_ced_bank *const bank = this_cpu_ptr(&dahdi_ced_bank);
+	echo_can_disable_detector_state_t *const det =
+		rx ? &ms->ec_state->rxecdis : &ms->ec_state->txecdis;
+	const unsigned int i = bank->count;
+	int x;
 
-#ifndef CONFIG_DAHDI_NO_ECHOCAN_DISABLE
-	if (ms->ec_state && (ms->ec_state->status.mode == ECHO_MODE_ACTIVE) && !ms->ec_state->features.CED_tx_detect) {
+	if (det->hit || ms->nextslave || (i == ECDIS_BANK_SIZE)) {
 		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-			if (echo_can_disable_detector_update(&ms->ec_state->txecdis, getlin[x])) {
-				set_echocan_fax_mode(ms, ss->channo, "CED tx detected", 1);
-				dahdi_qevent_nolock(ms, DAHDI_EVENT_TX_CED_DETECTED);
+			if (echo_can_disable_detector_update(det, lin[x])) {
+				dahdi_ced_hit(ms, channo, rx);
 				break;
 			}
 		}
+		return;
 	}
-#endif
 
-	if ((!ms->confmute && !ms->dialing) || (is_pseudo_chan(ms))) {
-		struct dahdi_chan *const conf_chan = ms->conf_chan;
-		/* Handle conferencing on non-clear channel and non-HDLC channels */
-		switch(ms->confmode & DAHDI_CONF_MODE_MASK) {
-		case DAHDI_CONF_NORMAL:
-			/* Do nuffin */
-			break;
-		case DAHDI_CONF_MONITOR:	/* Monitor a channel's rx mode */
-			  /* if a pseudo-channel, ignore */
-			if (is_pseudo_chan(ms))
-				break;
-			/* Add monitored channel */
-			if (is_pseudo_chan(conf_chan))
-				ACSS(getlin, conf_chan->getlin);
-			else
-				ACSS(getlin, conf_chan->putlin);
+	bank->chans[i] = ms;
+	bank->ecs[i] = ms->ec_state;
+	bank->channos[i] = channo;
+	bank->rx[i] = rx;
+	bank->dets[i] = *det;
+	echo_can_disable_bank_load(&bank->sig, i, det, lin);
+	bank->count++;
+}
 
-			for (x=0;x<DAHDI_CHUNKSIZE;x++)
-				txb[x] = DAHDI_LIN2X(getlin[x], ms);
-			break;
-		case DAHDI_CONF_MONITORTX: /* Monitor a channel's tx mode */
-			  /* if a pseudo-channel, ignore */
-			if (is_pseudo_chan(ms))
-				break;
-			/* Add monitored channel */
-			if (is_pseudo_chan(conf_chan))
-				ACSS(getlin, conf_chan->putlin);
-			else
-				ACSS(getlin, conf_chan->getlin);
+/**
+ * dahdi_ced_flush() - Run the CED detectors queued on this CPU.
+ *
+ * Filters all queued chunks together, with SSE4.1 when the pass owns the
+ * FPU, then takes each channel lock in turn to store the detector back
+ * and act on hits.  A channel whose echo canceller was replaced, or whose
+ * detector was moved on by someone else in the meantime, keeps its own
+ * state.
+ *
+ * Must be called without any channel lock held.
+ */
+static void dahdi_ced_flush(void)
+{
+	struct dahdi_ced_bank *const bank = this_cpu_ptr(&dahdi_ced_bank);
+	bool sse41 = false;
+	unsigned int i;
+	int x;
 
-			for (x=0;x<DAHDI_CHUNKSIZE;x++)
-				txb[x] = DAHDI_LIN2X(getlin[x], ms);
-			break;
-		case DAHDI_CONF_MONITORBOTH: /* monitor a channel's rx and tx mode */
-			  /* if a pseudo-channel, ignore */
-			if (is_pseudo_chan(ms))
-				break;
-			ACSS(getlin, conf_chan->putlin);
-			ACSS(getlin, conf_chan->getlin);
-			for (x=0;x<DAHDI_CHUNKSIZE;x++)
-				txb[x] = DAHDI_LIN2X(getlin[x], ms);
-			break;
-		case DAHDI_CONF_MONITOR_RX_PREECHO:	/* Monitor a channel's rx mode */
-			  /* if a pseudo-channel, ignore */
-			if (is_pseudo_chan(ms))
-				break;
+	if (!bank->count)
+		return;
 
-			if (!conf_chan->readchunkpreec)
-				break;
+#if defined(DAHDI_SIMD_MIX) && defined(ECDIS_BANK_SSE41)
+	sse41 = ced_sse41 && this_cpu_read(dahdi_mix_simd);
+#endif
+	echo_can_disable_bank_run(&bank->sig, bank->count, sse41);
 
-			/* Add monitored channel */
-			ACSS(getlin, is_pseudo_chan(conf_chan) ?
-			     conf_chan->readchunkpreec : conf_chan->putlin);
-			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-				txb[x] = DAHDI_LIN2X(getlin[x], ms);
+	for (i = 0; i < bank->count; i++) {
+		struct dahdi_chan *const chan = bank->chans[i];
+		echo_can_disable_detector_state_t det = bank->dets[i];
+		echo_can_disable_detector_state_t *cur;
+		int hit = 0;
 
-			break;
-		case DAHDI_CONF_MONITOR_TX_PREECHO: /* Monitor a channel's tx mode */
-			  /* if a pseudo-channel, ignore */
+		echo_can_disable_bank_store(&bank->sig, i, &det);
+		for (x = 0; (x < DAHDI_CHUNKSIZE) && !hit; x++) {
+			const u8 flags = bank->sig.flags[x][i];
+
+			hit = echo_can_disable_detector_cycle(&det,
+						flags & ECDIS_ENERGY,
+						flags & ECDIS_TONE);
+		}
+
+		spin_lock(&chan->lock);
+		if (chan->ec_state == bank->ecs[i]) {
+			cur = bank->rx[i] ? &chan->ec_state->rxecdis :
+					    &chan->ec_state->txecdis;
+			if (!memcmp(cur, &bank->dets[i], sizeof(*cur))) {
+				*cur = det;
+				if (hit)
+					dahdi_ced_hit(chan, bank->channos[i],
+						      bank->rx[i]);
+			}
+		}
+		spin_unlock(&chan->lock);
+	}
+	bank->count = 0;
+}
+
+/*
+ * Software DTMF / MF detection (DAHDI_TONEDETECT) is batched the same way:
+ * each received chunk is queued on this CPU's bank and dahdi_digit_flush()
+ * runs the filters of every queued channel together at the end of the
+ * span or master span pass.
+ */
+struct dahdi_digit_bank {
+	unsigned int count;
+	struct dahdi_chan *chans[DIGITDET_BANK_SIZE];
+	struct dahdi_digit_detector *dets[DIGITDET_BANK_SIZE];
+	unsigned int seqs[DIGITDET_BANK_SIZE];
+	struct digitdet_bank sig;
+};
+
+static DEFINE_PER_CPU(struct dahdi_digit_bank, dahdi_digit_bank);
+
+/**
+ * dahdi_digit_detect() - Look for digits in a received chunk of ms.
+ * @ms:		Master channel, with a software digit detector.
+ * @putlin:	The chunk, DAHDI_CHUNKSIZE linear samples.
+ * @rxb:	The same chunk in the law of the channel.
+ *
+ * Queues the chunk on this CPU's bank.  Channels with slaves (which pass
+ * more than once per pass) and chunks that do not fit in the bank are
+ * run through their detector on the spot.  With DAHDI_TONEDETECT_MUTE the
+ * chunk is silenced while a digit is being received.
+ *
+ * Called with the channel lock held, from span and master span passes
+ * only; they call dahdi_digit_flush() before they finish.
+ */
+static void dahdi_digit_detect(struct dahdi_chan *ms, short *putlin,
+			       u_char *rxb)
+{
+	struct dahdi_digit_bank *const bank = this_cpu_ptr(&dahdi_digit_bank);
+	struct dahdi_digit_detector *const det = ms->digitdet;
+	const unsigned int i = bank->count;
+	int events[2];
+	int n, x;
+
+	if (ms->nextslave || (i == DIGITDET_BANK_SIZE)) {
+		n = digitdet_chunk(det, putlin, events);
+		for (x = 0; x < n; x++)
+			__qevent(ms, events[x]);
+	} else {
+		bank->chans[i] = ms;
+		bank->dets[i] = det;
+		bank->seqs[i] = ++det->seq;
+		digitdet_bank_load(&bank->sig, i, det, putlin);
+		bank->count++;
+	}
+
+	if ((ms->digitdetect & DAHDI_TONEDETECT_MUTE) && digitdet_muting(det)) {
+		memset(putlin, 0, DAHDI_CHUNKSIZE * sizeof(short));
+		rxb[0] = DAHDI_LIN2X(0, ms);
+		memset(&rxb[1], rxb[0], DAHDI_CHUNKSIZE - 1);
+	}
+}
+
+/**
+ * dahdi_digit_flush() - Run the digit detectors queued on this CPU.
+ *
+ * Filters all queued chunks together, with SSE4.1 when the pass owns the
+ * FPU, then takes each channel lock in turn to store the filters back and
+ * queue any DAHDI_EVENT_DTMFDOWN / DAHDI_EVENT_DTMFUP.  A detector that
+ * was replaced in the meantime is left alone.
+ *
+ * Must be called without any channel lock held.
+ */
+static void dahdi_digit_flush(void)
+{
+	struct dahdi_digit_bank *const bank = this_cpu_ptr(&dahdi_digit_bank);
+	bool sse41 = false;
+	unsigned int i;
+	int events[2];
+	int n, x;
+
+	if (!bank->count)
+		return;
+
+#if defined(DAHDI_SIMD_MIX) && defined(DIGITDET_BANK_SSE41)
+	sse41 = digit_sse41 && this_cpu_read(dahdi_mix_simd);
+#endif
+	digitdet_bank_run(&bank->sig, bank->count, sse41);
+
+	for (i = 0; i < bank->count; i++) {
+		struct dahdi_chan *const chan = bank->chans[i];
+		struct dahdi_digit_detector *const det = bank->dets[i];
+
+		spin_lock(&chan->lock);
+		if ((chan->digitdet == det) && (det->seq == bank->seqs[i])) {
+			digitdet_bank_store(&bank->sig, i, det);
+			n = digitdet_chunk_done(det, events);
+			for (x = 0; x < n; x++)
+				__qevent(chan, events[x]);
+		}
+		spin_unlock(&chan->lock);
+	}
+	bank->count = 0;
+}
+
+static inline u32 dahdi_chunk_energy(const short *lin)
+{
+	u32 energy = 0;
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		energy += (u32)(lin[x] * lin[x]) / DAHDI_CHUNKSIZE;
+	return energy;
+}
+
+/**
+ * __dahdi_conf_talk() - Should a talker's chunk be mixed into its conference.
+ * @ms:		Master channel that talks.
+ * @lin:	The chunk it talks, DAHDI_CHUNKSIZE linear samples.
+ * @rx:		True if @lin is the chunk __dahdi_rx_level() just measured.
+ *
+ * Always true unless the conference mixes its loudest N talkers only (see
+ * DAHDI_CONF_LOUDEST).  Then members that are not talking, or were not among
+ * the N loudest on the last tick, are left out.  Span channels go by the
+ * voice activity of their receive path, pseudo channels by the level of
+ * what they write.
+ *
+ * Called with ms->lock held, and the conference's sum lock when sharded.
+ */
+static bool __dahdi_conf_talk(struct dahdi_chan *ms, const short *lin, bool rx)
+{
+	struct conf_talkers *const t = &conf_talkers[ms->_confn];
+	const int limit = READ_ONCE(t->max);
+	bool voice;
+	u32 energy;
+	int i;
+
+	if (!limit)
+		return true;
+
+	rx = rx && !is_pseudo_chan(ms);
+	energy = (rx) ? ms->rxenergy : dahdi_chunk_energy(lin);
+	/* Average over about 16 ms so the ranking does not flap between
+	 * syllables */
+	ms->confenergy = ms->confenergy - (ms->confenergy >> 4) + (energy >> 4);
+	voice = (rx) ? ms->rxhang : (ms->confenergy > DAHDI_VAD_MIN_ENERGY);
+	if (!voice)
+		return false;
+
+	/* Keep the loudest energies of this tick for the next one */
+	for (i = min(t->talking, limit); i > 0; i--) {
+		if (t->top[i - 1] >= ms->confenergy)
+			break;
+		if (i < limit)
+			t->top[i] = t->top[i - 1];
+	}
+	if (i < limit)
+		t->top[i] = ms->confenergy;
+	t->talking++;
+
+	if ((ms->confenergy < t->floor) || (t->admitted >= limit))
+		return false;
+	t->admitted++;
+	return true;
+}
+
+/* ACSS() / SCSS() over a wideband chunk */
+static inline void dahdi_wb_acss(short *dst, short *src)
+{
+	ACSS(dst, src);
+	ACSS(dst + DAHDI_CHUNKSIZE, src + DAHDI_CHUNKSIZE);
+}
+
+static inline void dahdi_wb_scss(short *dst, short *src)
+{
+	SCSS(dst, src);
+	SCSS(dst + DAHDI_CHUNKSIZE, src + DAHDI_CHUNKSIZE);
+}
+
+/**
+ * dahdi_wb_up() - Upsample a chunk to 16 kHz.
+ * @wb:		DAHDI_WB_CHUNKSIZE samples out.
+ * @nb:		DAHDI_CHUNKSIZE samples in.
+ * @last:	Last sample of the previous chunk, updated.
+ *
+ * Linear interpolation, half a sample late.
+ */
+static inline void dahdi_wb_up(short *wb, const short *nb, short *last)
+{
+	int prev = *last;
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		wb[2 * x] = (prev + nb[x]) >> 1;
+		wb[2 * x + 1] = nb[x];
+		prev = nb[x];
+	}
+	*last = prev;
+}
+
+/**
+ * dahdi_wb_down() - Downsample a 16 kHz chunk to 8 kHz.
+ * @nb:		DAHDI_CHUNKSIZE samples out.
+ * @wb:		DAHDI_WB_CHUNKSIZE samples in.
+ * @last:	Last sample of the previous chunk, updated.
+ *
+ * Low passes with a [1 2 1] / 4 filter, which is down 6 dB at 4 kHz,
+ * before dropping every other sample.
+ */
+static inline void dahdi_wb_down(short *nb, const short *wb, short *last)
+{
+	int prev = *last;
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		nb[x] = (prev + 2 * wb[2 * x] + wb[2 * x + 1]) >> 2;
+		prev = wb[2 * x + 1];
+	}
+	*last = prev;
+}
+
+/**
+ * __dahdi_conf_wb_add() - Add a narrowband talker to a wideband conference.
+ * @ms:		Master channel that talks.
+ * @which:	conf_wb_cur or conf_wb_next, matching the narrowband sum used.
+ * @lin:	What @ms added to the narrowband sum.
+ * @dir:	0 for what @ms received, 1 for what it transmits.
+ *
+ * Does nothing unless the conference has a wideband member, so that
+ * narrowband conferences pay no more than a bit test.
+ *
+ * Called with ms->lock held, and the conference's sum lock when sharded.
+ */
+static inline void __dahdi_conf_wb_add(struct dahdi_chan *ms, int which,
+				       const short *lin, int dir)
+{
+	short *const wbsum = conf_wbsum(ms->_confn, which);
+	short wb[DAHDI_WB_CHUNKSIZE];
+
+	if (!wbsum)
+		return;
+	dahdi_wb_up(wb, lin, &ms->wbup[dir]);
+	dahdi_wb_acss(wbsum, wb);
+}
+
+/**
+ * __dahdi_wb_getaudio() - Put what a wideband pseudo channel transmits on
+ *                         its conference.
+ * @ms:		The channel.
+ * @wblin:	DAHDI_WB_CHUNKSIZE samples written to it.
+ *
+ * The wideband counterpart of __dahdi_process_getaudio_chunk().  A
+ * narrowband copy goes to ms->getlin, for the channels monitoring this one,
+ * and into the narrowband sum for the conference's narrowband members.
+ *
+ * Called with ms->lock held, and the conference's sum lock when sharded.
+ */
+static void __dahdi_wb_getaudio(struct dahdi_chan *ms, short *wblin)
+{
+	short k[DAHDI_WB_CHUNKSIZE];
+	short *wbsum;
+
+	dahdi_wb_down(ms->getlin, wblin, &ms->wbdown[1]);
+
+	switch (ms->confmode & DAHDI_CONF_MODE_MASK) {
+	case DAHDI_CONF_CONF:
+		wbsum = conf_wbsum(ms->_confn, conf_wb_cur);
+		if (wbsum && (ms->confmode & DAHDI_CONF_TALKER) &&
+		    __dahdi_conf_talk(ms, ms->getlin, false)) {
+			/* Same as the narrowband pseudo channel talker */
+			memcpy(k, wblin, sizeof(k));
+			dahdi_wb_acss(k, wbsum);
+			memcpy(ms->wbconflast, k, sizeof(k));
+			dahdi_wb_scss(ms->wbconflast, wbsum);
+			dahdi_wb_acss(wbsum, ms->wbconflast);
+			ACSS(conf_sums[ms->_confn], ms->getlin);
+		} else {
+			memset(ms->wbconflast, 0, sizeof(ms->wbconflast));
+		}
+		break;
+	case DAHDI_CONF_CONFANN:
+		wbsum = conf_wbsum(ms->_confn, conf_wb_next);
+		if (!wbsum)
+			break;
+		dahdi_wb_acss(wbsum, wblin);
+		ACSS(conf_sums_next[ms->_confn], ms->getlin);
+		break;
+	}
+}
+
+/**
+ * __dahdi_wb_putaudio() - Get what a wideband pseudo channel receives from
+ *                         its conference.
+ * @ms:		The channel.
+ * @wblin:	DAHDI_WB_CHUNKSIZE samples to be read from it.
+ *
+ * The wideband counterpart of __dahdi_process_putaudio_chunk().  A
+ * narrowband copy goes to ms->putlin.
+ *
+ * Called with ms->lock held, and the conference's sum lock when sharded.
+ */
+static void __dahdi_wb_putaudio(struct dahdi_chan *ms, short *wblin)
+{
+	short *wbsum = NULL;
+
+	switch (ms->confmode & DAHDI_CONF_MODE_MASK) {
+	case DAHDI_CONF_CONF:
+		if (ms->confmode & DAHDI_CONF_LISTENER)
+			wbsum = conf_wbsum(ms->_confn, conf_wb_cur);
+		if (wbsum) {
+			memcpy(wblin, wbsum, sizeof(wbsumtype));
+			/* Leave out what we said ourselves */
+			dahdi_wb_scss(wblin, ms->wbconflast);
+		}
+		break;
+	case DAHDI_CONF_CONFMON:
+		wbsum = conf_wbsum(ms->_confn, conf_wb_prev);
+		if (wbsum)
+			memcpy(wblin, wbsum, sizeof(wbsumtype));
+		break;
+	}
+
+	if (!wbsum)
+		memset(wblin, 0, sizeof(wbsumtype));
+	dahdi_wb_down(ms->putlin, wblin, &ms->wbdown[0]);
+}
+
+static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigned char *txb)
+{
+	/* We transmit data from our master channel */
+	/* Called with ss->lock held */
+	struct dahdi_chan *ms = ss->master;
+	/* Linear representation */
+	short getlin[DAHDI_CHUNKSIZE], k[DAHDI_CHUNKSIZE];
+	int x;
+
+	/* Okay, now we've got something to transmit */
+	dahdi_xlaw_to_lin_block(ms, getlin, txb, DAHDI_CHUNKSIZE);
+
+#ifndef CONFIG_DAHDI_NO_ECHOCAN_DISABLE
+	if (ms->ec_state && (ms->ec_state->status.mode == ECHO_MODE_ACTIVE) && !ms->ec_state->features.CED_tx_detect)
+		dahdi_ced_detect(ms, ss->channo, getlin, false);
+#endif
+
+	if ((!ms->confmute && !ms->dialing) || (is_pseudo_chan(ms))) {
+		struct dahdi_chan *const conf_chan = ms->conf_chan;
+		/* Handle conferencing on non-clear channel and non-HDLC channels */
+		switch(ms->confmode & DAHDI_CONF_MODE_MASK) {
+		case DAHDI_CONF_NORMAL:
+			/* Do nuffin */
+			break;
+		case DAHDI_CONF_MONITOR:	/* Monitor a channel's rx mode */
+			  /* if a pseudo-channel, ignore */
+			if (is_pseudo_chan(ms))
+				break;
+			/* Add monitored channel */
+			if (is_pseudo_chan(conf_chan))
+				ACSS(getlin, conf_chan->getlin);
+			else
+				ACSS(getlin, conf_chan->putlin);
+
+			dahdi_lin_to_xlaw_block(ms, txb, getlin, DAHDI_CHUNKSIZE);
+			break;
+		case DAHDI_CONF_MONITORTX: /* Monitor a channel's tx mode */
+			  /* if a pseudo-channel, ignore */
+			if (is_pseudo_chan(ms))
+				break;
+			/* Add monitored channel */
+			if (is_pseudo_chan(conf_chan))
+				ACSS(getlin, conf_chan->putlin);
+			else
+				ACSS(getlin, conf_chan->getlin);
+
+			dahdi_lin_to_xlaw_block(ms, txb, getlin, DAHDI_CHUNKSIZE);
+			break;
+		case DAHDI_CONF_MONITORBOTH: /* monitor a channel's rx and tx mode */
+			  /* if a pseudo-channel, ignore */
+			if (is_pseudo_chan(ms))
+				break;
+			ACSS(getlin, conf_chan->putlin);
+			ACSS(getlin, conf_chan->getlin);
+			dahdi_lin_to_xlaw_block(ms, txb, getlin, DAHDI_CHUNKSIZE);
+			break;
+		case DAHDI_CONF_MONITOR_RX_PREECHO:	/* Monitor a channel's rx mode */
+			  /* if a pseudo-channel, ignore */
+			if (is_pseudo_chan(ms))
+				break;
+
+			if (!conf_chan->readchunkpreec)
+				break;
+
+			/* Add monitored channel */
+			ACSS(getlin, is_pseudo_chan(conf_chan) ?
+			     conf_chan->readchunkpreec : conf_chan->putlin);
+			dahdi_lin_to_xlaw_block(ms, txb, getlin, DAHDI_CHUNKSIZE);
+
+			break;
+		case DAHDI_CONF_MONITOR_TX_PREECHO: /* Monitor a channel's tx mode */
+			  /* if a pseudo-channel, ignore */
 			if (is_pseudo_chan(ms))
 				break;
 
@@ -7886,8 +9963,7 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 			/* Add monitored channel */
 			ACSS(getlin, is_pseudo_chan(conf_chan) ?
 			     conf_chan->putlin : conf_chan->readchunkpreec);
-			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-				txb[x] = DAHDI_LIN2X(getlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, txb, getlin, DAHDI_CHUNKSIZE);
 
 			break;
 		case DAHDI_CONF_MONITORBOTH_PREECHO: /* monitor a channel's rx and tx mode */
@@ -7901,8 +9977,7 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 			ACSS(getlin, conf_chan->putlin);
 			ACSS(getlin, conf_chan->readchunkpreec);
 
-			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-				txb[x] = DAHDI_LIN2X(getlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, txb, getlin, DAHDI_CHUNKSIZE);
 
 			break;
 		case DAHDI_CONF_REALANDPSEUDO:
@@ -7923,6 +9998,7 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 				SCSS(ms->conflast1, conf_sums_next[ms->_confn]);
 				/* Really add in new value */
 				ACSS(conf_sums_next[ms->_confn], ms->conflast1);
+				__dahdi_conf_wb_add(ms, conf_wb_next, ms->conflast1, 1);
 			} else {
 				memset(ms->conflast1, 0, DAHDI_CHUNKSIZE * sizeof(short));
 				memset(ms->conflast2, 0, DAHDI_CHUNKSIZE * sizeof(short));
@@ -7936,15 +10012,20 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 			   {
 				  /* if to talk on conf */
 				if (ms->confmode & DAHDI_CONF_TALKER) {
-					/* Store temp value */
-					memcpy(k, getlin, DAHDI_CHUNKSIZE * sizeof(short));
-					/* Add conf value */
-					ACSS(k, conf_sums[ms->_confn]);
-					/*  get amount actually added */
-					memcpy(ms->conflast, k, DAHDI_CHUNKSIZE * sizeof(short));
-					SCSS(ms->conflast, conf_sums[ms->_confn]);
-					/* Really add in new value */
-					ACSS(conf_sums[ms->_confn], ms->conflast);
+					if (__dahdi_conf_talk(ms, getlin, false)) {
+						/* Store temp value */
+						memcpy(k, getlin, DAHDI_CHUNKSIZE * sizeof(short));
+						/* Add conf value */
+						ACSS(k, conf_sums[ms->_confn]);
+						/*  get amount actually added */
+						memcpy(ms->conflast, k, DAHDI_CHUNKSIZE * sizeof(short));
+						SCSS(ms->conflast, conf_sums[ms->_confn]);
+						/* Really add in new value */
+						ACSS(conf_sums[ms->_confn], ms->conflast);
+						__dahdi_conf_wb_add(ms, conf_wb_cur,
+								    ms->conflast, 1);
+					} else
+						memset(ms->conflast, 0, DAHDI_CHUNKSIZE * sizeof(short));
 					memcpy(ms->getlin, getlin, DAHDI_CHUNKSIZE * sizeof(short));
 				} else {
 					memset(ms->conflast, 0, DAHDI_CHUNKSIZE * sizeof(short));
@@ -7962,13 +10043,13 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 				/* Add in conference */
 				ACSS(getlin, conf_sums[ms->_confn]);
 			}
-			for (x=0;x<DAHDI_CHUNKSIZE;x++)
-				txb[x] = DAHDI_LIN2X(getlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, txb, getlin, DAHDI_CHUNKSIZE);
 			break;
 		case DAHDI_CONF_CONFANN:
 		case DAHDI_CONF_CONFANNMON:
 			/* First, add tx buffer to conf */
 			ACSS(conf_sums_next[ms->_confn], getlin);
+			__dahdi_conf_wb_add(ms, conf_wb_next, getlin, 1);
 			/* Start with silence */
 			memset(getlin, 0, DAHDI_CHUNKSIZE * sizeof(short));
 			/* If a listener on the conf... */
@@ -7978,8 +10059,7 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 				/* Add in conf */
 				ACSS(getlin, conf_sums[ms->_confn]);
 			}
-			for (x=0;x<DAHDI_CHUNKSIZE;x++)
-				txb[x] = DAHDI_LIN2X(getlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, txb, getlin, DAHDI_CHUNKSIZE);
 			break;
 		case DAHDI_CONF_DIGITALMON:
 			/* Real digital monitoring, but still echo cancel if
@@ -7988,22 +10068,23 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 				break;
 			if (is_pseudo_chan(conf_chan)) {
 				if (ms->ec_state) {
-					for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-						txb[x] = DAHDI_LIN2X(conf_chan->getlin[x], ms);
+					dahdi_lin_to_xlaw_block(ms, txb,
+							conf_chan->getlin,
+							DAHDI_CHUNKSIZE);
 				} else {
 					memcpy(txb, conf_chan->getraw, DAHDI_CHUNKSIZE);
 				}
 			} else {
 				if (ms->ec_state) {
-					for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-						txb[x] = DAHDI_LIN2X(conf_chan->putlin[x], ms);
+					dahdi_lin_to_xlaw_block(ms, txb,
+							conf_chan->putlin,
+							DAHDI_CHUNKSIZE);
 				} else {
 					memcpy(txb, conf_chan->putraw,
 					       DAHDI_CHUNKSIZE);
 				}
 			}
-			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-				getlin[x] = DAHDI_XLAW(txb[x], ms);
+			dahdi_xlaw_to_lin_block(ms, getlin, txb, DAHDI_CHUNKSIZE);
 			break;
 		}
 	}
@@ -8024,10 +10105,8 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 	if (ms->v1_1 || ms->v2_1 || ms->v3_1)
 	{
 		for (x=0;x<DAHDI_CHUNKSIZE;x++)
-		{
 			getlin[x] += dahdi_txtone_nextsample(ms);
-			txb[x] = DAHDI_LIN2X(getlin[x], ms);
-		}
+		dahdi_lin_to_xlaw_block(ms, txb, getlin, DAHDI_CHUNKSIZE);
 	}
 	/* This is what to send (after having applied gain) */
 	for (x=0;x<DAHDI_CHUNKSIZE;x++)
@@ -8037,10 +10116,9 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb,
 			   int bytes);
 
-static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *txb)
+static inline void __dahdi_getbuf(struct dahdi_chan *ss, unsigned char *txb,
+				  int count)
 {
-
-
 #ifdef CONFIG_DAHDI_MIRROR
 	unsigned char *orig_txb = txb;
 #endif /* CONFIG_DAHDI_MIRROR */
@@ -8055,10 +10133,12 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 	/* Linear representation */
 	int getlin;
 	/* How many bytes we need to process */
-	int bytes = DAHDI_CHUNKSIZE, left;
+	int bytes = count, left;
 	bool needtxunderrun = false;
 	int x;
 
+	__dahdi_sync(ms);
+
 	/* Let's pick something to transmit.  First source to
 	   try is our write-out buffer.  Always check it first because
 	   its our 'fast path' for whatever that's worth. */
@@ -8094,6 +10174,11 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 
 				if (!(ms->flags & DAHDI_FLAG_MTP2)) {
 					ms->writen[oldbuf] = 0;
+					/* Pairs with the acquire in write() */
+					smp_store_release(&ms->tx_tail,
+						dahdi_pos_next(ms, ms->tx_tail));
+					if (ms->ring)
+						__dahdi_ring_tx_block(ms);
 					if (ms->outwritebuf == ms->inwritebuf) {
 						/* Whoopsies, we're run out of buffers.  Mark ours
 						as -1 and wait for the filler to notify us that
@@ -8201,7 +10286,9 @@ out in the later versions, and is put back now. */
 			needtxunderrun += bytes;
 			bytes = 0;
 		} else {
-			memset(txb, DAHDI_LIN2X(0, ms), bytes);	/* Lastly we use silence on telephony channels */
+			/* Lastly we use silence on telephony channels */
+			memset(txb, (ms->wideband) ? 0 : DAHDI_LIN2X(0, ms),
+			       bytes);
 			needtxunderrun += bytes;
 			bytes = 0;
 		}
@@ -8220,12 +10307,17 @@ out in the later versions, and is put back now. */
 #ifdef CONFIG_DAHDI_MIRROR
 	if (ss->txmirror) {
 		spin_lock(&ss->txmirror->lock);
-		__putbuf_chunk(ss->txmirror, orig_txb, DAHDI_CHUNKSIZE);
+		__putbuf_chunk(ss->txmirror, orig_txb, count);
 		spin_unlock(&ss->txmirror->lock);
 	}
 #endif /* CONFIG_DAHDI_MIRROR */
 }
 
+static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *txb)
+{
+	__dahdi_getbuf(ss, txb, DAHDI_CHUNKSIZE);
+}
+
 static inline void rbs_itimer_expire(struct dahdi_chan *chan)
 {
 	/* the only way this could have gotten here, is if a channel
@@ -8402,6 +10494,7 @@ static void __dahdi_hooksig_pvt(struct dahdi_chan *chan, enum dahdi_rxsig rxsig)
 		called with chan->lock held */
 
 	if ((chan->rxhooksig) == rxsig) return;
+	dahdi_chan_set_active(chan);
 
 	if ((chan->flags & DAHDI_FLAG_SIGFREEZE)) return;
 
@@ -8726,13 +10819,14 @@ void __dahdi_ec_chunk(struct dahdi_chan *ss, u8 *rxchunk,
 
 	if (ss->readchunkpreec) {
 		/* Save a copy of the audio before the echo can has its way with it */
-		for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-			/* We only ever really need to deal with signed linear - let's just convert it now */
-			ss->readchunkpreec[x] = DAHDI_XLAW(preecchunk[x], ss);
+		/* We only ever really need to deal with signed linear - let's just convert it now */
+		dahdi_xlaw_to_lin_block(ss, ss->readchunkpreec, preecchunk,
+					DAHDI_CHUNKSIZE);
 	}
 
 	/* Perform echo cancellation on a chunk if necessary */
 	if (ss->ec_state) {
+		const u64 start = dahdi_prof_start();
 #if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
 		dahdi_kernel_fpu_begin();
 #endif
@@ -8765,15 +10859,14 @@ void __dahdi_ec_chunk(struct dahdi_chan *ss, u8 *rxchunk,
 			if (ss->ec_state->ops->echocan_process) {
 				short rxlins[DAHDI_CHUNKSIZE], txlins[DAHDI_CHUNKSIZE];
 
-				for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-					rxlins[x] = DAHDI_XLAW(preecchunk[x],
-							       ss);
-					txlins[x] = DAHDI_XLAW(txchunk[x], ss);
-				}
+				dahdi_xlaw_to_lin_block(ss, rxlins, preecchunk,
+							DAHDI_CHUNKSIZE);
+				dahdi_xlaw_to_lin_block(ss, txlins, txchunk,
+							DAHDI_CHUNKSIZE);
 				ss->ec_state->ops->echocan_process(ss->ec_state, rxlins, txlins, DAHDI_CHUNKSIZE);
 
-				for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-					rxchunk[x] = DAHDI_LIN2X((int) rxlins[x], ss);
+				dahdi_lin_to_xlaw_block(ss, rxchunk, rxlins,
+							DAHDI_CHUNKSIZE);
 			} else if (ss->ec_state->ops->echocan_events)
 				ss->ec_state->ops->echocan_events(ss->ec_state);
 
@@ -8784,51 +10877,214 @@ void __dahdi_ec_chunk(struct dahdi_chan *ss, u8 *rxchunk,
 #if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
 		dahdi_kernel_fpu_end();
 #endif
+		dahdi_prof_end(DAHDI_PROF_EC_CHUNK, start);
 	}
 
 	spin_unlock(&ss->lock);
 }
 EXPORT_SYMBOL(__dahdi_ec_chunk);
 
+/* Number of DAHDI_CHUNKSIZE blocks the driver hands over per call */
+static inline int dahdi_span_chunks(const struct dahdi_span *span)
+{
+	const int chunks = READ_ONCE(span->chunks);
+
+	return (chunks > 1) ? chunks : 1;
+}
+
+/* Moves the chunk pointers of every channel in the span by delta samples */
+static void dahdi_span_seek_chunk(struct dahdi_span *span, int delta)
+{
+	unsigned int x;
+
+	for (x = 0; x < span->channels; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+
+		chan->readchunk += delta;
+		chan->writechunk += delta;
+	}
+}
+
+/* Channels handed to echocan_process_batch() in one call */
+#define DAHDI_EC_BATCH	32
+
+struct dahdi_ec_batch {
+	const struct dahdi_echocan_ops *ops;
+	unsigned int count;
+	struct dahdi_chan *chans[DAHDI_EC_BATCH];
+	struct dahdi_echocan_state *ecs[DAHDI_EC_BATCH];
+	u32 events[DAHDI_EC_BATCH];
+	short rx[DAHDI_EC_BATCH][DAHDI_CHUNKSIZE];
+	short tx[DAHDI_EC_BATCH][DAHDI_CHUNKSIZE];
+};
+
+/* dahdi_ec_span() runs with local interrupts disabled, so one per CPU */
+static DEFINE_PER_CPU(struct dahdi_ec_batch, dahdi_ec_batch);
+
+/* Called with chan->lock held */
+static inline bool dahdi_ec_batchable(const struct dahdi_chan *chan)
+{
+	const struct dahdi_echocan_state *const ec = chan->ec_state;
+
+	return ec && ec->ops->echocan_process_batch &&
+	       !(ec->status.mode & __ECHO_MODE_MUTE) &&
+	       (ec->status.mode != ECHO_MODE_IDLE);
+}
+
 /**
- * dahdi_ec_span() - process echo for all channels in a span.
- * @span:	DAHDI span
+ * dahdi_ec_batch_add() - Queue the current chunk of chan on batch.
  *
- * Similar to calling dahdi_ec_chunk() for each of the channels in the
- * span. Uses dahdi_chunk.write_chunk for the rxchunk (the chunk to fix)
- * and dahdi_chan.readchunk as the txchunk (the reference chunk).
+ * Called with chan->lock held. Takes a copy of the chunks and marks the
+ * canceller as in use by the batch, so that it is not freed before
+ * dahdi_ec_batch_flush() is done with it.
  */
-void _dahdi_ec_span(struct dahdi_span *span)
+static void dahdi_ec_batch_add(struct dahdi_ec_batch *batch,
+			       struct dahdi_chan *chan)
 {
-	int x;
-	for (x = 0; x < span->channels; x++) {
-		struct dahdi_chan *const chan = span->chans[x];
-		if (!chan->ec_current)
-			continue;
-		_dahdi_ec_chunk(chan, chan->readchunk, chan->writechunk);
+	const unsigned int i = batch->count++;
+
+	if (chan->readchunkpreec) {
+		dahdi_xlaw_to_lin_block(chan, chan->readchunkpreec,
+					chan->readchunk, DAHDI_CHUNKSIZE);
 	}
+	chan->ec_state->events.all = 0;
+	dahdi_xlaw_to_lin_block(chan, batch->rx[i], chan->readchunk,
+				DAHDI_CHUNKSIZE);
+	dahdi_xlaw_to_lin_block(chan, batch->tx[i], chan->writechunk,
+				DAHDI_CHUNKSIZE);
+	batch->ops = chan->ec_state->ops;
+	batch->chans[i] = chan;
+	batch->ecs[i] = chan->ec_state;
+	WRITE_ONCE(chan->ec_batched, 1);
 }
-EXPORT_SYMBOL(_dahdi_ec_span);
 
-/* return 0 if nothing detected, 1 if lack of tone, 2 if presence of tone */
-/* modifies buffer pointed to by 'amp' with notched-out values */
-static inline int sf_detect(struct sf_detect_state *s,
-                 short *amp,
-                 int samples,long p1, long p2, long p3)
+/**
+ * dahdi_ec_batch_flush() - Run the queued channels through the canceller.
+ *
+ * Called without any channel lock held. Once the canceller is done each
+ * channel is released for dahdi_ec_batch_sync() and then locked on its
+ * own to store the result, unless its canceller was changed meanwhile.
+ */
+static void dahdi_ec_batch_flush(struct dahdi_ec_batch *batch)
 {
-int     i,rv = 0;
-long x,y;
+	unsigned int i;
 
-#define	SF_DETECT_SAMPLES (DAHDI_CHUNKSIZE * 5)
-#define	SF_DETECT_MIN_ENERGY 500
-#define	NB 14  /* number of bits to shift left */
+	if (!batch->count)
+		return;
 
-        /* determine energy level before filtering */
-        for(i = 0; i < samples; i++)
-        {
-                if (amp[i] < 0) s->e1 -= amp[i];
-                else s->e1 += amp[i];
-        }
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+	dahdi_kernel_fpu_begin();
+#endif
+	batch->ops->echocan_process_batch(batch->ecs, &batch->rx[0][0],
+					  &batch->tx[0][0], batch->count,
+					  DAHDI_CHUNKSIZE);
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+	dahdi_kernel_fpu_end();
+#endif
+
+	for (i = 0; i < batch->count; i++) {
+		batch->events[i] = batch->ecs[i]->events.all;
+		smp_store_release(&batch->chans[i]->ec_batched, 0);
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		struct dahdi_chan *const chan = batch->chans[i];
+
+		spin_lock(&chan->lock);
+		if (chan->ec_state == batch->ecs[i]) {
+			dahdi_lin_to_xlaw_block(chan, chan->readchunk,
+						batch->rx[i], DAHDI_CHUNKSIZE);
+			if (batch->events[i])
+				process_echocan_events(chan);
+		}
+		spin_unlock(&chan->lock);
+	}
+	batch->count = 0;
+	batch->ops = NULL;
+}
+
+/*
+ * Cancels echo on the current chunk of every channel of span. Channels
+ * whose canceller has echocan_process_batch are copied out one at a time
+ * under their own lock and handed over together with no lock held.
+ * Anything else goes through __dahdi_ec_chunk() as before.
+ */
+static void dahdi_ec_span_chunk(struct dahdi_span *span)
+{
+	struct dahdi_ec_batch *const batch = this_cpu_ptr(&dahdi_ec_batch);
+	const u64 start = dahdi_prof_start();
+	int x;
+
+	for (x = 0; x < span->channels; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+
+		if (!chan->ec_current)
+			continue;
+		spin_lock(&chan->lock);
+		if (dahdi_ec_batchable(chan) && batch->count &&
+		    ((batch->count == DAHDI_EC_BATCH) ||
+		     (batch->ops != chan->ec_state->ops))) {
+			spin_unlock(&chan->lock);
+			dahdi_ec_batch_flush(batch);
+			spin_lock(&chan->lock);
+		}
+		if (!dahdi_ec_batchable(chan)) {
+			spin_unlock(&chan->lock);
+			_dahdi_ec_chunk(chan, chan->readchunk,
+					chan->writechunk);
+			continue;
+		}
+		dahdi_ec_batch_add(batch, chan);
+		spin_unlock(&chan->lock);
+	}
+	dahdi_ec_batch_flush(batch);
+	dahdi_prof_end(DAHDI_PROF_EC_SPAN, start);
+}
+
+/**
+ * dahdi_ec_span() - process echo for all channels in a span.
+ * @span:	DAHDI span
+ *
+ * Similar to calling dahdi_ec_chunk() for each of the channels in the
+ * span. Uses dahdi_chunk.write_chunk for the rxchunk (the chunk to fix)
+ * and dahdi_chan.readchunk as the txchunk (the reference chunk).
+ * Channels whose echo canceller provides echocan_process_batch are
+ * processed together, up to DAHDI_EC_BATCH at a time.
+ */
+void _dahdi_ec_span(struct dahdi_span *span)
+{
+	const int chunks = dahdi_span_chunks(span);
+	int c;
+
+	for (c = 0; c < chunks; c++) {
+		if (c)
+			dahdi_span_seek_chunk(span, DAHDI_CHUNKSIZE);
+		dahdi_ec_span_chunk(span);
+	}
+	if (chunks > 1)
+		dahdi_span_seek_chunk(span, -(chunks - 1) * DAHDI_CHUNKSIZE);
+}
+EXPORT_SYMBOL(_dahdi_ec_span);
+
+/* return 0 if nothing detected, 1 if lack of tone, 2 if presence of tone */
+/* modifies buffer pointed to by 'amp' with notched-out values */
+static inline int sf_detect(struct sf_detect_state *s,
+                 short *amp,
+                 int samples,long p1, long p2, long p3)
+{
+int     i,rv = 0;
+long x,y;
+
+#define	SF_DETECT_SAMPLES (DAHDI_CHUNKSIZE * 5)
+#define	SF_DETECT_MIN_ENERGY 500
+#define	NB 14  /* number of bits to shift left */
+
+        /* determine energy level before filtering */
+        for(i = 0; i < samples; i++)
+        {
+                if (amp[i] < 0) s->e1 -= amp[i];
+                else s->e1 += amp[i];
+        }
 	/* do 2nd order IIR notch filter at given freq. and calculate
 	    energy */
         for(i = 0; i < samples; i++)
@@ -8859,6 +11115,43 @@ long x,y;
 	return(rv);
 }
 
+/**
+ * __dahdi_rx_level() - Measure a received chunk for DAHDI_GET_RXLEVEL.
+ * @ms:		Master channel the chunk was received on.
+ * @putlin:	The chunk, DAHDI_CHUNKSIZE linear samples.
+ *
+ * The noise floor follows the energy straight down and creeps back up by
+ * about 4 dB a second, so speech does not drag it along.
+ *
+ * Called with ms->lock held.
+ */
+static inline void __dahdi_rx_level(struct dahdi_chan *ms, const short *putlin)
+{
+	const u32 energy = dahdi_chunk_energy(putlin);
+
+	ms->rxenergy = energy;
+	if (energy <= ms->rxnoise)
+		ms->rxnoise = energy;
+	else
+		ms->rxnoise = min(energy, ms->rxnoise + (ms->rxnoise >> 10) + 1);
+
+	if ((energy > DAHDI_VAD_MIN_ENERGY) && ((energy >> 3) > ms->rxnoise))
+		ms->rxhang = DAHDI_VAD_HANGOVER;
+	else if (ms->rxhang)
+		ms->rxhang--;
+
+	if (ms->rxhang)
+		ms->rxsilent = 0;
+	else if (ms->rxsilent != ~0U)
+		ms->rxsilent++;
+
+	if (ms->ring) {
+		if (ms->rxhang)
+			ms->rxblk_flags |= DAHDI_RXLEVEL_VOICE;
+		ms->rxblk_energy = max(ms->rxblk_energy, energy);
+	}
+}
+
 static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigned char *rxb)
 {
 	/* We transmit data from our master channel */
@@ -8875,31 +11168,25 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 		rxb[0] = DAHDI_LIN2X(0, ms);
 		memset(&rxb[1], rxb[0], DAHDI_CHUNKSIZE - 1);  /* receive as silence if dialing */
 	}
-	for (x=0;x<DAHDI_CHUNKSIZE;x++) {
+	for (x=0;x<DAHDI_CHUNKSIZE;x++)
 		rxb[x] = ms->rxgain[rxb[x]];
-		putlin[x] = DAHDI_XLAW(rxb[x], ms);
-	}
+	dahdi_xlaw_to_lin_block(ms, putlin, rxb, DAHDI_CHUNKSIZE);
 
 #ifndef CONFIG_DAHDI_NO_ECHOCAN_DISABLE
-	if (ms->ec_state && (ms->ec_state->status.mode == ECHO_MODE_ACTIVE) && !ms->ec_state->features.CED_rx_detect) {
-		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-			if (echo_can_disable_detector_update(&ms->ec_state->rxecdis, putlin[x])) {
-				set_echocan_fax_mode(ms, ss->channo, "CED rx detected", 1);
-				dahdi_qevent_nolock(ms, DAHDI_EVENT_RX_CED_DETECTED);
-				break;
-			}
-		}
-	}
+	if (ms->ec_state && (ms->ec_state->status.mode == ECHO_MODE_ACTIVE) && !ms->ec_state->features.CED_rx_detect)
+		dahdi_ced_detect(ms, ss->channo, putlin, true);
 #endif
 
+	if (ms->digitdet)
+		dahdi_digit_detect(ms, putlin, rxb);
+
 	/* if doing rx tone decoding */
 	if (ms->rxp1 && ms->rxp2 && ms->rxp3)
 	{
 		r = sf_detect(&ms->rd,putlin,DAHDI_CHUNKSIZE,ms->rxp1,
 			ms->rxp2,ms->rxp3);
 		/* Convert back */
-		for(x=0;x<DAHDI_CHUNKSIZE;x++)
-			rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+		dahdi_lin_to_xlaw_block(ms, rxb, putlin, DAHDI_CHUNKSIZE);
 		if (r) /* if something happened */
 		{
 			if (r != ms->rd.lastdetect)
@@ -8921,6 +11208,7 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 	if (!is_pseudo_chan(ms)) {
 		memcpy(ms->putlin, putlin, DAHDI_CHUNKSIZE * sizeof(short));
 		memcpy(ms->putraw, rxb, DAHDI_CHUNKSIZE);
+		__dahdi_rx_level(ms, putlin);
 	}
 
 	/* Take the rxc, twiddle it for conferencing if appropriate and put it
@@ -8941,8 +11229,7 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 			else
 				ACSS(putlin, conf_chan->putlin);
 			/* Convert back */
-			for(x=0;x<DAHDI_CHUNKSIZE;x++)
-				rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, rxb, putlin, DAHDI_CHUNKSIZE);
 			break;
 		case DAHDI_CONF_MONITORTX:	/* Monitor a channel's tx mode */
 			  /* if not a pseudo-channel, ignore */
@@ -8954,8 +11241,7 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 			else
 				ACSS(putlin, conf_chan->getlin);
 			/* Convert back */
-			for(x=0;x<DAHDI_CHUNKSIZE;x++)
-				rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, rxb, putlin, DAHDI_CHUNKSIZE);
 			break;
 		case DAHDI_CONF_MONITORBOTH:	/* Monitor a channel's tx and rx mode */
 			  /* if not a pseudo-channel, ignore */
@@ -8968,8 +11254,7 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 			ACSS(putlin, conf_chan->getlin);
 			ACSS(putlin, conf_chan->putlin);
 			/* Convert back */
-			for(x=0;x<DAHDI_CHUNKSIZE;x++)
-				rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, rxb, putlin, DAHDI_CHUNKSIZE);
 			break;
 		case DAHDI_CONF_MONITOR_RX_PREECHO:		/* Monitor a channel's rx mode */
 			  /* if not a pseudo-channel, ignore */
@@ -8982,8 +11267,7 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 			/* Add monitored channel */
 			ACSS(putlin, is_pseudo_chan(conf_chan) ?
 			     conf_chan->getlin : conf_chan->readchunkpreec);
-			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-				rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, rxb, putlin, DAHDI_CHUNKSIZE);
 
 			break;
 		case DAHDI_CONF_MONITOR_TX_PREECHO:	/* Monitor a channel's tx mode */
@@ -8997,8 +11281,7 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 			/* Add monitored channel */
 			ACSS(putlin, is_pseudo_chan(conf_chan) ?
 			     conf_chan->readchunkpreec : conf_chan->getlin);
-			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-				rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, rxb, putlin, DAHDI_CHUNKSIZE);
 
 			break;
 		case DAHDI_CONF_MONITORBOTH_PREECHO:	/* Monitor a channel's tx and rx mode */
@@ -9015,13 +11298,13 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 			   when you're so loud you're clipping anyway */
 			ACSS(putlin, conf_chan->getlin);
 			ACSS(putlin, conf_chan->readchunkpreec);
-			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-				rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, rxb, putlin, DAHDI_CHUNKSIZE);
 
 			break;
 		case DAHDI_CONF_REALANDPSEUDO:
 			  /* do normal conf mode processing */
-			if (ms->confmode & DAHDI_CONF_TALKER) {
+			if ((ms->confmode & DAHDI_CONF_TALKER) &&
+			    __dahdi_conf_talk(ms, putlin, true)) {
 				/* Store temp value */
 				memcpy(k, putlin, DAHDI_CHUNKSIZE * sizeof(short));
 				/* Add conf value */
@@ -9031,6 +11314,7 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 				SCSS(ms->conflast, conf_sums_next[ms->_confn]);
 				/* Really add in new value */
 				ACSS(conf_sums_next[ms->_confn], ms->conflast);
+				__dahdi_conf_wb_add(ms, conf_wb_next, ms->conflast, 0);
 			} else memset(ms->conflast, 0, DAHDI_CHUNKSIZE * sizeof(short));
 			  /* do the pseudo-channel part processing */
 			memset(putlin, 0, DAHDI_CHUNKSIZE * sizeof(short));
@@ -9041,8 +11325,7 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 				ACSS(putlin, conf_sums[ms->_confn]);
 			}
 			/* Convert back */
-			for(x=0;x<DAHDI_CHUNKSIZE;x++)
-				rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+			dahdi_lin_to_xlaw_block(ms, rxb, putlin, DAHDI_CHUNKSIZE);
 			break;
 		case DAHDI_CONF_CONF:	/* Normal conference mode */
 			if (is_pseudo_chan(ms)) /* if a pseudo-channel */
@@ -9054,14 +11337,14 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 					ACSS(putlin, conf_sums[ms->_confn]);
 				}
 				/* Convert back */
-				for(x=0;x<DAHDI_CHUNKSIZE;x++)
-					rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+				dahdi_lin_to_xlaw_block(ms, rxb, putlin, DAHDI_CHUNKSIZE);
 				memcpy(ss->putlin, putlin, DAHDI_CHUNKSIZE * sizeof(short));
 				break;
 			   }
 			/* fall through */
 		case DAHDI_CONF_CONFANN:  /* Conference with announce */
-			if (ms->confmode & DAHDI_CONF_TALKER) {
+			if ((ms->confmode & DAHDI_CONF_TALKER) &&
+			    __dahdi_conf_talk(ms, putlin, true)) {
 				/* Store temp value */
 				memcpy(k, putlin, DAHDI_CHUNKSIZE * sizeof(short));
 				/* Add conf value */
@@ -9071,13 +11354,15 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 				SCSS(ms->conflast, conf_sums_next[ms->_confn]);
 				/* Really add in new value */
 				ACSS(conf_sums_next[ms->_confn], ms->conflast);
+				__dahdi_conf_wb_add(ms, conf_wb_next, ms->conflast, 0);
 			} else
 				memset(ms->conflast, 0, DAHDI_CHUNKSIZE * sizeof(short));
 			  /* rxc unmodified */
 			break;
 		case DAHDI_CONF_CONFMON:
 		case DAHDI_CONF_CONFANNMON:
-			if (ms->confmode & DAHDI_CONF_TALKER) {
+			if ((ms->confmode & DAHDI_CONF_TALKER) &&
+			    __dahdi_conf_talk(ms, putlin, true)) {
 				/* Store temp value */
 				memcpy(k, putlin, DAHDI_CHUNKSIZE * sizeof(short));
 				/* Subtract last value */
@@ -9089,10 +11374,11 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 				SCSS(ms->conflast, conf_sums[ms->_confn]);
 				/* Really add in new value */
 				ACSS(conf_sums[ms->_confn], ms->conflast);
+				__dahdi_conf_wb_add(ms, conf_wb_cur, ms->conflast, 0);
 			} else
 				memset(ms->conflast, 0, DAHDI_CHUNKSIZE * sizeof(short));
-			for (x=0;x<DAHDI_CHUNKSIZE;x++)
-				rxb[x] = DAHDI_LIN2X((int)conf_sums_prev[ms->_confn][x], ms);
+			dahdi_lin_to_xlaw_block(ms, rxb, conf_sums_prev[ms->_confn],
+						DAHDI_CHUNKSIZE);
 			break;
 		case DAHDI_CONF_DIGITALMON:
 			  /* if not a pseudo-channel, ignore */
@@ -9126,6 +11412,8 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 	int res;
 	int left, x;
 
+	__dahdi_sync(ms);
+
 	while(bytes) {
 #if defined(CONFIG_DAHDI_NET)  || defined(CONFIG_DAHDI_PPP)
 		skb = NULL;
@@ -9283,6 +11571,11 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 						ms->readn[ms->inreadbuf] = 0;
 						ms->readidx[ms->inreadbuf] = 0;
 					} else {
+						/* Pairs with the acquire in read() */
+						smp_store_release(&ms->rx_head,
+							dahdi_pos_next(ms, ms->rx_head));
+						if (ms->ring)
+							__dahdi_ring_rx_block(ms, oldbuf);
 						ms->inreadbuf = (ms->inreadbuf + 1) % ms->numbufs;
 						if (ms->inreadbuf == ms->outreadbuf) {
 							/* Whoops, we're full, and have no where else
@@ -9619,6 +11912,7 @@ dahdi_chan_poll(struct file *file, struct poll_table_struct *wait_table)
 	poll_wait(file, &c->waitq, wait_table);
 
 	spin_lock_irqsave(&c->lock, flags);
+	__dahdi_sync(c);
 	ret |= (c->inwritebuf > -1) ? POLLOUT|POLLWRNORM : 0;
 	ret |= (c->outreadbuf > -1) ?  POLLIN|POLLRDNORM : 0;
 	ret |= (c->eventoutidx != c->eventinidx) ? POLLPRI : 0;
@@ -9744,6 +12038,9 @@ static void __dahdi_receive_chunk(struct dahdi_chan *chan, unsigned char *buf)
 #ifdef CONFIG_DAHDI_MMX
 		dahdi_kernel_fpu_end();
 #endif
+		/* Only the digits are wanted, nobody reads this audio */
+		if (chan->master->digitdetect & DAHDI_TONEDETECT_NOAUDIO)
+			return;
 	}
 	__dahdi_putbuf_chunk(chan, buf);
 }
@@ -9769,109 +12066,585 @@ static inline void __dahdi_real_receive(struct dahdi_chan *chan)
  */
 static void __transmit_to_slaves(struct dahdi_chan *const chan)
 {
-	u_char data[DAHDI_CHUNKSIZE];
+	u_char data[DAHDI_CHUNKSIZE];
+	int i;
+	int pos = DAHDI_CHUNKSIZE;
+	struct dahdi_chan *slave;
+	for (i = 0; i < DAHDI_CHUNKSIZE; i++) {
+		for (slave = chan; (NULL != slave); slave = slave->nextslave) {
+			if (pos == DAHDI_CHUNKSIZE) {
+				__dahdi_transmit_chunk(chan, data);
+				pos = 0;
+			}
+			slave->writechunk[i] = data[pos++];
+		}
+	}
+}
+
+/**
+ * __dahdi_idle_fill() - Fill the writechunk of an idle channel.
+ *
+ * Sends what __dahdi_getbuf_chunk() would for a closed channel, without
+ * taking chan->lock.
+ */
+static inline void __dahdi_idle_fill(struct dahdi_chan *chan)
+{
+	const unsigned long flags = READ_ONCE(chan->flags);
+
+	if ((flags & DAHDI_FLAG_CLEAR) && !(flags & DAHDI_FLAG_AUDIO))
+		memset(chan->writechunk, 0xff, DAHDI_CHUNKSIZE);
+	else
+		memset(chan->writechunk, DAHDI_LIN2X(0, chan), DAHDI_CHUNKSIZE);
+}
+
+static void _dahdi_transmit_chunk(struct dahdi_span *span)
+{
+	unsigned int x;
+	unsigned int skipped = 0;
+
+	dahdi_mix_begin();
+	for (x=0;x<span->channels;x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+		if (!test_bit(x, span->active_chans)) {
+			__dahdi_idle_fill(chan);
+			skipped++;
+			continue;
+		}
+		spin_lock(&chan->lock);
+		if (unlikely(chan->flags & DAHDI_FLAG_NOSTDTXRX)) {
+			spin_unlock(&chan->lock);
+			continue;
+		}
+		if (chan == chan->master) {
+			if (is_chan_dacsed(chan)) {
+				struct dahdi_chan *const src = chan->dacs_chan;
+				memcpy(chan->writechunk, src->readchunk,
+				       DAHDI_CHUNKSIZE);
+				if (chan->sig == DAHDI_SIG_DACS_RBS) {
+					/* Just set bits for our destination */
+					if (chan->txsig != src->rxsig) {
+						chan->txsig = src->rxsig;
+						span->ops->rbsbits(chan, src->rxsig);
+					}
+				}
+				/* there is no further processing to do for
+				 * DACS channels, so jump to the next channel
+				 * in the span */
+				spin_unlock(&chan->lock);
+				continue;
+			} else if (chan->nextslave) {
+				__transmit_to_slaves(chan);
+			} else {
+				/* Process a normal channel */
+				__dahdi_real_transmit(chan);
+			}
+			if (chan->otimer) {
+				chan->otimer -= DAHDI_CHUNKSIZE;
+				if (chan->otimer <= 0)
+					__rbs_otimer_expire(chan);
+			}
+		}
+		if (dahdi_chan_is_idle(chan))
+			clear_bit(x, span->active_chans);
+		spin_unlock(&chan->lock);
+	}
+	dahdi_ced_flush();
+	dahdi_digit_flush();
+	dahdi_mix_end();
+	span->skipped_channels = skipped;
+
+	if (span->mainttimer) {
+		span->mainttimer -= DAHDI_CHUNKSIZE;
+		if (span->mainttimer <= 0) {
+			span->mainttimer = 0;
+			span->maintstat = 0;
+		}
+	}
+}
+
+int _dahdi_transmit(struct dahdi_span *span)
+{
+	const int chunks = dahdi_span_chunks(span);
+	const u64 start = dahdi_prof_start();
+	int c;
+
+	for (c = 0; c < chunks; c++) {
+		if (c)
+			dahdi_span_seek_chunk(span, DAHDI_CHUNKSIZE);
+		_dahdi_transmit_chunk(span);
+	}
+	if (chunks > 1)
+		dahdi_span_seek_chunk(span, -(chunks - 1) * DAHDI_CHUNKSIZE);
+	dahdi_prof_end(DAHDI_PROF_TRANSMIT, start);
+	return 0;
+}
+EXPORT_SYMBOL(_dahdi_transmit);
+
+/* 16 kHz pseudo channels move DAHDI_WB_CHUNKSIZE samples a tick through
+ * their buffers, with no law, gain, echo cancelling or tone detection */
+static void __dahdi_wb_transmit_chunk(struct dahdi_chan *chan)
+{
+	short wblin[DAHDI_WB_CHUNKSIZE];
+
+	__dahdi_getbuf(chan, (unsigned char *)wblin, sizeof(wblin));
+#ifdef CONFIG_DAHDI_MMX
+	dahdi_kernel_fpu_begin();
+#endif
+	__dahdi_wb_getaudio(chan, wblin);
+#ifdef CONFIG_DAHDI_MMX
+	dahdi_kernel_fpu_end();
+#endif
+}
+
+static void __dahdi_wb_receive_chunk(struct dahdi_chan *chan)
+{
+	short wblin[DAHDI_WB_CHUNKSIZE];
+
+#ifdef CONFIG_DAHDI_MMX
+	dahdi_kernel_fpu_begin();
+#endif
+	__dahdi_wb_putaudio(chan, wblin);
+#ifdef CONFIG_DAHDI_MMX
+	dahdi_kernel_fpu_end();
+#endif
+	__putbuf_chunk(chan, (unsigned char *)wblin, sizeof(wblin));
+}
+
+static inline void __pseudo_rx_audio(struct dahdi_chan *chan)
+{
+	unsigned char tmp[DAHDI_CHUNKSIZE];
+	spinlock_t *conf_lock;
+
+	spin_lock(&chan->lock);
+	conf_lock = masterspan_lock_conf(chan);
+	if (chan->wideband) {
+		__dahdi_wb_receive_chunk(chan);
+	} else {
+		__dahdi_getempty(chan, tmp);
+		__dahdi_receive_chunk(chan, tmp);
+	}
+	masterspan_unlock_conf(conf_lock);
+	spin_unlock(&chan->lock);
+}
+
+#ifdef CONFIG_DAHDI_MIRROR
+static inline void pseudo_rx_audio(struct dahdi_chan *chan)
+{
+	if (!chan->srcmirror)
+		__pseudo_rx_audio(chan);
+}
+#else
+static inline void pseudo_rx_audio(struct dahdi_chan *chan)
+{
+	__pseudo_rx_audio(chan);
+}
+#endif /* CONFIG_DAHDI_MIRROR */
+
+#ifdef DAHDI_SYNC_TICK
+static inline void dahdi_sync_tick(struct dahdi_span *const s)
+{
+	if (s->ops->sync_tick)
+		s->ops->sync_tick(s, dahdi_is_sync_master(s));
+}
+#else
+#define dahdi_sync_tick(x) do { ; } while (0)
+#endif
+
+static inline void __span_conf_receive(struct dahdi_span *s)
+{
+	int x;
+	u_char *data;
+	spinlock_t *conf_lock;
+
+	for (x = 0; x < s->channels; ++x) {
+		struct dahdi_chan *const chan = s->chans[x];
+		if (!chan->confmode)
+			continue;
+		spin_lock(&chan->lock);
+		conf_lock = masterspan_lock_conf(chan);
+		data = __buf_peek(&chan->confin);
+		__dahdi_receive_chunk(chan, data);
+		if (data)
+			__buf_pull(&chan->confin, NULL, chan);
+		masterspan_unlock_conf(conf_lock);
+		spin_unlock(&chan->lock);
+	}
+}
+
+static inline void __span_conf_transmit(struct dahdi_span *s)
+{
+	int x;
+	u_char *data;
+	spinlock_t *conf_lock;
+
+	for (x = 0; x < s->channels; x++) {
+		struct dahdi_chan *const chan = s->chans[x];
+		if (!chan->confmode)
+			continue;
+		spin_lock(&chan->lock);
+		conf_lock = masterspan_lock_conf(chan);
+		data = __buf_pushpeek(&chan->confout);
+		__dahdi_transmit_chunk(chan, data);
+		if (data)
+			__buf_push(&chan->confout, NULL);
+		masterspan_unlock_conf(conf_lock);
+		spin_unlock(&chan->lock);
+	}
+
+	dahdi_sync_tick(s);
+}
+
+static inline void __pseudo_conf_transmit(struct dahdi_chan *chan)
+{
+	spinlock_t *conf_lock;
+
+	spin_lock(&chan->lock);
+	conf_lock = masterspan_lock_conf(chan);
+	if (chan->wideband)
+		__dahdi_wb_transmit_chunk(chan);
+	else
+		__dahdi_transmit_chunk(chan, NULL);
+	masterspan_unlock_conf(conf_lock);
+	spin_unlock(&chan->lock);
+}
+
+#ifdef CONFIG_DAHDI_CONFLINK
+static void process_conflinks(void)
+{
+	int x;
+	int z;
+	int y;
+
+	if (!maxlinks)
+		return;
+#ifdef CONFIG_DAHDI_MMX
+	dahdi_kernel_fpu_begin();
+#endif
+	/* process all the conf links */
+	for (x = 1; x <= maxlinks; x++) {
+		/* if we have a destination conf */
+		z = confalias[conf_links[x].dst];
+		if (z) {
+			y = confalias[conf_links[x].src];
+			if (y)
+				ACSS(conf_sums[z], conf_sums[y]);
+		}
+	}
+#ifdef CONFIG_DAHDI_MMX
+	dahdi_kernel_fpu_end();
+#endif
+}
+#else
+static inline void process_conflinks(void) { }
+#endif /* CONFIG_DAHDI_CONFLINK */
+
+#ifdef DAHDI_SHARDED_MASTERSPAN
+
+static inline bool in_shard(unsigned int *pos, unsigned int index)
+{
+	return ((*pos)++ % num_shards) == index;
+}
+
+static bool span_has_monitors(const struct dahdi_span *s)
+{
+	int x;
+
+	for (x = 0; x < s->channels; x++) {
+		if (s->chans[x]->confmode && masterspan_monitors(s->chans[x]))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * masterspan_run_shard() - Process one shard of the current phase.
+ * @shard:	The shard to process.
+ * @gen:	The phase generation the caller was dispatched for.
+ *
+ * Each shard is claimed exactly once per generation, either by the CPU it
+ * is bound to or by the master CPU if that CPU has not picked it up yet.
+ * A stale call for a generation that has already completed fails the claim
+ * and returns without touching anything.
+ *
+ * The master CPU holds chan_lock for the whole time any shard of a
+ * generation may be running, so the span and pseudo channel lists are
+ * stable here without taking it again.
+ */
+static void masterspan_run_shard(struct masterspan_shard *shard, int gen)
+{
+	const unsigned int index = shard - shards;
+	unsigned int pos = 0;
+	struct pseudo_chan *pseudo;
+	struct dahdi_span *s;
+	u64 start;
+
+	if (atomic_cmpxchg(&shard->claimed, gen - 1, gen) != gen - 1)
+		return;
+
+	start = ktime_get_ns();
+	dahdi_mix_begin();
+
+	switch (shard_phase) {
+	case MASTERSPAN_SPAN_RECEIVE:
+		list_for_each_entry(s, &span_list, spans_node) {
+			if (in_shard(&pos, index) && !span_has_monitors(s))
+				__span_conf_receive(s);
+		}
+		break;
+	case MASTERSPAN_PSEUDO_TRANSMIT:
+		list_for_each_entry(pseudo, &pseudo_chans, node) {
+			if (in_shard(&pos, index) &&
+			    !masterspan_monitors(&pseudo->chan))
+				__pseudo_conf_transmit(&pseudo->chan);
+		}
+		break;
+	case MASTERSPAN_PSEUDO_RECEIVE:
+		list_for_each_entry(pseudo, &pseudo_chans, node) {
+			if (in_shard(&pos, index) &&
+			    !masterspan_monitors(&pseudo->chan))
+				pseudo_rx_audio(&pseudo->chan);
+		}
+		break;
+	case MASTERSPAN_SPAN_TRANSMIT:
+		list_for_each_entry(s, &span_list, spans_node) {
+			if (in_shard(&pos, index) && !span_has_monitors(s))
+				__span_conf_transmit(s);
+		}
+		break;
+	}
+
+	dahdi_ced_flush();
+	dahdi_digit_flush();
+	dahdi_mix_end();
+	shard->tick_ns += ktime_get_ns() - start;
+	smp_mb__before_atomic();
+	atomic_dec(&shards_pending);
+}
+
+static void masterspan_shard_work(struct irq_work *work)
+{
+	struct masterspan_shard *const shard =
+		container_of(work, struct masterspan_shard, work);
+	const int gen = atomic_read(&shard_gen);
+
+	smp_rmb();
+	masterspan_run_shard(shard, gen);
+}
+
+/**
+ * masterspan_run_monitors() - Process what the shards left to the master.
+ *
+ * Spans with a channel in one of the monitor modes, and pseudo channels in
+ * those modes, are skipped by the shards.  They are run here once all the
+ * shards of the phase have finished, so the channels they monitor are not
+ * being written to by another CPU.
+ */
+static void masterspan_run_monitors(enum masterspan_phase phase)
+{
+	struct pseudo_chan *pseudo;
+	struct dahdi_span *s;
+
+	switch (phase) {
+	case MASTERSPAN_SPAN_RECEIVE:
+		list_for_each_entry(s, &span_list, spans_node) {
+			if (span_has_monitors(s))
+				__span_conf_receive(s);
+		}
+		break;
+	case MASTERSPAN_PSEUDO_TRANSMIT:
+		list_for_each_entry(pseudo, &pseudo_chans, node) {
+			if (masterspan_monitors(&pseudo->chan))
+				__pseudo_conf_transmit(&pseudo->chan);
+		}
+		break;
+	case MASTERSPAN_PSEUDO_RECEIVE:
+		list_for_each_entry(pseudo, &pseudo_chans, node) {
+			if (masterspan_monitors(&pseudo->chan))
+				pseudo_rx_audio(&pseudo->chan);
+		}
+		break;
+	case MASTERSPAN_SPAN_TRANSMIT:
+		list_for_each_entry(s, &span_list, spans_node) {
+			if (span_has_monitors(s))
+				__span_conf_transmit(s);
+		}
+		break;
+	}
+
+	dahdi_ced_flush();
+	dahdi_digit_flush();
+}
+
+/**
+ * masterspan_run_phase() - Run one phase of the master span on all shards.
+ *
+ * Kicks every remote shard CPU and then works through the shards locally,
+ * claiming any that have not been started yet.  Returns once every shard
+ * has finished, so the caller may rely on the phase being complete.
+ *
+ * By the time the local loop is done every shard has either finished or
+ * been claimed by its own CPU, where it runs from hard interrupt context
+ * and cannot be preempted, so the wait is at most one shard's worth of
+ * work.  Should a shard still not be done after DAHDI_SHARD_STALL_NS (a
+ * CPU held up by a hypervisor, say) the stall is counted and the following
+ * ticks are processed without shards.  This tick still has to wait, since
+ * the next phase reads what the shard writes.
+ *
+ * Called with chan_lock held and interrupts disabled.
+ */
+static void masterspan_run_phase(enum masterspan_phase phase)
+{
+	const int this_cpu = smp_processor_id();
+	u64 deadline;
+	int gen;
+	int i;
+
+	shard_phase = phase;
+	atomic_set(&shards_pending, num_shards);
+	smp_wmb();
+	gen = atomic_inc_return(&shard_gen);
+
+	for (i = 0; i < num_shards; i++) {
+		struct masterspan_shard *const shard = &shards[i];
+		if (shard->cpu != this_cpu && cpu_online(shard->cpu))
+			irq_work_queue_on(&shard->work, shard->cpu);
+	}
+
+	for (i = 0; i < num_shards; i++)
+		masterspan_run_shard(&shards[i], gen);
+
+	deadline = ktime_get_ns() + DAHDI_SHARD_STALL_NS;
+	while (atomic_read(&shards_pending)) {
+		cpu_relax();
+		if (!shards_stalled && ktime_get_ns() > deadline) {
+			++shard_stalls;
+			WRITE_ONCE(shards_stalled, true);
+		}
+	}
+	smp_rmb();
+
+	masterspan_run_monitors(phase);
+}
+
+static void masterspan_finish_tick(void)
+{
+	int i;
+
+	for (i = 0; i < num_shards; i++) {
+		struct masterspan_shard *const shard = &shards[i];
+		shard->last_ns = shard->tick_ns;
+		if (shard->tick_ns > shard->max_ns)
+			shard->max_ns = shard->tick_ns;
+		shard->tick_ns = 0;
+	}
+}
+
+/**
+ * _process_masterspan_sharded - Sharded variant of one master span pass.
+ *
+ * Runs the same steps in the same order, but each step that walks the span
+ * or pseudo channel lists is spread over the shards and completes on all of
+ * them before the next one starts.  Timers, rotate_sums(), the conference
+ * links and the channels in a monitor mode are still handled by the master
+ * CPU alone.
+ */
+static void _process_masterspan_sharded(void)
+{
+	spin_lock(&chan_lock);
+
+	process_timers();
+
+	masterspan_run_phase(MASTERSPAN_SPAN_RECEIVE);
+
+	rotate_sums();
+
+	masterspan_run_phase(MASTERSPAN_PSEUDO_TRANSMIT);
+
+	process_conflinks();
+
+	masterspan_run_phase(MASTERSPAN_PSEUDO_RECEIVE);
+
+	masterspan_run_phase(MASTERSPAN_SPAN_TRANSMIT);
+
+	masterspan_finish_tick();
+
+	spin_unlock(&chan_lock);
+}
+
+int dahdi_masterspan_shard_stats(char *buf, size_t size)
+{
+	int len = 0;
 	int i;
-	int pos = DAHDI_CHUNKSIZE;
-	struct dahdi_chan *slave;
-	for (i = 0; i < DAHDI_CHUNKSIZE; i++) {
-		for (slave = chan; (NULL != slave); slave = slave->nextslave) {
-			if (pos == DAHDI_CHUNKSIZE) {
-				__dahdi_transmit_chunk(chan, data);
-				pos = 0;
-			}
-			slave->writechunk[i] = data[pos++];
-		}
+
+	len += scnprintf(buf + len, size - len, "shards: %d\n", num_shards);
+	len += scnprintf(buf + len, size - len, "stalls: %u%s\n",
+			 READ_ONCE(shard_stalls),
+			 READ_ONCE(shards_stalled) ? " (sharding off)" : "");
+	for (i = 0; i < num_shards; i++) {
+		const struct masterspan_shard *const shard = &shards[i];
+		len += scnprintf(buf + len, size - len,
+				 "%d: cpu %d last %llu ns max %llu ns\n",
+				 i, shard->cpu,
+				 (unsigned long long)READ_ONCE(shard->last_ns),
+				 (unsigned long long)READ_ONCE(shard->max_ns));
 	}
+	return len;
 }
 
-int _dahdi_transmit(struct dahdi_span *span)
+static void __init masterspan_shards_init(void)
 {
-	unsigned int x;
+	int cpu;
+	int i;
 
-	for (x=0;x<span->channels;x++) {
-		struct dahdi_chan *const chan = span->chans[x];
-		spin_lock(&chan->lock);
-		if (unlikely(chan->flags & DAHDI_FLAG_NOSTDTXRX)) {
-			spin_unlock(&chan->lock);
-			continue;
-		}
-		if (chan == chan->master) {
-			if (is_chan_dacsed(chan)) {
-				struct dahdi_chan *const src = chan->dacs_chan;
-				memcpy(chan->writechunk, src->readchunk,
-				       DAHDI_CHUNKSIZE);
-				if (chan->sig == DAHDI_SIG_DACS_RBS) {
-					/* Just set bits for our destination */
-					if (chan->txsig != src->rxsig) {
-						chan->txsig = src->rxsig;
-						span->ops->rbsbits(chan, src->rxsig);
-					}
-				}
-				/* there is no further processing to do for
-				 * DACS channels, so jump to the next channel
-				 * in the span */
-				spin_unlock(&chan->lock);
-				continue;
-			} else if (chan->nextslave) {
-				__transmit_to_slaves(chan);
-			} else {
-				/* Process a normal channel */
-				__dahdi_real_transmit(chan);
-			}
-			if (chan->otimer) {
-				chan->otimer -= DAHDI_CHUNKSIZE;
-				if (chan->otimer <= 0)
-					__rbs_otimer_expire(chan);
-			}
-		}
-		spin_unlock(&chan->lock);
+	for (i = 0; i < ARRAY_SIZE(conf_sum_locks); i++)
+		spin_lock_init(&conf_sum_locks[i]);
+
+	num_shards = min3(masterspan_shards, (int)num_online_cpus(),
+			  DAHDI_MAX_SHARDS);
+	if (num_shards <= 1) {
+		num_shards = 0;
+		return;
 	}
 
-	if (span->mainttimer) {
-		span->mainttimer -= DAHDI_CHUNKSIZE;
-		if (span->mainttimer <= 0) {
-			span->mainttimer = 0;
-			span->maintstat = 0;
-		}
+	i = 0;
+	for_each_online_cpu(cpu) {
+		if (i >= num_shards)
+			break;
+		shards[i].cpu = cpu;
+		atomic_set(&shards[i].claimed, 0);
+		init_irq_work(&shards[i].work, masterspan_shard_work);
+		++i;
 	}
-	return 0;
+	atomic_set(&shard_gen, 0);
+	module_printk(KERN_INFO, "Master span processing split over %d shards\n",
+		      num_shards);
 }
-EXPORT_SYMBOL(_dahdi_transmit);
 
-static inline void __pseudo_rx_audio(struct dahdi_chan *chan)
+static void masterspan_shards_cleanup(void)
 {
-	unsigned char tmp[DAHDI_CHUNKSIZE];
-	spin_lock(&chan->lock);
-	__dahdi_getempty(chan, tmp);
-	__dahdi_receive_chunk(chan, tmp);
-	spin_unlock(&chan->lock);
-}
+	int i;
 
-#ifdef CONFIG_DAHDI_MIRROR
-static inline void pseudo_rx_audio(struct dahdi_chan *chan)
-{
-	if (!chan->srcmirror)
-		__pseudo_rx_audio(chan);
+	for (i = 0; i < num_shards; i++)
+		irq_work_sync(&shards[i].work);
 }
+
 #else
-static inline void pseudo_rx_audio(struct dahdi_chan *chan)
-{
-	__pseudo_rx_audio(chan);
-}
-#endif /* CONFIG_DAHDI_MIRROR */
 
-#ifdef DAHDI_SYNC_TICK
-static inline void dahdi_sync_tick(struct dahdi_span *const s)
+static inline void _process_masterspan_sharded(void) { }
+
+int dahdi_masterspan_shard_stats(char *buf, size_t size)
 {
-	if (s->ops->sync_tick)
-		s->ops->sync_tick(s, dahdi_is_sync_master(s));
+	return scnprintf(buf, size, "shards: 0\n");
 }
-#else
-#define dahdi_sync_tick(x) do { ; } while (0)
-#endif
+
+static inline void masterspan_shards_init(void) { }
+static inline void masterspan_shards_cleanup(void) { }
+
+#endif /* DAHDI_SHARDED_MASTERSPAN */
 
 /**
- * _process_masterspan - Handle conferencing and timers.
+ * _process_masterspan_chunks - Handle conferencing and timers.
+ * @chunks:	Number of DAHDI_CHUNKSIZE passes to run back to back.
  *
  * There are three sets of conference sum accumulators. One for the current
  * sample chunk (conf_sums), one for the next sample chunk (conf_sums_next), and
@@ -9906,96 +12679,72 @@ static inline void dahdi_sync_tick(struct dahdi_span *const s)
  * the next sample chunk accumulators (conf_sums_next) to be processed as part
  * of the next sample chunk's data (next time around the world).
  *
+ * A span serviced in several chunks at a time, and the core timer when it
+ * has fallen behind, run all their passes in one call, so chan_lock and the
+ * FPU are only taken once.
  */
-static void _process_masterspan(void)
+static void _process_masterspan_chunks(int chunks)
 {
-	int x;
 	struct pseudo_chan *pseudo;
 	struct dahdi_span *s;
-	u_char *data;
+	const u64 start = dahdi_prof_start();
+	int c;
 
 #ifdef CONFIG_DAHDI_CORE_TIMER
 	/* We increment the calls since start here, so that if we switch over
 	 * to the core timer, we know how many times we need to call
 	 * process_masterspan in order to catch up since this function needs
 	 * to be called (1000 / (DAHDI_CHUNKSIZE / 8)) times per second. */
-	atomic_inc(&core_timer.count);
+	atomic_add(chunks, &core_timer.count);
 #endif
+	if (masterspan_sharded()) {
+		dahdi_mix_begin();
+		for (c = 0; c < chunks; c++)
+			_process_masterspan_sharded();
+		dahdi_mix_end();
+		dahdi_prof_end(DAHDI_PROF_MASTERSPAN, start);
+		return;
+	}
+
 	/* Hold the chan_lock for the duration of major
 	   activities which touch all sorts of channels */
 	spin_lock(&chan_lock);
+	dahdi_mix_begin();
 
-	/* Process any timers */
-	process_timers();
-
-	list_for_each_entry(s, &span_list, spans_node) {
-		for (x = 0; x < s->channels; ++x) {
-			struct dahdi_chan *const chan = s->chans[x];
-			if (!chan->confmode)
-				continue;
-			spin_lock(&chan->lock);
-			data = __buf_peek(&chan->confin);
-			__dahdi_receive_chunk(chan, data);
-			if (data)
-				__buf_pull(&chan->confin, NULL, chan);
-			spin_unlock(&chan->lock);
-		}
-	}
+	for (c = 0; c < chunks; c++) {
+		/* Process any timers */
+		process_timers();
 
-	/* This is the master channel, so make things switch over */
-	rotate_sums();
+		list_for_each_entry(s, &span_list, spans_node)
+			__span_conf_receive(s);
 
-	/* do all the pseudo and/or conferenced channel receives (getbuf's) */
-	list_for_each_entry(pseudo, &pseudo_chans, node) {
-		spin_lock(&pseudo->chan.lock);
-		__dahdi_transmit_chunk(&pseudo->chan, NULL);
-		spin_unlock(&pseudo->chan.lock);
-	}
+		/* This is the master channel, so make things switch over */
+		rotate_sums();
 
-#ifdef CONFIG_DAHDI_CONFLINK
-	if (maxlinks) {
-		int z;
-		int y;
-#ifdef CONFIG_DAHDI_MMX
-		dahdi_kernel_fpu_begin();
-#endif
-		/* process all the conf links */
-		for (x = 1; x <= maxlinks; x++) {
-			/* if we have a destination conf */
-			z = confalias[conf_links[x].dst];
-			if (z) {
-				y = confalias[conf_links[x].src];
-				if (y)
-					ACSS(conf_sums[z], conf_sums[y]);
-			}
-		}
-#ifdef CONFIG_DAHDI_MMX
-		dahdi_kernel_fpu_end();
-#endif
-	}
-#endif /* CONFIG_DAHDI_CONFLINK */
+		/* do all the pseudo and/or conferenced channel receives
+		 * (getbuf's) */
+		list_for_each_entry(pseudo, &pseudo_chans, node)
+			__pseudo_conf_transmit(&pseudo->chan);
 
-	/* do all the pseudo/conferenced channel transmits (putbuf's) */
-	list_for_each_entry(pseudo, &pseudo_chans, node) {
-		pseudo_rx_audio(&pseudo->chan);
-	}
+		process_conflinks();
 
-	list_for_each_entry(s, &span_list, spans_node) {
-		for (x = 0; x < s->channels; x++) {
-			struct dahdi_chan *const chan = s->chans[x];
-			if (!chan->confmode)
-				continue;
-			spin_lock(&chan->lock);
-			data = __buf_pushpeek(&chan->confout);
-			__dahdi_transmit_chunk(chan, data);
-			if (data)
-				__buf_push(&chan->confout, NULL);
-			spin_unlock(&chan->lock);
+		/* do all the pseudo/conferenced channel transmits
+		 * (putbuf's) */
+		list_for_each_entry(pseudo, &pseudo_chans, node) {
+			pseudo_rx_audio(&pseudo->chan);
 		}
 
-		dahdi_sync_tick(s);
+		list_for_each_entry(s, &span_list, spans_node)
+			__span_conf_transmit(s);
+
+		/* A channel may only be queued once per detector bank */
+		dahdi_ced_flush();
+		dahdi_digit_flush();
 	}
+
+	dahdi_mix_end();
 	spin_unlock(&chan_lock);
+	dahdi_prof_end(DAHDI_PROF_MASTERSPAN, start);
 }
 
 #ifndef CONFIG_DAHDI_CORE_TIMER
@@ -10010,6 +12759,16 @@ static void coretimer_cleanup(void)
 	return;
 }
 
+int dahdi_core_timer_stats(char *buf, size_t size)
+{
+	return scnprintf(buf, size, "mode: none\n");
+}
+
+static int coretimer_set_chunks(int chunks)
+{
+	return -EOPNOTSUPP;
+}
+
 #else
 
 static inline unsigned long msecs_processed(const struct core_timer *const ct)
@@ -10017,106 +12776,237 @@ static inline unsigned long msecs_processed(const struct core_timer *const ct)
 	return atomic_read(&ct->count) * DAHDI_MSECS_PER_CHUNK;
 }
 
-static void coretimer_func(TIMER_DATA_TYPE unused)
+/* True if no board driver called dahdi_receive since the last tick */
+static inline bool coretimer_is_master(void)
+{
+	return atomic_read(&core_timer.count) ==
+	       atomic_read(&core_timer.last_count);
+}
+
+/* Account how late this tick is compared to when it was due */
+static void coretimer_account(ktime_t now)
+{
+	const s64 late = ktime_to_ns(ktime_sub(now, core_timer.expires));
+
+	core_timer.ticks++;
+	if (late <= 0) {
+		core_timer.late_last_ns = 0;
+		return;
+	}
+	core_timer.late_last_ns = late;
+	core_timer.late_total_ns += late;
+	if (late > core_timer.late_max_ns)
+		core_timer.late_max_ns = late;
+}
+
+/*
+ * The core of dahdi performs the master span processing itself, since
+ * no board driver is calling dahdi_receive. Catches up with whatever
+ * has elapsed since the time base was set.
+ */
+static void coretimer_run(ktime_t now)
 {
 	unsigned long flags;
 	long ms_since_start;
-	ktime_t now;
 	const unsigned long MAX_INTERVAL = 100000L;
-	const unsigned long ONESEC_INTERVAL = HZ;
 	const long MS_LIMIT = 3000;
 	long difference;
+	int processed = 0;
 
-	now = ktime_get();
+	if (core_timer.dahdi_receive_used) {
+		core_timer.dahdi_receive_used = 0;
+		dahdi_dbg(GENERAL, "Master changed to core_timer\n");
+	}
 
-	if (atomic_read(&core_timer.count) ==
-	    atomic_read(&core_timer.last_count)) {
+	ms_since_start = ktime_ms_delta(now, core_timer.start_interval);
 
-		/* This is the code path if a board driver is not calling
-		 * dahdi_receive, and therefore the core of dahdi needs to
-		 * perform the master span processing itself. */
-		if (core_timer.dahdi_receive_used) {
-			core_timer.dahdi_receive_used = 0;
-			dahdi_dbg(GENERAL, "Master changed to core_timer\n");
+	/*
+	 * If the system time has changed, it is possible for us to be
+	 * far behind.  If we are more than MS_LIMIT milliseconds
+	 * behind (or ahead in time), just reset our time base and
+	 * continue so that we do not hang the system here.
+	 *
+	 */
+	difference = ms_since_start - msecs_processed(&core_timer);
+	if (unlikely((difference >  MS_LIMIT) || (difference < 0))) {
+		if (printk_ratelimit()) {
+			module_printk(KERN_INFO,
+				      "Detected time shift.\n");
 		}
+		atomic_set(&core_timer.count, 0);
+		atomic_set(&core_timer.last_count, 0);
+		core_timer.start_interval = now;
+		return;
+	}
 
+	local_irq_save(flags);
+	if (ms_since_start > msecs_processed(&core_timer)) {
+		processed = (ms_since_start - msecs_processed(&core_timer) +
+			     DAHDI_MSECS_PER_CHUNK - 1) / DAHDI_MSECS_PER_CHUNK;
+		_process_masterspan_chunks(processed);
+	}
+	local_irq_restore(flags);
+
+	if (processed > 1)
+		core_timer.catchup += processed - 1;
+
+	if (ms_since_start > MAX_INTERVAL) {
+		atomic_set(&core_timer.count, 0);
+		atomic_set(&core_timer.last_count, 0);
+		core_timer.start_interval = now;
+	} else {
+		atomic_set(&core_timer.last_count,
+			   atomic_read(&core_timer.count));
+	}
+}
+
+/*
+ * It looks like a board driver is calling dahdi_receive. The caller
+ * checks again in a second.
+ */
+static void coretimer_idle(ktime_t now)
+{
+	if (!core_timer.dahdi_receive_used) {
+		core_timer.dahdi_receive_used = 1;
+		dahdi_dbg(GENERAL, "Master is no longer core_timer\n");
+	}
+	atomic_set(&core_timer.count, 0);
+	atomic_set(&core_timer.last_count, 0);
+	core_timer.start_interval = now;
+}
+
+static void coretimer_func(TIMER_DATA_TYPE unused)
+{
+	const unsigned long ONESEC_INTERVAL = HZ;
+	const ktime_t now = ktime_get();
+
+	if (coretimer_is_master()) {
+		coretimer_account(now);
 		if (!atomic_read(&core_timer.shutdown)) {
 			mod_timer(&core_timer.timer, jiffies +
 				  core_timer.interval);
+			core_timer.expires = ktime_add_ns(now,
+				jiffies_to_nsecs(core_timer.interval));
 		}
-
-		ms_since_start = ktime_ms_delta(now, core_timer.start_interval);
-
-		/*
-		 * If the system time has changed, it is possible for us to be
-		 * far behind.  If we are more than MS_LIMIT milliseconds
-		 * behind (or ahead in time), just reset our time base and
-		 * continue so that we do not hang the system here.
-		 *
-		 */
-		difference = ms_since_start - msecs_processed(&core_timer);
-		if (unlikely((difference >  MS_LIMIT) || (difference < 0))) {
-			if (printk_ratelimit()) {
-				module_printk(KERN_INFO,
-					      "Detected time shift.\n");
-			}
-			atomic_set(&core_timer.count, 0);
-			atomic_set(&core_timer.last_count, 0);
-			core_timer.start_interval = now;
-			return;
+		coretimer_run(now);
+	} else {
+		coretimer_idle(now);
+		if (!atomic_read(&core_timer.shutdown)) {
+			mod_timer(&core_timer.timer, jiffies + ONESEC_INTERVAL);
+			core_timer.expires = ktime_add_ns(now,
+				jiffies_to_nsecs(ONESEC_INTERVAL));
 		}
+	}
+}
 
-		local_irq_save(flags);
-		while (ms_since_start > msecs_processed(&core_timer))
-			_process_masterspan();
-		local_irq_restore(flags);
+/*
+ * Same as coretimer_func() on a high resolution timer, so a tick is due
+ * every core_timer.chunks * DAHDI_MSECS_PER_CHUNK regardless of HZ and
+ * normally processes exactly that many chunks.
+ */
+static enum hrtimer_restart coretimer_hrtimer_func(struct hrtimer *timer)
+{
+	const ktime_t now = ktime_get();
 
-		if (ms_since_start > MAX_INTERVAL) {
-			atomic_set(&core_timer.count, 0);
-			atomic_set(&core_timer.last_count, 0);
-			core_timer.start_interval = now;
-		} else {
-			atomic_set(&core_timer.last_count,
-				   atomic_read(&core_timer.count));
-		}
+	if (atomic_read(&core_timer.shutdown))
+		return HRTIMER_NORESTART;
 
+	if (coretimer_is_master()) {
+		core_timer.expires = hrtimer_get_expires(timer);
+		coretimer_account(now);
+		coretimer_run(now);
+		hrtimer_forward(timer, now,
+				ms_to_ktime(READ_ONCE(core_timer.chunks) *
+					    DAHDI_MSECS_PER_CHUNK));
 	} else {
-
-		/* It looks like a board driver is calling dahdi_receive. We
-		 * will just check again in a second. */
-		if (!core_timer.dahdi_receive_used) {
-			core_timer.dahdi_receive_used = 1;
-			dahdi_dbg(GENERAL, "Master is no longer core_timer\n");
-		}
-		atomic_set(&core_timer.count, 0);
-		atomic_set(&core_timer.last_count, 0);
-		core_timer.start_interval = now;
-		if (!atomic_read(&core_timer.shutdown))
-			mod_timer(&core_timer.timer, jiffies + ONESEC_INTERVAL);
+		coretimer_idle(now);
+		hrtimer_forward(timer, now, ktime_set(1, 0));
 	}
+	return HRTIMER_RESTART;
+}
+
+int dahdi_core_timer_stats(char *buf, size_t size)
+{
+	const u64 ticks = READ_ONCE(core_timer.ticks);
+	int len = 0;
+
+	len += scnprintf(buf + len, size - len, "mode: %s\n",
+			 (hires_core_timer) ? "hrtimer" : "jiffies");
+	len += scnprintf(buf + len, size - len, "master: %s\n",
+			 (core_timer.dahdi_receive_used) ? "span" : "core_timer");
+	len += scnprintf(buf + len, size - len, "chunks per tick: %d\n",
+			 READ_ONCE(core_timer.chunks));
+	len += scnprintf(buf + len, size - len, "ticks: %llu\n",
+			 (unsigned long long)ticks);
+	len += scnprintf(buf + len, size - len,
+			 "late last %llu ns avg %llu ns max %llu ns\n",
+			 (unsigned long long)READ_ONCE(core_timer.late_last_ns),
+			 (unsigned long long)((ticks) ?
+				div64_u64(READ_ONCE(core_timer.late_total_ns),
+					  ticks) : 0),
+			 (unsigned long long)READ_ONCE(core_timer.late_max_ns));
+	len += scnprintf(buf + len, size - len, "catchup chunks: %llu\n",
+			 (unsigned long long)READ_ONCE(core_timer.catchup));
+	return len;
+}
+
+/*
+ * Sets how many chunks the core timer processes per tick while it is the
+ * master.  The pseudo channels are still processed a chunk at a time, just
+ * in bursts; the jiffies timer never ticks faster than every 4 ms anyway.
+ */
+static int coretimer_set_chunks(int chunks)
+{
+	unsigned long interval;
+
+	interval = max(msecs_to_jiffies(chunks * DAHDI_MSECS_PER_CHUNK), 1UL);
+	if (interval < (HZ/250))
+		interval = (HZ/250);
+	WRITE_ONCE(core_timer.interval, interval);
+	WRITE_ONCE(core_timer.chunks, chunks);
+	return 0;
 }
 
 static void coretimer_init(void)
 {
+	core_timer.start_interval = ktime_get();
+	atomic_set(&core_timer.count, 0);
+	atomic_set(&core_timer.shutdown, 0);
+	coretimer_set_chunks(1);
+
+	if (hires_core_timer) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+		hrtimer_setup(&core_timer.hrtimer, coretimer_hrtimer_func,
+			      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+		hrtimer_init(&core_timer.hrtimer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		core_timer.hrtimer.function = coretimer_hrtimer_func;
+#endif
+		hrtimer_start(&core_timer.hrtimer,
+			      ms_to_ktime(DAHDI_MSECS_PER_CHUNK),
+			      HRTIMER_MODE_REL);
+		return;
+	}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
 	init_timer(&core_timer.timer);
 	core_timer.timer.function = coretimer_func;
 #else
 	timer_setup(&core_timer.timer, coretimer_func, 0);
 #endif
-	core_timer.start_interval = ktime_get();
-	atomic_set(&core_timer.count, 0);
-	atomic_set(&core_timer.shutdown, 0);
-	core_timer.interval = max(msecs_to_jiffies(DAHDI_MSECS_PER_CHUNK), 1UL);
-	if (core_timer.interval < (HZ/250))
-		core_timer.interval = (HZ/250);
+	core_timer.expires = ktime_add_ns(core_timer.start_interval,
+				jiffies_to_nsecs(core_timer.interval));
 	mod_timer(&core_timer.timer, jiffies + core_timer.interval);
 }
 
 static void coretimer_cleanup(void)
 {
 	atomic_set(&core_timer.shutdown, 1);
-	del_timer_sync(&core_timer.timer);
+	if (hires_core_timer)
+		hrtimer_cancel(&core_timer.hrtimer);
+	else
+		del_timer_sync(&core_timer.timer);
 }
 
 #endif /* CONFIG_DAHDI_CORE_TIMER */
@@ -10150,15 +13040,16 @@ static inline bool should_skip_receive(const struct dahdi_chan *const chan)
 		is_chan_dacsed(chan));
 }
 
-int _dahdi_receive(struct dahdi_span *span)
+static void _dahdi_receive_chunk(struct dahdi_span *span)
 {
 	unsigned int x;
 
-#ifdef CONFIG_DAHDI_WATCHDOG
-	span->watchcounter--;
-#endif
+	dahdi_mix_begin();
 	for (x = 0; x < span->channels; x++) {
 		struct dahdi_chan *const chan = span->chans[x];
+		/* Idle channels have nothing queued and no timers to run */
+		if (!test_bit(x, span->active_chans))
+			continue;
 		spin_lock(&chan->lock);
 		if (should_skip_receive(chan)) {
 			spin_unlock(&chan->lock);
@@ -10216,9 +13107,36 @@ int _dahdi_receive(struct dahdi_span *span)
 #endif
 		spin_unlock(&chan->lock);
 	}
+	dahdi_ced_flush();
+	dahdi_digit_flush();
+	dahdi_mix_end();
+}
+
+int _dahdi_receive(struct dahdi_span *span)
+{
+	const int chunks = dahdi_span_chunks(span);
+	const u64 start = dahdi_prof_start();
+	int c;
+
+	dahdi_prof_span_rx(span, start, chunks);
+#ifdef CONFIG_DAHDI_WATCHDOG
+	span->watchcounter--;
+#endif
+	for (c = 0; c < chunks; c++) {
+		if (c)
+			dahdi_span_seek_chunk(span, DAHDI_CHUNKSIZE);
+		_dahdi_receive_chunk(span);
+	}
+	if (chunks > 1)
+		dahdi_span_seek_chunk(span, -(chunks - 1) * DAHDI_CHUNKSIZE);
+	/* The master span pass has a histogram of its own */
+	dahdi_prof_end(DAHDI_PROF_RECEIVE, start);
 
+	/* The chunks just received wait in the conference queues, so the
+	 * master span passes for all of them run together, under one
+	 * chan_lock and FPU section. */
 	if (dahdi_is_sync_master(span))
-		_process_masterspan();
+		_process_masterspan_chunks(chunks);
 
 	return 0;
 }
@@ -10238,12 +13156,33 @@ MODULE_PARM_DESC(debug, "Sets debugging verbosity as a bitfield, to see"\
 		" this to 32");
 module_param(deftaps, int, 0644);
 
+module_param(ec_pool, int, 0444);
+MODULE_PARM_DESC(ec_pool, "Echo canceler instances each pooling software echo canceler preallocates.");
+
 module_param(max_pseudo_channels, int, 0644);
 MODULE_PARM_DESC(max_pseudo_channels, "Maximum number of pseudo channels.");
 
 module_param(hwec_overrides_swec, int, 0644);
 MODULE_PARM_DESC(hwec_overrides_swec, "When true, a hardware echo canceller is used instead of configured SWEC.");
 
+module_param(masterspan_shards, int, 0444);
+MODULE_PARM_DESC(masterspan_shards,
+		 "Split conference and pseudo channel processing of each tick over this many CPUs (0 or 1 to disable).");
+
+#ifdef CONFIG_DAHDI_CORE_TIMER
+module_param(hires_core_timer, int, 0444);
+MODULE_PARM_DESC(hires_core_timer,
+		 "Run the core timer on a high resolution timer that ticks every chunk instead of on jiffies.");
+#endif
+
+module_param(latency_profiling, int, 0644);
+MODULE_PARM_DESC(latency_profiling,
+		 "Record latency histograms of the transmit, receive, echo cancel and master span paths (1 to enable).");
+
+module_param(simd_mix, int, 0444);
+MODULE_PARM_DESC(simd_mix,
+		 "Use SSE2/NEON for conference mixing and law conversion when built with CONFIG_DAHDI_SIMD_MIX (0 to disable).");
+
 module_param(auto_assign_spans, int, 0644);
 MODULE_PARM_DESC(auto_assign_spans,
 		 "If 1 spans will automatically have their children span and "
@@ -10354,6 +13293,7 @@ static const struct file_operations dahdi_chan_fops = {
 	.read    = dahdi_chan_read,
 	.write   = dahdi_chan_write,
 	.poll    = dahdi_chan_poll,
+	.mmap    = dahdi_chan_mmap,
 };
 
 #ifdef CONFIG_DAHDI_WATCHDOG
@@ -10432,6 +13372,8 @@ static int __init dahdi_init(void)
 	dahdi_conv_init();
 	fasthdlc_precalc();
 	rotate_sums();
+	masterspan_shards_init();
+	simd_mix_init();
 #ifdef CONFIG_DAHDI_WATCHDOG
 	watchdog_init();
 #endif
@@ -10447,6 +13389,7 @@ static int __init dahdi_init(void)
 
 failed_register_ec_factory:
 	coretimer_cleanup();
+	masterspan_shards_cleanup();
 	dahdi_sysfs_exit();
 failed_driver_init:
 	if (root_proc_entry) {
@@ -10464,9 +13407,11 @@ static inline void flush_find_master_work(void)
 static void __exit dahdi_cleanup(void)
 {
 	struct dahdi_zone *z;
+	int a;
 
 	dahdi_unregister_echocan_factory(&hwec_factory);
 	coretimer_cleanup();
+	masterspan_shards_cleanup();
 	dahdi_sysfs_exit();
 
 #ifdef CONFIG_PROC_FS
@@ -10490,6 +13435,9 @@ static void __exit dahdi_cleanup(void)
 	}
 	spin_unlock(&zone_lock);
 
+	for (a = 0; a <= DAHDI_MAX_CONF; a++)
+		kfree(conf_wbsums[a]);
+
 #ifdef CONFIG_DAHDI_WATCHDOG
 	watchdog_cleanup();
 #endif
@@ -101,6 +101,21 @@ span_attr(desc, "%s\n");
 span_attr(alarms, "0x%x\n");
 span_attr(lbo, "%d\n");
 span_attr(syncsrc, "%d\n");
+span_attr(skipped_channels, "%u\n");
+
+static BUS_ATTR_READER(rx_latency_show, dev, buf)
+{
+	return dahdi_span_latency_stats(dev_to_span(dev), buf, PAGE_SIZE);
+}
+
+static BUS_ATTR_READER(rx_jitter_show, dev, buf)
+{
+	struct dahdi_span *span = dev_to_span(dev);
+
+	if (!span->ops->rx_jitter_stats)
+		return 0;
+	return span->ops->rx_jitter_stats(span, buf, PAGE_SIZE);
+}
 
 static BUS_ATTR_READER(spantype_show, dev, buf)
 {
@@ -199,6 +214,9 @@ static struct device_attribute span_dev_attrs[] = {
 	__ATTR_RO(channels),
 	__ATTR_RO(lineconfig),
 	__ATTR_RO(linecompat),
+	__ATTR_RO(skipped_channels),
+	__ATTR_RO(rx_latency),
+	__ATTR_RO(rx_jitter),
 	__ATTR_NULL,
 };
 #else
@@ -215,6 +233,9 @@ static DEVICE_ATTR_RO(basechan);
 static DEVICE_ATTR_RO(channels);
 static DEVICE_ATTR_RO(lineconfig);
 static DEVICE_ATTR_RO(linecompat);
+static DEVICE_ATTR_RO(skipped_channels);
+static DEVICE_ATTR_RO(rx_latency);
+static DEVICE_ATTR_RO(rx_jitter);
 
 static struct attribute *span_dev_attrs[] = {
 	&dev_attr_name.attr,
@@ -230,6 +251,9 @@ static struct attribute *span_dev_attrs[] = {
 	&dev_attr_channels.attr,
 	&dev_attr_lineconfig.attr,
 	&dev_attr_linecompat.attr,
+	&dev_attr_skipped_channels.attr,
+	&dev_attr_rx_latency.attr,
+	&dev_attr_rx_jitter.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(span_dev);
@@ -255,16 +279,57 @@ static ssize_t master_span_store(struct device_driver *driver, const char *buf,
 	return count;
 }
 
+static ssize_t shard_stats_show(struct device_driver *driver, char *buf)
+{
+	return dahdi_masterspan_shard_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t core_timer_stats_show(struct device_driver *driver, char *buf)
+{
+	return dahdi_core_timer_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t latency_stats_show(struct device_driver *driver, char *buf)
+{
+	return dahdi_latency_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t ec_pool_stats_show(struct device_driver *driver, char *buf)
+{
+	return dahdi_ec_pool_stats(buf, PAGE_SIZE);
+}
+
+/* Writing anything clears the histograms */
+static ssize_t latency_stats_store(struct device_driver *driver,
+				   const char *buf, size_t count)
+{
+	dahdi_latency_stats_reset();
+	return count;
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 static struct driver_attribute dahdi_attrs[] = {
 	__ATTR(master_span, S_IRUGO | S_IWUSR, master_span_show,
 			master_span_store),
+	__ATTR_RO(shard_stats),
+	__ATTR_RO(core_timer_stats),
+	__ATTR(latency_stats, S_IRUGO | S_IWUSR, latency_stats_show,
+			latency_stats_store),
+	__ATTR_RO(ec_pool_stats),
 	__ATTR_NULL,
 };
 #else
 static DRIVER_ATTR_RW(master_span);
+static DRIVER_ATTR_RO(shard_stats);
+static DRIVER_ATTR_RO(core_timer_stats);
+static DRIVER_ATTR_RW(latency_stats);
+static DRIVER_ATTR_RO(ec_pool_stats);
 static struct attribute *dahdi_attrs[] = {
 	&driver_attr_master_span.attr,
+	&driver_attr_shard_stats.attr,
+	&driver_attr_core_timer_stats.attr,
+	&driver_attr_latency_stats.attr,
+	&driver_attr_ec_pool_stats.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(dahdi);
@@ -44,6 +44,13 @@ int dahdi_assign_span(struct dahdi_span *span, unsigned int spanno,
 int dahdi_unassign_span(struct dahdi_span *span);
 int dahdi_assign_device_spans(struct dahdi_device *ddev);
 
+int dahdi_masterspan_shard_stats(char *buf, size_t size);
+int dahdi_core_timer_stats(char *buf, size_t size);
+int dahdi_latency_stats(char *buf, size_t size);
+int dahdi_span_latency_stats(struct dahdi_span *span, char *buf, size_t size);
+void dahdi_latency_stats_reset(void);
+int dahdi_ec_pool_stats(char *buf, size_t size);
+
 static inline int get_span(struct dahdi_span *span)
 {
 	return try_module_get(span->ops->owner);
@@ -77,6 +77,7 @@ struct dahdi_dummy {
 	struct dahdi_span span;
 	struct dahdi_chan _chan;
 	struct dahdi_chan *chan;
+	int next_chunks;	/* span->chunks from the next tick on */
 #if !defined(USE_HIGHRESTIMER)
 	unsigned long calls_since_start;
 	ktime_t start_interval;
@@ -104,11 +105,20 @@ static atomic_t shutdown;
 #define DEBUG_GENERAL (1 << 0)
 #define DEBUG_TICKS   (1 << 1)
 
+/* Only changed between ticks, so that dahdi_receive() and dahdi_transmit()
+ * see the same number of chunks */
+static inline int dahdi_dummy_chunks(struct dahdi_dummy *ztd)
+{
+	ztd->span.chunks = READ_ONCE(ztd->next_chunks);
+	return ztd->span.chunks;
+}
+
 #if defined(USE_HIGHRESTIMER)
 static enum hrtimer_restart dahdi_dummy_hr_int(struct hrtimer *htmr)
 {
 	unsigned long overrun;
-	
+	const int chunks = dahdi_dummy_chunks(ztd);
+
 	/* Trigger DAHDI */
 	dahdi_receive(&ztd->span);
 	dahdi_transmit(&ztd->span);
@@ -118,7 +128,7 @@ static enum hrtimer_restart dahdi_dummy_hr_int(struct hrtimer *htmr)
 	 * We should worry if overrun is 2 or more; then we really missed 
 	 * a tick */
 	overrun = hrtimer_forward(&zaptimer, hrtimer_get_expires(htmr), 
-			ktime_set(0, DAHDI_TIME_NS));
+			ktime_set(0, DAHDI_TIME_NS * chunks));
 	if(overrun > 1) {
 		if(printk_ratelimit())
 			printk(KERN_NOTICE "dahdi_dummy: HRTimer missed %lu ticks\n", 
@@ -168,8 +178,9 @@ static void dahdi_dummy_timer(TIMER_DATA_TYPE unused)
 		return;
 	}
 
-	while (ms_since_start > ztd->calls_since_start) {
-		ztd->calls_since_start++;
+	while (ms_since_start >=
+	       ztd->calls_since_start + dahdi_dummy_chunks(ztd)) {
+		ztd->calls_since_start += ztd->span.chunks;
 		dahdi_receive(&ztd->span);
 		dahdi_transmit(&ztd->span);
 	}
@@ -181,8 +192,18 @@ static void dahdi_dummy_timer(TIMER_DATA_TYPE unused)
 }
 #endif
 
+static int dahdi_dummy_setchunksize(struct dahdi_span *span, int chunksize)
+{
+	struct dahdi_dummy *const ztd = container_of(span, struct dahdi_dummy,
+						     span);
+
+	WRITE_ONCE(ztd->next_chunks, chunksize / DAHDI_CHUNKSIZE);
+	return 0;
+}
+
 static const struct dahdi_span_ops dummy_ops = {
 	.owner = THIS_MODULE,
+	.setchunksize = dahdi_dummy_setchunksize,
 };
 
 static int dahdi_dummy_initialize(struct dahdi_dummy *ztd)
@@ -204,6 +225,8 @@ static int dahdi_dummy_initialize(struct dahdi_dummy *ztd)
 	ztd->span.deflaw = DAHDI_LAW_MULAW;
 	ztd->chan->pvt = ztd;
 	ztd->span.ops = &dummy_ops;
+	ztd->span.chunks = 1;
+	ztd->next_chunks = 1;
 	list_add_tail(&ztd->span.device_node, &ztd->ddev->spans);
 	res = dahdi_register_device(ztd->ddev, NULL);
 	return res;
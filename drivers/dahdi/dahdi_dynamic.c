@@ -32,6 +32,9 @@
 #include <linux/sched.h>
 #include <linux/interrupt.h>
 #include <linux/moduleparam.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
 
 #include <dahdi/kernel.h>
 
@@ -72,6 +75,18 @@
 #define DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT	(1 << 1)
 #define DAHDI_DYNAMIC_FLAG_LOOPBACK		(1 << 2)
 
+/* Frames (a sample of every channel) the receive jitter buffer can hold */
+#define DAHDI_DYNAMIC_JB_FRAMES		(32 * DAHDI_CHUNKSIZE)
+/* Ticks between two slips or stuffs, and the time constant of the fill
+ * level they follow */
+#define DAHDI_DYNAMIC_JB_HOLD		64
+/* Ticks the drift of the other end is measured over */
+#define DAHDI_DYNAMIC_JB_WINDOW		16384
+/* Most lost messages in a row filled in */
+#define DAHDI_DYNAMIC_JB_CONCEAL	4
+/* Bigger jumps of the message counter are taken as a restart */
+#define DAHDI_DYNAMIC_SEQ_RESYNC	1000
+
 #define ERR_NSAMP			(1 << 16)
 #define ERR_NCHAN			(1 << 17)
 #define ERR_LEN				(1 << 18)
@@ -101,6 +116,9 @@ static LIST_HEAD(driver_list);
 
 static int debug = 0;
 
+/* Least chunks buffered on top of a message before playing out */
+static int jitter = 1;
+
 static int hasmaster = 0;
 
 static void checkmaster(void)
@@ -138,16 +156,47 @@ static void checkmaster(void)
 		printk(KERN_INFO "TDMoX: No master.\n");
 }
 
+/* Offset of the channel data in a message of a span with nchans channels */
+static inline int dahdi_dynamic_hdrlen(int nchans)
+{
+	return 6 + ((nchans + 3) / 4) * 2;
+}
+
 static void dahdi_dynamic_sendmessage(struct dahdi_dynamic *d)
 {
-	unsigned char *buf = d->msgbuf;
+	const int hdrlen = dahdi_dynamic_hdrlen(d->span.channels);
+	unsigned char *buf;
+	unsigned char *data;
 	unsigned short bits;
 	int msglen = 0;
 	int x;
 	int offset;
+	int nsamp;
+
+	/* Collect a chunk per run, send once the message is full */
+	if (!d->txpos) {
+		d->txchunks = READ_ONCE(d->chunks);
+		d->txbuf = NULL;
+		if (d->driver->getbuf) {
+			d->txbuf = d->driver->getbuf(d, hdrlen +
+				d->span.channels * d->txchunks * DAHDI_CHUNKSIZE);
+		}
+		if (!d->txbuf)
+			d->txbuf = d->msgbuf;
+	}
+	buf = d->txbuf;
+	data = buf + hdrlen;
+	nsamp = d->txchunks * DAHDI_CHUNKSIZE;
+	for (x = 0; x < d->span.channels; x++) {
+		memcpy(data + x * nsamp + d->txpos * DAHDI_CHUNKSIZE,
+		       d->chans[x]->writechunk, DAHDI_CHUNKSIZE);
+	}
+	if (++d->txpos < d->txchunks)
+		return;
+	d->txpos = 0;
 
 	/* Byte 0: Number of samples per channel */
-	*buf = DAHDI_CHUNKSIZE;
+	*buf = nsamp;
 	buf++; msglen++;
 
 	/* Byte 1: Flags */
@@ -188,14 +237,364 @@ static void dahdi_dynamic_sendmessage(struct dahdi_dynamic *d)
 		buf++; msglen++;
 	}
 	
-	for (x = 0; x < d->span.channels; x++) {
-		memcpy(buf, d->chans[x]->writechunk, DAHDI_CHUNKSIZE);
-		buf += DAHDI_CHUNKSIZE;
-		msglen += DAHDI_CHUNKSIZE;
+	/* The data is in place already */
+	msglen += d->span.channels * nsamp;
+
+	if (d->txbuf != d->msgbuf)
+		d->driver->sendbuf(d, d->txbuf, msglen);
+	else
+		d->driver->transmit(d, d->msgbuf, msglen);
+}
+
+/* The frame i frames after the head of the jitter buffer */
+static inline unsigned char *dahdi_dynamic_jb_frame(struct dahdi_dynamic *d,
+						    int i)
+{
+	return d->jb.buf + ((d->jb.head + i) % DAHDI_DYNAMIC_JB_FRAMES) *
+		d->span.channels;
+}
+
+/*
+ * A message that arrived after later ones goes into the frames that were
+ * filled in for it, as long as none of them has been played out yet. That
+ * takes every message from it to the last one to have frames in the
+ * buffer, all of the same length. Called with jb.lock held.
+ */
+static bool dahdi_dynamic_jb_insert(struct dahdi_dynamic *d, int idx,
+				    const unsigned char *msg, int nsamp)
+{
+	struct dahdi_dynamic_jb *const jb = &d->jb;
+	const unsigned long mask = GENMASK(idx, 0);
+	const int nchans = d->span.channels;
+	unsigned char *frame;
+	int start;
+	int pos, x;
+
+	if (jb->master || nsamp != jb->lastlen || (jb->filled & mask) != mask)
+		return false;
+	start = jb->fill - (idx + 1) * nsamp;
+	if (start < 0)
+		return false;
+
+	for (pos = 0; pos < nsamp; pos++) {
+		frame = dahdi_dynamic_jb_frame(d, start + pos);
+		for (x = 0; x < nchans; x++)
+			frame[x] = msg[x * nsamp + pos];
 	}
-	
-	d->driver->transmit(d, d->msgbuf, msglen);
-	
+	return true;
+}
+
+/*
+ * Check the counter of a message. Returns how many messages are missing
+ * before it, or -1 if it should not be handled any further: because it
+ * was seen already, or comes after later ones. In the latter case its
+ * samples are still used if their place in the buffer has not been played
+ * out yet. Called with jb.lock held.
+ */
+static int dahdi_dynamic_rx_seq(struct dahdi_dynamic *d, unsigned short rxpos,
+				const unsigned char *msg, int nsamp)
+{
+	struct dahdi_dynamic_jb *const jb = &d->jb;
+	int diff = (short)(rxpos - d->rxcnt);
+	int idx;
+
+	if (diff < 0 && diff >= -BITS_PER_LONG) {
+		idx = -diff - 1;
+		if (test_bit(idx, &jb->seen)) {
+			jb->duplicate++;
+		} else {
+			__set_bit(idx, &jb->seen);
+			if (dahdi_dynamic_jb_insert(d, idx, msg, nsamp))
+				jb->reordered++;
+			else
+				jb->late++;
+			/* Counted when its successor came */
+			if (jb->lost)
+				jb->lost--;
+		}
+		return -1;
+	}
+	if (diff < 0 || diff > DAHDI_DYNAMIC_SEQ_RESYNC) {
+		/* The other end restarted, or we did */
+		if (debug) {
+			printk(KERN_NOTICE "Span %s: Expected seq no %d, but received %d instead\n",
+			       d->span.name, d->rxcnt, rxpos);
+		}
+		diff = 0;
+		jb->seen = 0;
+		jb->filled = 0;
+	}
+	jb->lost += diff;
+	if (diff + 1 < BITS_PER_LONG) {
+		jb->seen = (jb->seen << (diff + 1)) | 1;
+		jb->filled <<= diff + 1;
+	} else {
+		jb->seen = 1;
+		jb->filled = 0;
+	}
+	d->rxcnt = rxpos + 1;
+	return diff;
+}
+
+/* Make room for a frame at the tail and return it */
+static unsigned char *dahdi_dynamic_jb_push(struct dahdi_dynamic *d)
+{
+	struct dahdi_dynamic_jb *const jb = &d->jb;
+
+	if (jb->fill == DAHDI_DYNAMIC_JB_FRAMES) {
+		/* Full, drop the oldest */
+		jb->head = (jb->head + 1) % DAHDI_DYNAMIC_JB_FRAMES;
+		jb->fill--;
+	}
+	return dahdi_dynamic_jb_frame(d, jb->fill++);
+}
+
+/*
+ * Spans that are not the timing master get their messages at whatever pace
+ * the network delivers them, several chunks at once with multi-chunk
+ * messages. Their samples are queued here and played out a chunk per tick
+ * by dahdi_dynamic_playout().
+ */
+static void dahdi_dynamic_jb_put(struct dahdi_dynamic *d,
+				 const unsigned char *msg, int nsamp,
+				 int missing)
+{
+	struct dahdi_dynamic_jb *const jb = &d->jb;
+	const int nchans = d->span.channels;
+	unsigned long flags;
+	unsigned char *frame;
+	const unsigned char *last;
+	int margin;
+	int dev;
+	int pos, x;
+
+	spin_lock_irqsave(&jb->lock, flags);
+
+	/* Arrivals were timed by the local clock while it was the master,
+	 * and what is buffered was queued for the playout timer */
+	if (jb->master) {
+		jb->master = 0;
+		jb->lastlen = 0;
+		jb->drift_valid = 0;
+		jb->fill = 0;
+		jb->filled = 0;
+		jb->playing = 0;
+	}
+
+	/* Arrival jitter as in RFC 3550: how far off the pace of the
+	 * messages before it this one came, in frames */
+	if (jb->lastlen) {
+		dev = (int)(jb->ticks - jb->arrival) * DAHDI_CHUNKSIZE -
+			jb->lastlen * (missing + 1);
+		jb->jitter += (abs(dev) * 256 - jb->jitter) / 16;
+	}
+	jb->arrival = jb->ticks;
+	/* Where earlier messages are can only be told while they are all
+	 * of the same length */
+	if (nsamp != jb->lastlen)
+		jb->filled = 0;
+	jb->lastlen = nsamp;
+
+	/* A message plus twice the jitter, at least the jitter parameter */
+	margin = max(max(jitter, 0) * DAHDI_CHUNKSIZE,
+		     (2 * jb->jitter + 255) / 256);
+	jb->target = min(nsamp + margin, DAHDI_DYNAMIC_JB_FRAMES - nsamp);
+
+	if (jb->fill + (missing + 1) * nsamp > DAHDI_DYNAMIC_JB_FRAMES)
+		jb->overruns++;
+
+	/* Fill in for a few lost messages by repeating the last sample, to
+	 * keep the pace */
+	if (missing && missing <= DAHDI_DYNAMIC_JB_CONCEAL && jb->fill) {
+		for (pos = 0; pos < missing * nsamp; pos++) {
+			last = dahdi_dynamic_jb_frame(d, jb->fill - 1);
+			frame = dahdi_dynamic_jb_push(d);
+			if (frame != last)
+				memcpy(frame, last, nchans);
+		}
+		/* Should they turn up after all */
+		jb->filled |= GENMASK(missing, 1);
+	} else if (missing) {
+		jb->filled = 0;
+	}
+
+	for (pos = 0; pos < nsamp; pos++) {
+		frame = dahdi_dynamic_jb_push(d);
+		for (x = 0; x < nchans; x++)
+			frame[x] = msg[x * nsamp + pos];
+	}
+	jb->filled |= 1;
+	spin_unlock_irqrestore(&jb->lock, flags);
+}
+
+/*
+ * Keep the fill level, averaged over the sawtooth of message arrivals, at
+ * half a message under the target, by playing out one sample less (a stuff)
+ * or one more (a slip) than a chunk now and then. Returns the frames to
+ * play out. Called with jb.lock held.
+ */
+static int dahdi_dynamic_jb_adjust(struct dahdi_dynamic_jb *jb)
+{
+	const int setpoint = (jb->target - jb->lastlen / 2) * 256;
+
+	jb->avg += (jb->fill * 256 - jb->avg) / DAHDI_DYNAMIC_JB_HOLD;
+	if (jb->hold) {
+		jb->hold--;
+		return DAHDI_CHUNKSIZE;
+	}
+	if (jb->avg > setpoint + DAHDI_CHUNKSIZE * 256 &&
+	    jb->fill > DAHDI_CHUNKSIZE) {
+		jb->hold = DAHDI_DYNAMIC_JB_HOLD;
+		jb->slips++;
+		return DAHDI_CHUNKSIZE + 1;
+	}
+	if (jb->avg < setpoint - DAHDI_CHUNKSIZE * 256) {
+		jb->hold = DAHDI_DYNAMIC_JB_HOLD;
+		jb->stuffs++;
+		return DAHDI_CHUNKSIZE - 1;
+	}
+	return DAHDI_CHUNKSIZE;
+}
+
+/*
+ * The frames played out over a window, corrected by the change of the
+ * averaged fill, are the frames the other end sent in that time. Called
+ * with jb.lock held.
+ */
+static void dahdi_dynamic_jb_drift(struct dahdi_dynamic_jb *jb, int frames)
+{
+	s64 sent, played;
+
+	jb->wframes += frames;
+	if (++jb->wticks < DAHDI_DYNAMIC_JB_WINDOW)
+		return;
+	sent = (s64)jb->wframes * 256 + jb->avg - jb->wavg;
+	played = (s64)DAHDI_DYNAMIC_JB_WINDOW * DAHDI_CHUNKSIZE * 256;
+	jb->drift = div_s64((sent - played) * 1000000000LL, played);
+	jb->drift_valid = 1;
+	jb->wticks = 0;
+	jb->wframes = 0;
+	jb->wavg = jb->avg;
+}
+
+/*
+ * The timing master is not buffered: its messages are what drives the
+ * tick, so they cannot be timed in ticks. Time them by the local clock
+ * instead for the same jitter figure. The drift is how the least transit
+ * offset, that of the message least delayed by queueing, moves from one
+ * window to the next. Called with jb.lock held.
+ */
+static void dahdi_dynamic_master_arrival(struct dahdi_dynamic_jb *jb,
+					 int nsamp, int missing)
+{
+	const u64 window = (u64)DAHDI_DYNAMIC_JB_WINDOW * NSEC_PER_MSEC;
+	const u64 now = ktime_get_ns();
+	s64 offset, dev;
+
+	/* Tick based figures do not carry over, and a second without
+	 * messages is an outage rather than drift */
+	if (!jb->master || now - jb->rxtime > NSEC_PER_SEC) {
+		jb->master = 1;
+		jb->lastlen = 0;
+		jb->drift_valid = 0;
+		jb->pmin_valid = 0;
+		jb->rxframes = 0;
+		jb->wstart = now;
+		jb->wmin = S64_MAX;
+	}
+
+	if (jb->lastlen) {
+		/* In 1/256 frames */
+		dev = (s64)div_u64((now - jb->rxtime) *
+				   DAHDI_MS_TO_SAMPLES(256), NSEC_PER_MSEC) -
+		      (s64)jb->lastlen * 256 * (missing + 1);
+		if (dev < 0)
+			dev = -dev;
+		jb->jitter += (int)(dev - jb->jitter) / 16;
+	}
+	jb->rxtime = now;
+	jb->lastlen = nsamp;
+	jb->rxframes += (s64)nsamp * (missing + 1);
+
+	/* Local time less the remote time it took to send these frames */
+	offset = (s64)now - div_s64(jb->rxframes * NSEC_PER_MSEC,
+				    DAHDI_MS_TO_SAMPLES(1));
+	if (offset < jb->wmin) {
+		jb->wmin = offset;
+		jb->wmin_at = now;
+	}
+	if (now - jb->wstart < window)
+		return;
+
+	/* A remote clock running fast sends more frames a second, which
+	 * brings the offset down */
+	if (jb->pmin_valid && jb->wmin_at - jb->pmin_at >= window / 2) {
+		jb->drift = div64_s64((jb->pmin - jb->wmin) * 1000000000LL,
+				      jb->wmin_at - jb->pmin_at);
+		jb->drift_valid = 1;
+	}
+	jb->pmin = jb->wmin;
+	jb->pmin_at = jb->wmin_at;
+	jb->pmin_valid = 1;
+	jb->wstart = now;
+	jb->wmin = S64_MAX;
+}
+
+/* Copy the chunk at the head of the jitter buffer to the channels and
+ * drop frames from it. Called with jb.lock held. */
+static void dahdi_dynamic_jb_pull(struct dahdi_dynamic *d, int frames)
+{
+	struct dahdi_dynamic_jb *const jb = &d->jb;
+	const int nchans = d->span.channels;
+	unsigned char *frame;
+	int i, x;
+
+	for (i = 0; i < DAHDI_CHUNKSIZE; i++) {
+		frame = dahdi_dynamic_jb_frame(d, i);
+		for (x = 0; x < nchans; x++)
+			d->chans[x]->readchunk[i] = frame[x];
+	}
+	jb->head = (jb->head + frames) % DAHDI_DYNAMIC_JB_FRAMES;
+	jb->fill -= frames;
+}
+
+/* Receive the next chunk of the jitter buffer, once per tick */
+static void dahdi_dynamic_playout(struct dahdi_dynamic *d)
+{
+	struct dahdi_dynamic_jb *const jb = &d->jb;
+	unsigned long flags;
+	int frames;
+
+	spin_lock_irqsave(&jb->lock, flags);
+	jb->ticks++;
+	if (!jb->playing) {
+		/* Refill to the target first, so that the next message
+		 * arrives before this one has been played out */
+		if (!jb->fill || jb->fill < jb->target) {
+			spin_unlock_irqrestore(&jb->lock, flags);
+			return;
+		}
+		jb->playing = 1;
+		jb->avg = jb->fill * 256;
+		jb->hold = DAHDI_DYNAMIC_JB_HOLD;
+		jb->wticks = 0;
+		jb->wframes = 0;
+		jb->wavg = jb->avg;
+	}
+	if (jb->fill < DAHDI_CHUNKSIZE) {
+		jb->playing = 0;
+		jb->underruns++;
+		spin_unlock_irqrestore(&jb->lock, flags);
+		return;
+	}
+
+	frames = dahdi_dynamic_jb_adjust(jb);
+	dahdi_dynamic_jb_pull(d, frames);
+	dahdi_dynamic_jb_drift(jb, frames);
+	spin_unlock_irqrestore(&jb->lock, flags);
+
+	dahdi_ec_span(&d->span);
+	dahdi_receive(&d->span);
 }
 
 static void __dahdi_dynamic_run(void)
@@ -207,6 +606,8 @@ static void __dahdi_dynamic_run(void)
 
 	rcu_read_lock();
 	list_for_each_entry_rcu(d, &dspan_list, list) {
+		if (!d->master)
+			dahdi_dynamic_playout(d);
 		dahdi_transmit(&d->span);
 		/* Handle all transmissions now */
 		dahdi_dynamic_sendmessage(d);
@@ -254,6 +655,80 @@ static inline struct dahdi_dynamic *dynamic_from_span(struct dahdi_span *span)
 	return container_of(span, struct dahdi_dynamic, span);
 }
 
+/*
+ * Plays out the chunks of the timing master's messages, the first one as
+ * the message arrives and the rest a chunk time apart, so that a message
+ * of several chunks still gives evenly spaced ticks. Chunks of a message
+ * that have not been played out by the time the next one arrives are
+ * overdue, and go out at once.
+ */
+static enum hrtimer_restart dahdi_dynamic_master_tick(struct hrtimer *timer)
+{
+	struct dahdi_dynamic *const d = container_of(timer, struct dahdi_dynamic,
+						     playout);
+	struct dahdi_dynamic_jb *const jb = &d->jb;
+	unsigned long flags;
+	int chunks;
+
+	spin_lock_irqsave(&jb->lock, flags);
+	chunks = max(jb->due, 1);
+	jb->due = 0;
+	while (chunks-- && jb->master && jb->fill >= DAHDI_CHUNKSIZE) {
+		dahdi_dynamic_jb_pull(d, DAHDI_CHUNKSIZE);
+		spin_unlock_irqrestore(&jb->lock, flags);
+
+		dahdi_ec_span(&d->span);
+		dahdi_receive(&d->span);
+		/* This is our master span, so run everything */
+		dahdi_dynamic_run();
+
+		spin_lock_irqsave(&jb->lock, flags);
+	}
+	if (!jb->master || jb->fill < DAHDI_CHUNKSIZE) {
+		jb->timed = 0;
+		spin_unlock_irqrestore(&jb->lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	spin_unlock_irqrestore(&jb->lock, flags);
+
+	hrtimer_forward_now(timer, ns_to_ktime(DAHDI_MSECS_PER_CHUNK *
+					       NSEC_PER_MSEC));
+	return HRTIMER_RESTART;
+}
+
+/* Queue a message of the timing master for dahdi_dynamic_master_tick() */
+static void dahdi_dynamic_master_put(struct dahdi_dynamic *d,
+				     const unsigned char *msg, int nsamp,
+				     int missing)
+{
+	struct dahdi_dynamic_jb *const jb = &d->jb;
+	const int nchans = d->span.channels;
+	unsigned long flags;
+	unsigned char *frame;
+	bool start;
+	int pos, x;
+
+	spin_lock_irqsave(&jb->lock, flags);
+	/* Left from before it became the master */
+	if (!jb->master)
+		jb->fill = 0;
+	dahdi_dynamic_master_arrival(jb, nsamp, missing);
+
+	jb->due = jb->fill / DAHDI_CHUNKSIZE + 1;
+	for (pos = 0; pos < nsamp; pos++) {
+		frame = dahdi_dynamic_jb_push(d);
+		for (x = 0; x < nchans; x++)
+			frame[x] = msg[x * nsamp + pos];
+	}
+	start = !jb->timed;
+	jb->timed = 1;
+	spin_unlock_irqrestore(&jb->lock, flags);
+
+	/* A running timer picks up the overdue chunks on its next tick */
+	if (start)
+		hrtimer_start(&d->playout, 0, HRTIMER_MODE_REL);
+}
+
 void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msglen)
 {
 	struct dahdi_dynamic *dtd = dynamic_from_span(span);
@@ -262,8 +737,11 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	int xlen;
 	int x, bits, sig;
 	int nchans, master;
+	int nsamp;
 	int newalarm;
-	unsigned short rxpos, rxcnt;
+	int missing;
+	unsigned long flags;
+	unsigned short rxpos;
 
 	rcu_read_lock();
 
@@ -276,12 +754,15 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 		return;
 	}
 	
-	/* First, check the chunksize */
-	if (unlikely(*msg != DAHDI_CHUNKSIZE)) {
+	/* First, check the chunksize.  Any number of whole chunks is fine,
+	 * whatever we send ourselves. */
+	nsamp = *msg;
+	if (unlikely(!nsamp || (nsamp % DAHDI_CHUNKSIZE) ||
+		     (nsamp > DAHDI_MAX_SPAN_CHUNKSIZE))) {
 		rcu_read_unlock();
 		newerr = ERR_NSAMP | msg[0];
 		if (newerr != dtd->err)
-			printk(KERN_NOTICE "Span %s: Expected %d samples, but receiving %d\n", span->name, DAHDI_CHUNKSIZE, msg[0]);
+			printk(KERN_NOTICE "Span %s: Expected a multiple of %d samples, but receiving %d\n", span->name, DAHDI_CHUNKSIZE, msg[0]);
 		dtd->err = newerr;
 		return;
 	}
@@ -311,7 +792,7 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	/* Start with header */
 	xlen = 6;
 	/* Add samples of audio */
-	xlen += nchans * DAHDI_CHUNKSIZE;
+	xlen += nchans * nsamp;
 	/* If RBS info is there, add that */
 	if (sflags & DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT) {
 		/* Account for sigbits -- one short per 4 channels*/
@@ -327,6 +808,17 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 		return;
 	}
 
+	/* Drop duplicates, and messages overtaken by later ones once
+	 * their samples, which come last, are in place */
+	spin_lock_irqsave(&dtd->jb.lock, flags);
+	missing = dahdi_dynamic_rx_seq(dtd, rxpos,
+				       msg + xlen - 6 - nchans * nsamp, nsamp);
+	spin_unlock_irqrestore(&dtd->jb.lock, flags);
+	if (missing < 0) {
+		rcu_read_unlock();
+		return;
+	}
+
 	bits = 0;
 
 	/* Record sigbits if present */
@@ -349,16 +841,7 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 		}
 	}
 	
-	/* Record data for channels */
-	for (x=0;x<nchans;x++) {
-		memcpy(span->chans[x]->readchunk, msg, DAHDI_CHUNKSIZE);
-		msg += DAHDI_CHUNKSIZE;
-	}
-
 	master = dtd->master;
-	
-	rxcnt = dtd->rxcnt;
-	dtd->rxcnt = rxpos+1;
 
 	/* Keep track of last received packet */
 	dtd->rxjif = jiffies;
@@ -376,16 +859,11 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 		checkmaster();
 	}
 
-	/* note if we had a missing packet */
-	if (unlikely(rxpos != rxcnt))
-		printk(KERN_NOTICE "Span %s: Expected seq no %d, but received %d instead\n", span->name, rxcnt, rxpos);
-
-	dahdi_ec_span(span);
-	dahdi_receive(span);
-
-	/* If this is our master span, then run everything */
+	/* The master sets the pace */
 	if (master)
-		dahdi_dynamic_run();
+		dahdi_dynamic_master_put(dtd, msg, nsamp, missing);
+	else
+		dahdi_dynamic_jb_put(dtd, msg, nsamp, missing);
 }
 EXPORT_SYMBOL(dahdi_dynamic_receive);
 
@@ -403,6 +881,7 @@ static void dahdi_dynamic_release(struct kref *kref)
 	WARN_ON(test_bit(DAHDI_FLAGBIT_REGISTERED, &d->span.flags));
 
 	kfree(d->msgbuf);
+	kfree(d->jb.buf);
 
 	for (x = 0; x < d->span.channels; x++)
 		kfree(d->chans[x]);
@@ -472,16 +951,24 @@ static int _destroy_dynamic(struct dahdi_dynamic_span *dds)
 		return -EBUSY;
 	}
 
+	if (d->pvt && d->driver && d->driver->destroy &&
+	    !try_module_get(d->driver->owner)) {
+		/* The driver for this device is in the process of
+		 * unloading. Leave this dynamic on the list so it's
+		 * cleaned up when the driver unregisters. */
+		dynamic_put(d);
+		return -ENXIO;
+	}
+
+	/* Stop sending first: a message may be under construction in a
+	 * buffer of the driver (see getbuf) */
+	spin_lock_irqsave(&dspan_lock, flags);
+	list_del_rcu(&d->list);
+	spin_unlock_irqrestore(&dspan_lock, flags);
+	synchronize_rcu();
+
 	if (d->pvt) {
 		if (d->driver && d->driver->destroy) {
-			if (!try_module_get(d->driver->owner)) {
-				/* The driver for this device is in the
-				 * process of unloading. Leave this dynamic on
-				 * the list so it's cleaned up when the driver
-				 * unregisters. */
-				 dynamic_put(d);
-				 return -ENXIO;
-			}
 			d->driver->destroy(d);
 			module_put(d->driver->owner);
 		} else {
@@ -489,14 +976,11 @@ static int _destroy_dynamic(struct dahdi_dynamic_span *dds)
 		}
 		d->pvt = NULL;
 	}
+	/* Nothing can queue master chunks any more */
+	hrtimer_cancel(&d->playout);
 
 	dahdi_unregister_device(d->ddev);
 
-	spin_lock_irqsave(&dspan_lock, flags);
-	list_del_rcu(&d->list);
-	spin_unlock_irqrestore(&dspan_lock, flags);
-	synchronize_rcu();
-
 	/* One since we've removed the item from the list... */
 	dynamic_put(d);
 	/* ...and one for find_dynamic. */
@@ -534,6 +1018,21 @@ static int dahdi_dynamic_chanconfig(struct file *file,
 	return 0;
 }
 
+static int dahdi_dynamic_setchunksize(struct dahdi_span *span, int chunksize)
+{
+	struct dahdi_dynamic *d = dynamic_from_span(span);
+	int res;
+
+	if (!d->driver->setchunksize)
+		return -EOPNOTSUPP;
+	res = d->driver->setchunksize(d, chunksize);
+	if (res)
+		return res;
+	/* Picked up by the next message, see dahdi_dynamic_sendmessage() */
+	WRITE_ONCE(d->chunks, chunksize / DAHDI_CHUNKSIZE);
+	return 0;
+}
+
 static int dahdi_dynamic_close(struct dahdi_chan *chan)
 {
 	struct dahdi_dynamic *d = dynamic_from_span(chan->span);
@@ -560,13 +1059,54 @@ static void dahdi_dynamic_sync_tick(struct dahdi_span *span, int is_master)
 	return;
 }
 
+static int dahdi_dynamic_rx_jitter_stats(struct dahdi_span *span, char *buf,
+					 size_t size)
+{
+	struct dahdi_dynamic *d = dynamic_from_span(span);
+	struct dahdi_dynamic_jb *const jb = &d->jb;
+	unsigned long flags;
+	char drift[24] = "-";
+	int len;
+
+	spin_lock_irqsave(&jb->lock, flags);
+	if (jb->drift_valid) {
+		snprintf(drift, sizeof(drift), "%s%d.%03d",
+			 jb->drift < 0 ? "-" : "", abs(jb->drift) / 1000,
+			 abs(jb->drift) % 1000);
+	}
+	/* The master is not buffered, its arrivals are timed by the local
+	 * clock rather than by ticks */
+	if (d->master) {
+		len = scnprintf(buf, size,
+				"mode: master\ntimed_by: local clock\n"
+				"depth: -\ntarget: -\n");
+	} else {
+		len = scnprintf(buf, size,
+				"mode: buffered\ntimed_by: ticks\n"
+				"depth: %d\ntarget: %d\n", jb->fill, jb->target);
+	}
+	len += scnprintf(buf + len, size - len,
+			 "jitter: %d.%d\ndrift_ppm: %s\n",
+			 jb->jitter / 256, (jb->jitter % 256) * 10 / 256, drift);
+	len += scnprintf(buf + len, size - len,
+			 "late: %u\nlost: %u\nduplicate: %u\nreordered: %u\n",
+			 jb->late, jb->lost, jb->duplicate, jb->reordered);
+	len += scnprintf(buf + len, size - len,
+			 "underruns: %u\noverruns: %u\nslips: %u\nstuffs: %u\n",
+			 jb->underruns, jb->overruns, jb->slips, jb->stuffs);
+	spin_unlock_irqrestore(&jb->lock, flags);
+	return len;
+}
+
 static const struct dahdi_span_ops dynamic_ops = {
 	.owner = THIS_MODULE,
 	.rbsbits = dahdi_dynamic_rbsbits,
 	.open = dahdi_dynamic_open,
 	.close = dahdi_dynamic_close,
 	.chanconfig = dahdi_dynamic_chanconfig,
+	.setchunksize = dahdi_dynamic_setchunksize,
 	.sync_tick = dahdi_dynamic_sync_tick,
+	.rx_jitter_stats = dahdi_dynamic_rx_jitter_stats,
 };
 
 static int _create_dynamic(struct dahdi_dynamic_span *dds)
@@ -612,7 +1152,8 @@ static int _create_dynamic(struct dahdi_dynamic_span *dds)
 	}
 
 	/* Allocate message buffer with sample space and header space */
-	bufsize = dds->numchans * DAHDI_CHUNKSIZE + dds->numchans / 4 + 48;
+	bufsize = dds->numchans * DAHDI_MAX_SPAN_CHUNKSIZE +
+		  dds->numchans / 4 + 48;
 
 	d->msgbuf = kzalloc(bufsize, GFP_KERNEL);
 
@@ -620,11 +1161,22 @@ static int _create_dynamic(struct dahdi_dynamic_span *dds)
 		dynamic_put(d);
 		return -ENOMEM;
 	}
+
+	d->jb.buf = kzalloc(dds->numchans * DAHDI_DYNAMIC_JB_FRAMES,
+			    GFP_KERNEL);
+	if (!d->jb.buf) {
+		dynamic_put(d);
+		return -ENOMEM;
+	}
+	spin_lock_init(&d->jb.lock);
+	hrtimer_init(&d->playout, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	d->playout.function = dahdi_dynamic_master_tick;
 	
 	/* Setup parameters properly assuming we're going to be okay. */
 	strlcpy(d->dname, dds->driver, sizeof(d->dname));
 	strlcpy(d->addr, dds->addr, sizeof(d->addr));
 	d->timing = dds->timing;
+	d->chunks = 1;
 	snprintf(d->span.name, sizeof(d->span.name), "DYN/%s/%s",
 		 dds->driver, dds->addr);
 	snprintf(d->span.desc, sizeof(d->span.desc),
@@ -781,7 +1333,7 @@ int dahdi_dynamic_register_driver(struct dahdi_dynamic_driver *dri)
 	unsigned long flags;
 	int res = 0;
 
-	if (!dri->owner)
+	if (!dri->owner || (dri->getbuf && !dri->sendbuf))
 		return -EINVAL;
 
 	if (find_driver(dri->name)) {
@@ -804,17 +1356,18 @@ void dahdi_dynamic_unregister_driver(struct dahdi_dynamic_driver *dri)
 
 	list_for_each_entry_safe(d, n, &dspan_list, list) {
 		if (d->driver == dri) {
+			spin_lock_irqsave(&dspan_lock, flags);
+			list_del_rcu(&d->list);
+			spin_unlock_irqrestore(&dspan_lock, flags);
+			synchronize_rcu();
 			if (d->pvt) {
 				if (d->driver && d->driver->destroy)
 					d->driver->destroy(d);
 				else
 					WARN_ON(1);
 			}
+			hrtimer_cancel(&d->playout);
 			dahdi_unregister_device(d->ddev);
-			spin_lock_irqsave(&dspan_lock, flags);
-			list_del_rcu(&d->list);
-			spin_unlock_irqrestore(&dspan_lock, flags);
-			synchronize_rcu();
 			d->driver = NULL;
 			dynamic_put(d);
 		}
@@ -902,6 +1455,8 @@ static void dahdi_dynamic_cleanup(void)
 }
 
 module_param(debug, int, 0600);
+module_param(jitter, int, 0644);
+MODULE_PARM_DESC(jitter, "Least chunks (ms) a span that is not the timing master buffers on top of the chunks of a message before playing them out. The buffer grows beyond that with the measured jitter.");
 
 MODULE_DESCRIPTION("DAHDI Dynamic Span Support");
 MODULE_AUTHOR("Mark Spencer <markster@digium.com>");
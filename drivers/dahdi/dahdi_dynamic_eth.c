@@ -52,6 +52,8 @@ static struct ztdeth {
 	struct dahdi_span *span;
 	char ethdev[IFNAMSIZ];
 	struct net_device *dev;
+	struct sk_buff *txskb;	/* The message being built in place */
+	struct sk_buff *spare;	/* The last one sent, to be reused */
 	struct ztdeth *next;
 } *zdevs = NULL;
 
@@ -172,6 +174,140 @@ static void ztdeth_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 		spin_unlock_irqrestore(&zlock, flags);
 }
 
+/*
+ * The frame sent last, emptied, if the stack is done with it and it can
+ * take size bytes. The state it picked up on its way down (dst, conntrack,
+ * queue mapping, cb and such) is cleared as for a new skb. Called with
+ * zlock held.
+ */
+static struct sk_buff *ztdeth_recycle(struct ztdeth *z, unsigned int size)
+{
+	struct sk_buff *skb = z->spare;
+
+	if (!skb)
+		return NULL;
+	z->spare = NULL;
+	if (skb_shared(skb) || skb_cloned(skb) || skb_is_nonlinear(skb) ||
+	    skb_end_pointer(skb) - skb->head < size) {
+		/* Only drops our reference if it is still queued */
+		dev_kfree_skb_any(skb);
+		return NULL;
+	}
+	/* Whatever the last holder wrote before letting go */
+	smp_rmb();
+
+	skb_scrub_packet(skb, true);
+	skb->priority = 0;
+	skb->ip_summed = CHECKSUM_NONE;
+	skb_set_queue_mapping(skb, 0);
+	memset(skb->cb, 0, sizeof(skb->cb));
+	skb->data = skb->head;
+	skb_reset_tail_pointer(skb);
+	skb->len = 0;
+	return skb;
+}
+
+/* Have dahdi_dynamic write the message straight into the frame */
+static u8 *ztdeth_getbuf(struct dahdi_dynamic *dyn, size_t msglen)
+{
+	struct ztdeth *z;
+	struct sk_buff *skb;
+	unsigned long flags;
+	unsigned int headroom;
+	u8 *msg = NULL;
+
+	spin_lock_irqsave(&zlock, flags);
+	z = dyn->pvt;
+	if (z && z->dev) {
+		/* Left over if the device went away before it was sent */
+		if (z->txskb) {
+			dev_kfree_skb_any(z->txskb);
+			z->txskb = NULL;
+		}
+		headroom = z->dev->hard_header_len + sizeof(struct ztdeth_header);
+		skb = ztdeth_recycle(z, headroom + msglen + 32);
+		if (!skb)
+			skb = dev_alloc_skb(headroom + msglen + 32);
+		if (skb) {
+			skb_reserve(skb, headroom);
+			msg = skb_put(skb, msglen);
+			z->txskb = skb;
+		}
+	}
+	spin_unlock_irqrestore(&zlock, flags);
+	return msg;
+}
+
+static void ztdeth_sendbuf(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
+{
+	struct ztdeth *z;
+	struct sk_buff *skb = NULL;
+	struct ztdeth_header *zh;
+	unsigned long flags;
+	struct net_device *dev = NULL;
+	unsigned char addr[ETH_ALEN];
+	unsigned short subaddr; /* Network byte order */
+
+	spin_lock_irqsave(&zlock, flags);
+	z = dyn->pvt;
+	if (z) {
+		skb = z->txskb;
+		z->txskb = NULL;
+		dev = z->dev;
+	}
+	if (!skb) {
+		spin_unlock_irqrestore(&zlock, flags);
+		return;
+	}
+	if (!dev ||
+	    skb_headroom(skb) < dev->hard_header_len + sizeof(*zh)) {
+		spin_unlock_irqrestore(&zlock, flags);
+		dev_kfree_skb_any(skb);
+		return;
+	}
+	memcpy(addr, z->addr, sizeof(z->addr));
+	subaddr = z->subaddr;
+	/* Hold on to it for the next message, see ztdeth_recycle(). That
+	 * hands the device a shared skb, which only those that say they
+	 * take one get */
+	if (z->spare) {
+		dev_kfree_skb_any(z->spare);
+		z->spare = NULL;
+	}
+	if (dev->priv_flags & IFF_TX_SKB_SHARING)
+		z->spare = skb_get(skb);
+	spin_unlock_irqrestore(&zlock, flags);
+
+	/* Throw on header */
+	zh = (struct ztdeth_header *)skb_push(skb, sizeof(struct ztdeth_header));
+	zh->subaddr = subaddr;
+
+	/* Setup protocol and such */
+	skb->protocol = __constant_htons(ETH_P_DAHDI_DETH);
+	skb_set_network_header(skb, 0);
+	skb->dev = dev;
+	dev_hard_header(skb, dev, ETH_P_DAHDI_DETH, addr, dev->dev_addr, skb->len);
+	skb_queue_tail(&skbs, skb);
+}
+
+/* A message must fit in one frame, there is no fragmentation */
+static int ztdeth_setchunksize(struct dahdi_dynamic *dyn, int chunksize)
+{
+	const int nchans = dyn->span.channels;
+	const int msglen = 6 + ((nchans + 3) / 4) * 2 + nchans * chunksize;
+	struct ztdeth *z;
+	unsigned long flags;
+	int res = 0;
+
+	spin_lock_irqsave(&zlock, flags);
+	z = dyn->pvt;
+	if (z && z->dev &&
+	    msglen + sizeof(struct ztdeth_header) > z->dev->mtu)
+		res = -EMSGSIZE;
+	spin_unlock_irqrestore(&zlock, flags);
+	return res;
+}
+
 /**
  * ztdeth_flush - Flush all pending transactions.
  *
@@ -267,10 +403,15 @@ static void ztdeth_destroy(struct dahdi_dynamic *dyn)
 		prev = cur;
 		cur = cur->next;
 	}
+	if (cur == z)
+		dyn->pvt = NULL;
 	spin_unlock_irqrestore(&zlock, flags);
 
 	if (cur == z) {	/* Successfully removed */
-		dyn->pvt = NULL;
+		if (z->txskb)
+			kfree_skb(z->txskb);
+		if (z->spare)
+			kfree_skb(z->spare);
 		dev_put(z->dev);
 		printk(KERN_INFO "TDMoE: Removed interface for %s\n", z->span->name);
 		kfree(z);
@@ -384,7 +525,10 @@ static struct dahdi_dynamic_driver ztd_eth = {
 	.create = ztdeth_create,
 	.destroy = ztdeth_destroy,
 	.transmit = ztdeth_transmit,
+	.getbuf = ztdeth_getbuf,
+	.sendbuf = ztdeth_sendbuf,
 	.flush = ztdeth_flush,
+	.setchunksize = ztdeth_setchunksize,
 };
 
 static struct notifier_block ztdeth_nblock = {
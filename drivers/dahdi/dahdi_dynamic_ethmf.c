@@ -56,11 +56,18 @@
 #include <dahdi/kernel.h>
 #include <dahdi/user.h>
 
+#if defined(CONFIG_SMP) && LINUX_VERSION_CODE >= KERNEL_VERSION(3, 17, 0)
+#define ETHMF_RX_STEERING
+#include <linux/irq_work.h>
+#endif
+
 #define ETH_P_ZTDETH			0xd00d
 #define ETHMF_MAX_PER_SPAN_GROUP	8
 #define ETHMF_MAX_GROUPS		16
 #define ETHMF_FLAG_IGNORE_CHAN0	(1 << 3)
 #define ETHMF_MAX_SPANS			4
+/* Size of the trx and rcv buffers. MAX OF 31 CHANNELS!!!! */
+#define ETHMF_BUFSIZE			(31 * DAHDI_CHUNKSIZE + 31 / 4 + 48)
 
 struct ztdeth_header {
 	unsigned short subaddr;
@@ -123,6 +130,8 @@ struct ztdeth {
 	atomic_t no_front_padding;
 	/* counter to pseudo lock the rcvbuf */
 	atomic_t refcnt;
+	/* receive CPU of the span group, see rx_cpus */
+	int rx_index;
 
 	struct list_head list;
 };
@@ -137,6 +146,33 @@ static DEFINE_SPINLOCK(ethmf_lock);
  */
 static LIST_HEAD(ethmf_list);
 
+#ifdef ETHMF_RX_STEERING
+
+#define ETHMF_MAX_RX_CPUS		32
+/* Frames waiting for a receive CPU before dropping more */
+#define ETHMF_RX_QUEUE_MAX		256
+/* Frames handled per tasklet run before letting others in */
+#define ETHMF_RX_BUDGET			64
+
+/* Spread receive processing of the span groups over this many CPUs */
+static int rx_cpus;
+
+struct ethmf_rx {
+	struct sk_buff_head queue;
+	/* schedules the tasklet on cpu */
+	struct irq_work work;
+	struct tasklet_struct tasklet;
+	int cpu;
+	atomic_t frames;
+} ____cacheline_aligned_in_smp;
+
+static struct ethmf_rx ethmf_rx[ETHMF_MAX_RX_CPUS];
+static int num_rx;
+/* rx_index for the next new span group */
+static int next_rx_index;
+
+#endif
+
 static inline void ethmf_errors_inc(void)
 {
 #ifdef USE_PROC_FS
@@ -223,10 +259,9 @@ static inline int ethmf_trx_spans_ready(unsigned int addr_hash, struct ztdeth *(
 }
 
 /**
- * Ethernet receiving side processing function.
+ * Hand the spans of a received frame to dahdi_dynamic, and free it.
  */
-static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
-		struct packet_type *pt, struct net_device *orig_dev)
+static void ztdethmf_rcv_frame(struct sk_buff *skb)
 {
 	int num_spans = 0, span_index = 0;
 	unsigned char *data;
@@ -244,7 +279,7 @@ static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
 		/* Currently max of 4 spans supported */
 		if (unlikely(num_spans > ETHMF_MAX_SPANS)) {
 			kfree_skb(skb);
-			return 0;
+			return;
 		}
 
 		skb_pull(skb, sizeof(struct ztdeth_header));
@@ -286,7 +321,7 @@ static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
 				continue;
 			}
 
-			if (atomic_dec_and_test(&z->refcnt) == 0) {
+			if (atomic_inc_return(&z->refcnt) == 1) {
 				memcpy(z->rcvbuf, data + 6*span_index, 6); /* TDM Header */
 				/*
 				 * If we ignore channel zero we must skip the first eight bytes and
@@ -318,7 +353,7 @@ static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
 				ethmf_errors_inc();
 				printk(KERN_INFO "TDMoE span overflow detected. Span %d was dropped.", span_index);
 			}
-			atomic_inc(&z->refcnt);
+			atomic_dec(&z->refcnt);
 
 #ifdef USE_PROC_FS
 			if (span_index == 0) {
@@ -334,6 +369,172 @@ static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
 	}
 
 	kfree_skb(skb);
+}
+
+#ifdef ETHMF_RX_STEERING
+/**
+ * Find any span of the group with the given MAC address.
+ *
+ * NOTE: RCU read lock must already be held.
+ */
+static inline struct ztdeth *find_ethmf_group(const unsigned char *addr)
+{
+	struct ztdeth *z;
+
+	list_for_each_entry_rcu(z, &ethmf_list, list) {
+		if (!memcmp(addr, z->addr, ETH_ALEN))
+			return z;
+	}
+	return NULL;
+}
+
+/**
+ * The receive CPU for a span of the group with the given MAC address: that
+ * of the group if it has other spans already, else the next one in turn.
+ *
+ * NOTE: ethmf_lock must already be held.
+ */
+static int ethmf_rx_index(const unsigned char *addr)
+{
+	struct ztdeth *z;
+
+	if (!num_rx)
+		return -1;
+	list_for_each_entry(z, &ethmf_list, list) {
+		if (!memcmp(addr, z->addr, ETH_ALEN))
+			return z->rx_index;
+	}
+	return next_rx_index++ % num_rx;
+}
+
+static void ethmf_rx_tasklet(unsigned long data)
+{
+	struct ethmf_rx *rx = (struct ethmf_rx *)data;
+	struct sk_buff *skb;
+	int budget = ETHMF_RX_BUDGET;
+
+	while (budget-- && (skb = skb_dequeue(&rx->queue)))
+		ztdethmf_rcv_frame(skb);
+
+	if (!skb_queue_empty(&rx->queue))
+		tasklet_schedule(&rx->tasklet);
+}
+
+static void ethmf_rx_kick(struct irq_work *work)
+{
+	struct ethmf_rx *rx = container_of(work, struct ethmf_rx, work);
+
+	tasklet_schedule(&rx->tasklet);
+}
+
+/**
+ * Queue a frame for the receive CPU of its span group, and get that CPU
+ * going unless it has frames queued already.
+ */
+static void ethmf_rx_queue(struct ethmf_rx *rx, struct sk_buff *skb)
+{
+	unsigned long flags;
+	int kick;
+
+	spin_lock_irqsave(&rx->queue.lock, flags);
+	if (unlikely(skb_queue_len(&rx->queue) >= ETHMF_RX_QUEUE_MAX)) {
+		spin_unlock_irqrestore(&rx->queue.lock, flags);
+		ethmf_errors_inc();
+		kfree_skb(skb);
+		return;
+	}
+	kick = skb_queue_empty(&rx->queue);
+	__skb_queue_tail(&rx->queue, skb);
+	spin_unlock_irqrestore(&rx->queue.lock, flags);
+	atomic_inc(&rx->frames);
+
+	if (!kick)
+		return;
+	if (rx->cpu == smp_processor_id() || !cpu_online(rx->cpu))
+		tasklet_schedule(&rx->tasklet);
+	else
+		irq_work_queue_on(&rx->work, rx->cpu);
+}
+
+static void __init ethmf_rx_init(void)
+{
+	struct ethmf_rx *rx;
+	int cpu;
+	int i;
+
+	num_rx = min3(rx_cpus, (int)num_online_cpus(), ETHMF_MAX_RX_CPUS);
+	if (num_rx <= 1) {
+		num_rx = 0;
+		return;
+	}
+
+	i = 0;
+	for_each_online_cpu(cpu) {
+		if (i >= num_rx)
+			break;
+		rx = &ethmf_rx[i];
+		rx->cpu = cpu;
+		skb_queue_head_init(&rx->queue);
+		init_irq_work(&rx->work, ethmf_rx_kick);
+		tasklet_init(&rx->tasklet, ethmf_rx_tasklet, (unsigned long)rx);
+		atomic_set(&rx->frames, 0);
+		++i;
+	}
+	printk(KERN_INFO "TDMoEmf: Receive spread over %d CPUs\n", num_rx);
+}
+
+static void ethmf_rx_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < num_rx; i++) {
+		irq_work_sync(&ethmf_rx[i].work);
+		tasklet_kill(&ethmf_rx[i].tasklet);
+		skb_queue_purge(&ethmf_rx[i].queue);
+	}
+}
+#endif
+
+/**
+ * Ethernet receiving side processing function.
+ *
+ * All frames of a span group come from the same MAC address, so NIC
+ * receive hashing, where it looks at non-IP frames at all, puts them all on
+ * the same queue. With rx_cpus, frames are handed to the receive CPU of
+ * their group instead of being processed on the CPU that got them.
+ */
+static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
+		struct packet_type *pt, struct net_device *orig_dev)
+{
+#ifdef ETHMF_RX_STEERING
+	struct ztdeth *z;
+	int rx_index = -1;
+#endif
+
+	/* We pull the header off it below */
+	skb = skb_share_check(skb, GFP_ATOMIC);
+	if (unlikely(!skb))
+		return 0;
+
+#ifdef ETHMF_RX_STEERING
+	if (num_rx) {
+		rcu_read_lock();
+		z = find_ethmf_group(eth_hdr(skb)->h_source);
+		if (z)
+			rx_index = z->rx_index;
+		rcu_read_unlock();
+
+		if (unlikely(rx_index < 0)) {
+			/* Not from any of our span groups */
+			kfree_skb(skb);
+			return 0;
+		}
+		ethmf_rx_queue(&ethmf_rx[rx_index], skb);
+		return 0;
+	}
+#endif
+
+	ztdethmf_rcv_frame(skb);
 	return 0;
 }
 
@@ -396,7 +597,9 @@ static void ztdethmf_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 
 	if (!atomic_read(&z->ready)) {
 		if (atomic_inc_return(&z->ready) == 1) {
-			memcpy(z->msgbuf, msg, msglen);
+			/* Unless built in place, see ztdethmf_getbuf() */
+			if (msg != z->msgbuf)
+				memcpy(z->msgbuf, msg, msglen);
 			z->msgbuf_len = msglen;
 		}
 	}
@@ -438,6 +641,12 @@ static void ztdethmf_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 			return;
 		}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
+		/* A flow of its own for each span group, to spread the groups
+		 * over the transmit queues of the device */
+		skb_set_hash(skb, z->addr_hash, PKT_HASH_TYPE_L4);
+#endif
+
 		/* Reserve header space */
 		skb_reserve(skb, dev->hard_header_len
 				+ sizeof(struct ztdeth_header));
@@ -498,6 +707,20 @@ static void ztdethmf_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 	return;
 }
 
+/**
+ * Have dahdi_dynamic build the message in our trx buffer, unless that still
+ * holds the last one, waiting for the other spans of the group.
+ */
+static u8 *ztdethmf_getbuf(struct dahdi_dynamic *dyn, size_t msglen)
+{
+	struct ztdeth *z = dyn->pvt;
+
+	if (atomic_read(&shutdown) || unlikely(!z) ||
+	    atomic_read(&z->ready) || msglen > ETHMF_BUFSIZE)
+		return NULL;
+	return z->msgbuf;
+}
+
 static int ztdethmf_flush(void)
 {
 	struct sk_buff *skb;
@@ -547,7 +770,7 @@ static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 	struct ztdeth *z;
 	char src[256];
 	char *src_ptr;
-	int x, bufsize, num_matched;
+	int x, num_matched;
 	unsigned long flags;
 	struct dahdi_span *const span = &dyn->span;
 
@@ -564,10 +787,9 @@ static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 	/* set a delay for xmit/recv to workaround Zaptel problems */
 	atomic_set(&z->delay, 4);
 
-	/* create a msg buffer. MAX OF 31 CHANNELS!!!! */
-	bufsize = 31 * DAHDI_CHUNKSIZE + 31 / 4 + 48;
-	z->msgbuf = kmalloc(bufsize, GFP_KERNEL);
-	z->rcvbuf = kmalloc(bufsize, GFP_KERNEL);
+	/* create a msg buffer */
+	z->msgbuf = kmalloc(ETHMF_BUFSIZE, GFP_KERNEL);
+	z->rcvbuf = kmalloc(ETHMF_BUFSIZE, GFP_KERNEL);
 
 	/* Address should be <dev>/<macaddr>/subaddr */
 	strlcpy(src, addr, sizeof(src));
@@ -613,6 +835,9 @@ static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 	atomic_set(&z->refcnt, 0);
 
 	spin_lock_irqsave(&ethmf_lock, flags);
+#ifdef ETHMF_RX_STEERING
+	z->rx_index = ethmf_rx_index(z->addr);
+#endif
 	list_add_rcu(&z->list, &ethmf_list);
 	spin_unlock_irqrestore(&ethmf_lock, flags);
 	atomic_inc(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].spans));
@@ -631,6 +856,8 @@ static struct dahdi_dynamic_driver ztd_ethmf = {
 	.create = ztdethmf_create,
 	.destroy = ztdethmf_destroy,
 	.transmit = ztdethmf_transmit,
+	.getbuf = ztdethmf_getbuf,
+	.sendbuf = ztdethmf_transmit,
 	.flush = ztdethmf_flush,
 };
 
@@ -687,6 +914,16 @@ static int ztdethmf_proc_show(struct seq_file *sfile, void *not_used)
 
 	seq_printf(sfile, "Errors: %d\n\n", atomic_read(&errcount));
 
+#ifdef ETHMF_RX_STEERING
+	for (c = 0; c < num_rx; ++c) {
+		seq_printf(sfile, "Rx CPU %d: frames=%u queued=%u\n",
+			   ethmf_rx[c].cpu, atomic_read(&ethmf_rx[c].frames),
+			   skb_queue_len(&ethmf_rx[c].queue));
+	}
+	if (num_rx)
+		seq_printf(sfile, "\n");
+#endif
+
 	for (group = 0; group < ETHMF_MAX_GROUPS; ++group) {
 		if (atomic_read(&(ethmf_groups[group].spans))) {
 			seq_printf(sfile, "Group #%d (0x%x)\n", i++,
@@ -703,6 +940,12 @@ static int ztdethmf_proc_show(struct seq_file *sfile, void *not_used)
 							z->ethdev,
 							z->addr[0], z->addr[1], z->addr[2],
 							z->addr[3], z->addr[4], z->addr[5]);
+#ifdef ETHMF_RX_STEERING
+						if (num_rx) {
+							seq_printf(sfile, "  Rx CPU: %d\n",
+								ethmf_rx[z->rx_index].cpu);
+						}
+#endif
 					}
 					seq_printf(sfile, "    Span %d: subaddr=%u ready=%d delay=%d real_channels=%d no_front_padding=%d\n",
 						c++, ntohs(z->subaddr),
@@ -756,6 +999,9 @@ static int __init ztdethmf_init(void)
 	timer_setup(&timer, timer_callback, 0);
 	mod_timer(&timer, jiffies + HZ);
 
+#ifdef ETHMF_RX_STEERING
+	ethmf_rx_init();
+#endif
 	dev_add_pack(&ztdethmf_ptype);
 	register_netdevice_notifier(&ztdethmf_nblock);
 	dahdi_dynamic_register_driver(&ztd_ethmf);
@@ -781,6 +1027,9 @@ static void __exit ztdethmf_exit(void)
 	dev_remove_pack(&ztdethmf_ptype);
 	unregister_netdevice_notifier(&ztdethmf_nblock);
 	dahdi_dynamic_unregister_driver(&ztd_ethmf);
+#ifdef ETHMF_RX_STEERING
+	ethmf_rx_cleanup();
+#endif
 
 #ifdef USE_PROC_FS
 	if (proc_entry)
@@ -788,6 +1037,11 @@ static void __exit ztdethmf_exit(void)
 #endif
 }
 
+#ifdef ETHMF_RX_STEERING
+module_param(rx_cpus, int, 0444);
+MODULE_PARM_DESC(rx_cpus, "Spread receive processing of the span groups over this many CPUs. 0 or 1 processes frames on the CPU the device delivers them to.");
+#endif
+
 MODULE_DESCRIPTION("DAHDI Dynamic TDMoEmf Support");
 MODULE_AUTHOR("Joseph Benden <joe@thrallingpenguin.com>");
 #ifdef MODULE_LICENSE
@@ -26,7 +26,9 @@
  *   1:2:0
  *   1:3:1
  * 
- * Contrary to TDMoE, no frame loss can occur.
+ * Contrary to TDMoE, no frame loss can occur, unless asked for with the
+ * inject_delay and inject_loss parameters to try out the receive jitter
+ * buffer of dahdi_dynamic.
  *
  * See bug #2021 for more details
  * 
@@ -54,13 +56,26 @@
 #include <linux/kmod.h>
 #include <linux/netdevice.h>
 #include <linux/notifier.h>
+#include <linux/random.h>
 
 #include <dahdi/kernel.h>
 
+/* Messages a span can hold back with inject_delay */
+#define LOC_HELD_MAX	32
+
+/* Hold each message back by up to this many messages */
+static int inject_delay;
+/* Drop one in this many messages */
+static int inject_loss;
+
 /**
  * struct dahdi_dynamic_loc - For local dynamic spans
  * @monitor_rx_peer:   Indicates the peer span that monitors this span.
  * @peer:	       Indicates the rw peer for this span.
+ * @held:	       Messages held back for inject_delay, LOC_HELD_MAX
+ *		       slots of @slotsize bytes.
+ * @held_len:	       Length of the message in each slot.
+ * @held_due:	       Message count at which each slot is delivered.
  *
  */
 struct dahdi_dynamic_local {
@@ -70,33 +85,112 @@ struct dahdi_dynamic_local {
 	struct dahdi_dynamic_local *peer;
 	struct dahdi_span *span;
 	struct list_head node;
+	u8 *held;
+	size_t slotsize;
+	size_t held_len[LOC_HELD_MAX];
+	unsigned int held_due[LOC_HELD_MAX];
+	int held_head;
+	int held_fill;
+	unsigned int count;
 };
 
 static DEFINE_SPINLOCK(local_lock);
 static LIST_HEAD(dynamic_local_list);
 
+/* Called with local_lock held */
 static void
-dahdi_dynamic_local_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
+dahdi_dynamic_local_deliver(struct dahdi_dynamic_local *d, u8 *msg,
+			    size_t msglen)
 {
-	struct dahdi_dynamic_local *d;
-	unsigned long flags;
-
-	spin_lock_irqsave(&local_lock, flags);
-	d = dyn->pvt;
-	if (d && d->peer && d->peer->span) {
+	if (d->peer && d->peer->span) {
 		if (test_bit(DAHDI_FLAGBIT_REGISTERED, &d->peer->span->flags))
 			dahdi_dynamic_receive(d->peer->span, msg, msglen);
 	}
-	if (d && d->monitor_rx_peer && d->monitor_rx_peer->span) {
+	if (d->monitor_rx_peer && d->monitor_rx_peer->span) {
 		if (test_bit(DAHDI_FLAGBIT_REGISTERED,
 			     &d->monitor_rx_peer->span->flags))  {
 			dahdi_dynamic_receive(d->monitor_rx_peer->span,
 					      msg, msglen);
 		}
 	}
+}
+
+/*
+ * Hold a message back by a random number of messages, keeping them in
+ * order, and deliver the ones that are due. Called with local_lock held.
+ */
+static void
+dahdi_dynamic_local_delay(struct dahdi_dynamic_local *d, u8 *msg,
+			  size_t msglen)
+{
+	unsigned int due;
+	int slot;
+
+	if (d->held_fill == LOC_HELD_MAX || msglen > d->slotsize) {
+		/* No room to hold it, let everything through */
+		while (d->held_fill) {
+			slot = d->held_head;
+			dahdi_dynamic_local_deliver(d,
+				d->held + slot * d->slotsize,
+				d->held_len[slot]);
+			d->held_head = (slot + 1) % LOC_HELD_MAX;
+			d->held_fill--;
+		}
+		dahdi_dynamic_local_deliver(d, msg, msglen);
+		return;
+	}
+
+	due = d->count + get_random_u32() % (inject_delay + 1);
+	if (d->held_fill) {
+		slot = (d->held_head + d->held_fill - 1) % LOC_HELD_MAX;
+		if ((int)(d->held_due[slot] - due) > 0)
+			due = d->held_due[slot];
+	}
+	slot = (d->held_head + d->held_fill) % LOC_HELD_MAX;
+	memcpy(d->held + slot * d->slotsize, msg, msglen);
+	d->held_len[slot] = msglen;
+	d->held_due[slot] = due;
+	d->held_fill++;
+
+	while (d->held_fill) {
+		slot = d->held_head;
+		if ((int)(d->held_due[slot] - d->count) > 0)
+			break;
+		dahdi_dynamic_local_deliver(d, d->held + slot * d->slotsize,
+					    d->held_len[slot]);
+		d->held_head = (slot + 1) % LOC_HELD_MAX;
+		d->held_fill--;
+	}
+}
+
+static void
+dahdi_dynamic_local_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
+{
+	struct dahdi_dynamic_local *d;
+	unsigned long flags;
+
+	spin_lock_irqsave(&local_lock, flags);
+	d = dyn->pvt;
+	if (!d)
+		goto out;
+	d->count++;
+	if (inject_loss > 0 && !(get_random_u32() % inject_loss))
+		goto out;
+	if (d->held)
+		dahdi_dynamic_local_delay(d, msg, msglen);
+	else
+		dahdi_dynamic_local_deliver(d, msg, msglen);
+out:
 	spin_unlock_irqrestore(&local_lock, flags);
 }
 
+static int
+dahdi_dynamic_local_setchunksize(struct dahdi_dynamic *dyn, int chunksize)
+{
+	/* Messages are handed over in memory, any size will do */
+	return 0;
+}
+
 static int digit2int(char d)
 {
 	switch(d) {
@@ -149,6 +243,7 @@ static void dahdi_dynamic_local_destroy(struct dahdi_dynamic *dyn)
 
 	printk(KERN_INFO "TDMoL: Removed interface for %s, key %d "
 		"id %d\n", d->span->name, d->key, d->id);
+	kfree(d->held);
 	kfree(d);
 }
 
@@ -183,6 +278,17 @@ static int dahdi_dynamic_local_create(struct dahdi_dynamic *dyn,
 	d->id = id;
 	d->span = span;
 
+	if (inject_delay > 0) {
+		/* Header, sigbits and the largest multi-chunk message */
+		d->slotsize = 6 + ((span->channels + 3) / 4) * 2 +
+			      span->channels * DAHDI_MAX_SPAN_CHUNKSIZE;
+		d->held = kcalloc(LOC_HELD_MAX, d->slotsize, GFP_KERNEL);
+		if (!d->held) {
+			kfree(d);
+			return -ENOMEM;
+		}
+	}
+
 	spin_lock_irqsave(&local_lock, flags);
 	/* Add this peer to any existing spans with same key
 	   And add them as peers to this one */
@@ -234,6 +340,7 @@ CLEAR_AND_DEL_FROM_PEERS:
 		if (l->monitor_rx_peer == d)
 			l->monitor_rx_peer = NULL;
 	}
+	kfree(d->held);
 	kfree(d);
 	spin_unlock_irqrestore(&local_lock, flags);
 	return -EINVAL;
@@ -250,6 +357,7 @@ static struct dahdi_dynamic_driver dahdi_dynamic_local = {
 	.create = dahdi_dynamic_local_create,
 	.destroy = dahdi_dynamic_local_destroy,
 	.transmit = dahdi_dynamic_local_transmit,
+	.setchunksize = dahdi_dynamic_local_setchunksize,
 };
 
 static int __init dahdi_dynamic_local_init(void)
@@ -266,4 +374,9 @@ static void __exit dahdi_dynamic_local_exit(void)
 module_init(dahdi_dynamic_local_init);
 module_exit(dahdi_dynamic_local_exit);
 
+module_param(inject_delay, int, 0644);
+MODULE_PARM_DESC(inject_delay, "Hold each message back by a random 0 to inject_delay messages, in order, for testing the receive jitter buffer. Applies to spans created afterwards.");
+module_param(inject_loss, int, 0644);
+MODULE_PARM_DESC(inject_loss, "Drop one in inject_loss messages at random, for testing.");
+
 MODULE_LICENSE("GPL v2");
@@ -0,0 +1,534 @@
+/*
+ * Dynamic Span Interface for DAHDI (UDP/IP Interface)
+ *
+ * Carries the same messages as the TDMoE driver (dahdi_dynamic_eth),
+ * including its two byte sub-address header, as UDP datagrams over IPv4
+ * or IPv6, so that spans can cross routers.
+ *
+ * Address syntax:
+ * <local port>/<peer address>:<peer port>[/<subaddr>]
+ *
+ * IPv6 peer addresses are written in brackets, e.g.
+ * 4000/[fd00::2]:4000/1 . Any number of spans may share a local port,
+ * messages are told apart by the peer address and port and the
+ * sub-address. Two spans looped over the loopback interface:
+ *
+ *   dynamic,udp,4000/127.0.0.1:4001,24,0
+ *   dynamic,udp,4001/127.0.0.1:4000,24,1
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/inet.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <linux/socket.h>
+#include <net/sock.h>
+#include <net/ipv6.h>
+#include <net/udp_tunnel.h>
+
+#include <dahdi/kernel.h>
+
+/* Datagrams sent in one go by UDP segmentation offload */
+#define ZTDUDP_MAX_SEGS		64
+/* Spans are looked up by peer and sub-address in 1 << this buckets */
+#define ZTDUDP_HASH_BITS	8
+
+#define ZTDUDP_TX_IDLE		0	/* txbuf belongs to dahdi_dynamic */
+#define ZTDUDP_TX_QUEUED	1	/* txbuf waits for ztdudp_flush() */
+
+struct ztdudp_header {
+	unsigned short subaddr;
+};
+
+/* A local port, shared by all spans using it */
+struct ztdudp_sock {
+	struct socket *sock;
+	sa_family_t family;
+	unsigned short port;	/* Host byte order */
+	int users;
+	struct list_head node;
+};
+
+struct ztdudp {
+	struct ztdudp_sock *us;
+	union {
+		struct sockaddr_in v4;
+		struct sockaddr_in6 v6;
+	} peer;
+	int peerlen;
+	unsigned short subaddr;	/* Network byte order */
+	struct dahdi_span *span;
+	/* Sub-address header and message */
+	unsigned char *txbuf;
+	size_t txsize;
+	size_t txlen;
+	int txstate;
+	struct list_head node;
+	struct hlist_node hnode;
+};
+
+/* Protects adding and removing spans and ports, in process context */
+static DEFINE_MUTEX(ztdudp_mutex);
+/* Spans, read under RCU when sending */
+static LIST_HEAD(ztdudp_list);
+static LIST_HEAD(ztdudp_socks);
+/* The same spans by ztdudp_hash() of their peer, read under RCU when
+ * receiving */
+static DEFINE_HASHTABLE(ztdudp_spans, ZTDUDP_HASH_BITS);
+
+/* port and subaddr in network byte order */
+static u32 ztdudp_hash(sa_family_t family, const void *addr,
+		       unsigned short port, unsigned short subaddr)
+{
+	u32 a = 0;
+
+	if (family == AF_INET)
+		a = *(const u32 *)addr;
+#if IS_ENABLED(CONFIG_IPV6)
+	else
+		a = ipv6_addr_hash(addr);
+#endif
+	return jhash_3words(a, port, subaddr, 0);
+}
+
+/* The sockets are IPv6 only or IPv4 only, so sk tells the family */
+static u32 ztdudp_hash_skb(const struct sock *sk, const struct sk_buff *skb,
+			   unsigned short subaddr)
+{
+	const void *addr;
+
+	if (sk->sk_family == AF_INET)
+		addr = &ip_hdr(skb)->saddr;
+	else
+		addr = &ipv6_hdr(skb)->saddr;
+	return ztdudp_hash(sk->sk_family, addr, udp_hdr(skb)->source,
+			   subaddr);
+}
+
+static int ztdudp_match(const struct ztdudp *z, const struct sk_buff *skb)
+{
+	/* sin_port and sin6_port are at the same place */
+	if (z->peer.v4.sin_port != udp_hdr(skb)->source)
+		return 0;
+	if (z->us->family == AF_INET)
+		return z->peer.v4.sin_addr.s_addr == ip_hdr(skb)->saddr;
+#if IS_ENABLED(CONFIG_IPV6)
+	return ipv6_addr_equal(&z->peer.v6.sin6_addr, &ipv6_hdr(skb)->saddr);
+#else
+	return 0;
+#endif
+}
+
+/* Called by UDP in softirq context with skb->data at the UDP header */
+static int ztdudp_rcv(struct sock *sk, struct sk_buff *skb)
+{
+	const int hlen = sizeof(struct udphdr) + sizeof(struct ztdudp_header);
+	struct ztdudp_header *zh;
+	struct ztdudp *z;
+	u32 key;
+
+	if (!pskb_may_pull(skb, hlen) || skb_linearize(skb))
+		goto out;
+	zh = (struct ztdudp_header *)(skb->data + sizeof(struct udphdr));
+
+	key = ztdudp_hash_skb(sk, skb, zh->subaddr);
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(ztdudp_spans, z, hnode, key) {
+		if (z->us->sock->sk != sk || z->subaddr != zh->subaddr ||
+		    !ztdudp_match(z, skb))
+			continue;
+		if (test_bit(DAHDI_FLAGBIT_REGISTERED, &z->span->flags)) {
+			dahdi_dynamic_receive(z->span, skb->data + hlen,
+					      skb->len - hlen);
+		}
+		break;
+	}
+	rcu_read_unlock();
+out:
+	kfree_skb(skb);
+	return 0;
+}
+
+static u8 *ztdudp_getbuf(struct dahdi_dynamic *dyn, size_t msglen)
+{
+	struct ztdudp *z = dyn->pvt;
+
+	/* Still queued if the flush is late, the message is dropped then */
+	if (unlikely(!z) ||
+	    msglen + sizeof(struct ztdudp_header) > z->txsize ||
+	    smp_load_acquire(&z->txstate) != ZTDUDP_TX_IDLE)
+		return NULL;
+	return z->txbuf + sizeof(struct ztdudp_header);
+}
+
+static void ztdudp_sendbuf(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
+{
+	struct ztdudp *z = dyn->pvt;
+
+	if (unlikely(!z))
+		return;
+	z->txlen = sizeof(struct ztdudp_header) + msglen;
+	/* Pairs with ztdudp_flush() */
+	smp_store_release(&z->txstate, ZTDUDP_TX_QUEUED);
+}
+
+static void ztdudp_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
+{
+	u8 *buf = ztdudp_getbuf(dyn, msglen);
+
+	if (!buf)
+		return;
+	memcpy(buf, msg, msglen);
+	ztdudp_sendbuf(dyn, buf, msglen);
+}
+
+static int ztdudp_sendmsg(struct ztdudp *z, struct kvec *iov, int n,
+			  size_t len, int segs)
+{
+	struct msghdr msg = {
+		.msg_name = &z->peer,
+		.msg_namelen = z->peerlen,
+		.msg_flags = MSG_DONTWAIT,
+	};
+#ifdef UDP_SEGMENT
+	char control[CMSG_SPACE(sizeof(u16))] = { 0 };
+	struct cmsghdr *cm;
+
+	if (segs > 1) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(u16));
+		*(u16 *)CMSG_DATA(cm) = len / segs;
+	}
+#endif
+	return kernel_sendmsg(z->us->sock, &msg, iov, n, len);
+}
+
+/*
+ * Send the queued messages. Those of spans with the same local port, peer
+ * and message size go out as one send, which UDP segmentation offload
+ * splits into a datagram per message.
+ *
+ * This function is always called in softirq context.
+ */
+static int ztdudp_flush(void)
+{
+	/* Only ever run from the flush tasklet, one at a time */
+	static struct kvec iov[ZTDUDP_MAX_SEGS];
+	static struct ztdudp *batch[ZTDUDP_MAX_SEGS];
+	struct ztdudp *z;
+#ifdef UDP_SEGMENT
+	struct ztdudp *t;
+#endif
+	size_t len;
+	int n, i;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(z, &ztdudp_list, node) {
+		if (smp_load_acquire(&z->txstate) != ZTDUDP_TX_QUEUED)
+			continue;
+		n = 0;
+		len = z->txlen;
+		batch[n++] = z;
+#ifdef UDP_SEGMENT
+		t = z;
+		list_for_each_entry_continue_rcu(t, &ztdudp_list, node) {
+			if (n == ZTDUDP_MAX_SEGS || (n + 1) * len > 0xffff -
+			    sizeof(struct ipv6hdr) - sizeof(struct udphdr))
+				break;
+			if (t->us != z->us || t->peerlen != z->peerlen ||
+			    memcmp(&t->peer, &z->peer, z->peerlen) ||
+			    smp_load_acquire(&t->txstate) != ZTDUDP_TX_QUEUED ||
+			    t->txlen != len)
+				continue;
+			batch[n++] = t;
+		}
+#endif
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = batch[i]->txbuf;
+			iov[i].iov_len = len;
+		}
+		/* Segments bigger than the path MTU are refused, and devices
+		 * without checksum offload cannot segment: whatever the
+		 * error, try again a datagram at a time */
+		if (ztdudp_sendmsg(z, iov, n, n * len, n) < 0 && n > 1) {
+			for (i = 0; i < n; i++)
+				ztdudp_sendmsg(z, &iov[i], 1, len, 1);
+		}
+		for (i = 0; i < n; i++)
+			smp_store_release(&batch[i]->txstate, ZTDUDP_TX_IDLE);
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+/* A message must fit in the buffer allocated for DAHDI_MAX_SPAN_CHUNKSIZE */
+static int ztdudp_setchunksize(struct dahdi_dynamic *dyn, int chunksize)
+{
+	const int nchans = dyn->span.channels;
+	const int msglen = 6 + ((nchans + 3) / 4) * 2 + nchans * chunksize;
+	struct ztdudp *z = dyn->pvt;
+
+	if (!z || msglen + sizeof(struct ztdudp_header) > z->txsize)
+		return -EMSGSIZE;
+	return 0;
+}
+
+/* Find or open the socket of a local port. Called with ztdudp_mutex held. */
+static struct ztdudp_sock *ztdudp_get_sock(sa_family_t family,
+					   unsigned short port)
+{
+	struct udp_tunnel_sock_cfg tunnel_cfg;
+	struct udp_port_cfg conf;
+	struct ztdudp_sock *us;
+	int res;
+
+	list_for_each_entry(us, &ztdudp_socks, node) {
+		if (us->family == family && us->port == port) {
+			us->users++;
+			return us;
+		}
+	}
+
+	us = kzalloc(sizeof(*us), GFP_KERNEL);
+	if (!us)
+		return ERR_PTR(-ENOMEM);
+
+	memset(&conf, 0, sizeof(conf));
+	conf.family = family;
+	conf.local_udp_port = htons(port);
+	/* Segmentation offload is refused on sockets without checksums */
+	conf.use_udp_checksums = 1;
+	conf.use_udp6_tx_checksums = 1;
+	conf.use_udp6_rx_checksums = 1;
+	if (family == AF_INET) {
+		conf.local_ip.s_addr = htonl(INADDR_ANY);
+	} else {
+#if IS_ENABLED(CONFIG_IPV6)
+		conf.local_ip6 = in6addr_any;
+		conf.ipv6_v6only = 1;
+#endif
+	}
+	res = udp_sock_create(&init_net, &conf, &us->sock);
+	if (res) {
+		kfree(us);
+		return ERR_PTR(res);
+	}
+
+	memset(&tunnel_cfg, 0, sizeof(tunnel_cfg));
+	tunnel_cfg.sk_user_data = us;
+	tunnel_cfg.encap_type = 1;
+	tunnel_cfg.encap_rcv = ztdudp_rcv;
+	setup_udp_tunnel_sock(&init_net, us->sock, &tunnel_cfg);
+
+	us->family = family;
+	us->port = port;
+	us->users = 1;
+	list_add(&us->node, &ztdudp_socks);
+	return us;
+}
+
+/* Called with ztdudp_mutex held */
+static void ztdudp_put_sock(struct ztdudp_sock *us)
+{
+	if (--us->users)
+		return;
+	list_del(&us->node);
+	udp_tunnel_sock_release(us->sock);
+	kfree(us);
+}
+
+static int ztdudp_parse_port(const char *s, unsigned short *port)
+{
+	unsigned int val;
+
+	if (kstrtouint(s, 10, &val) || !val || val > 0xffff)
+		return -EINVAL;
+	*port = val;
+	return 0;
+}
+
+/* <local port>/<peer address>:<peer port>[/<subaddr>] */
+static int ztdudp_parse(struct ztdudp *z, const char *addr,
+			sa_family_t *family, unsigned short *lport)
+{
+	char tmp[256];
+	char *host, *port, *sub;
+	unsigned short rport;
+	unsigned int val;
+
+	strlcpy(tmp, addr, sizeof(tmp));
+	host = strchr(tmp, '/');
+	if (!host)
+		return -EINVAL;
+	*host++ = '\0';
+	if (ztdudp_parse_port(tmp, lport))
+		return -EINVAL;
+
+	if (*host == '[') {
+		/* [IPv6]:port */
+		port = strchr(++host, ']');
+		if (!port || port[1] != ':')
+			return -EINVAL;
+		*port = '\0';
+		port += 2;
+	} else {
+		port = strchr(host, ':');
+		if (!port)
+			return -EINVAL;
+		*port++ = '\0';
+	}
+	sub = strchr(port, '/');
+	if (sub) {
+		*sub++ = '\0';
+		if (kstrtouint(sub, 10, &val) || val > 0xffff)
+			return -EINVAL;
+		z->subaddr = htons(val);
+	}
+	if (ztdudp_parse_port(port, &rport))
+		return -EINVAL;
+
+	if (in4_pton(host, -1, (u8 *)&z->peer.v4.sin_addr.s_addr, -1, NULL)) {
+		z->peer.v4.sin_family = AF_INET;
+		z->peer.v4.sin_port = htons(rport);
+		z->peerlen = sizeof(z->peer.v4);
+		*family = AF_INET;
+		return 0;
+	}
+#if IS_ENABLED(CONFIG_IPV6)
+	if (in6_pton(host, -1, z->peer.v6.sin6_addr.s6_addr, -1, NULL)) {
+		z->peer.v6.sin6_family = AF_INET6;
+		z->peer.v6.sin6_port = htons(rport);
+		z->peerlen = sizeof(z->peer.v6);
+		*family = AF_INET6;
+		return 0;
+	}
+#endif
+	return -EINVAL;
+}
+
+static void ztdudp_destroy(struct dahdi_dynamic *dyn)
+{
+	struct ztdudp *z = dyn->pvt;
+
+	mutex_lock(&ztdudp_mutex);
+	list_del_rcu(&z->node);
+	hash_del_rcu(&z->hnode);
+	mutex_unlock(&ztdudp_mutex);
+	/* Wait for ztdudp_rcv() and ztdudp_flush() */
+	synchronize_rcu();
+
+	mutex_lock(&ztdudp_mutex);
+	ztdudp_put_sock(z->us);
+	mutex_unlock(&ztdudp_mutex);
+
+	printk(KERN_INFO "TDMoUDP: Removed interface for %s\n", z->span->name);
+	dyn->pvt = NULL;
+	kfree(z->txbuf);
+	kfree(z);
+}
+
+static int ztdudp_create(struct dahdi_dynamic *dyn, const char *addr)
+{
+	const int nchans = dyn->span.channels;
+	struct ztdudp_sock *us;
+	struct ztdudp *z;
+	sa_family_t family;
+	unsigned short lport;
+	int res;
+
+	z = kzalloc(sizeof(*z), GFP_KERNEL);
+	if (!z)
+		return -ENOMEM;
+
+	res = ztdudp_parse(z, addr, &family, &lport);
+	if (res) {
+		printk(KERN_NOTICE "TDMoUDP: Invalid address '%s'\n", addr);
+		kfree(z);
+		return res;
+	}
+
+	z->txsize = sizeof(struct ztdudp_header) + 6 + ((nchans + 3) / 4) * 2 +
+		    nchans * DAHDI_MAX_SPAN_CHUNKSIZE;
+	z->txbuf = kzalloc(z->txsize, GFP_KERNEL);
+	if (!z->txbuf) {
+		kfree(z);
+		return -ENOMEM;
+	}
+	((struct ztdudp_header *)z->txbuf)->subaddr = z->subaddr;
+	z->span = &dyn->span;
+
+	mutex_lock(&ztdudp_mutex);
+	us = ztdudp_get_sock(family, lport);
+	if (IS_ERR(us)) {
+		mutex_unlock(&ztdudp_mutex);
+		printk(KERN_NOTICE "TDMoUDP: Cannot open local port %d: %ld\n",
+		       lport, PTR_ERR(us));
+		kfree(z->txbuf);
+		kfree(z);
+		return PTR_ERR(us);
+	}
+	z->us = us;
+	dyn->pvt = z;
+	list_add_rcu(&z->node, &ztdudp_list);
+	hash_add_rcu(ztdudp_spans, &z->hnode,
+		     ztdudp_hash(family, (family == AF_INET) ?
+				 (const void *)&z->peer.v4.sin_addr :
+				 (const void *)&z->peer.v6.sin6_addr,
+				 z->peer.v4.sin_port, z->subaddr));
+	mutex_unlock(&ztdudp_mutex);
+
+	printk(KERN_INFO "TDMoUDP: Added new interface for %s at local port %d (addr=%s, subaddr=%d)\n",
+	       z->span->name, lport, addr, ntohs(z->subaddr));
+	return 0;
+}
+
+static struct dahdi_dynamic_driver ztd_udp = {
+	.owner = THIS_MODULE,
+	.name = "udp",
+	.desc = "UDP/IP",
+	.create = ztdudp_create,
+	.destroy = ztdudp_destroy,
+	.transmit = ztdudp_transmit,
+	.getbuf = ztdudp_getbuf,
+	.sendbuf = ztdudp_sendbuf,
+	.flush = ztdudp_flush,
+	.setchunksize = ztdudp_setchunksize,
+};
+
+static int __init ztdudp_init(void)
+{
+	return dahdi_dynamic_register_driver(&ztd_udp);
+}
+
+static void __exit ztdudp_exit(void)
+{
+	dahdi_dynamic_unregister_driver(&ztd_udp);
+}
+
+MODULE_DESCRIPTION("DAHDI Dynamic TDM over UDP/IP Support");
+MODULE_LICENSE("GPL v2");
+
+module_init(ztdudp_init);
+module_exit(ztdudp_exit);
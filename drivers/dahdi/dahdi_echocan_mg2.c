@@ -43,6 +43,9 @@
 
 static int debug;
 static int aggressive;
+static int simd = 1;
+/* CONVOLVE2_SIMD() level picked at load time */
+static int simd_level;
 
 #define ABS(a) abs(a!=-32768?a:-32767)
 
@@ -175,15 +178,21 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
 static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echo_can_process_batch(struct dahdi_echocan_state *const *ecs,
+				   short *isig, const short *iref,
+				   u32 count, u32 size);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
 static const char *name = "MG2";
 static const char *ec_name(const struct dahdi_chan *chan) { return name; }
 
+static struct dahdi_echocan_pool ec_pool;
+
 static const struct dahdi_echocan_factory my_factory = {
 	.get_name = ec_name,
 	.owner = THIS_MODULE,
 	.echocan_create = echo_can_create,
+	.pool = &ec_pool,
 };
 
 static const struct dahdi_echocan_features my_features = {
@@ -193,6 +202,7 @@ static const struct dahdi_echocan_features my_features = {
 static const struct dahdi_echocan_ops my_ops = {
 	.echocan_free = echo_can_free,
 	.echocan_process = echo_can_process,
+	.echocan_process_batch = echo_can_process_batch,
 	.echocan_traintap = echo_can_traintap,
 	.echocan_NLP_toggle = echocan_NLP_toggle,
 };
@@ -277,6 +287,29 @@ struct ec_pvt {
 
 #define dahdi_to_pvt(a) container_of(a, struct ec_pvt, dahdi)
 
+/* Size of an instance for tap_length taps, and its y and u history lengths */
+static size_t ec_size(int tap_length, int *maxy, int *maxu)
+{
+	*maxy = tap_length + DEFAULT_M;
+	*maxu = DEFAULT_M;
+	if (*maxy < (1 << DEFAULT_ALPHA_YT_I))
+		*maxy = (1 << DEFAULT_ALPHA_YT_I);
+	if (*maxy < (1 << DEFAULT_SIGMA_LY_I))
+		*maxy = (1 << DEFAULT_SIGMA_LY_I);
+	if (*maxu < (1 << DEFAULT_SIGMA_LU_I))
+		*maxu = (1 << DEFAULT_SIGMA_LU_I);
+	return sizeof(struct ec_pvt) +
+		4 + 						/* align */
+		sizeof(int) * tap_length +			/* a_i */
+		sizeof(short) * tap_length + 		/* a_s */
+		sizeof(int) * tap_length +			/* b_i */
+		sizeof(int) * tap_length +			/* c_i */
+		2 * sizeof(short) * *maxy +			/* y_s */
+		2 * sizeof(short) * (1 << DEFAULT_ALPHA_ST_I) + /* s_s */
+		2 * sizeof(short) * *maxu +			/* u_s */
+		2 * sizeof(short) * tap_length;		/* y_tilde_s */
+}
+
 static inline void init_cb_s(echo_can_cb_s *cb, int len, void *where)
 {
 	cb->buf_d = (short *)where;
@@ -381,7 +414,7 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 #if defined(DC_NORMALIZE) && defined(MEC2_DCBIAS_MESSAGE)
 	printk(KERN_INFO "EC: DC bias calculated: %d V\n", pvt->dc_estimate >> 15);
 #endif
-	kfree(pvt);
+	dahdi_ec_pool_free(&ec_pool, pvt);
 }
 
 #ifdef DC_NORMALIZE
@@ -392,7 +425,8 @@ static inline short dc_removal(int *dc_estimate, short samp)
 }
 #endif
 
-static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
+static inline short sample_update(struct ec_pvt *pvt, short iref, short isig,
+				  int level)
 {
 	/* Declare local variables that are used more than once */
 	/* ... */
@@ -433,9 +467,9 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
  
 
 	/* eq. (2): compute r in fixed-point */
-	rs = CONVOLVE2(pvt->a_s,
-		       pvt->y_s.buf_d + pvt->y_s.idx_d,
-		       pvt->N_d);
+	rs = CONVOLVE2_SIMD(level, pvt->a_s,
+			    pvt->y_s.buf_d + pvt->y_s.idx_d,
+			    pvt->N_d);
 	rs >>= 15;
 
 	if (pvt->lastsig == isig) {
@@ -618,9 +652,10 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 			for (k = 0; k < pvt->N_d; k++) {
 				/* eq. (7): compute an expectation over M_d samples */
 				int grad2;
-				grad2 = CONVOLVE2(pvt->u_s.buf_d + pvt->u_s.idx_d,
-						  pvt->y_s.buf_d + pvt->y_s.idx_d + k,
-						  DEFAULT_M);
+				grad2 = CONVOLVE2_SIMD(level,
+						       pvt->u_s.buf_d + pvt->u_s.idx_d,
+						       pvt->y_s.buf_d + pvt->y_s.idx_d + k,
+						       DEFAULT_M);
 				/* eq. (7): update the coefficient */
 				pvt->a_i[k] += grad2 / two_beta_i;
 				pvt->a_s[k] = pvt->a_i[k] >> 16;
@@ -753,19 +788,44 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 	return u;
 }
 
-static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size)
+static void __echo_can_process(struct ec_pvt *pvt, short *isig,
+			       const short *iref, u32 size, int level)
 {
-	struct ec_pvt *pvt = dahdi_to_pvt(ec);
 	u32 x;
 	short result;
 
 	for (x = 0; x < size; x++) {
-		result = sample_update(pvt, *iref, *isig);
+		result = sample_update(pvt, *iref, *isig, level);
 		*isig++ = result;
 		++iref;
 	}
 }
 
+static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size)
+{
+	const int level = dahdi_simd_ec_begin(simd_level);
+
+	__echo_can_process(dahdi_to_pvt(ec), isig, iref, size, level);
+	dahdi_simd_ec_end(level);
+}
+
+/* Same as echo_can_process() on each entry, with the FPU claimed once */
+static void echo_can_process_batch(struct dahdi_echocan_state *const *ecs,
+				   short *isig, const short *iref,
+				   u32 count, u32 size)
+{
+	const int level = dahdi_simd_ec_begin(simd_level);
+	u32 i;
+
+	for (i = 0; i < count; i++) {
+		__echo_can_process(dahdi_to_pvt(ecs[i]), isig, iref, size,
+				   level);
+		isig += size;
+		iref += size;
+	}
+	dahdi_simd_ec_end(level);
+}
+
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
 {
@@ -776,26 +836,8 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 	char *c;
 	struct ec_pvt *pvt;
 
-	maxy = ecp->tap_length + DEFAULT_M;
-	maxu = DEFAULT_M;
-	if (maxy < (1 << DEFAULT_ALPHA_YT_I))
-		maxy = (1 << DEFAULT_ALPHA_YT_I);
-	if (maxy < (1 << DEFAULT_SIGMA_LY_I))
-		maxy = (1 << DEFAULT_SIGMA_LY_I);
-	if (maxu < (1 << DEFAULT_SIGMA_LU_I))
-		maxu = (1 << DEFAULT_SIGMA_LU_I);
-	size = sizeof(**ec) +
-		4 + 						/* align */
-		sizeof(int) * ecp->tap_length +			/* a_i */
-		sizeof(short) * ecp->tap_length + 		/* a_s */
-		sizeof(int) * ecp->tap_length +			/* b_i */
-		sizeof(int) * ecp->tap_length +			/* c_i */
-		2 * sizeof(short) * (maxy) +			/* y_s */
-		2 * sizeof(short) * (1 << DEFAULT_ALPHA_ST_I) + /* s_s */
-		2 * sizeof(short) * (maxu) +			/* u_s */
-		2 * sizeof(short) * ecp->tap_length;		/* y_tilde_s */
-
-	pvt = kzalloc(size, GFP_KERNEL);
+	size = ec_size(ecp->tap_length, &maxy, &maxu);
+	pvt = dahdi_ec_pool_alloc(&ec_pool, size);
 	if (!pvt)
 		return -ENOMEM;
 
@@ -811,7 +853,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			pvt->aggressive = p[x].value ? 1 : 0;
 		} else {
 			printk(KERN_WARNING "Unknown parameter supplied to MG2 echo canceler: '%s'\n", p[x].name);
-			kfree(pvt);
+			dahdi_ec_pool_free(&ec_pool, pvt);
 
 			return -EINVAL;
 		}
@@ -862,14 +904,26 @@ static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enab
 
 static int __init mod_init(void)
 {
+	int maxy, maxu;
+
+	if (dahdi_ec_pool_init(&ec_pool, "mg2", ec_size(128, &maxy, &maxu))) {
+		module_printk(KERN_ERR, "could not preallocate instances\n");
+
+		return -ENOMEM;
+	}
+
 	if (dahdi_register_echocan_factory(&my_factory)) {
 		module_printk(KERN_ERR, "could not register with DAHDI core\n");
+		dahdi_ec_pool_destroy(&ec_pool);
 
 		return -EPERM;
 	}
 
-	module_printk(KERN_NOTICE, "Registered echo canceler '%s'\n",
-		      my_factory.get_name(NULL));
+	if (simd)
+		simd_level = dahdi_simd_ec_check(dahdi_simd_ec_level());
+
+	module_printk(KERN_NOTICE, "Registered echo canceler '%s' (%s)\n",
+		      my_factory.get_name(NULL), dahdi_simd_ec_name(simd_level));
 
 	return 0;
 }
@@ -877,10 +931,13 @@ static int __init mod_init(void)
 static void __exit mod_exit(void)
 {
 	dahdi_unregister_echocan_factory(&my_factory);
+	dahdi_ec_pool_destroy(&ec_pool);
 }
 
 module_param(debug, int, S_IRUGO | S_IWUSR);
 module_param(aggressive, int, S_IRUGO | S_IWUSR);
+module_param(simd, int, S_IRUGO);
+MODULE_PARM_DESC(simd, "Use SSE2/AVX2/NEON for the FIR convolution when built with CONFIG_DAHDI_SIMD_EC (0 to disable).");
 
 MODULE_DESCRIPTION("DAHDI 'MG2' Echo Canceler");
 MODULE_AUTHOR("Michael Gernoth");
@@ -81,10 +81,13 @@ static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val)
 static const char *name = "SEC2";
 static const char *ec_name(const struct dahdi_chan *chan) { return name; }
 
+static struct dahdi_echocan_pool ec_pool;
+
 static const struct dahdi_echocan_factory my_factory = {
 	.get_name = ec_name,
 	.owner = THIS_MODULE,
 	.echocan_create = echo_can_create,
+	.pool = &ec_pool,
 };
 
 static const struct dahdi_echocan_ops my_ops = {
@@ -125,6 +128,12 @@ struct ec_pvt {
 
 #define dahdi_to_pvt(a) container_of(a, struct ec_pvt, dahdi)
 
+static size_t ec_size(int tap_length)
+{
+	return sizeof(struct ec_pvt) + tap_length * sizeof(int32_t) +
+		tap_length * 3 * sizeof(int16_t);
+}
+
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
 {
@@ -136,9 +145,8 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 		return -EINVAL;
 	}
 
-	size = sizeof(*pvt) + ecp->tap_length * sizeof(int32_t) + ecp->tap_length * 3 * sizeof(int16_t);
-	
-	pvt = kzalloc(size, GFP_KERNEL);
+	size = ec_size(ecp->tap_length);
+	pvt = dahdi_ec_pool_alloc(&ec_pool, size);
 	if (!pvt)
 		return -ENOMEM;
 
@@ -152,8 +160,8 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 	pvt->taps = ecp->tap_length;
 	pvt->curr_pos = ecp->tap_length - 1;
 	pvt->tap_mask = ecp->tap_length - 1;
-	pvt->fir_taps32 = (int32_t *) (pvt + sizeof(*pvt));
-	pvt->fir_taps16 = (int16_t *) (pvt + sizeof(*pvt) + ecp->tap_length * sizeof(int32_t));
+	pvt->fir_taps32 = (int32_t *) ((char *) pvt + sizeof(*pvt));
+	pvt->fir_taps16 = (int16_t *) ((char *) pvt + sizeof(*pvt) + ecp->tap_length * sizeof(int32_t));
 	/* Create FIR filter */
 	fir16_create(&pvt->fir_state, pvt->fir_taps16, pvt->taps);
 	pvt->rx_power_threshold = 10000000;
@@ -171,7 +179,7 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 	struct ec_pvt *pvt = dahdi_to_pvt(ec);
 
 	fir16_free(&pvt->fir_state);
-	kfree(pvt);
+	dahdi_ec_pool_free(&ec_pool, pvt);
 }
 
 static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
@@ -323,8 +331,15 @@ static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val)
 
 static int __init mod_init(void)
 {
+	if (dahdi_ec_pool_init(&ec_pool, "sec2", ec_size(128))) {
+		module_printk(KERN_ERR, "could not preallocate instances\n");
+
+		return -ENOMEM;
+	}
+
 	if (dahdi_register_echocan_factory(&my_factory)) {
 		module_printk(KERN_ERR, "could not register with DAHDI core\n");
+		dahdi_ec_pool_destroy(&ec_pool);
 
 		return -EPERM;
 	}
@@ -338,6 +353,7 @@ static int __init mod_init(void)
 static void __exit mod_exit(void)
 {
 	dahdi_unregister_echocan_factory(&my_factory);
+	dahdi_ec_pool_destroy(&ec_pool);
 }
 
 module_param(debug, int, S_IRUGO | S_IWUSR);
@@ -0,0 +1,200 @@
+/*
+ * DAHDI conference mixing benchmark
+ *
+ * Times the saturating add / subtract used for conference mixing (ACSS /
+ * SCSS) with every implementation built into this tree and logs the
+ * result when loaded. Not built by default:
+ *
+ *   make MODULES_EXTRA="dahdi_mix_bench"
+ *   insmod dahdi_mix_bench.ko conferences=1024 iterations=1000
+ *
+ * Each iteration mixes one chunk into and out of every conference, the
+ * same pattern the master span pass produces, and claims the FPU once for
+ * the whole iteration as dahdi does.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+
+#include <dahdi/kernel.h>
+
+#include "arith.h"
+
+#if defined(CONFIG_DAHDI_MMX) || \
+	(defined(DAHDI_SIMD_MIX) && defined(CONFIG_X86_64))
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#endif
+#if defined(DAHDI_SIMD_MIX) && defined(CONFIG_ARM64)
+#include <asm/neon.h>
+#endif
+
+typedef short sumtype[DAHDI_CHUNKSIZE];
+
+static int conferences = 1024;
+static int iterations = 1000;
+
+struct mix_variant {
+	const char *name;
+	void (*add)(short *dst, const short *src);
+	void (*sub)(short *dst, const short *src);
+	void (*begin)(void);
+	void (*end)(void);
+};
+
+static void bench_c_add(short *dst, const short *src)
+{
+	__ACSS_C(dst, src);
+}
+
+static void bench_c_sub(short *dst, const short *src)
+{
+	__SCSS_C(dst, src);
+}
+
+#if defined(CONFIG_DAHDI_MMX) || \
+	(defined(DAHDI_SIMD_MIX) && defined(CONFIG_X86_64))
+static void bench_fpu_begin(void)
+{
+	kernel_fpu_begin();
+}
+
+static void bench_fpu_end(void)
+{
+	kernel_fpu_end();
+}
+#endif
+
+#ifdef CONFIG_DAHDI_MMX
+static void bench_mmx_add(short *dst, const short *src)
+{
+	__ACSS(dst, src);
+}
+
+static void bench_mmx_sub(short *dst, const short *src)
+{
+	__SCSS(dst, src);
+}
+#endif
+
+#ifdef DAHDI_SIMD_MIX
+static void bench_simd_add(short *dst, const short *src)
+{
+	__ACSS_SIMD(dst, src);
+}
+
+static void bench_simd_sub(short *dst, const short *src)
+{
+	__SCSS_SIMD(dst, src);
+}
+
+#ifdef CONFIG_ARM64
+static void bench_fpu_begin(void)
+{
+	kernel_neon_begin();
+}
+
+static void bench_fpu_end(void)
+{
+	kernel_neon_end();
+}
+#endif
+#endif
+
+static const struct mix_variant variants[] = {
+	{ "c", bench_c_add, bench_c_sub, NULL, NULL },
+#ifdef CONFIG_DAHDI_MMX
+	{ "mmx", bench_mmx_add, bench_mmx_sub,
+	  bench_fpu_begin, bench_fpu_end },
+#endif
+#ifdef DAHDI_SIMD_MIX
+	{ DAHDI_SIMD_MIX_NAME, bench_simd_add, bench_simd_sub,
+	  bench_fpu_begin, bench_fpu_end },
+#endif
+};
+
+static u64 run_variant(const struct mix_variant *v, sumtype *sums,
+		       const short *in, const short *out)
+{
+	u64 start, elapsed = 0;
+	int i, c;
+
+	for (i = 0; i < iterations; i++) {
+		start = ktime_get_ns();
+		if (v->begin)
+			v->begin();
+		for (c = 0; c < conferences; c++) {
+			v->add(sums[c], in);
+			v->sub(sums[c], out);
+		}
+		if (v->end)
+			v->end();
+		elapsed += ktime_get_ns() - start;
+		cond_resched();
+	}
+	return elapsed;
+}
+
+static int __init dahdi_mix_bench_init(void)
+{
+	short in[DAHDI_CHUNKSIZE];
+	short out[DAHDI_CHUNKSIZE];
+	sumtype *sums;
+	unsigned int i;
+
+	if (conferences <= 0 || iterations <= 0)
+		return -EINVAL;
+
+	sums = kcalloc(conferences, sizeof(*sums), GFP_KERNEL);
+	if (!sums)
+		return -ENOMEM;
+
+	get_random_bytes(in, sizeof(in));
+	get_random_bytes(out, sizeof(out));
+
+	for (i = 0; i < ARRAY_SIZE(variants); i++) {
+		const u64 ns = run_variant(&variants[i], sums, in, out);
+		const u64 chunks = (u64)iterations * conferences * 2;
+
+		printk(KERN_INFO "dahdi_mix_bench: %-6s %llu ns total, "
+		       "%llu ps/chunk\n", variants[i].name, ns,
+		       div64_u64(ns * 1000, chunks));
+	}
+
+	kfree(sums);
+	return 0;
+}
+
+static void __exit dahdi_mix_bench_exit(void)
+{
+}
+
+module_param(conferences, int, 0444);
+MODULE_PARM_DESC(conferences, "Number of conferences mixed per iteration.");
+module_param(iterations, int, 0444);
+MODULE_PARM_DESC(iterations, "Number of iterations timed per variant.");
+
+MODULE_DESCRIPTION("DAHDI conference mixing benchmark");
+MODULE_LICENSE("GPL v2");
+
+module_init(dahdi_mix_bench_init);
+module_exit(dahdi_mix_bench_exit);
@@ -0,0 +1,190 @@
+/*
+ * DAHDI law conversion benchmark
+ *
+ * Times the linear to mu-law / A-law conversion of a span's worth of
+ * channels with every implementation built into this tree, checks that
+ * they agree, and logs the result when loaded. Not built by default:
+ *
+ *   make MODULES_EXTRA="dahdi_xlaw_bench"
+ *   insmod dahdi_xlaw_bench.ko channels=1024 iterations=1000
+ *
+ * Each iteration converts one chunk of different audio for every channel,
+ * the pattern a transmit or receive pass over a large span produces, and
+ * claims the FPU once for the whole iteration as dahdi does.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+
+#include <dahdi/kernel.h>
+
+#include "arith.h"
+
+#ifdef DAHDI_SIMD_XLAW
+#include <asm/fpu/api.h>
+#endif
+
+static int channels = 1024;
+static int iterations = 1000;
+
+struct xlaw_variant {
+	const char *name;
+	void (*mu)(u8 *dst, const short *src);
+	void (*a)(u8 *dst, const short *src);
+	void (*begin)(void);
+	void (*end)(void);
+};
+
+static void bench_lin2mu(u8 *dst, const short *src)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		dst[x] = DAHDI_LIN2MU(src[x]);
+}
+
+static void bench_lin2a(u8 *dst, const short *src)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		dst[x] = DAHDI_LIN2A(src[x]);
+}
+
+#ifdef DAHDI_SIMD_XLAW
+static void bench_simd_lin2mu(u8 *dst, const short *src)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x += 8)
+		__LIN2MU_SIMD(dst + x, src + x);
+}
+
+static void bench_simd_lin2a(u8 *dst, const short *src)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x += 8)
+		__LIN2A_SIMD(dst + x, src + x);
+}
+
+static void bench_fpu_begin(void)
+{
+	kernel_fpu_begin();
+}
+
+static void bench_fpu_end(void)
+{
+	kernel_fpu_end();
+}
+#endif
+
+static const struct xlaw_variant variants[] = {
+#ifdef CONFIG_CALC_XLAW
+	{ "calc", bench_lin2mu, bench_lin2a, NULL, NULL },
+#else
+	{ "table", bench_lin2mu, bench_lin2a, NULL, NULL },
+#endif
+#ifdef DAHDI_SIMD_XLAW
+	{ "sse2", bench_simd_lin2mu, bench_simd_lin2a,
+	  bench_fpu_begin, bench_fpu_end },
+#endif
+};
+
+static u64 run_variant(const struct xlaw_variant *v, bool alaw, u8 *out,
+		       const short *in)
+{
+	void (*const conv)(u8 *dst, const short *src) = alaw ? v->a : v->mu;
+	u64 start, elapsed = 0;
+	int i, c;
+
+	for (i = 0; i < iterations; i++) {
+		start = ktime_get_ns();
+		if (v->begin)
+			v->begin();
+		for (c = 0; c < channels; c++) {
+			conv(out + c * DAHDI_CHUNKSIZE,
+			     in + c * DAHDI_CHUNKSIZE);
+		}
+		if (v->end)
+			v->end();
+		elapsed += ktime_get_ns() - start;
+		cond_resched();
+	}
+	return elapsed;
+}
+
+static int __init dahdi_xlaw_bench_init(void)
+{
+	const size_t samples = (size_t)channels * DAHDI_CHUNKSIZE;
+	short *in;
+	u8 *out, *ref;
+	unsigned int i;
+	int alaw;
+
+	if (channels <= 0 || iterations <= 0)
+		return -EINVAL;
+
+	in = vmalloc(samples * sizeof(*in));
+	out = vmalloc(samples);
+	ref = vmalloc(samples);
+	if (!in || !out || !ref) {
+		vfree(in);
+		vfree(out);
+		vfree(ref);
+		return -ENOMEM;
+	}
+
+	get_random_bytes(in, samples * sizeof(*in));
+
+	for (alaw = 0; alaw < 2; alaw++) {
+		for (i = 0; i < ARRAY_SIZE(variants); i++) {
+			const u64 ns = run_variant(&variants[i], alaw, out, in);
+			const u64 chunks = (u64)iterations * channels;
+
+			if (!i)
+				memcpy(ref, out, samples);
+			printk(KERN_INFO "dahdi_xlaw_bench: %s %-6s %llu ns "
+			       "total, %llu ps/chunk%s\n",
+			       alaw ? "alaw" : "mulaw", variants[i].name, ns,
+			       div64_u64(ns * 1000, chunks),
+			       memcmp(ref, out, samples) ? ", MISMATCH" : "");
+		}
+	}
+
+	vfree(in);
+	vfree(out);
+	vfree(ref);
+	return 0;
+}
+
+static void __exit dahdi_xlaw_bench_exit(void)
+{
+}
+
+module_param(channels, int, 0444);
+MODULE_PARM_DESC(channels, "Number of channels converted per iteration.");
+module_param(iterations, int, 0444);
+MODULE_PARM_DESC(iterations, "Number of iterations timed per variant.");
+
+MODULE_DESCRIPTION("DAHDI law conversion benchmark");
+MODULE_LICENSE("GPL v2");
+
+module_init(dahdi_xlaw_bench_init);
+module_exit(dahdi_xlaw_bench_exit);
@@ -0,0 +1,395 @@
+/*
+ * DAHDI Telephony Interface Driver
+ *
+ * digitdet.h - Goertzel based DTMF, MFR1 and MFR2 digit detection
+ *
+ * Every detector runs eight Goertzel filters over blocks of about 13 ms
+ * (DIGITDET_BLOCK samples) and decides at the end of each block whether
+ * it held a digit.  A digit goes down after DIGITDET_HITS blocks in a row
+ * held it and up after DIGITDET_MISSES blocks did not.
+ *
+ * The filters of many detectors can be run together in a bank, laid out
+ * detector by detector so that one sample of four detectors is worked on
+ * at once.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef _DAHDI_DIGITDET_H
+#define _DAHDI_DIGITDET_H
+
+#define DIGITDET_TONES		8
+#define DIGITDET_BLOCK_CHUNKS	DIV_ROUND_UP(102, DAHDI_CHUNKSIZE)
+#define DIGITDET_BLOCK		(DIGITDET_BLOCK_CHUNKS * DAHDI_CHUNKSIZE)
+#define DIGITDET_HITS		2
+#define DIGITDET_MISSES		2
+#define DIGITDET_BANK_SIZE	64
+
+/* Samples are scaled down by DIGITDET_SHIFT and the coefficients are in
+   Q12, which keeps every filter of a full scale block within 32 bits */
+#define DIGITDET_SHIFT		5
+#define DIGITDET_COEF_SHIFT	12
+
+/* Weakest tone accepted, as a peak amplitude after scaling: about -33 dBm0 */
+#define DIGITDET_MIN_AMP	16
+#define DIGITDET_MIN_POWER \
+	((s64)DIGITDET_MIN_AMP * DIGITDET_MIN_AMP * \
+	 DIGITDET_BLOCK * DIGITDET_BLOCK / 4)
+
+enum digitdet_mode {
+	DIGITDET_DTMF,
+	DIGITDET_MFR1,
+	DIGITDET_MFR2_FWD,
+	DIGITDET_MFR2_REV,
+};
+
+/* 2 * cos(2 * pi * f / 8000) in Q12 for the frequencies of each mode:
+   DTMF rows and columns, MFR1 700 to 1700 Hz, MFR2 forward 1380 to
+   1980 Hz and MFR2 backward 1140 down to 540 Hz. */
+static const int32_t digitdet_coefs[4][DIGITDET_TONES] = {
+	{ 6995, 6739, 6425, 6055, 4768, 4081, 3271, 2329 },
+	{ 6985, 6229, 5320, 4280, 3135, 1912, 0, 0 },
+	{ 3833, 3135, 2409, 1661, 899, 129, 0, 0 },
+	{ 5122, 5701, 6229, 6702, 7116, 7466, 0, 0 },
+};
+
+static const char digitdet_dtmf_digits[4][4] = {
+	{ '1', '2', '3', 'A' },
+	{ '4', '5', '6', 'B' },
+	{ '7', '8', '9', 'C' },
+	{ '*', '0', '#', 'D' },
+};
+
+/* MF digits by their pair of tones, lower tone first, numbered 1 to 15
+   as in the Q.441 / Bell MF tables */
+static const u8 digitdet_mf_pairs[6][6] = {
+	{ 0, 1, 2, 4, 7, 11 },
+	{ 1, 0, 3, 5, 8, 12 },
+	{ 2, 3, 0, 6, 9, 13 },
+	{ 4, 5, 6, 0, 10, 14 },
+	{ 7, 8, 9, 10, 0, 15 },
+	{ 11, 12, 13, 14, 15, 0 },
+};
+
+/* The characters dahdi_mf_tone() dials for MF digits 1 to 15 */
+static const char digitdet_mfr1_digits[16] = "\0001234567890CA*B#";
+static const char digitdet_mfr2_digits[16] = "\000123456789ABCDEF";
+
+struct dahdi_digit_detector {
+	int mode;
+	/* Bumped every time the detector is queued on a bank */
+	unsigned int seq;
+	/* Chunks of the current block seen so far */
+	int chunks;
+	int32_t s1[DIGITDET_TONES];
+	int32_t s2[DIGITDET_TONES];
+	int32_t energy;
+	/* Digit held by the last block, and by how many blocks in a row */
+	char last;
+	u8 hits;
+	/* Digit reported down, and how many blocks in a row did not hold it */
+	char current;
+	u8 misses;
+};
+
+static inline void digitdet_init(struct dahdi_digit_detector *det, int mode)
+{
+	memset(det, 0, sizeof(*det));
+	det->mode = mode;
+}
+
+/* True while a digit is down or about to be, for muting the audio */
+static inline int digitdet_muting(const struct dahdi_digit_detector *det)
+{
+	return det->current || det->hits;
+}
+
+static inline void digitdet_goertzel(int32_t *s1, int32_t *s2, int32_t coef,
+				     int32_t amp)
+{
+	const int32_t s0 = amp + ((coef * *s1) >> DIGITDET_COEF_SHIFT) - *s2;
+
+	*s2 = *s1;
+	*s1 = s0;
+}
+
+static inline s64 digitdet_power(const struct dahdi_digit_detector *det, int t)
+{
+	const s64 s1 = det->s1[t];
+	const s64 s2 = det->s2[t];
+
+	return s1 * s1 + s2 * s2 -
+	       ((digitdet_coefs[det->mode][t] * s1 * s2) >> DIGITDET_COEF_SHIFT);
+}
+
+static inline int digitdet_max(const s64 *p, int from, int to, int skip)
+{
+	int best = -1;
+	int t;
+
+	for (t = from; t < to; t++) {
+		if ((t != skip) && ((best < 0) || (p[t] > p[best])))
+			best = t;
+	}
+	return best;
+}
+
+/* A DTMF digit is the strongest row with the strongest column, each well
+   above the other rows and columns, within 8 dB (normal) or 6 dB
+   (reverse) of each other and together most of the signal */
+static inline char digitdet_block_dtmf(const s64 *p, s64 total)
+{
+	const int row = digitdet_max(p, 0, 4, -1);
+	const int col = digitdet_max(p, 4, 8, -1);
+	int t;
+
+	if ((p[row] < DIGITDET_MIN_POWER) || (p[col] < DIGITDET_MIN_POWER))
+		return 0;
+	if ((p[col] * 10 > p[row] * 63) || (p[row] > p[col] * 4))
+		return 0;
+	for (t = 0; t < DIGITDET_TONES; t++) {
+		if ((t != row) && (t != col) &&
+		    (p[t] * 63 > ((t < 4) ? p[row] : p[col]) * 10))
+			return 0;
+	}
+	if ((p[row] + p[col]) * 4 < total)
+		return 0;
+	return digitdet_dtmf_digits[row][col - 4];
+}
+
+/* An MF digit is the two strongest of the six tones, within 6 dB of each
+   other, 6 dB above the rest and together most of the signal */
+static inline char digitdet_block_mf(const s64 *p, s64 total, int mode)
+{
+	const int first = digitdet_max(p, 0, 6, -1);
+	const int second = digitdet_max(p, 0, 6, first);
+	int t;
+
+	if (p[second] < DIGITDET_MIN_POWER)
+		return 0;
+	if (p[first] > p[second] * 4)
+		return 0;
+	for (t = 0; t < 6; t++) {
+		if ((t != first) && (t != second) && (p[t] * 4 > p[second]))
+			return 0;
+	}
+	if ((p[first] + p[second]) * 4 < total)
+		return 0;
+	t = digitdet_mf_pairs[first][second];
+	return (mode == DIGITDET_MFR1) ? digitdet_mfr1_digits[t] :
+					 digitdet_mfr2_digits[t];
+}
+
+static inline char digitdet_block(const struct dahdi_digit_detector *det)
+{
+	s64 p[DIGITDET_TONES];
+	/* A block of one tone at the frequency of a filter puts half the
+	   block energy times the block length into that filter */
+	const s64 total = (s64)det->energy * DIGITDET_BLOCK;
+	int t;
+
+	for (t = 0; t < DIGITDET_TONES; t++)
+		p[t] = digitdet_power(det, t);
+	if (det->mode == DIGITDET_DTMF)
+		return digitdet_block_dtmf(p, total);
+	return digitdet_block_mf(p, total, det->mode);
+}
+
+/**
+ * digitdet_chunk_done() - Account for a chunk that went through the filters.
+ * @det:	The detector.
+ * @events:	Room for two DAHDI_EVENT_DTMFUP / DAHDI_EVENT_DTMFDOWN events.
+ *
+ * Returns the number of events stored in @events, in the order they
+ * happened.
+ */
+static inline int digitdet_chunk_done(struct dahdi_digit_detector *det, int *events)
+{
+	char digit;
+	int n = 0;
+
+	if (++det->chunks < DIGITDET_BLOCK_CHUNKS)
+		return 0;
+
+	digit = digitdet_block(det);
+	det->chunks = 0;
+	det->energy = 0;
+	memset(det->s1, 0, sizeof(det->s1));
+	memset(det->s2, 0, sizeof(det->s2));
+
+	if (!digit)
+		det->hits = 0;
+	else if (digit != det->last)
+		det->hits = 1;
+	else if (det->hits < DIGITDET_HITS)
+		det->hits++;
+	det->last = digit;
+
+	if (det->current) {
+		if (digit == det->current) {
+			det->misses = 0;
+		} else if (++det->misses >= DIGITDET_MISSES) {
+			events[n++] = DAHDI_EVENT_DTMFUP | det->current;
+			det->current = 0;
+		}
+	}
+	if (!det->current && (det->hits >= DIGITDET_HITS)) {
+		events[n++] = DAHDI_EVENT_DTMFDOWN | digit;
+		det->current = digit;
+		det->misses = 0;
+	}
+	return n;
+}
+
+/* Scales a chunk down for the filters and adds it to the block energy */
+static inline void digitdet_scale(struct dahdi_digit_detector *det,
+				  int16_t *dst, int stride, const short *amp)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		const int16_t a = amp[x] >> DIGITDET_SHIFT;
+
+		dst[x * stride] = a;
+		det->energy += a * a;
+	}
+}
+
+/* Runs a chunk through the filters of a single detector */
+static inline int digitdet_chunk(struct dahdi_digit_detector *det,
+				 const short *amp, int *events)
+{
+	int16_t scaled[DAHDI_CHUNKSIZE];
+	int x, t;
+
+	digitdet_scale(det, scaled, 1, amp);
+	for (t = 0; t < DIGITDET_TONES; t++) {
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+			digitdet_goertzel(&det->s1[t], &det->s2[t],
+					  digitdet_coefs[det->mode][t],
+					  scaled[x]);
+		}
+	}
+	return digitdet_chunk_done(det, events);
+}
+
+struct digitdet_bank {
+	int32_t s1[DIGITDET_TONES][DIGITDET_BANK_SIZE];
+	int32_t s2[DIGITDET_TONES][DIGITDET_BANK_SIZE];
+	int32_t coef[DIGITDET_TONES][DIGITDET_BANK_SIZE];
+	int16_t amp[DAHDI_CHUNKSIZE][DIGITDET_BANK_SIZE];
+};
+
+/* Puts the filters of det and its next chunk in slot i */
+static inline void digitdet_bank_load(struct digitdet_bank *bank, int i,
+				      struct dahdi_digit_detector *det,
+				      const short *amp)
+{
+	int t;
+
+	for (t = 0; t < DIGITDET_TONES; t++) {
+		bank->s1[t][i] = det->s1[t];
+		bank->s2[t][i] = det->s2[t];
+		bank->coef[t][i] = digitdet_coefs[det->mode][t];
+	}
+	digitdet_scale(det, &bank->amp[0][i], DIGITDET_BANK_SIZE, amp);
+}
+
+static inline void digitdet_bank_store(const struct digitdet_bank *bank,
+				       int i, struct dahdi_digit_detector *det)
+{
+	int t;
+
+	for (t = 0; t < DIGITDET_TONES; t++) {
+		det->s1[t] = bank->s1[t][i];
+		det->s2[t] = bank->s2[t][i];
+	}
+}
+
+static inline void digitdet_bank_filter(struct digitdet_bank *bank, int t,
+					int i)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		digitdet_goertzel(&bank->s1[t][i], &bank->s2[t][i],
+				  bank->coef[t][i], bank->amp[x][i]);
+	}
+}
+
+#if defined(CONFIG_X86_64) && (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0))
+#define DIGITDET_BANK_SSE41
+
+/* digitdet_bank_filter() for filter t of slots i to i + 3 with SSE4.1.
+   The caller owns the FPU. */
+static inline void digitdet_bank_filter4_sse41(struct digitdet_bank *bank,
+					       int t, int i)
+{
+	const int16_t *amp = &bank->amp[0][i];
+	int x = DAHDI_CHUNKSIZE;
+
+	__asm__ __volatile__ (
+		"movdqu %[s1], %%xmm1;\n"
+		"movdqu %[s2], %%xmm2;\n"
+		"movdqu %[coef], %%xmm3;\n"
+		"1:\n"
+		"pmovsxwd (%[amp]), %%xmm0;\n"
+		"movdqa %%xmm1, %%xmm4;\n"
+		"pmulld %%xmm3, %%xmm4;\n"
+		"psrad %[shift], %%xmm4;\n"
+		"paddd %%xmm0, %%xmm4;\n"
+		"psubd %%xmm2, %%xmm4;\n"
+		"movdqa %%xmm1, %%xmm2;\n"
+		"movdqa %%xmm4, %%xmm1;\n"
+		"add %[stride], %[amp];\n"
+		"dec %[x];\n"
+		"jnz 1b;\n"
+		"movdqu %%xmm1, %[s1];\n"
+		"movdqu %%xmm2, %[s2];\n"
+	    : [s1] "+m" (*(int32_t (*)[4])&bank->s1[t][i]),
+	      [s2] "+m" (*(int32_t (*)[4])&bank->s2[t][i]),
+	      [amp] "+r" (amp),
+	      [x] "+r" (x)
+	    : [coef] "m" (*(const int32_t (*)[4])&bank->coef[t][i]),
+	      [shift] "i" (DIGITDET_COEF_SHIFT),
+	      [stride] "i" (DIGITDET_BANK_SIZE * sizeof(int16_t)),
+	      "m" (bank->amp)
+	    : "cc");
+}
+#endif
+
+/* Filters the chunk of the first count slots of the bank. sse41 may only
+   be set by callers that own the FPU on a CPU with SSE4.1. */
+static inline void digitdet_bank_run(struct digitdet_bank *bank, int count,
+				     int sse41)
+{
+	int t, i = 0;
+
+#ifdef DIGITDET_BANK_SSE41
+	if (sse41) {
+		for (t = 0; t < DIGITDET_TONES; t++) {
+			for (i = 0; i + 4 <= count; i += 4)
+				digitdet_bank_filter4_sse41(bank, t, i);
+		}
+	}
+#endif
+	for (t = 0; t < DIGITDET_TONES; t++) {
+		int j;
+
+		for (j = i; j < count; j++)
+			digitdet_bank_filter(bank, t, j);
+	}
+}
+
+#endif /* _DAHDI_DIGITDET_H */
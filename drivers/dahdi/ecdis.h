@@ -31,17 +31,23 @@
 #define FALSE 0
 #define TRUE (!FALSE)
 
+/* Elliptic notch */
+/* This is actually centred at 2095Hz, but gets the balance we want, due
+   to the asymmetric walls of the notch */
+#define ECDIS_NOTCH_GAIN	((int32_t) (-0.7600000*32768.0))
+#define ECDIS_NOTCH_A1		((int32_t) (-0.1183852*32768.0))
+#define ECDIS_NOTCH_A2		((int32_t) (-0.5104039*32768.0))
+#define ECDIS_NOTCH_B1		((int32_t) ( 0.1567596*32768.0))
+#define ECDIS_NOTCH_B2		((int32_t) ( 1.0000000*32768.0))
+
 static inline void echo_can_disable_detector_init (echo_can_disable_detector_state_t *det)
 {
-    /* Elliptic notch */
-    /* This is actually centred at 2095Hz, but gets the balance we want, due
-       to the asymmetric walls of the notch */
     biquad2_init (&det->notch,
-    	     	  (int32_t) (-0.7600000*32768.0),
-    	    	  (int32_t) (-0.1183852*32768.0),
-    	    	  (int32_t) (-0.5104039*32768.0),
-    	    	  (int32_t) ( 0.1567596*32768.0),
-    	    	  (int32_t) ( 1.0000000*32768.0));
+		  ECDIS_NOTCH_GAIN,
+		  ECDIS_NOTCH_A1,
+		  ECDIS_NOTCH_A2,
+		  ECDIS_NOTCH_B1,
+		  ECDIS_NOTCH_B2);
 
     det->channel_level = 0;
     det->notch_level = 0;    
@@ -52,23 +58,14 @@ static inline void echo_can_disable_detector_init (echo_can_disable_detector_sta
 }
 /*- End of function --------------------------------------------------------*/
 
-static inline int echo_can_disable_detector_update (echo_can_disable_detector_state_t *det,
-						    int16_t amp)
+/* Runs the tone state machine for one sample, given whether the channel
+   has energy and whether most of it is at 2100Hz */
+static inline int echo_can_disable_detector_cycle (echo_can_disable_detector_state_t *det,
+						   int energy, int tone)
 {
-	int16_t notched;
-
-    	notched = biquad2 (&det->notch, amp);
-    	/* Estimate the overall energy in the channel, and the energy in
-	   the notch (i.e. overall channel energy - tone energy => noise).
-	   Use abs instead of multiply for speed (is it really faster?).
-	   Damp the overall energy a little more for a stable result.
-	   Damp the notch energy a little less, so we don't damp out the
-	   blip every time the phase reverses */
-        det->channel_level += ((abs(amp) - det->channel_level) >> 5);
-	det->notch_level += ((abs(notched) - det->notch_level) >> 4);
-	if (det->channel_level >= 70) {
+	if (energy) {
 		/* There is adequate energy in the channel. Is it mostly at 2100Hz? */
-		if (det->notch_level*6 < det->channel_level) {
+		if (tone) {
 			det->tone_cycle_duration++;
 			/* The notch says yes, so we have the tone. */
 			if (!det->tone_present) {
@@ -100,4 +97,192 @@ static inline int echo_can_disable_detector_update (echo_can_disable_detector_st
 	return  det->hit;
 }
 /*- End of function --------------------------------------------------------*/
+
+static inline int echo_can_disable_detector_update (echo_can_disable_detector_state_t *det,
+						    int16_t amp)
+{
+	int16_t notched;
+
+    	notched = biquad2 (&det->notch, amp);
+    	/* Estimate the overall energy in the channel, and the energy in
+	   the notch (i.e. overall channel energy - tone energy => noise).
+	   Use abs instead of multiply for speed (is it really faster?).
+	   Damp the overall energy a little more for a stable result.
+	   Damp the notch energy a little less, so we don't damp out the
+	   blip every time the phase reverses */
+        det->channel_level += ((abs(amp) - det->channel_level) >> 5);
+	det->notch_level += ((abs(notched) - det->notch_level) >> 4);
+	return echo_can_disable_detector_cycle(det,
+					       det->channel_level >= 70,
+					       det->notch_level*6 < det->channel_level);
+}
+/*- End of function --------------------------------------------------------*/
+/* A bank of notch filters and level trackers for many detectors, laid out
+   detector by detector so that one sample of every detector is worked on
+   together.  The caller loads each detector in, filters a chunk, stores
+   the filter state back and runs echo_can_disable_detector_cycle() on the
+   resulting flags. */
+#define ECDIS_BANK_SIZE	64
+#define ECDIS_ENERGY	1
+#define ECDIS_TONE	2
+
+typedef struct
+{
+    int32_t z1[ECDIS_BANK_SIZE];
+    int32_t z2[ECDIS_BANK_SIZE];
+    int32_t channel_level[ECDIS_BANK_SIZE];
+    int32_t notch_level[ECDIS_BANK_SIZE];
+    int16_t amp[DAHDI_CHUNKSIZE][ECDIS_BANK_SIZE];
+    uint8_t flags[DAHDI_CHUNKSIZE][ECDIS_BANK_SIZE];
+} echo_can_disable_bank_t;
+
+static inline void echo_can_disable_bank_load (echo_can_disable_bank_t *bank, int i,
+					       const echo_can_disable_detector_state_t *det,
+					       const int16_t *amp)
+{
+	int x;
+
+	bank->z1[i] = det->notch.z1;
+	bank->z2[i] = det->notch.z2;
+	bank->channel_level[i] = det->channel_level;
+	bank->notch_level[i] = det->notch_level;
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		bank->amp[x][i] = amp[x];
+}
+/*- End of function --------------------------------------------------------*/
+
+static inline void echo_can_disable_bank_store (const echo_can_disable_bank_t *bank, int i,
+						echo_can_disable_detector_state_t *det)
+{
+	det->notch.z2 = bank->z2[i];
+	det->notch.z1 = bank->z1[i];
+	det->channel_level = bank->channel_level[i];
+	det->notch_level = bank->notch_level[i];
+}
+/*- End of function --------------------------------------------------------*/
+
+/* Same as the filtering in echo_can_disable_detector_update() */
+static inline void echo_can_disable_bank_filter (echo_can_disable_bank_t *bank,
+						 int x, int i)
+{
+	const int16_t amp = bank->amp[x][i];
+	const int32_t z1 = bank->z1[i];
+	const int32_t z2 = bank->z2[i];
+	int32_t z0;
+	int16_t notched;
+
+	z0 = amp*ECDIS_NOTCH_GAIN + z1*ECDIS_NOTCH_A1 + z2*ECDIS_NOTCH_A2;
+	notched = (z0 + z1*ECDIS_NOTCH_B1 + z2*ECDIS_NOTCH_B2) >> 15;
+	bank->z2[i] = z1;
+	bank->z1[i] = z0 >> 15;
+	bank->channel_level[i] += ((abs(amp) - bank->channel_level[i]) >> 5);
+	bank->notch_level[i] += ((abs(notched) - bank->notch_level[i]) >> 4);
+	bank->flags[x][i] =
+		((bank->channel_level[i] >= 70) ? ECDIS_ENERGY : 0) |
+		((bank->notch_level[i]*6 < bank->channel_level[i]) ? ECDIS_TONE : 0);
+}
+/*- End of function --------------------------------------------------------*/
+
+#if defined(CONFIG_X86_64) && (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0))
+#define ECDIS_BANK_SSE41
+
+static const int32_t __ecdis_bank_k[7][4] __aligned(16) = {
+    { ECDIS_NOTCH_GAIN, ECDIS_NOTCH_GAIN, ECDIS_NOTCH_GAIN, ECDIS_NOTCH_GAIN },
+    { ECDIS_NOTCH_A1, ECDIS_NOTCH_A1, ECDIS_NOTCH_A1, ECDIS_NOTCH_A1 },
+    { ECDIS_NOTCH_A2, ECDIS_NOTCH_A2, ECDIS_NOTCH_A2, ECDIS_NOTCH_A2 },
+    { ECDIS_NOTCH_B1, ECDIS_NOTCH_B1, ECDIS_NOTCH_B1, ECDIS_NOTCH_B1 },
+    { ECDIS_NOTCH_B2, ECDIS_NOTCH_B2, ECDIS_NOTCH_B2, ECDIS_NOTCH_B2 },
+    { 69, 69, 69, 69 },
+    { 6, 6, 6, 6 },
+};
+
+/* echo_can_disable_bank_filter() for detectors i to i + 3 with SSE4.1.
+   The caller owns the FPU. */
+static inline void echo_can_disable_bank_filter4_sse41 (echo_can_disable_bank_t *bank,
+							int x, int i)
+{
+	__asm__ __volatile__ (
+		"pmovsxwd %[amp], %%xmm0;\n"
+		"movdqu %[z1], %%xmm1;\n"
+		"movdqu %[z2], %%xmm2;\n"
+		/* z0 in %%xmm3 */
+		"movdqa %%xmm0, %%xmm3;\n"
+		"pmulld 0(%[k]), %%xmm3;\n"
+		"movdqa %%xmm1, %%xmm4;\n"
+		"pmulld 16(%[k]), %%xmm4;\n"
+		"paddd %%xmm4, %%xmm3;\n"
+		"movdqa %%xmm2, %%xmm4;\n"
+		"pmulld 32(%[k]), %%xmm4;\n"
+		"paddd %%xmm4, %%xmm3;\n"
+		/* output of the notch in %%xmm4 */
+		"movdqa %%xmm1, %%xmm4;\n"
+		"pmulld 48(%[k]), %%xmm4;\n"
+		"paddd %%xmm3, %%xmm4;\n"
+		"pmulld 64(%[k]), %%xmm2;\n"
+		"paddd %%xmm2, %%xmm4;\n"
+		"movdqu %%xmm1, %[z2];\n"
+		"psrad $15, %%xmm3;\n"
+		"movdqu %%xmm3, %[z1];\n"
+		"psrad $15, %%xmm4;\n"
+		"pslld $16, %%xmm4;\n"
+		"psrad $16, %%xmm4;\n"
+		"pabsd %%xmm4, %%xmm4;\n"
+		/* levels in %%xmm5 and %%xmm6 */
+		"pabsd %%xmm0, %%xmm0;\n"
+		"movdqu %[cl], %%xmm5;\n"
+		"psubd %%xmm5, %%xmm0;\n"
+		"psrad $5, %%xmm0;\n"
+		"paddd %%xmm0, %%xmm5;\n"
+		"movdqu %%xmm5, %[cl];\n"
+		"movdqu %[nl], %%xmm6;\n"
+		"psubd %%xmm6, %%xmm4;\n"
+		"psrad $4, %%xmm4;\n"
+		"paddd %%xmm4, %%xmm6;\n"
+		"movdqu %%xmm6, %[nl];\n"
+		/* flags */
+		"movdqa %%xmm5, %%xmm0;\n"
+		"pcmpgtd 80(%[k]), %%xmm0;\n"
+		"psrld $31, %%xmm0;\n"
+		"pmulld 96(%[k]), %%xmm6;\n"
+		"pcmpgtd %%xmm6, %%xmm5;\n"
+		"psrld $31, %%xmm5;\n"
+		"pslld $1, %%xmm5;\n"
+		"por %%xmm5, %%xmm0;\n"
+		"packusdw %%xmm0, %%xmm0;\n"
+		"packuswb %%xmm0, %%xmm0;\n"
+		"movd %%xmm0, %[flags];\n"
+	    : [z1] "+m" (*(int32_t (*)[4])&bank->z1[i]),
+	      [z2] "+m" (*(int32_t (*)[4])&bank->z2[i]),
+	      [cl] "+m" (*(int32_t (*)[4])&bank->channel_level[i]),
+	      [nl] "+m" (*(int32_t (*)[4])&bank->notch_level[i]),
+	      [flags] "=m" (*(uint32_t *)&bank->flags[x][i])
+	    : [amp] "m" (*(const int16_t (*)[4])&bank->amp[x][i]),
+	      [k] "r" (__ecdis_bank_k));
+}
+/*- End of function --------------------------------------------------------*/
+#endif
+
+/* Filters the chunk of the first count detectors of the bank. sse41 may
+   only be set by callers that own the FPU on a CPU with SSE4.1. */
+static inline void echo_can_disable_bank_run (echo_can_disable_bank_t *bank,
+					      int count, int sse41)
+{
+	int x, i = 0;
+
+#ifdef ECDIS_BANK_SSE41
+	if (sse41) {
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+			for (i = 0; i + 4 <= count; i += 4)
+				echo_can_disable_bank_filter4_sse41(bank, x, i);
+		}
+	}
+#endif
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		int j;
+
+		for (j = i; j < count; j++)
+			echo_can_disable_bank_filter(bank, x, j);
+	}
+}
+/*- End of function --------------------------------------------------------*/
 /*- End of file ------------------------------------------------------------*/
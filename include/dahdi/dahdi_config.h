@@ -68,6 +68,28 @@
  */
 /* #define CONFIG_DAHDI_MMX */
 
+/*
+ * Define CONFIG_DAHDI_SIMD_MIX to use SSE2 (x86_64) or NEON (arm64) for the
+ * saturating conference arithmetic.  On x86_64 the conversion of linear
+ * audio to mu-law / A-law is then also done with SSE2, and the CED and
+ * DTMF / MF detectors of a pass with SSE4.1 if the CPU has it, in the
+ * same sections.  The FPU is claimed once per span and once per master span
+ * pass instead of per channel, and the plain C version is used whenever
+ * the FPU cannot be used.  Can be turned off at load time with the
+ * simd_mix module parameter.  Has no effect together with
+ * CONFIG_DAHDI_MMX.
+ */
+/* #define CONFIG_DAHDI_SIMD_MIX */
+
+/*
+ * Define CONFIG_DAHDI_SIMD_EC to let the MG2 and KB1 software echo
+ * cancellers run their FIR convolution with SSE2 or AVX2 (x86_64) or NEON
+ * (arm64), picked at load time and checked against the C version then.
+ * Can be turned off with their simd module parameter.  Has no effect
+ * together with CONFIG_DAHDI_MMX.
+ */
+/* #define CONFIG_DAHDI_SIMD_EC */
+
 /* We now use the linux kernel config to detect which options to use */
 /* You can still override them below */
 #if defined(CONFIG_HDLC) || defined(CONFIG_HDLC_MODULE)
@@ -55,6 +55,7 @@
 #endif
 #include <linux/device.h>
 #include <linux/sysfs.h>
+#include <linux/hrtimer.h>
 
 #include <linux/poll.h>
 
@@ -114,7 +115,18 @@ static inline int pci_set_dma_mask(struct pci_dev *dev, u64 mask)
 #define DAHDI_MIN_CHUNKSIZE	 DAHDI_CHUNKSIZE
 #define DAHDI_DEFAULT_CHUNKSIZE	 DAHDI_CHUNKSIZE
 #define DAHDI_MAX_CHUNKSIZE 	 DAHDI_CHUNKSIZE
-#define DAHDI_CB_SIZE		 (1 << 3)
+/*! A span may take several chunks per dahdi_receive() / dahdi_transmit() call
+   (see dahdi_span_ops.setchunksize), up to 10 ms worth */
+#define DAHDI_MAX_SPAN_CHUNKSIZE (DAHDI_CHUNKSIZE * 10)
+/*! Samples in a chunk of a 16 kHz pseudo channel (see DAHDI_SET_WIDEBAND) */
+#define DAHDI_WB_CHUNKSIZE	 (DAHDI_CHUNKSIZE * 2)
+/*! Chunks a conference queue holds; the chunks of a whole span service
+   interval may wait there for the master span passes */
+#define DAHDI_CB_SIZE		 (1 << 4)
+/*! Buckets of the latency histograms. Bucket 0 counts 0 ns, bucket n
+   counts durations in [2^(n-1), 2^n) ns, the last one also anything
+   longer */
+#define DAHDI_LATENCY_BUCKETS	32
 
 /* DAHDI operates at 8Khz by default */
 #define DAHDI_MS_TO_SAMPLES(ms) ((ms) * 8)
@@ -177,6 +189,7 @@ struct confq {
 
 struct dahdi_chan;
 struct dahdi_echocan_state;
+struct dahdi_digit_detector;
 
 /*! Features a DAHDI echo canceler (software or hardware) can provide to the DAHDI core. */
 struct dahdi_echocan_features {
@@ -245,6 +258,27 @@ struct dahdi_echocan_ops {
 	 */
 	void (*echocan_process)(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
 
+	/*! \brief Optional: process the same number of samples for several
+	 * instances in one call.
+	 * \param[in,out] ecs Array of \a count state structures, all created
+	 * by the factory that provides these ops.
+	 * \param[in,out] isig \a count blocks of \a size receive samples, one
+	 * per entry of \a ecs, back to back (will be modified).
+	 * \param[in] iref \a count blocks of \a size transmit samples.
+	 * \param[in] count The number of entries in \a ecs.
+	 * \param[in] size The number of samples per block.
+	 *
+	 * Must give the same result as calling echocan_process on each entry.
+	 * Used by dahdi_ec_span(); the core already holds the FPU (when
+	 * CONFIG_DAHDI_MMX or ECHO_CAN_FP is set) for the whole call, but
+	 * no channel lock. The instances are kept from being freed meanwhile.
+	 *
+	 * \return Nothing.
+	 */
+	void (*echocan_process_batch)(struct dahdi_echocan_state *const *ecs,
+				      short *isig, const short *iref,
+				      u32 count, u32 size);
+
 	/*! \brief Retrieve events from the echocan.
 	 * \param[in,out] ec Pointer to the state structure.
 	 *
@@ -284,6 +318,63 @@ struct dahdi_echocan_ops {
 #endif
 };
 
+/*! Different size classes a dahdi_echocan_pool keeps */
+#define DAHDI_EC_POOL_SIZES	8
+
+/*! Instances of one size class in a dahdi_echocan_pool */
+struct dahdi_echocan_pool_bucket {
+	size_t size;			/*!< Largest instance, a power of two */
+	struct kmem_cache *cache;	/*!< Cache line aligned slab of them */
+	struct list_head free;		/*!< Instances waiting for reuse */
+	unsigned int nfree;
+	unsigned int nused;
+	char name[32];			/*!< Of the slab cache */
+};
+
+/*! \brief Echo canceler instances kept for reuse, see dahdi_ec_pool_alloc().
+ *
+ * A factory whose state is a single block sized by the tail length can
+ * take its instances from a pool instead of kzalloc() / kfree(), so call
+ * setup and hangup do not go through the allocator.
+ */
+struct dahdi_echocan_pool {
+	const char *name;		/*!< Shown in the ec_pool_stats */
+	spinlock_t lock;		/*!< Protects the lists and counters */
+	struct mutex create;		/*!< Serializes adding buckets */
+	struct dahdi_echocan_pool_bucket buckets[DAHDI_EC_POOL_SIZES];
+	unsigned long hits;		/*!< Instances reused */
+	unsigned long misses;		/*!< Instances that had to be allocated */
+	unsigned long shrunk;		/*!< Instances given back to the slab */
+};
+
+/*! \brief Set up a pool and fill it for the common tail length.
+ * \param[in] pool The pool, usually static in the echo canceler module.
+ * \param[in] name Name of the echo canceler.
+ * \param[in] size Size of an instance with a 128 tap (16 ms) tail.
+ *
+ * Preallocates as many instances as the ec_pool parameter of dahdi says.
+ *
+ * \retval Zero on success.
+ * \retval Non-zero on failure (a standard error number).
+ */
+int dahdi_ec_pool_init(struct dahdi_echocan_pool *pool, const char *name,
+		       size_t size);
+
+/*! \brief Free a pool once its factory is unregistered and no instance is left.
+ * \retval Zero on success.
+ * \retval -EBUSY if instances are still in use; the pool is left untouched.
+ */
+int dahdi_ec_pool_destroy(struct dahdi_echocan_pool *pool);
+
+/*! \brief Take a zeroed, cache line aligned instance of size bytes from a pool.
+ *
+ * Used like kzalloc(size, GFP_KERNEL), and may sleep.
+ */
+void *dahdi_ec_pool_alloc(struct dahdi_echocan_pool *pool, size_t size);
+
+/*! \brief Give an instance from dahdi_ec_pool_alloc() back to its pool. */
+void dahdi_ec_pool_free(struct dahdi_echocan_pool *pool, void *ptr);
+
 /*! A factory for creating instances of software echo cancelers to be used on DAHDI channels. */
 struct dahdi_echocan_factory {
 
@@ -306,6 +397,9 @@ struct dahdi_echocan_factory {
 	 */
 	int (*echocan_create)(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			      struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
+
+	/*! Pool the instances come from, if any, for its statistics. */
+	struct dahdi_echocan_pool *pool;
 };
 
 /*! \brief Register an echo canceler factory with the DAHDI core.
@@ -424,6 +518,9 @@ struct dahdi_chan {
 #endif
 	spinlock_t lock;
 	struct mutex mutex;
+	/*! One reader / writer of the blocks at a time, see dahdi-base.c */
+	struct mutex read_mutex;
+	struct mutex write_mutex;
 	char name[40];
 	/* Specified by DAHDI */
 	/*! \brief DAHDI channel number */
@@ -441,6 +538,10 @@ struct dahdi_chan {
 	int v3_1;
 	int toneflags;
 	struct sf_detect_state rd;
+	/*! DAHDI_TONEDETECT flags the channel was set up with */
+	int digitdetect;
+	/*! DTMF / MF detector run by dahdi, if the hardware does not */
+	struct dahdi_digit_detector *digitdet;
 
 	struct dahdi_chan *master;	/*!< Our Master channel (could be us) */
 	/*! \brief Next slave (if appropriate) */
@@ -498,6 +599,14 @@ struct dahdi_chan {
 	int		writeidx[DAHDI_MAX_NUM_BUFS];  /*!< current write pointer */
 	
 	int		numbufs;			/*!< How many buffers in channel */
+	struct dahdi_ring *ring;	/*!< Buffers shared with user space, if any */
+	/* Block positions (0 .. 2 * numbufs - 1), each advanced by one side */
+	u32		rx_head;	/*!< read blocks filled (interrupt side) */
+	u32		rx_tail;	/*!< read blocks consumed (reader) */
+	u32		rx_done;	/*!< consumed blocks handed back (locked) */
+	u32		tx_head;	/*!< write blocks filled (writer) */
+	u32		tx_done;	/*!< filled blocks queued (locked) */
+	u32		tx_tail;	/*!< write blocks sent (interrupt side) */
 	int		txbufpolicy;			/*!< Buffer policy */
 	int		txdisable;				/*!< Disable transmitter */
 	
@@ -535,6 +644,7 @@ struct dahdi_chan {
 	int		confmode;  /*! conference mode */
 	int		confmute; /*! conference mute mode */
 	struct dahdi_chan *conf_chan;
+	atomic_t	monitors; /*! Channels whose conf_chan is this one */
 
 	/* Incoming and outgoing conference chunk queues for
 	   communicating between DAHDI master time and
@@ -546,9 +656,20 @@ struct dahdi_chan {
 	unsigned char getraw[DAHDI_MAX_CHUNKSIZE];		/*!< Last received raw data */
 	short	putlin[DAHDI_MAX_CHUNKSIZE];			/*!< Last received samples */
 	unsigned char putraw[DAHDI_MAX_CHUNKSIZE];		/*!< Last received raw data */
+	u32	rxenergy;	/*!< Mean square of the last received chunk */
+	u32	rxnoise;	/*!< Noise floor of rxenergy */
+	int	rxhang;		/*!< Chunks until voice is no longer reported */
+	u32	rxsilent;	/*!< Chunks since voice was last reported */
+	u32	rxblk_energy;	/*!< Loudest chunk of the ring block being filled */
+	u32	rxblk_flags;	/*!< DAHDI_RXLEVEL_VOICE if that block holds voice */
 	short	conflast[DAHDI_MAX_CHUNKSIZE];			/*!< Last conference sample -- base part of channel */
 	short	conflast1[DAHDI_MAX_CHUNKSIZE];		/*!< Last conference sample  -- pseudo part of channel */
 	short	conflast2[DAHDI_MAX_CHUNKSIZE];		/*!< Previous last conference sample -- pseudo part of channel */
+	u32	confenergy;	/*!< Smoothed energy talked into a loudest-N conference */
+	int	wideband;	/*!< 16 kHz signed linear, see DAHDI_SET_WIDEBAND */
+	short	wbconflast[DAHDI_WB_CHUNKSIZE];	/*!< Last wideband conference sample */
+	short	wbup[2];	/*!< Last sample upsampled into a wideband conference, rx and tx */
+	short	wbdown[2];	/*!< Last odd sample of the wideband audio downsampled, rx and tx */
 
 
 	/*! The echo canceler module that should be used to create an
@@ -559,6 +680,8 @@ struct dahdi_chan {
 	const struct dahdi_echocan_factory *ec_current;
 	/*! The state data of the echo canceler instance in use */
 	struct dahdi_echocan_state *ec_state;
+	/*! Set while ec_state is being run by a batch without the lock */
+	int ec_batched;
 
 	/* RBS timings  */
 	int		prewinktime;  /*!< pre-wink time (ms) */
@@ -823,8 +946,12 @@ struct dahdi_span_ops {
 	struct module *owner;		/*!< Which module is exporting this span. */
 
 	/*   ==== Span Callback Operations ====   */
-	/*! Req: Set the requested chunk size.  This is the unit in which you must
-	   report results for conferencing, etc */
+	/*! Opt: Service the span every chunksize samples (a multiple of
+	   DAHDI_CHUNKSIZE) from now on.  A driver that then hands over several
+	   chunks per dahdi_receive() / dahdi_transmit() / dahdi_ec_span() call
+	   sets span->chunks itself, in step with its interrupt handler, and
+	   makes readchunk / writechunk of every channel that long.  One that
+	   keeps calling once per chunk only batches its own transport. */
 	int (*setchunksize)(struct dahdi_span *span, int chunksize);
 
 	/*! Opt: Configure the span (if appropriate) */
@@ -916,6 +1043,10 @@ struct dahdi_span_ops {
 	/*! Called when the spantype / linemode is changed before the span is
 	 * assigned a number. */
 	int (*set_spantype)(struct dahdi_span *span, enum spantypes st);
+
+	/*! Opt: Describe the receive jitter buffer of the span, for its
+	 * rx_jitter file in sysfs. Returns the length written to buf. */
+	int (*rx_jitter_stats)(struct dahdi_span *span, char *buf, size_t size);
 };
 
 /**
@@ -964,6 +1095,8 @@ struct dahdi_span {
 
 	int maintstat;			/*!< Maintenance state */
 	int mainttimer;			/*!< Maintenance timer */
+	int chunks;			/*!< DAHDI_CHUNKSIZE blocks per service
+					     call (0 is the same as 1) */
 
 	struct dahdi_chan **chans;	/*!< Member channel structures */
 
@@ -973,6 +1106,14 @@ struct dahdi_span {
 	int spanno;			/*!< Span number for DAHDI */
 	int offset;			/*!< Offset within a given card */
 	int lastalarms;			/*!< Previous alarms */
+	/*! Channels (by chanpos - 1) that need the full transmit / receive
+	 *  path. Cleared bits get idle code without taking the chan lock. */
+	DECLARE_BITMAP(active_chans, DAHDI_MAX_CHANNELS);
+	unsigned int skipped_channels;	/*!< Idle channels in the last pass */
+	u64 rx_last_ns;			/*!< When _dahdi_receive() last ran */
+	/*! log2 histogram of how far each _dahdi_receive() call was from
+	 *  the expected period (see DAHDI_LATENCY_BUCKETS) */
+	u32 rx_latency[DAHDI_LATENCY_BUCKETS];
 
 #ifdef CONFIG_DAHDI_WATCHDOG
 	int watchcounter;
@@ -1079,6 +1220,52 @@ struct dahdi_transcoder {
 #define DAHDI_WATCHSTATE_RECOVERING	2
 #define DAHDI_WATCHSTATE_FAILED		3
 
+/*! Receive jitter buffer of a dynamic span. Lengths are in frames (a
+ *  sample of every channel). */
+struct dahdi_dynamic_jb {
+	spinlock_t lock;
+	unsigned char *buf;
+	int head;		/*!< Frame played out next */
+	int fill;		/*!< Frames buffered */
+	int target;		/*!< Frames buffered before playing out */
+	int playing;		/*!< Not refilling after an underrun */
+	int lastlen;		/*!< Frames in the last message */
+	int avg;		/*!< fill, low pass filtered, in 1/256 frames */
+	int jitter;		/*!< Arrival jitter, in 1/256 frames */
+	int hold;		/*!< Ticks until the next slip or stuff */
+	unsigned int ticks;	/*!< Ticks (playout calls) so far */
+	unsigned int arrival;	/*!< ticks at the last message */
+	unsigned long seen;	/*!< Bit n: message rxcnt - 1 - n arrived */
+	unsigned long filled;	/*!< Bit n: it has frames in the buffer */
+	/* Drift measurement */
+	unsigned int wticks;	/*!< Ticks played out in this window */
+	unsigned int wframes;	/*!< Frames played out in this window */
+	int wavg;		/*!< avg when the window started */
+	int drift;		/*!< Of the remote clock, in 1/1000 ppm */
+	int drift_valid;
+	/* Arrival timing of the timing master, which is not buffered: its
+	 * messages drive the tick, so they are timed by the local clock */
+	int master;		/*!< The figures above are for the master */
+	u64 rxtime;		/*!< ktime_get_ns() at the last message */
+	u64 wstart;		/*!< rxtime when this window started */
+	s64 rxframes;		/*!< Frames received, lost ones included */
+	s64 wmin;		/*!< Least transit offset in this window, ns */
+	u64 wmin_at;		/*!< rxtime of wmin */
+	s64 pmin;		/*!< wmin of the window before */
+	u64 pmin_at;		/*!< rxtime of pmin */
+	int pmin_valid;
+	int due;		/*!< Master chunks to play out at once */
+	int timed;		/*!< The playout timer is running */
+	/* Counters */
+	unsigned int late;
+	unsigned int lost;
+	unsigned int duplicate;
+	unsigned int reordered;	/*!< Late, but in time for playout */
+	unsigned int underruns;
+	unsigned int overruns;
+	unsigned int slips;
+	unsigned int stuffs;
+};
 
 struct dahdi_dynamic {
 	char addr[40];
@@ -1087,7 +1274,7 @@ struct dahdi_dynamic {
 	struct kref kref;
 	long rxjif;
 	unsigned short txcnt;
-	unsigned short rxcnt;
+	unsigned short rxcnt;	/*!< Counter of the next message expected */
 	struct dahdi_device *ddev;
 	struct dahdi_span span;
 	struct dahdi_chan *chans[256];
@@ -1095,7 +1282,13 @@ struct dahdi_dynamic {
 	void *pvt;
 	int timing;
 	int master;
+	int chunks;		/*!< Chunks sent per message */
+	int txchunks;		/*!< chunks of the message being collected */
+	int txpos;		/*!< Chunks collected so far */
 	unsigned char *msgbuf;
+	unsigned char *txbuf;	/*!< Where that message is built */
+	struct dahdi_dynamic_jb jb;
+	struct hrtimer playout;	/*!< Spreads the chunks of the master */
 	struct device *dev;
 
 	struct list_head list;
@@ -1117,9 +1310,23 @@ struct dahdi_dynamic_driver {
 	/*! Transmit a given message */
 	void (*transmit)(struct dahdi_dynamic *d, u8 *msg, size_t msglen);
 
+	/*! Opt: Return a buffer of msglen bytes for the next message to be
+	    built in place (e.g. in the data of a network buffer), or NULL
+	    to have it built in msgbuf and passed to transmit().  May be
+	    called in interrupt context. */
+	u8 *(*getbuf)(struct dahdi_dynamic *d, size_t msglen);
+
+	/*! Send the message built in the buffer from getbuf().  Required
+	    with getbuf. */
+	void (*sendbuf)(struct dahdi_dynamic *d, u8 *msg, size_t msglen);
+
 	/*! Flush any pending messages */
 	int (*flush)(void);
 
+	/*! Opt: Check that messages of chunksize samples per channel can
+	    be carried.  Without it only DAHDI_CHUNKSIZE is supported. */
+	int (*setchunksize)(struct dahdi_dynamic *d, int chunksize);
+
 	struct list_head list;
 	struct module *owner;
 
@@ -1450,6 +1657,7 @@ timer_setup(struct timer_list *timer,
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
 #define refcount_read atomic_read
+#define get_random_u32 get_random_int
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
 #define dahdi_ktime_equal ktime_equal
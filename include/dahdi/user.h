@@ -247,6 +247,11 @@ enum {
 
 #define DAHDI_TONEDETECT_ON	(1 << 0)		/* Detect tones */
 #define DAHDI_TONEDETECT_MUTE	(1 << 1)		/* Mute audio in received channel */
+#define DAHDI_TONEDETECT_SOFT	(1 << 2)		/* Detect in dahdi if the hardware cannot */
+#define DAHDI_TONEDETECT_MFR1	(1 << 3)		/* Detect MFR1 digits instead, in dahdi */
+#define DAHDI_TONEDETECT_MFR2_FWD	(1 << 4)	/* Detect MFR2 forward digits instead, in dahdi */
+#define DAHDI_TONEDETECT_MFR2_REV	(1 << 5)	/* Detect MFR2 backward digits instead, in dahdi */
+#define DAHDI_TONEDETECT_NOAUDIO	(1 << 6)	/* Do not queue received audio for read() */
 
 /* Define the max # of outgoing DTMF, MFR1 or MFR2 digits to queue */
 #define DAHDI_MAX_DTMF_BUF 256
@@ -291,7 +296,7 @@ enum {
 
 #define DAHDI_MAX_SPANS			128	/* Max, 128 spans */
 #define DAHDI_MAX_CHANNELS		1024	/* Max, 1024 channels */
-#define DAHDI_MAX_CONF			1024	/* Max, 1024 conferences */
+#define DAHDI_MAX_CONF			8192	/* Max, 8192 conferences */
 
 /* Conference modes */
 #define DAHDI_CONF_MODE_MASK		0xFF		/* mask for modes */
@@ -314,6 +319,19 @@ enum {
 #define DAHDI_CONF_PSEUDO_LISTENER	0x400		/* pseudo is a listener on the conference */
 #define DAHDI_CONF_PSEUDO_TALKER	0x800		/* pseudo is a talker on the conference */
 
+/*
+ * Loudest-N mixing, passed to DAHDI_SETCONF in the upper bits of confmode.
+ * With N set, only the N loudest members of the conference that are
+ * talking are mixed and silent members add nothing.  0 leaves the
+ * conference's setting as is, DAHDI_CONF_LOUDEST_OFF mixes everyone again.
+ * DAHDI_SETCONF returns the conference's current setting in the same bits.
+ */
+#define DAHDI_CONF_LOUDEST_MASK		0xFF0000
+#define DAHDI_CONF_LOUDEST_SHIFT	16
+#define DAHDI_CONF_LOUDEST_MAX		16		/* largest N */
+#define DAHDI_CONF_LOUDEST_OFF		0xFF
+#define DAHDI_CONF_LOUDEST(n)		(((n) << DAHDI_CONF_LOUDEST_SHIFT) & DAHDI_CONF_LOUDEST_MASK)
+
 /* Alarm Condition bits */
 #define DAHDI_ALARM_NONE		0	 /* No alarms */
 #define DAHDI_ALARM_RECOVER		(1 << 0) /* Recovering from alarm */
@@ -1035,7 +1053,11 @@ struct dahdi_hwgain {
 #define DAHDI_SET_HWGAIN		_IOW(DAHDI_CODE, 86, struct dahdi_hwgain)
 
 /*
- * Enable tone detection -- implemented by low level driver
+ * Enable tone detection -- implemented by low level driver, or by dahdi
+ * itself when DAHDI_TONEDETECT_SOFT or an MF mode is asked for.  Digits are
+ * reported as DAHDI_EVENT_DTMFDOWN and DAHDI_EVENT_DTMFUP events, also for
+ * MF.  With DAHDI_TONEDETECT_NOAUDIO the channel only reports digits and
+ * read() returns no audio.
  */
 #define DAHDI_TONEDETECT		_IOW(DAHDI_CODE, 91, int)
 
@@ -1102,6 +1124,152 @@ struct dahdi_vmwi_info {
  */
 #define DAHDI_BUFFER_EVENTS		_IOW(DAHDI_CODE, 105, int)
 
+/*
+ * Shared memory ring for channel data
+ *
+ * DAHDI_RING_SETUP moves the read and write buffers of a channel (as set with
+ * DAHDI_SET_BUFINFO) into memory that the application then maps with
+ * mmap(fd, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0).  From then on
+ * read() and write() return EBUSY; blocks are passed through the ring
+ * without a system call per block:
+ *
+ * - Receive: DAHDI fills block (rx_head % numbufs) and advances rx_head.
+ *   The application consumes block (rx_tail % numbufs), rx_len[] bytes
+ *   long, and advances rx_tail.
+ * - Transmit: the application fills block (tx_head % numbufs), sets
+ *   tx_len[] and advances tx_head, as long as fewer than numbufs blocks are
+ *   between tx_tail and tx_head.  DAHDI advances tx_tail as blocks are sent.
+ *
+ * Blocks are always in the channel's law; DAHDI_SETLINEAR does not apply.
+ * The positions run from 0 to 2 * numbufs - 1 and wrap to 0, so the ring is
+ * empty when head == tail and full when they are numbufs apart.  Each is only
+ * advanced by the side named above.  Whatever the application writes is
+ * picked up on the next chunk or on poll().  If eventfd is not -1, the
+ * eventfd is signalled for each received block so one eventfd can serve
+ * many channels.  DAHDI_FLUSH drops the blocks of the flushed direction by
+ * moving rx_tail up to rx_head or tx_tail up to tx_head.
+ * rx_flags[] and rx_energy[] tell whether a received block held voice, see
+ * DAHDI_GET_RXLEVEL.  DAHDI_RING_RELEASE (or closing the channel) returns
+ * the channel to regular read()/write().
+ *
+ * Not available on HDLC / network channels.
+ */
+#define DAHDI_RING_VERSION		3
+
+struct dahdi_ring_hdr {
+	__u32 version;		/* DAHDI_RING_VERSION */
+	__u32 blocksize;	/* Size of each block in bytes */
+	__u32 numbufs;		/* Number of blocks in each direction */
+	__u32 rx_offset;	/* Offset of the receive blocks in the map */
+	__u32 tx_offset;	/* Offset of the transmit blocks in the map */
+	__u32 rx_head;		/* Receive blocks filled (DAHDI) */
+	__u32 rx_tail;		/* Receive blocks consumed (application) */
+	__u32 tx_head;		/* Transmit blocks filled (application) */
+	__u32 tx_tail;		/* Transmit blocks sent (DAHDI) */
+	__u32 rx_len[DAHDI_MAX_NUM_BUFS];
+	__u32 tx_len[DAHDI_MAX_NUM_BUFS];
+	__u32 rx_flags[DAHDI_MAX_NUM_BUFS];	/* DAHDI_RXLEVEL_VOICE */
+	__u32 rx_energy[DAHDI_MAX_NUM_BUFS];	/* See DAHDI_GET_RXLEVEL */
+};
+
+struct dahdi_ring_setup {
+	__s32 eventfd;		/* eventfd to signal, or -1 */
+	__u32 size;		/* Size of the map (filled in by DAHDI) */
+};
+
+#define DAHDI_RING_SETUP		_IOWR(DAHDI_CODE, 106, struct dahdi_ring_setup)
+#define DAHDI_RING_RELEASE		_IO(DAHDI_CODE, 107)
+
+/*
+ * Read and write many channels with one call on the control device
+ *
+ * Each entry is serviced like a non-blocking write() followed by a
+ * non-blocking read() on fd, a channel the caller has open (/dev/dahdi/chan/N,
+ * /dev/dahdi/pseudo or a channel selected with DAHDI_SPECIFY), and with the
+ * same permissions.  Readers and writers of a channel take turns with
+ * read() and write() on it.  readlen / writelen return the
+ * number of bytes moved (0 when nothing was ready), status the state of
+ * the channel afterwards and error a negative errno for that channel only.
+ * A pending event (DAHDI_BULK_EVENT) stops data the same way ELAST does for
+ * read() and write(); fetch it with DAHDI_GETEVENT on the channel.
+ */
+#define DAHDI_BULK_READ		(1 << 0)	/* Fill readbuf */
+#define DAHDI_BULK_WRITE	(1 << 1)	/* Queue writebuf */
+
+#define DAHDI_BULK_READABLE	(1 << 0)	/* More data can be read */
+#define DAHDI_BULK_WRITABLE	(1 << 1)	/* More data can be written */
+#define DAHDI_BULK_EVENT	(1 << 2)	/* An event is pending */
+
+struct dahdi_bulk_chan {
+	__s32 fd;		/* File descriptor of the open channel */
+	__u32 flags;		/* DAHDI_BULK_READ / DAHDI_BULK_WRITE */
+	__u64 readbuf;		/* Where to read to */
+	__u64 writebuf;		/* What to write */
+	__s32 readlen;		/* Size of readbuf / bytes read */
+	__s32 writelen;		/* Bytes in writebuf / bytes written */
+	__u32 status;		/* DAHDI_BULK_READABLE etc. (filled in) */
+	__s32 error;		/* 0 or negative errno (filled in) */
+};
+
+struct dahdi_bulk_io {
+	__u32 count;		/* Number of entries, at most DAHDI_MAX_CHANNELS */
+	__u32 reserved;		/* Always set to 0 */
+	__u64 chans;		/* Pointer to count struct dahdi_bulk_chan */
+};
+
+#define DAHDI_BULK_IO			_IOW(DAHDI_CODE, 108, struct dahdi_bulk_io)
+
+/*
+ * Set the processing chunk size of a span
+ *
+ * chunksize is in samples: a multiple of 8 (1 ms) up to 80 (10 ms).  A span
+ * with a larger chunk is serviced that much less often, trading latency for
+ * less per call overhead; DAHDI still processes it in 1 ms steps.  Span 0
+ * sets the period of the core timer, which runs the pseudo channels when no
+ * span provides timing.  EOPNOTSUPP if the span's driver cannot do it.
+ */
+struct dahdi_chunkconfig {
+	int span;		/* Span number, or 0 for the core timer */
+	int chunksize;		/* Samples per channel per service */
+};
+
+#define DAHDI_SET_CHUNKSIZE		_IOW(DAHDI_CODE, 109, struct dahdi_chunkconfig)
+
+/*
+ * Level of the audio received on a channel
+ *
+ * DAHDI measures every chunk received on a span channel.  energy is the
+ * mean square of the linear samples of the last chunk (0 to 2^30) and
+ * noise the floor that energy has been tracked down to.
+ * DAHDI_RXLEVEL_VOICE is set while chunks stand 9 dB above the floor (and
+ * above about -50 dBFS), and for 200 ms after; silent counts the chunks
+ * since then.  Rings set up with DAHDI_RING_SETUP carry the flag and the
+ * loudest chunk energy of every received block as well, so silent blocks
+ * can be dropped without looking at the audio.
+ */
+#define DAHDI_RXLEVEL_VOICE	(1 << 0)	/* Voice in the chunk or block */
+
+struct dahdi_rxlevel {
+	__u32 energy;		/* Mean square of the last chunk */
+	__u32 noise;		/* Noise floor of energy */
+	__u32 flags;		/* DAHDI_RXLEVEL_VOICE */
+	__u32 silent;		/* Chunks since voice was last seen */
+};
+
+#define DAHDI_GET_RXLEVEL		_IOR(DAHDI_CODE, 110, struct dahdi_rxlevel)
+
+/*
+ * Put a pseudo channel in 16 kHz (wideband) mode, or back with 0.
+ *
+ * A wideband pseudo channel reads and writes signed linear samples at
+ * 16 kHz, 32 bytes a millisecond, and DAHDI_SET_BLOCKSIZE counts bytes.
+ * It may join conferences as DAHDI_CONF_CONF, DAHDI_CONF_CONFANN or
+ * DAHDI_CONF_CONFMON; narrowband members of the same conference are
+ * resampled to and from it.  Fails with EBUSY while the channel is in a
+ * conference.
+ */
+#define DAHDI_SET_WIDEBAND		_IOW(DAHDI_CODE, 111, int)
+
 /* Get current status IOCTL */
 /* Defines for Radio Status (dahdi_radio_stat.radstat) bits */
 
@@ -0,0 +1,535 @@
+/*
+ * echocan_test - Run recorded audio through a DAHDI software echo canceller
+ *
+ * Builds the echo canceller sources from drivers/dahdi against a small
+ * kernel API shim, so they can be tried on recordings without loading
+ * them into a kernel:
+ *
+ *   echocan_test [-e mg2|kb1|sec|sec2] [-t taps] [-c] far-end near-end [out]
+ *
+ * far-end is what was sent to the line, near-end what came back from it,
+ * echo included. Both are 8 kHz mono 16 bit WAV files, or raw signed 16
+ * bit little endian samples. The echo cancelled near end is written to
+ * out, in the format of near-end. Reports the echo return loss
+ * enhancement (ERLE) and how fast the samples were processed.
+ *
+ * With -c, mg2 and kb1 are run twice, with the C convolution and with the
+ * SIMD one the CPU supports, and the two outputs are compared sample for
+ * sample.
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dahdi/kernel.h>
+#include "arith.h"
+
+#include "shim.h"
+
+/* ERLE is also reported over this many samples at the end */
+#define TAIL_SAMPLES		DAHDI_MS_TO_SAMPLES(1000)
+/* and measured over windows of this many samples to find convergence */
+#define WINDOW_SAMPLES		DAHDI_MS_TO_SAMPLES(100)
+#define MAX_PARAMS		8
+
+struct echocan_module {
+	const char *name;
+	int (*init)(void);
+	void (*exit)(void);
+};
+
+#define ECHOCAN(n)							\
+	extern int n##_init(void);					\
+	extern void n##_exit(void);
+
+ECHOCAN(mg2)
+ECHOCAN(kb1)
+ECHOCAN(sec)
+ECHOCAN(sec2)
+
+/* Not jpah, which does not cancel echo at all, nor oslec, which is a
+ * wrapper around the echo canceller in the kernel's staging tree, whose
+ * source is not part of DAHDI. See the README. */
+#undef ECHOCAN
+#define ECHOCAN(n)	{ #n, n##_init, n##_exit }
+
+static const struct echocan_module modules[] = {
+	ECHOCAN(mg2),
+	ECHOCAN(kb1),
+	ECHOCAN(sec),
+	ECHOCAN(sec2),
+};
+
+struct audio {
+	short *samples;
+	int count;
+	int wav;
+};
+
+struct result {
+	double seconds;
+	double erle;
+	double erle_tail;
+	int converged_ms;
+};
+
+static int taps = 128;
+static int erle_target = 20;
+static struct dahdi_echocanparam params[MAX_PARAMS];
+static int nparams;
+
+static unsigned int le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int le32(const unsigned char *p)
+{
+	return le16(p) | (le16(p + 2) << 16);
+}
+
+static int read_file(const char *path, unsigned char **data, long *len)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	rewind(f);
+	*data = malloc(*len ? *len : 1);
+	if (!*data || fread(*data, 1, *len, f) != (size_t)*len) {
+		fprintf(stderr, "%s: cannot read\n", path);
+		free(*data);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Finds the samples of a WAV file. Returns 0 if it is not one. */
+static int find_wav_data(const char *path, const unsigned char *data,
+			 long len, long *start, long *size)
+{
+	long pos = 12;
+	int fmt_ok = 0;
+
+	if (len < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4))
+		return 0;
+
+	while (pos + 8 <= len) {
+		const long chunk = le32(data + pos + 4);
+
+		if (!memcmp(data + pos, "fmt ", 4) && chunk >= 16) {
+			if (le16(data + pos + 8) != 1 ||
+			    le16(data + pos + 10) != 1 ||
+			    le32(data + pos + 12) != 8000 ||
+			    le16(data + pos + 22) != 16) {
+				fprintf(stderr, "%s: not 8 kHz mono 16 bit PCM\n",
+					path);
+				return -1;
+			}
+			fmt_ok = 1;
+		} else if (!memcmp(data + pos, "data", 4)) {
+			if (!fmt_ok)
+				break;
+			*start = pos + 8;
+			*size = (chunk < len - *start) ? chunk : len - *start;
+			return 1;
+		}
+		pos += 8 + chunk + (chunk & 1);
+	}
+	fprintf(stderr, "%s: no PCM data found\n", path);
+	return -1;
+}
+
+static int read_audio(const char *path, struct audio *a)
+{
+	unsigned char *data;
+	long len, start = 0, size;
+	int i;
+
+	if (read_file(path, &data, &len))
+		return -1;
+	size = len;
+	a->wav = find_wav_data(path, data, len, &start, &size);
+	if (a->wav < 0) {
+		free(data);
+		return -1;
+	}
+
+	a->count = size / 2;
+	a->samples = malloc(a->count * sizeof(short) + 1);
+	if (!a->samples) {
+		free(data);
+		return -1;
+	}
+	for (i = 0; i < a->count; i++)
+		a->samples[i] = (short)le16(data + start + 2 * i);
+	free(data);
+	return 0;
+}
+
+static void put_le16(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *p, unsigned int v)
+{
+	put_le16(p, v & 0xffff);
+	put_le16(p + 2, v >> 16);
+}
+
+static int write_audio(const char *path, const short *samples, int count,
+		       int wav)
+{
+	unsigned char hdr[44];
+	FILE *f = fopen(path, "wb");
+	int i, ok = 1;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	if (wav) {
+		memcpy(hdr, "RIFF", 4);
+		put_le32(hdr + 4, 36 + count * 2);
+		memcpy(hdr + 8, "WAVEfmt ", 8);
+		put_le32(hdr + 16, 16);
+		put_le16(hdr + 20, 1);		/* PCM */
+		put_le16(hdr + 22, 1);		/* Mono */
+		put_le32(hdr + 24, 8000);
+		put_le32(hdr + 28, 16000);	/* Bytes per second */
+		put_le16(hdr + 32, 2);		/* Bytes per frame */
+		put_le16(hdr + 34, 16);
+		memcpy(hdr + 36, "data", 4);
+		put_le32(hdr + 40, count * 2);
+		ok = fwrite(hdr, sizeof(hdr), 1, f) == 1;
+	}
+	for (i = 0; ok && i < count; i++) {
+		put_le16(hdr, (unsigned short)samples[i]);
+		ok = fwrite(hdr, 2, 1, f) == 1;
+	}
+	if (fclose(f) || !ok) {
+		fprintf(stderr, "%s: cannot write\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static double power(const short *s, int count)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		sum += (double)s[i] * s[i];
+	return sum;
+}
+
+/* 10 * log10(near / out), as the echo canceller took out near - out */
+static double erle_db(const short *near, const short *out, int count)
+{
+	const double p_near = power(near, count);
+	const double p_out = power(out, count);
+
+	return 10 * log10((p_near + 1) / (p_out + 1));
+}
+
+static const struct echocan_module *find_module(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(modules); i++) {
+		if (!strcasecmp(modules[i].name, name))
+			return &modules[i];
+	}
+	return NULL;
+}
+
+/* The convolution mg2 and kb1 pick when loaded with simd=1 */
+static int simd_level(void)
+{
+	return dahdi_simd_ec_check(dahdi_simd_ec_level());
+}
+
+/* What the last run of the module convolved with */
+static const char *level_name(const struct echocan_module *m)
+{
+	int simd;
+
+	if (shim_param_get(m->name, "simd", &simd) || !simd)
+		return "c";
+	return dahdi_simd_ec_name(simd_level());
+}
+
+/*
+ * Runs near through a fresh instance of the echo canceller, with simd as
+ * its simd parameter unless that is negative, into out.
+ */
+static int run(const struct echocan_module *m, int simd,
+	       const short *far, const short *near, short *out, int count,
+	       struct result *r)
+{
+	struct dahdi_echocanparam p[MAX_PARAMS];
+	struct dahdi_echocanparams ecp = {
+		.tap_length = taps,
+		.param_count = nparams,
+	};
+	const struct dahdi_echocan_factory *factory;
+	struct dahdi_echocan_state *ec;
+	struct timespec start, end;
+	int i, res;
+
+	if (simd >= 0 && shim_param_set(m->name, "simd", simd)) {
+		fprintf(stderr, "%s has no simd parameter\n", m->name);
+		return -1;
+	}
+	res = m->init();
+	if (res) {
+		fprintf(stderr, "%s: init failed: %d\n", m->name, res);
+		return -1;
+	}
+	factory = dahdi_echocan_factory_get(m->name);
+	if (!factory) {
+		fprintf(stderr, "%s did not register\n", m->name);
+		m->exit();
+		return -1;
+	}
+	/* The echo canceller may change the names */
+	memcpy(p, params, sizeof(p));
+	res = factory->echocan_create(NULL, &ecp, p, &ec);
+	if (res) {
+		fprintf(stderr, "%s: cannot create an instance: %d\n",
+			m->name, res);
+		dahdi_echocan_factory_put(factory);
+		m->exit();
+		return -1;
+	}
+
+	memcpy(out, near, count * sizeof(short));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i += DAHDI_CHUNKSIZE) {
+		const int n = min(count - i, DAHDI_CHUNKSIZE);
+
+		ec->events.all = 0;
+		ec->ops->echocan_process(ec, out + i, far + i, n);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ec->ops->echocan_free(NULL, ec);
+	dahdi_echocan_factory_put(factory);
+	m->exit();
+
+	r->seconds = (end.tv_sec - start.tv_sec) +
+		     (end.tv_nsec - start.tv_nsec) / 1e9;
+	r->erle = erle_db(near, out, count);
+	i = max(count - TAIL_SAMPLES, 0);
+	r->erle_tail = erle_db(near + i, out + i, count - i);
+	r->converged_ms = -1;
+	for (i = 0; i + WINDOW_SAMPLES <= count; i += WINDOW_SAMPLES) {
+		if (erle_db(near + i, out + i, WINDOW_SAMPLES) >= erle_target) {
+			r->converged_ms = (i + WINDOW_SAMPLES) /
+					  DAHDI_MS_TO_SAMPLES(1);
+			break;
+		}
+	}
+	return 0;
+}
+
+static void print_result(const char *name, const char *level, int count,
+			 const struct result *r)
+{
+	printf("%s (%s): %d samples, %.1f Msamples/s\n", name, level, count,
+	       r->seconds > 0 ? count / r->seconds / 1e6 : 0.0);
+	printf("  ERLE %.1f dB, %.1f dB over the last %d ms",
+	       r->erle, r->erle_tail,
+	       min(count, TAIL_SAMPLES) / DAHDI_MS_TO_SAMPLES(1));
+	if (r->converged_ms >= 0)
+		printf(", %d dB after %d ms\n", erle_target, r->converged_ms);
+	else
+		printf(", never %d dB\n", erle_target);
+}
+
+/* Number of samples that differ between a and b, and the first one */
+static int compare(const short *a, const short *b, int count, int *first)
+{
+	int i, diff = 0;
+
+	*first = -1;
+	for (i = 0; i < count; i++) {
+		if (a[i] == b[i])
+			continue;
+		if (!diff++)
+			*first = i;
+	}
+	return diff;
+}
+
+/*
+ * Runs the C and the SIMD convolution on the same input and checks that
+ * they give the same output. The C pass has to come first: a module only
+ * picks its SIMD level when loaded with simd=1, and keeps it afterwards.
+ */
+static int run_compare(const struct echocan_module *m, const short *far,
+		       const short *near, short *out, int count)
+{
+	struct result c, simd;
+	short *out_c;
+	int diff, first;
+
+	if (simd_level() == DAHDI_SIMD_EC_NONE) {
+		fprintf(stderr, "No SIMD convolution on this CPU to compare\n");
+		return -1;
+	}
+	out_c = malloc(count * sizeof(short) + 1);
+	if (!out_c)
+		return -1;
+	if (run(m, 0, far, near, out_c, count, &c) ||
+	    run(m, 1, far, near, out, count, &simd)) {
+		free(out_c);
+		return -1;
+	}
+	print_result(m->name, "c", count, &c);
+	print_result(m->name, level_name(m), count, &simd);
+
+	diff = compare(out_c, out, count, &first);
+	if (diff) {
+		printf("%d of %d samples differ, first at %d: %d (c) vs %d (%s)\n",
+		       diff, count, first, out_c[first], out[first],
+		       level_name(m));
+	} else {
+		printf("Outputs match, ERLE differs by %.2f dB\n",
+		       simd.erle - c.erle);
+	}
+	free(out_c);
+	return diff ? 1 : 0;
+}
+
+static int add_param(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	struct dahdi_echocanparam *p = &params[nparams];
+
+	if (!eq || nparams == MAX_PARAMS ||
+	    eq - arg >= (int)sizeof(p->name))
+		return -1;
+	memcpy(p->name, arg, eq - arg);
+	p->name[eq - arg] = '\0';
+	p->value = atoi(eq + 1);
+	nparams++;
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options] far-end near-end [out]\n"
+		"  -e name       echo canceller: mg2 (default), kb1, sec, sec2\n"
+		"  -t taps       tail length in taps (default 128)\n"
+		"  -p name=value echo canceller parameter, may be repeated\n"
+		"  -s simd       simd parameter of mg2 and kb1: 0 for the C\n"
+		"                convolution, 1 (default) for the best the CPU has\n"
+		"  -c            run mg2 or kb1 with simd=0 and simd=1, and\n"
+		"                compare the outputs (out has the simd=1 one)\n"
+		"  -r dB         ERLE to report the time to (default 20)\n"
+		"  -v            show what the echo canceller logs\n",
+		argv0);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct echocan_module *m = &modules[0];
+	struct audio far = { NULL }, near = { NULL };
+	struct result r;
+	short *out = NULL;
+	int simd = -1;
+	int cmp = 0;
+	int res = 1;
+	int count;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:t:p:s:cr:v")) != -1) {
+		switch (opt) {
+		case 'e':
+			m = find_module(optarg);
+			if (!m) {
+				fprintf(stderr, "Unknown echo canceller %s\n",
+					optarg);
+				return 2;
+			}
+			break;
+		case 't':
+			taps = atoi(optarg);
+			break;
+		case 'p':
+			if (add_param(optarg))
+				usage(argv[0]);
+			break;
+		case 's':
+			simd = !!atoi(optarg);
+			break;
+		case 'c':
+			cmp = 1;
+			break;
+		case 'r':
+			erle_target = atoi(optarg);
+			break;
+		case 'v':
+			shim_verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2 || argc - optind > 3 || taps <= 0)
+		usage(argv[0]);
+
+	if (read_audio(argv[optind], &far) ||
+	    read_audio(argv[optind + 1], &near))
+		goto out;
+	count = min(far.count, near.count);
+	if (far.count != near.count) {
+		fprintf(stderr, "Using the first %d samples of both files\n",
+			count);
+	}
+	out = malloc(count * sizeof(short) + 1);
+	if (!out)
+		goto out;
+
+	if (cmp) {
+		res = run_compare(m, far.samples, near.samples, out, count);
+		if (res < 0) {
+			res = 1;
+			goto out;
+		}
+	} else {
+		if (run(m, simd, far.samples, near.samples, out, count, &r))
+			goto out;
+		print_result(m->name, level_name(m), count, &r);
+		res = 0;
+	}
+
+	if (argc - optind == 3 &&
+	    write_audio(argv[optind + 2], out, count, near.wav))
+		res = 1;
+out:
+	free(out);
+	free(near.samples);
+	free(far.samples);
+	return res;
+}
@@ -0,0 +1,158 @@
+/*
+ * The kernel API the software echo cancellers use, in userspace, for
+ * echocan_test.
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdarg.h>
+#include <strings.h>
+
+#include <linux/moduleparam.h>
+#include <dahdi/kernel.h>
+
+#include "shim.h"
+
+#define SHIM_MAX_PARAMS		32
+#define SHIM_MAX_FACTORIES	8
+
+int shim_verbose;
+
+static struct {
+	const char *module;
+	const char *name;
+	int *value;
+} params[SHIM_MAX_PARAMS];
+static int nparams;
+
+static const struct dahdi_echocan_factory *factories[SHIM_MAX_FACTORIES];
+
+int printk(const char *fmt, ...)
+{
+	va_list ap;
+	int res = 0;
+
+	if (shim_verbose) {
+		va_start(ap, fmt);
+		res = vfprintf(stderr, fmt, ap);
+		va_end(ap);
+	}
+	return res;
+}
+
+void shim_param_register(const char *module, const char *name, int *value)
+{
+	if (nparams == SHIM_MAX_PARAMS) {
+		fprintf(stderr, "Too many module parameters\n");
+		abort();
+	}
+	params[nparams].module = module;
+	params[nparams].name = name;
+	params[nparams].value = value;
+	nparams++;
+}
+
+static int *shim_param_find(const char *module, const char *name)
+{
+	int i;
+
+	for (i = 0; i < nparams; i++) {
+		if (!strcmp(params[i].module, module) &&
+		    !strcmp(params[i].name, name))
+			return params[i].value;
+	}
+	return NULL;
+}
+
+int shim_param_set(const char *module, const char *name, int value)
+{
+	int *const p = shim_param_find(module, name);
+
+	if (!p)
+		return -ENOENT;
+	*p = value;
+	return 0;
+}
+
+int shim_param_get(const char *module, const char *name, int *value)
+{
+	const int *const p = shim_param_find(module, name);
+
+	if (!p)
+		return -ENOENT;
+	*value = *p;
+	return 0;
+}
+
+int dahdi_ec_pool_init(struct dahdi_echocan_pool *pool, const char *name,
+		       size_t size)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->name = name;
+	return 0;
+}
+
+void dahdi_ec_pool_destroy(struct dahdi_echocan_pool *pool)
+{
+}
+
+/* Zeroed and cache line aligned, as from the real pool */
+void *dahdi_ec_pool_alloc(struct dahdi_echocan_pool *pool, size_t size)
+{
+	void *ptr;
+
+	if (posix_memalign(&ptr, 64, size))
+		return NULL;
+	memset(ptr, 0, size);
+	pool->misses++;
+	return ptr;
+}
+
+void dahdi_ec_pool_free(struct dahdi_echocan_pool *pool, void *ptr)
+{
+	free(ptr);
+}
+
+int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec)
+{
+	int i;
+
+	for (i = 0; i < SHIM_MAX_FACTORIES; i++) {
+		if (!factories[i]) {
+			factories[i] = ec;
+			return 0;
+		}
+	}
+	return -ENOMEM;
+}
+
+void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec)
+{
+	int i;
+
+	for (i = 0; i < SHIM_MAX_FACTORIES; i++) {
+		if (factories[i] == ec)
+			factories[i] = NULL;
+	}
+}
+
+const struct dahdi_echocan_factory *dahdi_echocan_factory_get(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SHIM_MAX_FACTORIES; i++) {
+		if (factories[i] &&
+		    !strcasecmp(factories[i]->get_name(NULL), name))
+			return factories[i];
+	}
+	return NULL;
+}
+
+void dahdi_echocan_factory_put(const struct dahdi_echocan_factory *ec)
+{
+}
@@ -0,0 +1,24 @@
+/*
+ * What the kernel API shim offers echocan_test on top of what the echo
+ * cancellers use.
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef _ECHOCAN_TEST_SHIM_H
+#define _ECHOCAN_TEST_SHIM_H
+
+/* Print what the echo cancellers printk() */
+extern int shim_verbose;
+
+/* Set an integer module parameter. Returns 0, or -ENOENT if the module has
+ * no such parameter. */
+int shim_param_set(const char *module, const char *name, int value);
+int shim_param_get(const char *module, const char *name, int *value);
+
+#endif
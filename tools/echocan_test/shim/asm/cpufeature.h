@@ -0,0 +1,13 @@
+#ifndef _ECHOCAN_TEST_ASM_CPUFEATURE_H
+#define _ECHOCAN_TEST_ASM_CPUFEATURE_H
+
+#ifdef CONFIG_X86_64
+#define X86_FEATURE_XMM2	"sse2"
+#define X86_FEATURE_AVX2	"avx2"
+#define boot_cpu_has(feature)	__builtin_cpu_supports(feature)
+#else
+/* Advanced SIMD is mandatory on arm64 */
+#define system_supports_fpsimd()	1
+#endif
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _ECHOCAN_TEST_ASM_FPU_API_H
+#define _ECHOCAN_TEST_ASM_FPU_API_H
+
+static inline void kernel_fpu_begin(void) { }
+static inline void kernel_fpu_end(void) { }
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _ECHOCAN_TEST_ASM_NEON_H
+#define _ECHOCAN_TEST_ASM_NEON_H
+
+static inline void kernel_neon_begin(void) { }
+static inline void kernel_neon_end(void) { }
+
+#endif
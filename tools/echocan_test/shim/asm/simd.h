@@ -0,0 +1,7 @@
+#ifndef _ECHOCAN_TEST_ASM_SIMD_H
+#define _ECHOCAN_TEST_ASM_SIMD_H
+
+/* Userspace can always use the vector registers */
+#define may_use_simd()	1
+
+#endif
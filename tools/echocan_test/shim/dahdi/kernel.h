@@ -0,0 +1,147 @@
+/*
+ * The echo canceller part of include/dahdi/kernel.h, for echocan_test.
+ * See there for the documentation. Keep in step with it.
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef _ECHOCAN_TEST_DAHDI_KERNEL_H
+#define _ECHOCAN_TEST_DAHDI_KERNEL_H
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include <dahdi/user.h>
+#include <dahdi/dahdi_config.h>
+
+/* Build the vector convolution of arith.h wherever the CPU has one */
+#define CONFIG_DAHDI_SIMD_EC
+#if defined(__x86_64__)
+#define CONFIG_X86_64
+#elif defined(__aarch64__)
+#define CONFIG_ARM64
+#define CONFIG_KERNEL_MODE_NEON
+#endif
+
+#define DAHDI_CHUNKSIZE		 8
+#define DAHDI_MS_TO_SAMPLES(ms) ((ms) * 8)
+
+#define module_printk(level, fmt, args...) \
+	printk(level "%s: " fmt, __stringify(ECHOCAN_MODULE), ## args)
+
+typedef struct {
+	int32_t gain;
+	int32_t a1;
+	int32_t a2;
+	int32_t b1;
+	int32_t b2;
+	int32_t z1;
+	int32_t z2;
+} biquad2_state_t;
+
+typedef struct {
+	biquad2_state_t notch;
+	int notch_level;
+	int channel_level;
+	int tone_present;
+	int tone_cycle_duration;
+	int good_cycles;
+	int hit;
+} echo_can_disable_detector_state_t;
+
+struct dahdi_chan;
+struct dahdi_echocan_state;
+
+struct dahdi_echocan_features {
+	u32 CED_tx_detect:1;
+	u32 CED_rx_detect:1;
+	u32 CNG_tx_detect:1;
+	u32 CNG_rx_detect:1;
+	u32 NLP_toggle:1;
+	u32 NLP_automatic:1;
+};
+
+struct dahdi_echocan_ops {
+	void (*echocan_free)(struct dahdi_chan *chan,
+			     struct dahdi_echocan_state *ec);
+	void (*echocan_process)(struct dahdi_echocan_state *ec, short *isig,
+				const short *iref, u32 size);
+	void (*echocan_process_batch)(struct dahdi_echocan_state *const *ecs,
+				      short *isig, const short *iref,
+				      u32 count, u32 size);
+	void (*echocan_events)(struct dahdi_echocan_state *ec);
+	int (*echocan_traintap)(struct dahdi_echocan_state *ec, int pos,
+				short val);
+	void (*echocan_NLP_toggle)(struct dahdi_echocan_state *ec,
+				   unsigned int enable);
+};
+
+/* Instances come straight from the C library here */
+struct dahdi_echocan_pool {
+	const char *name;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+int dahdi_ec_pool_init(struct dahdi_echocan_pool *pool, const char *name,
+		       size_t size);
+void dahdi_ec_pool_destroy(struct dahdi_echocan_pool *pool);
+void *dahdi_ec_pool_alloc(struct dahdi_echocan_pool *pool, size_t size);
+void dahdi_ec_pool_free(struct dahdi_echocan_pool *pool, void *ptr);
+
+struct dahdi_echocan_factory {
+	const char *(*get_name)(const struct dahdi_chan *chan);
+	struct module *owner;
+	int (*echocan_create)(struct dahdi_chan *chan,
+			      struct dahdi_echocanparams *ecp,
+			      struct dahdi_echocanparam *p,
+			      struct dahdi_echocan_state **ec);
+	struct dahdi_echocan_pool *pool;
+};
+
+int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec);
+void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec);
+/* Only in the shim: look up a canceller registered above by name */
+const struct dahdi_echocan_factory *dahdi_echocan_factory_get(const char *name);
+void dahdi_echocan_factory_put(const struct dahdi_echocan_factory *ec);
+
+enum dahdi_echocan_mode {
+	__ECHO_MODE_MUTE = 1 << 8,
+	ECHO_MODE_IDLE = 0,
+	ECHO_MODE_PRETRAINING = 1 | __ECHO_MODE_MUTE,
+	ECHO_MODE_STARTTRAINING = 2 | __ECHO_MODE_MUTE,
+	ECHO_MODE_AWAITINGECHO = 3 | __ECHO_MODE_MUTE,
+	ECHO_MODE_TRAINING = 4 | __ECHO_MODE_MUTE,
+	ECHO_MODE_ACTIVE = 5,
+	ECHO_MODE_FAX = 6,
+};
+
+struct dahdi_echocan_state {
+	const struct dahdi_echocan_ops *ops;
+	echo_can_disable_detector_state_t txecdis;
+	echo_can_disable_detector_state_t rxecdis;
+	struct dahdi_echocan_features features;
+	struct {
+		enum dahdi_echocan_mode mode;
+		u32 last_train_tap;
+		u32 pretrain_timer;
+	} status;
+	union dahdi_echocan_events {
+		u32 all;
+		struct {
+			u32 CED_tx_detected:1;
+			u32 CED_rx_detected:1;
+			u32 CNG_tx_detected:1;
+			u32 CNG_rx_detected:1;
+			u32 NLP_auto_disabled:1;
+			u32 NLP_auto_enabled:1;
+		} bit;
+	} events;
+};
+
+#endif
@@ -0,0 +1,2 @@
+/* Covered by the shim linux/kernel.h */
+#include <linux/kernel.h>
@@ -0,0 +1,2 @@
+/* glibc's errno.h includes this one too, so this must be the real thing */
+#include <asm/errno.h>
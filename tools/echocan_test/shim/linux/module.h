@@ -0,0 +1,29 @@
+/*
+ * module_init() and module_exit() become <ECHOCAN_MODULE>_init() and
+ * <ECHOCAN_MODULE>_exit(), which echocan_test calls around each run. The
+ * Makefile sets ECHOCAN_MODULE for each echo canceller.
+ */
+
+#ifndef _ECHOCAN_TEST_LINUX_MODULE_H
+#define _ECHOCAN_TEST_LINUX_MODULE_H
+
+#include <linux/kernel.h>
+
+struct module;
+
+#define THIS_MODULE	((struct module *)NULL)
+
+#define __shim_paste(a, b)	a##b
+#define __shim_name(a, b)	__shim_paste(a, b)
+
+#define module_init(fn) \
+	int __shim_name(ECHOCAN_MODULE, _init)(void) { return fn(); }
+#define module_exit(fn) \
+	void __shim_name(ECHOCAN_MODULE, _exit)(void) { fn(); }
+
+#define MODULE_DESCRIPTION(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_LICENSE(x)
+#define MODULE_PARM_DESC(name, desc)
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * Integer module parameters are registered by name, so that echocan_test
+ * can set them before calling the module's init function (see shim.c).
+ */
+
+#ifndef _ECHOCAN_TEST_LINUX_MODULEPARAM_H
+#define _ECHOCAN_TEST_LINUX_MODULEPARAM_H
+
+#include <linux/module.h>
+
+#define S_IRUGO		0444
+#define S_IWUSR		0200
+
+void shim_param_register(const char *module, const char *name, int *value);
+
+#define module_param(name, type, perm)					\
+	static void __attribute__((constructor))			\
+	__shim_name(__shim_param_, name)(void)				\
+	{								\
+		int *const p = &name;	/* Only int parameters */	\
+		shim_param_register(__stringify(ECHOCAN_MODULE), #name, p); \
+	}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _ECHOCAN_TEST_LINUX_RANDOM_H
+#define _ECHOCAN_TEST_LINUX_RANDOM_H
+
+#include <linux/kernel.h>
+
+static inline void get_random_bytes(void *buf, int nbytes)
+{
+	unsigned char *p = buf;
+
+	while (nbytes--)
+		*p++ = rand();
+}
+
+#endif
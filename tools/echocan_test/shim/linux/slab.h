@@ -0,0 +1,24 @@
+#ifndef _ECHOCAN_TEST_LINUX_SLAB_H
+#define _ECHOCAN_TEST_LINUX_SLAB_H
+
+#include <linux/kernel.h>
+
+#define GFP_KERNEL	0
+#define GFP_ATOMIC	0
+
+static inline void *kmalloc(size_t size, int flags)
+{
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, int flags)
+{
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *ptr)
+{
+	free((void *)ptr);
+}
+
+#endif